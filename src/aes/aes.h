@@ -204,6 +204,31 @@ typedef void cbuf_inc(unsigned char *cbuf);
 AES_RETURN aes_ctr_crypt(const unsigned char *ibuf, unsigned char *obuf,
             int len, unsigned char *cbuf, cbuf_inc ctr_inc, aes_encrypt_ctx cx[1]);
 
+/* CTR mode with one of the common 128-bit counter layouts in place  */
+/* of a ctr_inc function. The results and the state left in cbuf and */
+/* the context are the same as for aes_ctr_crypt with the matching   */
+/* increment but, since the counter update is known, an accelerated */
+/* implementation can generate and encrypt several blocks at once.   */
+/* In the '_BE' layouts the last byte of cbuf is least significant, */
+/* in the '_LE' layouts the first byte is.                           */
+
+#define AES_CTR_INC_BE  0
+#define AES_CTR_DEC_BE  1
+#define AES_CTR_INC_LE  2
+#define AES_CTR_DEC_LE  3
+
+/* The decrements of the earlier releases, kept so that what they wrote */
+/* still decrypts: a byte borrows from the next one when it becomes 0   */
+/* rather than when it wraps. Taking 1 from every byte turns them into  */
+/* the plain decrements above, which is how they are moved on by more  */
+/* than one block.                                                      */
+
+#define AES_CTR_DEC_BE_LEGACY  4
+#define AES_CTR_DEC_LE_LEGACY  5
+
+AES_RETURN aes_ctr_crypt_ex(const unsigned char *ibuf, unsigned char *obuf,
+            int len, unsigned char *cbuf, int ctr_mode, aes_encrypt_ctx cx[1]);
+
 #endif
 
 #if 0
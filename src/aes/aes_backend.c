@@ -0,0 +1,272 @@
+/*
+ The list of AES engines for run time selection, see aes_backend.h. The
+ table driven code and the bitsliced engine of aes_bs.c are always present;
+ the AES-NI and VAES engines of aes_ni.c and the SSSE3 engine of
+ aes_vpaes.c are only listed when the CPU supports them.
+*/
+
+#include <string.h>
+#include "aes_backend.h"
+#include "aesopt.h"
+
+#if defined( USE_INTEL_AES_IF_PRESENT )
+#  include "aes_ni.h"
+#else
+/* map names here to provide the external API ('name' -> 'aes_name') */
+#  define aes_xi(x) aes_ ## x
+#endif
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+static AES_RETURN table_encrypt_key(const unsigned char *key, int key_len, aes_encrypt_ctx cx[1])
+{
+	switch(key_len)
+	{
+	case 16: case 128: return aes_xi(encrypt_key128)(key, cx);
+	case 24: case 192: return aes_xi(encrypt_key192)(key, cx);
+	case 32: case 256: return aes_xi(encrypt_key256)(key, cx);
+	default: return EXIT_FAILURE;
+	}
+}
+
+static AES_RETURN table_decrypt_key(const unsigned char *key, int key_len, aes_decrypt_ctx cx[1])
+{
+	switch(key_len)
+	{
+	case 16: case 128: return aes_xi(decrypt_key128)(key, cx);
+	case 24: case 192: return aes_xi(decrypt_key192)(key, cx);
+	case 32: case 256: return aes_xi(decrypt_key256)(key, cx);
+	default: return EXIT_FAILURE;
+	}
+}
+
+const aes_backend aes_backend_table =
+{
+	"table",
+	table_encrypt_key,     table_decrypt_key,
+	NULL,
+	aes_xi(encrypt),       aes_xi(decrypt),
+	aes_xi(ecb_encrypt),   aes_xi(ecb_decrypt),
+	aes_xi(cbc_encrypt),   aes_xi(cbc_decrypt),
+	aes_xi(cfb_encrypt),   aes_xi(cfb_decrypt),
+	aes_xi(ofb_crypt),
+	aes_xi(ctr_crypt),     aes_xi(ctr_crypt_ex),
+	NULL
+};
+
+/* the counter updates for the standard layouts, also those of aes_ctr_crypt_ex */
+
+static void ctr_inc_be(unsigned char *cbuf)
+{
+	int i = AES_BLOCK_SIZE;
+	while(i-- && !++cbuf[i])
+		;
+}
+
+static void ctr_dec_be(unsigned char *cbuf)
+{
+	int i = AES_BLOCK_SIZE;
+	while(i-- && !cbuf[i]--)
+		;
+}
+
+static void ctr_inc_le(unsigned char *cbuf)
+{
+	int i = 0;
+	while(i < AES_BLOCK_SIZE && !++cbuf[i++])
+		;
+}
+
+static void ctr_dec_le(unsigned char *cbuf)
+{
+	int i = 0;
+	while(i < AES_BLOCK_SIZE && !cbuf[i++]--)
+		;
+}
+
+static void ctr_dec_be_legacy(unsigned char *cbuf)
+{
+	int i = AES_BLOCK_SIZE;
+	while(i-- && !--cbuf[i])
+		;
+}
+
+static void ctr_dec_le_legacy(unsigned char *cbuf)
+{
+	int i = 0;
+	while(i < AES_BLOCK_SIZE && !--cbuf[i++])
+		;
+}
+
+cbuf_inc *aes_ctr_inc(int ctr_mode)
+{
+	switch(ctr_mode)
+	{
+	case AES_CTR_INC_BE: return ctr_inc_be;
+	case AES_CTR_DEC_BE: return ctr_dec_be;
+	case AES_CTR_INC_LE: return ctr_inc_le;
+	case AES_CTR_DEC_LE: return ctr_dec_le;
+	case AES_CTR_DEC_BE_LEGACY: return ctr_dec_be_legacy;
+	case AES_CTR_DEC_LE_LEGACY: return ctr_dec_le_legacy;
+	default: return NULL;
+	}
+}
+
+void aes_ctr_add(unsigned char *cbuf, uint64_t n, int ctr_mode)
+{
+	const int legacy = ctr_mode == AES_CTR_DEC_BE_LEGACY || ctr_mode == AES_CTR_DEC_LE_LEGACY;
+	const int be  = ctr_mode == AES_CTR_INC_BE || ctr_mode == AES_CTR_DEC_BE || ctr_mode == AES_CTR_DEC_BE_LEGACY;
+	const int dec = ctr_mode != AES_CTR_INC_BE && ctr_mode != AES_CTR_INC_LE;
+	unsigned int carry = 0, d;
+	int i, s;
+
+	if(legacy)      /* see AES_CTR_DEC_BE_LEGACY */
+		for(i = 0; i < AES_BLOCK_SIZE; ++i)
+			--cbuf[i];
+
+	/* a 128-bit add or subtract of n, from the low byte up */
+	for(i = 0; i < AES_BLOCK_SIZE && (n || carry); ++i)
+	{
+		unsigned char *p = cbuf + (be ? AES_BLOCK_SIZE - 1 - i : i);
+		d = (unsigned int)(n & 0xff) + carry;
+		n >>= 8;
+		if(dec)
+		{
+			s = (int)*p - (int)d;
+			carry = s < 0;
+		}
+		else
+		{
+			s = (int)(*p + d);
+			carry = s > 0xff;
+		}
+		*p = (unsigned char)(s & 0xff);
+	}
+
+	if(legacy)
+		for(i = 0; i < AES_BLOCK_SIZE; ++i)
+			++cbuf[i];
+}
+
+AES_RETURN aes_backend_encrypt_keys(const aes_backend *b, const unsigned char *const key[],
+                    int key_len, aes_encrypt_ctx *const cx[], int n)
+{
+	int i;
+
+	if(b->encrypt_keys)
+		return b->encrypt_keys(key, key_len, cx, n);
+
+	for(i = 0; i < n; ++i)
+		if(b->encrypt_key(key[i], key_len, cx[i]) != EXIT_SUCCESS)
+			return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
+
+/* the inverse MixColumns of the round keys between the first and the
+   last, done on bytes without tables or branches on the key. Where the
+   table code keeps the decryption round keys last first (AES_REV_DKS)
+   they are then swapped end for end, as aeskey.c stores them
+*/
+
+#define ks_xtime(x) ((unsigned char)(((x) << 1) ^ (0x1b & -((x) >> 7))))
+
+void aes_backend_decrypt_schedule(const aes_encrypt_ctx ecx[1], aes_decrypt_ctx dcx[1])
+{
+	unsigned char *k = (unsigned char*)dcx->ks;
+	unsigned char a0, a1, a2, a3, t, u;
+	int i, n = ecx->inf.b[0];
+
+	if(dcx != (aes_decrypt_ctx*)ecx)
+		memcpy(dcx, ecx, sizeof(aes_decrypt_ctx));
+
+	for(i = AES_BLOCK_SIZE; i < n; i += 4)
+	{
+		/* multiply by {04}x^2 + {05} and then by the MixColumns matrix */
+		t = ks_xtime(k[i] ^ k[i + 2]);   t = ks_xtime(t);
+		u = ks_xtime(k[i + 1] ^ k[i + 3]); u = ks_xtime(u);
+		a0 = k[i] ^ t; a1 = k[i + 1] ^ u; a2 = k[i + 2] ^ t; a3 = k[i + 3] ^ u;
+
+		t = a0 ^ a1 ^ a2 ^ a3;
+		k[i]     = a0 ^ t ^ ks_xtime(a0 ^ a1);
+		k[i + 1] = a1 ^ t ^ ks_xtime(a1 ^ a2);
+		k[i + 2] = a2 ^ t ^ ks_xtime(a2 ^ a3);
+		k[i + 3] = a3 ^ t ^ ks_xtime(a3 ^ a0);
+	}
+
+#if defined( AES_REV_DKS )
+	for(i = 0; i < n - i; i += AES_BLOCK_SIZE)
+	{
+		int j;
+		for(j = 0; j < AES_BLOCK_SIZE; ++j)
+		{
+			t = k[i + j];
+			k[i + j] = k[n - i + j];
+			k[n - i + j] = t;
+		}
+	}
+#endif
+}
+
+#define MAX_BACKENDS 8
+
+const aes_backend *const *aes_backend_list(void)
+{
+	static const aes_backend *list[MAX_BACKENDS];
+	const aes_backend *found[MAX_BACKENDS];
+	int n = 0;
+
+	if(list[0])
+		return list;
+
+#if defined( USE_INTEL_AES_IF_PRESENT )
+	switch(aes_ni_support())
+	{
+	case AES_NI_128 + AES_VAES_512: found[n++] = &aes_backend_vaes512;
+	    /* fall through */
+	case AES_NI_128 + AES_VAES_256: found[n++] = &aes_backend_vaes256;
+	    /* fall through */
+	case AES_NI_128:                found[n++] = &aes_backend_aesni;
+	}
+#endif
+
+#if defined( INTEL_AES_POSSIBLE )
+	if(aes_vpaes_support())
+		found[n++] = &aes_backend_vpaes;
+#endif
+
+	/* the bitsliced engine is constant time but on most machines no
+	   faster than the tables, and much slower in the chained modes */
+	found[n++] = &aes_backend_table;
+	found[n++] = &aes_backend_bitslice;
+
+	/* the list only depends on the CPU so filling it more than once is
+	   harmless, the first entry is written last as it marks it as done */
+	while(--n)
+		list[n] = found[n];
+	list[0] = found[0];
+	return list;
+}
+
+const aes_backend *aes_backend_kernel(const aes_backend *b, int rounds)
+{
+	if(b->kernels && (rounds == 10 || rounds == 12 || rounds == 14))
+		return b->kernels[(rounds - 10) >> 1];
+	return b;
+}
+
+const aes_backend *aes_backend_find(const char *name)
+{
+	const aes_backend *const *b;
+
+	for(b = aes_backend_list(); *b; ++b)
+		if(!strcmp((*b)->name, name))
+			return *b;
+	return NULL;
+}
+
+#if defined(__cplusplus)
+}
+#endif
@@ -0,0 +1,117 @@
+/*
+ Run time selection of the AES engine. Each backend is a table of the
+ key setup, block and mode functions of one implementation, with the same
+ signatures and semantics as the functions in aes.h. All backends build
+ identical key schedules and mode state, so a context set up through one
+ of them can be used with any other.
+*/
+
+#ifndef _AES_BACKEND_H
+#define _AES_BACKEND_H
+
+#include "aes.h"
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+typedef struct aes_backend
+{   const char *name;
+
+    AES_RETURN (*encrypt_key)(const unsigned char *key, int key_len, aes_encrypt_ctx cx[1]);
+    AES_RETURN (*decrypt_key)(const unsigned char *key, int key_len, aes_decrypt_ctx cx[1]);
+
+    /* NULL or the encryption key setup for n keys of the same length at */
+    /* once, see aes_backend_encrypt_keys()                              */
+    AES_RETURN (*encrypt_keys)(const unsigned char *const key[], int key_len,
+                    aes_encrypt_ctx *const cx[], int n);
+
+    AES_RETURN (*encrypt)(const unsigned char *in, unsigned char *out, const aes_encrypt_ctx cx[1]);
+    AES_RETURN (*decrypt)(const unsigned char *in, unsigned char *out, const aes_decrypt_ctx cx[1]);
+
+    AES_RETURN (*ecb_encrypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, const aes_encrypt_ctx cx[1]);
+    AES_RETURN (*ecb_decrypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, const aes_decrypt_ctx cx[1]);
+
+    AES_RETURN (*cbc_encrypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, const aes_encrypt_ctx cx[1]);
+    AES_RETURN (*cbc_decrypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, const aes_decrypt_ctx cx[1]);
+
+    AES_RETURN (*cfb_encrypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1]);
+    AES_RETURN (*cfb_decrypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1]);
+
+    AES_RETURN (*ofb_crypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1]);
+
+    AES_RETURN (*ctr_crypt)(const unsigned char *ibuf, unsigned char *obuf,
+            int len, unsigned char *cbuf, cbuf_inc ctr_inc, aes_encrypt_ctx cx[1]);
+    AES_RETURN (*ctr_crypt_ex)(const unsigned char *ibuf, unsigned char *obuf,
+            int len, unsigned char *cbuf, int ctr_mode, aes_encrypt_ctx cx[1]);
+
+    /* NULL or the tables specialised for 10, 12 and 14 rounds, which */
+    /* only accept a context with that number of rounds               */
+    const struct aes_backend *const *kernels;
+} aes_backend;
+
+/* the portable table driven code, always available                 */
+
+extern const aes_backend aes_backend_table;
+
+/* the bitsliced constant time engine in aes_bs.c, also portable     */
+
+extern const aes_backend aes_backend_bitslice;
+
+/* the SSSE3 vector permute engine in aes_vpaes.c, constant time too */
+/* and only present on x86 when aes_vpaes_support() returns non-zero */
+
+extern const aes_backend aes_backend_vpaes;
+
+int aes_vpaes_support(void);
+
+/* the counter update for one of the AES_CTR_* layouts of the        */
+/* ctr_crypt_ex call, NULL if ctr_mode is not one of them            */
+
+cbuf_inc *aes_ctr_inc(int ctr_mode);
+
+/* moves the counter of the AES_CTR_* layout ctr_mode on by n blocks, */
+/* the same as n calls of its counter update                          */
+
+void aes_ctr_add(unsigned char *cbuf, uint64_t n, int ctr_mode);
+
+/* the table of b specialised for a context with the given number   */
+/* of rounds, b itself if it has none; it must be looked up again     */
+/* whenever the key of the context changes                            */
+
+const aes_backend *aes_backend_kernel(const aes_backend *b, int rounds);
+
+/* expands the n keys of key_len bytes into cx[0..n-1], in one batch */
+/* if b has encrypt_keys and one key at a time if it does not         */
+
+AES_RETURN aes_backend_encrypt_keys(const aes_backend *b, const unsigned char *const key[],
+                    int key_len, aes_encrypt_ctx *const cx[], int n);
+
+/* the decryption key schedule for the key of an encryption schedule, */
+/* the same as decrypt_key of any backend builds for that key          */
+
+void aes_backend_decrypt_schedule(const aes_encrypt_ctx ecx[1], aes_decrypt_ctx dcx[1]);
+
+/* the backends that can run on this machine in order of preference */
+/* and terminated by NULL; the first entry is the default choice     */
+
+const aes_backend *const *aes_backend_list(void);
+
+/* the backend with the given name or NULL if it is not known or can */
+/* not run on this machine                                           */
+
+const aes_backend *aes_backend_find(const char *name);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
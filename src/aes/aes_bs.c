@@ -0,0 +1,973 @@
+/*
+ Bitsliced constant time AES engine for machines without AES-NI.
+
+ The state of 8 blocks is held as 8 bit planes: plane j has bit j of every
+ byte of the blocks, so one pass of the boolean S-box circuit below does
+ the SubBytes of all 128 bytes at once and no memory access depends on
+ the key or the data. The layout is that of the 64-bit "ct64" code in
+ BearSSL, where a 64-bit word holds one plane of 4 blocks. With SSE2 the
+ two 64-bit halves of a register carry two such groups, otherwise the
+ same operations are applied to a pair of 64-bit integers.
+
+ The parallel modes (ECB, CBC decryption, CFB decryption and CTR) run 8
+ blocks per pass. The chained modes and the single block calls can only
+ use one lane of the engine; they are here so that this backend is
+ constant time throughout but are much slower than the table code.
+*/
+
+#include <string.h>
+#include "aes_backend.h"
+#include "aesopt.h"
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+#if defined( _MSC_VER )
+#  define INLINE  static __inline
+#elif defined( __GNUC__ )
+#  define INLINE  static __inline
+#else
+#  define INLINE  static
+#endif
+
+#if defined( __SSE2__ ) || defined( _M_X64 ) || defined( _M_AMD64 )
+
+#include <emmintrin.h>
+
+#define BS_SSE2
+
+typedef __m128i bs_word;
+
+#define bs_xor(a, b)    _mm_xor_si128(a, b)
+#define bs_and(a, b)    _mm_and_si128(a, b)
+#define bs_or(a, b)     _mm_or_si128(a, b)
+#define bs_not(a)       _mm_xor_si128(a, _mm_set1_epi32(-1))
+#define bs_shl(a, n)    _mm_slli_epi64(a, n)
+#define bs_shr(a, n)    _mm_srli_epi64(a, n)
+#define bs_const(c)     _mm_set1_epi64x((long long)(c))
+#define bs_rotr32(a)    _mm_shuffle_epi32(a, 0xb1)
+#define bs_rotr16(a)    _mm_shufflehi_epi16(_mm_shufflelo_epi16(a, 0x39), 0x39)
+
+/* rotate each 16-bit field right by n bits */
+#define bs_rotf(a, n)   _mm_or_si128(_mm_srli_epi16(a, n), _mm_slli_epi16(a, 16 - (n)))
+
+INLINE bs_word bs_pack(uint64_t lo, uint64_t hi)
+{
+	return _mm_set_epi64x((long long)hi, (long long)lo);
+}
+
+INLINE void bs_unpack(uint64_t *lo, uint64_t *hi, bs_word a)
+{
+	uint64_t t[2];
+
+	_mm_storeu_si128((__m128i*)t, a);
+	*lo = t[0];
+	*hi = t[1];
+}
+
+#else
+
+typedef struct { uint64_t lo, hi; } bs_word;
+
+INLINE bs_word bs_pack(uint64_t lo, uint64_t hi)
+{
+	bs_word r;
+
+	r.lo = lo;
+	r.hi = hi;
+	return r;
+}
+
+INLINE void bs_unpack(uint64_t *lo, uint64_t *hi, bs_word a)
+{
+	*lo = a.lo;
+	*hi = a.hi;
+}
+
+INLINE bs_word bs_xor(bs_word a, bs_word b) { return bs_pack(a.lo ^ b.lo, a.hi ^ b.hi); }
+INLINE bs_word bs_and(bs_word a, bs_word b) { return bs_pack(a.lo & b.lo, a.hi & b.hi); }
+INLINE bs_word bs_or(bs_word a, bs_word b)  { return bs_pack(a.lo | b.lo, a.hi | b.hi); }
+INLINE bs_word bs_not(bs_word a)            { return bs_pack(~a.lo, ~a.hi); }
+INLINE bs_word bs_shl(bs_word a, int n)     { return bs_pack(a.lo << n, a.hi << n); }
+INLINE bs_word bs_shr(bs_word a, int n)     { return bs_pack(a.lo >> n, a.hi >> n); }
+INLINE bs_word bs_const(uint64_t c)         { return bs_pack(c, c); }
+
+INLINE bs_word bs_rotr32(bs_word a)
+{
+	return bs_pack((a.lo << 32) | (a.lo >> 32), (a.hi << 32) | (a.hi >> 32));
+}
+
+INLINE bs_word bs_rotr16(bs_word a)
+{
+	return bs_pack((a.lo >> 16) | (a.lo << 48), (a.hi >> 16) | (a.hi << 48));
+}
+
+INLINE bs_word bs_rotf(bs_word a, int n)
+{
+	uint64_t m = 0x0001000100010001 * (0xffff >> n);
+
+	return bs_pack(((a.lo >> n) & m) | ((a.lo << (16 - n)) & ~m),
+	               ((a.hi >> n) & m) | ((a.hi << (16 - n)) & ~m));
+}
+
+#endif
+
+#define BS_BLOCKS   8
+
+#define X(a, b)     bs_xor(a, b)
+#define A(a, b)     bs_and(a, b)
+
+/* The AES S-box as a circuit of 113 XOR/AND/XNOR gates (Boyar-Peralta) */
+
+INLINE void bs_sbox(bs_word q[8])
+{
+	bs_word x0, x1, x2, x3, x4, x5, x6, x7;
+	bs_word y1, y2, y3, y4, y5, y6, y7, y8, y9, y10, y11;
+	bs_word y12, y13, y14, y15, y16, y17, y18, y19, y20, y21;
+	bs_word z0, z1, z2, z3, z4, z5, z6, z7, z8, z9;
+	bs_word z10, z11, z12, z13, z14, z15, z16, z17;
+	bs_word t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+	bs_word t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+	bs_word t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+	bs_word t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+	bs_word t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+	bs_word t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+	bs_word t60, t61, t62, t63, t64, t65, t66, t67;
+
+	x0 = q[7]; x1 = q[6]; x2 = q[5]; x3 = q[4];
+	x4 = q[3]; x5 = q[2]; x6 = q[1]; x7 = q[0];
+
+	/* top linear transformation */
+	y14 = X(x3, x5);    y13 = X(x0, x6);    y9 = X(x0, x3);
+	y8 = X(x0, x5);     t0 = X(x1, x2);     y1 = X(t0, x7);
+	y4 = X(y1, x3);     y12 = X(y13, y14);  y2 = X(y1, x0);
+	y5 = X(y1, x6);     y3 = X(y5, y8);     t1 = X(x4, y12);
+	y15 = X(t1, x5);    y20 = X(t1, x1);    y6 = X(y15, x7);
+	y10 = X(y15, t0);   y11 = X(y20, y9);   y7 = X(x7, y11);
+	y17 = X(y10, y11);  y19 = X(y10, y8);   y16 = X(t0, y11);
+	y21 = X(y13, y16);  y18 = X(x0, y16);
+
+	/* non-linear section */
+	t2 = A(y12, y15);   t3 = A(y3, y6);     t4 = X(t3, t2);
+	t5 = A(y4, x7);     t6 = X(t5, t2);     t7 = A(y13, y16);
+	t8 = A(y5, y1);     t9 = X(t8, t7);     t10 = A(y2, y7);
+	t11 = X(t10, t7);   t12 = A(y9, y11);   t13 = A(y14, y17);
+	t14 = X(t13, t12);  t15 = A(y8, y10);   t16 = X(t15, t12);
+	t17 = X(t4, t14);   t18 = X(t6, t16);   t19 = X(t9, t14);
+	t20 = X(t11, t16);  t21 = X(t17, y20);  t22 = X(t18, y19);
+	t23 = X(t19, y21);  t24 = X(t20, y18);
+
+	t25 = X(t21, t22);  t26 = A(t21, t23);  t27 = X(t24, t26);
+	t28 = A(t25, t27);  t29 = X(t28, t22);  t30 = X(t23, t24);
+	t31 = X(t22, t26);  t32 = A(t31, t30);  t33 = X(t32, t24);
+	t34 = X(t23, t33);  t35 = X(t27, t33);  t36 = A(t24, t35);
+	t37 = X(t36, t34);  t38 = X(t27, t36);  t39 = A(t29, t38);
+	t40 = X(t25, t39);
+
+	t41 = X(t40, t37);  t42 = X(t29, t33);  t43 = X(t29, t40);
+	t44 = X(t33, t37);  t45 = X(t42, t41);
+	z0 = A(t44, y15);   z1 = A(t37, y6);    z2 = A(t33, x7);
+	z3 = A(t43, y16);   z4 = A(t40, y1);    z5 = A(t29, y7);
+	z6 = A(t42, y11);   z7 = A(t45, y17);   z8 = A(t41, y10);
+	z9 = A(t44, y12);   z10 = A(t37, y3);   z11 = A(t33, y4);
+	z12 = A(t43, y13);  z13 = A(t40, y5);   z14 = A(t29, y2);
+	z15 = A(t42, y9);   z16 = A(t45, y14);  z17 = A(t41, y8);
+
+	/* bottom linear transformation */
+	t46 = X(z15, z16);  t47 = X(z10, z11);  t48 = X(z5, z13);
+	t49 = X(z9, z10);   t50 = X(z2, z12);   t51 = X(z2, z5);
+	t52 = X(z7, z8);    t53 = X(z0, z3);    t54 = X(z6, z7);
+	t55 = X(z16, z17);  t56 = X(z12, t48);  t57 = X(t50, t53);
+	t58 = X(z4, t46);   t59 = X(z3, t54);   t60 = X(t46, t57);
+	t61 = X(z14, t57);  t62 = X(t52, t58);  t63 = X(t49, t58);
+	t64 = X(z4, t59);   t65 = X(t61, t62);  t66 = X(z1, t63);
+	t67 = X(t64, t65);
+
+	q[7] = X(t59, t63);
+	q[1] = X(t56, bs_not(t62));
+	q[0] = X(t48, bs_not(t60));
+	q[4] = X(t53, t66);
+	q[3] = X(t51, t66);
+	q[2] = X(t47, t65);
+	q[6] = X(t64, bs_not(q[4]));
+	q[5] = X(t55, bs_not(t67));
+}
+
+/* the inverse S-box is the forward one between two inverse affine maps */
+
+INLINE void bs_inv_affine(bs_word q[8])
+{
+	bs_word q0 = bs_not(q[0]), q1 = bs_not(q[1]), q2 = q[2], q3 = q[3],
+	        q4 = q[4], q5 = bs_not(q[5]), q6 = bs_not(q[6]), q7 = q[7];
+
+	q[7] = X(X(q1, q4), q6);
+	q[6] = X(X(q0, q3), q5);
+	q[5] = X(X(q7, q2), q4);
+	q[4] = X(X(q6, q1), q3);
+	q[3] = X(X(q5, q0), q2);
+	q[2] = X(X(q4, q7), q1);
+	q[1] = X(X(q3, q6), q0);
+	q[0] = X(X(q2, q5), q7);
+}
+
+INLINE void bs_inv_sbox(bs_word q[8])
+{
+	bs_inv_affine(q);
+	bs_sbox(q);
+	bs_inv_affine(q);
+}
+
+/* each 64-bit word holds the rows of 4 blocks as 16-bit fields of column
+   bits, 4 bits per column, so ShiftRows rotates row r by 4.r bits; this
+   is done as a rotation by 8 of rows 2 and 3 and then one by 4 of rows 1
+   and 3 (or by 12 for the inverse) */
+
+#define BS_ROWS01   bs_const(0x00000000FFFFFFFF)
+#define BS_ROWS02   bs_const(0x0000FFFF0000FFFF)
+
+INLINE bs_word bs_rows(bs_word x, bs_word m, bs_word r)
+{
+	return bs_or(bs_and(x, m), bs_and(r, bs_not(m)));
+}
+
+INLINE void bs_shift_rows(bs_word q[8])
+{
+	int i;
+
+	for(i = 0; i < 8; ++i)
+	{
+		bs_word x = bs_rows(q[i], BS_ROWS01, bs_rotf(q[i], 8));
+		q[i] = bs_rows(x, BS_ROWS02, bs_rotf(x, 4));
+	}
+}
+
+INLINE void bs_inv_shift_rows(bs_word q[8])
+{
+	int i;
+
+	for(i = 0; i < 8; ++i)
+	{
+		bs_word x = bs_rows(q[i], BS_ROWS01, bs_rotf(q[i], 8));
+		q[i] = bs_rows(x, BS_ROWS02, bs_rotf(x, 12));
+	}
+}
+
+INLINE void bs_mix_columns(bs_word q[8])
+{
+	bs_word q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3],
+	        q4 = q[4], q5 = q[5], q6 = q[6], q7 = q[7];
+	bs_word r0 = bs_rotr16(q0), r1 = bs_rotr16(q1), r2 = bs_rotr16(q2), r3 = bs_rotr16(q3),
+	        r4 = bs_rotr16(q4), r5 = bs_rotr16(q5), r6 = bs_rotr16(q6), r7 = bs_rotr16(q7);
+	bs_word s7 = X(q7, r7);
+
+	q[0] = X(X(s7, r0), bs_rotr32(X(q0, r0)));
+	q[1] = X(X(X(q0, r0), X(s7, r1)), bs_rotr32(X(q1, r1)));
+	q[2] = X(X(X(q1, r1), r2), bs_rotr32(X(q2, r2)));
+	q[3] = X(X(X(q2, r2), X(s7, r3)), bs_rotr32(X(q3, r3)));
+	q[4] = X(X(X(q3, r3), X(s7, r4)), bs_rotr32(X(q4, r4)));
+	q[5] = X(X(X(q4, r4), r5), bs_rotr32(X(q5, r5)));
+	q[6] = X(X(X(q5, r5), r6), bs_rotr32(X(q6, r6)));
+	q[7] = X(X(X(q6, r6), r7), bs_rotr32(s7));
+}
+
+/* InvMixColumns is MixColumns after adding 4.(a[i] ^ a[i + 2]) to each
+   byte a[i] of a column; the rows two apart are a 32-bit rotation away */
+
+INLINE void bs_inv_mix_columns(bs_word q[8])
+{
+	bs_word t[8], u[8];
+	int i;
+
+	for(i = 0; i < 8; ++i)
+		t[i] = X(q[i], bs_rotr32(q[i]));
+
+	/* multiply t by x^2 in GF(2^8), bit plane by bit plane */
+	u[0] = t[6];
+	u[1] = X(t[6], t[7]);
+	u[2] = X(t[0], t[7]);
+	u[3] = X(t[1], t[6]);
+	u[4] = X(X(t[2], t[6]), t[7]);
+	u[5] = X(t[3], t[7]);
+	u[6] = t[4];
+	u[7] = t[5];
+
+	for(i = 0; i < 8; ++i)
+		q[i] = X(q[i], u[i]);
+	bs_mix_columns(q);
+}
+
+INLINE void bs_add_round_key(bs_word q[8], const bs_word *sk)
+{
+	int i;
+
+	for(i = 0; i < 8; ++i)
+		q[i] = X(q[i], sk[i]);
+}
+
+#define bs_swapn(cl, ch, s, x, y) \
+	do { bs_word a_ = (x), b_ = (y); \
+	     (x) = bs_or(bs_and(a_, bs_const(cl)), bs_shl(bs_and(b_, bs_const(cl)), s)); \
+	     (y) = bs_or(bs_shr(bs_and(a_, bs_const(ch)), s), bs_and(b_, bs_const(ch))); \
+	} while(0)
+
+#define bs_swap2(x, y)  bs_swapn(0x5555555555555555, 0xAAAAAAAAAAAAAAAA, 1, x, y)
+#define bs_swap4(x, y)  bs_swapn(0x3333333333333333, 0xCCCCCCCCCCCCCCCC, 2, x, y)
+#define bs_swap8(x, y)  bs_swapn(0x0F0F0F0F0F0F0F0F, 0xF0F0F0F0F0F0F0F0, 4, x, y)
+
+/* moves between bytes and bit planes, it is its own inverse */
+
+INLINE void bs_ortho(bs_word q[8])
+{
+	bs_swap2(q[0], q[1]); bs_swap2(q[2], q[3]);
+	bs_swap2(q[4], q[5]); bs_swap2(q[6], q[7]);
+
+	bs_swap4(q[0], q[2]); bs_swap4(q[1], q[3]);
+	bs_swap4(q[4], q[6]); bs_swap4(q[5], q[7]);
+
+	bs_swap8(q[0], q[4]); bs_swap8(q[1], q[5]);
+	bs_swap8(q[2], q[6]); bs_swap8(q[3], q[7]);
+}
+
+INLINE uint32_t bs_get32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+INLINE void bs_put32(unsigned char *p, uint32_t v)
+{
+	p[0] = (unsigned char)v;
+	p[1] = (unsigned char)(v >> 8);
+	p[2] = (unsigned char)(v >> 16);
+	p[3] = (unsigned char)(v >> 24);
+}
+
+/* spread the 16 bytes of a block over two words, interleaved so that
+   the ortho() transposition leaves each row in a 16-bit field: the first
+   word has the bytes of columns 0 and 2 alternately, the second those
+   of columns 1 and 3 */
+
+static void bs_interleave_in(uint64_t *q0, uint64_t *q1, const unsigned char *p)
+{
+	uint64_t x0 = bs_get32(p), x1 = bs_get32(p + 4), x2 = bs_get32(p + 8), x3 = bs_get32(p + 12);
+
+	x0 |= x0 << 16; x1 |= x1 << 16; x2 |= x2 << 16; x3 |= x3 << 16;
+	x0 &= 0x0000FFFF0000FFFF; x1 &= 0x0000FFFF0000FFFF;
+	x2 &= 0x0000FFFF0000FFFF; x3 &= 0x0000FFFF0000FFFF;
+	x0 |= x0 << 8; x1 |= x1 << 8; x2 |= x2 << 8; x3 |= x3 << 8;
+	x0 &= 0x00FF00FF00FF00FF; x1 &= 0x00FF00FF00FF00FF;
+	x2 &= 0x00FF00FF00FF00FF; x3 &= 0x00FF00FF00FF00FF;
+	*q0 = x0 | (x2 << 8);
+	*q1 = x1 | (x3 << 8);
+}
+
+/* load nb <= BS_BLOCKS blocks, the unused lanes are zero; blocks 0 to 3
+   go into the low halves of the words and blocks 4 to 7 the high ones */
+
+#if defined( BS_SSE2 )
+
+/* the byte interleave above is a single unpack of the two block halves */
+
+static void bs_load(bs_word q[8], const unsigned char *ibuf, int nb)
+{
+	__m128i u[BS_BLOCKS], v;
+	int i;
+
+	for(i = 0; i < BS_BLOCKS; ++i)
+	{
+		v = i < nb ? _mm_loadu_si128((const __m128i*)ibuf + i) : _mm_setzero_si128();
+		u[i] = _mm_unpacklo_epi8(v, _mm_srli_si128(v, 8));
+	}
+
+	for(i = 0; i < 4; ++i)
+	{
+		q[i] = _mm_unpacklo_epi64(u[i], u[i + 4]);
+		q[i + 4] = _mm_unpackhi_epi64(u[i], u[i + 4]);
+	}
+	bs_ortho(q);
+}
+
+static void bs_store(unsigned char *obuf, bs_word q[8], int nb)
+{
+	__m128i u[BS_BLOCKS], m = _mm_set1_epi16(0x00ff);
+	int i;
+
+	bs_ortho(q);
+	for(i = 0; i < 4; ++i)
+	{
+		u[i] = _mm_unpacklo_epi64(q[i], q[i + 4]);
+		u[i + 4] = _mm_unpackhi_epi64(q[i], q[i + 4]);
+	}
+
+	for(i = 0; i < nb; ++i)
+		_mm_storeu_si128((__m128i*)obuf + i,
+			_mm_packus_epi16(_mm_and_si128(u[i], m), _mm_srli_epi16(u[i], 8)));
+}
+
+#else
+
+static void bs_interleave_out(unsigned char *p, uint64_t q0, uint64_t q1)
+{
+	uint64_t x0 = q0 & 0x00FF00FF00FF00FF, x1 = q1 & 0x00FF00FF00FF00FF,
+	         x2 = (q0 >> 8) & 0x00FF00FF00FF00FF, x3 = (q1 >> 8) & 0x00FF00FF00FF00FF;
+
+	x0 |= x0 >> 8; x1 |= x1 >> 8; x2 |= x2 >> 8; x3 |= x3 >> 8;
+	x0 &= 0x0000FFFF0000FFFF; x1 &= 0x0000FFFF0000FFFF;
+	x2 &= 0x0000FFFF0000FFFF; x3 &= 0x0000FFFF0000FFFF;
+	bs_put32(p,      (uint32_t)x0 | (uint32_t)(x0 >> 16));
+	bs_put32(p + 4,  (uint32_t)x1 | (uint32_t)(x1 >> 16));
+	bs_put32(p + 8,  (uint32_t)x2 | (uint32_t)(x2 >> 16));
+	bs_put32(p + 12, (uint32_t)x3 | (uint32_t)(x3 >> 16));
+}
+
+static void bs_load(bs_word q[8], const unsigned char *ibuf, int nb)
+{
+	static const unsigned char zero[AES_BLOCK_SIZE] = { 0 };
+	uint64_t w[16];
+	int i;
+
+	for(i = 0; i < BS_BLOCKS; ++i)
+		bs_interleave_in(w + (i & 4) * 2 + (i & 3), w + (i & 4) * 2 + (i & 3) + 4,
+			i < nb ? ibuf + i * AES_BLOCK_SIZE : zero);
+
+	for(i = 0; i < 8; ++i)
+		q[i] = bs_pack(w[i], w[i + 8]);
+	bs_ortho(q);
+}
+
+static void bs_store(unsigned char *obuf, bs_word q[8], int nb)
+{
+	unsigned char t[AES_BLOCK_SIZE];
+	uint64_t w[16];
+	int i;
+
+	bs_ortho(q);
+	for(i = 0; i < 8; ++i)
+		bs_unpack(w + i, w + i + 8, q[i]);
+
+	for(i = 0; i < nb; ++i)
+	{
+		bs_interleave_out(t, w[(i & 4) * 2 + (i & 3)], w[(i & 4) * 2 + (i & 3) + 4]);
+		memcpy(obuf + i * AES_BLOCK_SIZE, t, AES_BLOCK_SIZE);
+	}
+}
+
+#endif
+
+/* The key schedule in the context is converted to bit planes on each
+   call, with every round key repeated in all the lanes
+*/
+
+#define BS_MAX_KEYS (15 * 8)
+
+static int bs_key_order(bs_word sk[BS_MAX_KEYS], const uint32_t *ks, int rounds, int rev)
+{
+	const unsigned char *kp = (const unsigned char*)ks;
+	uint64_t w[8];
+	int i, r;
+
+	if(rounds != 10 && rounds != 12 && rounds != 14)
+		return 0;
+
+	for(r = 0; r <= rounds; ++r)
+	{
+		for(i = 0; i < 4; ++i)
+			bs_interleave_in(w + i, w + i + 4, kp + (rev ? rounds - r : r) * AES_BLOCK_SIZE);
+		for(i = 0; i < 8; ++i)
+			sk[r * 8 + i] = bs_pack(w[i], w[i]);
+		bs_ortho(sk + r * 8);
+	}
+	return rounds;
+}
+
+/* a decryption schedule has its round keys last first where the table
+   code keeps them so (AES_REV_DKS), see aes_backend_decrypt_schedule */
+
+#if defined( AES_REV_DKS )
+#  define BS_REV_DKS 1
+#else
+#  define BS_REV_DKS 0
+#endif
+
+#define bs_key_load(sk, ks, rounds)  bs_key_order(sk, ks, rounds, 0)
+#define bs_dkey_load(sk, ks, rounds) bs_key_order(sk, ks, rounds, BS_REV_DKS)
+
+static void bs_encrypt(bs_word q[8], const bs_word *sk, int rounds)
+{
+	int r;
+
+	bs_add_round_key(q, sk);
+	for(r = 1; r < rounds; ++r)
+	{
+		bs_sbox(q);
+		bs_shift_rows(q);
+		bs_mix_columns(q);
+		bs_add_round_key(q, sk + r * 8);
+	}
+	bs_sbox(q);
+	bs_shift_rows(q);
+	bs_add_round_key(q, sk + rounds * 8);
+}
+
+/* the decryption schedule is the one for the equivalent inverse cipher,
+   its middle round keys have InvMixColumns applied already */
+
+static void bs_decrypt(bs_word q[8], const bs_word *sk, int rounds)
+{
+	int r;
+
+	bs_add_round_key(q, sk + rounds * 8);
+	for(r = rounds - 1; r > 0; --r)
+	{
+		bs_inv_sbox(q);
+		bs_inv_shift_rows(q);
+		bs_inv_mix_columns(q);
+		bs_add_round_key(q, sk + r * 8);
+	}
+	bs_inv_sbox(q);
+	bs_inv_shift_rows(q);
+	bs_add_round_key(q, sk);
+}
+
+INLINE void bs_xor_block(unsigned char *d, const unsigned char *a, const unsigned char *b, int n)
+{
+	uint64_t x, y;
+	int i;
+
+	for(i = 0; i + 8 <= n; i += 8)
+	{
+		memcpy(&x, a + i, 8);
+		memcpy(&y, b + i, 8);
+		x ^= y;
+		memcpy(d + i, &x, 8);
+	}
+	for( ; i < n; ++i)
+		d[i] = a[i] ^ b[i];
+}
+/* key expansion without table lookups, SubWord uses the S-box circuit */
+
+static uint32_t bs_sub_word(uint32_t x)
+{
+	bs_word q[8];
+	uint64_t lo, hi;
+	int i;
+
+	q[0] = bs_pack(x, 0);
+	for(i = 1; i < 8; ++i)
+		q[i] = bs_pack(0, 0);
+	bs_ortho(q);
+	bs_sbox(q);
+	bs_ortho(q);
+	bs_unpack(&lo, &hi, q[0]);
+	return (uint32_t)lo;
+}
+
+static AES_RETURN bs_expand_key(const unsigned char *key, int key_len, uint32_t *w, aes_inf *inf)
+{
+	uint32_t t, rcon = 1;
+	int nk, rounds, i;
+
+	switch(key_len)
+	{
+	case 16: case 128: nk = 4; break;
+	case 24: case 192: nk = 6; break;
+	case 32: case 256: nk = 8; break;
+	default: return EXIT_FAILURE;
+	}
+	rounds = nk + 6;
+
+	for(i = 0; i < nk; ++i)
+		w[i] = bs_get32(key + 4 * i);
+
+	for(i = nk; i < 4 * (rounds + 1); ++i)
+	{
+		t = w[i - 1];
+		if(i % nk == 0)
+		{
+			t = bs_sub_word((t >> 8) | (t << 24)) ^ rcon;
+			rcon = (rcon << 1) ^ (0x11b & (0u - (rcon >> 7)));
+		}
+		else if(nk > 6 && i % nk == 4)
+			t = bs_sub_word(t);
+		w[i] = w[i - nk] ^ t;
+	}
+
+	inf->l = 0;
+	inf->b[0] = (uint8_t)(rounds * 16);
+	return EXIT_SUCCESS;
+}
+
+/* the round keys are kept as bytes in the context, see aes_ni.c */
+
+static void bs_store_key(uint32_t *ks, const uint32_t *w, int n)
+{
+	int i;
+
+	for(i = 0; i < n; ++i)
+		bs_put32((unsigned char*)(ks + i), w[i]);
+}
+
+#define bs_xtime(w) ((((w) & 0x7f7f7f7f) << 1) ^ ((((w) >> 7) & 0x01010101) * 0x1b))
+#define bs_rotw(w, n) (((w) >> (n)) | ((w) << (32 - (n))))
+
+static uint32_t bs_inv_mix_word(uint32_t w)
+{
+	uint32_t t = w ^ bs_rotw(w, 16);
+
+	w ^= bs_xtime(bs_xtime(t));
+	t = bs_rotw(w, 8);
+	return bs_xtime(w ^ t) ^ t ^ bs_rotw(w, 16) ^ bs_rotw(w, 24);
+}
+
+static AES_RETURN bs_encrypt_key(const unsigned char *key, int key_len, aes_encrypt_ctx cx[1])
+{
+	uint32_t w[KS_LENGTH];
+
+	if(bs_expand_key(key, key_len, w, &cx->inf) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	bs_store_key(cx->ks, w, 4 * ((cx->inf.b[0] >> 4) + 1));
+	memset(w, 0, sizeof(w));
+	return EXIT_SUCCESS;
+}
+
+static AES_RETURN bs_decrypt_key(const unsigned char *key, int key_len, aes_decrypt_ctx cx[1])
+{
+	uint32_t w[KS_LENGTH];
+	int i, n;
+
+	if(bs_expand_key(key, key_len, w, &cx->inf) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	n = 4 * (cx->inf.b[0] >> 4);
+	for(i = 4; i < n; ++i)
+		w[i] = bs_inv_mix_word(w[i]);
+#if defined( AES_REV_DKS )
+	for(i = 0; i <= n; i += 4)
+		bs_store_key(cx->ks + n - i, w + i, 4);
+#else
+	bs_store_key(cx->ks, w, n + 4);
+#endif
+	memset(w, 0, sizeof(w));
+	return EXIT_SUCCESS;
+}
+
+static AES_RETURN bs_encrypt_one(const unsigned char *in, unsigned char *out, const aes_encrypt_ctx cx[1])
+{
+	bs_word sk[BS_MAX_KEYS], q[8];
+	int rounds = bs_key_load(sk, cx->ks, cx->inf.b[0] >> 4);
+
+	if(!rounds)
+		return EXIT_FAILURE;
+
+	bs_load(q, in, 1);
+	bs_encrypt(q, sk, rounds);
+	bs_store(out, q, 1);
+	return EXIT_SUCCESS;
+}
+
+static AES_RETURN bs_decrypt_one(const unsigned char *in, unsigned char *out, const aes_decrypt_ctx cx[1])
+{
+	bs_word sk[BS_MAX_KEYS], q[8];
+	int rounds = bs_dkey_load(sk, cx->ks, cx->inf.b[0] >> 4);
+
+	if(!rounds)
+		return EXIT_FAILURE;
+
+	bs_load(q, in, 1);
+	bs_decrypt(q, sk, rounds);
+	bs_store(out, q, 1);
+	return EXIT_SUCCESS;
+}
+
+static AES_RETURN bs_ecb_encrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, const aes_encrypt_ctx cx[1])
+{
+	bs_word sk[BS_MAX_KEYS], q[8];
+	int rounds = bs_key_load(sk, cx->ks, cx->inf.b[0] >> 4), nb = len >> 4, n;
+
+	if(len & (AES_BLOCK_SIZE - 1) || !rounds)
+		return EXIT_FAILURE;
+
+	for( ; nb; nb -= n)
+	{
+		n = nb < BS_BLOCKS ? nb : BS_BLOCKS;
+		bs_load(q, ibuf, n);
+		bs_encrypt(q, sk, rounds);
+		bs_store(obuf, q, n);
+		ibuf += n * AES_BLOCK_SIZE;
+		obuf += n * AES_BLOCK_SIZE;
+	}
+	return EXIT_SUCCESS;
+}
+
+static AES_RETURN bs_ecb_decrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, const aes_decrypt_ctx cx[1])
+{
+	bs_word sk[BS_MAX_KEYS], q[8];
+	int rounds = bs_dkey_load(sk, cx->ks, cx->inf.b[0] >> 4), nb = len >> 4, n;
+
+	if(len & (AES_BLOCK_SIZE - 1) || !rounds)
+		return EXIT_FAILURE;
+
+	for( ; nb; nb -= n)
+	{
+		n = nb < BS_BLOCKS ? nb : BS_BLOCKS;
+		bs_load(q, ibuf, n);
+		bs_decrypt(q, sk, rounds);
+		bs_store(obuf, q, n);
+		ibuf += n * AES_BLOCK_SIZE;
+		obuf += n * AES_BLOCK_SIZE;
+	}
+	return EXIT_SUCCESS;
+}
+
+static AES_RETURN bs_cbc_encrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, const aes_encrypt_ctx cx[1])
+{
+	bs_word sk[BS_MAX_KEYS], q[8];
+	int rounds = bs_key_load(sk, cx->ks, cx->inf.b[0] >> 4), nb = len >> 4;
+
+	if(len & (AES_BLOCK_SIZE - 1) || !rounds)
+		return EXIT_FAILURE;
+
+	for( ; nb; --nb)
+	{
+		bs_xor_block(iv, iv, ibuf, AES_BLOCK_SIZE);
+		bs_load(q, iv, 1);
+		bs_encrypt(q, sk, rounds);
+		bs_store(iv, q, 1);
+		memcpy(obuf, iv, AES_BLOCK_SIZE);
+		ibuf += AES_BLOCK_SIZE;
+		obuf += AES_BLOCK_SIZE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/* the ciphertext is copied out before the decrypted blocks are stored
+   so that ibuf may equal obuf */
+
+static AES_RETURN bs_cbc_decrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, const aes_decrypt_ctx cx[1])
+{
+	bs_word sk[BS_MAX_KEYS], q[8];
+	unsigned char c[AES_BLOCK_SIZE * (BS_BLOCKS + 1)];
+	int rounds = bs_dkey_load(sk, cx->ks, cx->inf.b[0] >> 4), nb = len >> 4, n;
+
+	if(len & (AES_BLOCK_SIZE - 1) || !rounds)
+		return EXIT_FAILURE;
+
+	memcpy(c, iv, AES_BLOCK_SIZE);
+	for( ; nb; nb -= n)
+	{
+		n = nb < BS_BLOCKS ? nb : BS_BLOCKS;
+		memcpy(c + AES_BLOCK_SIZE, ibuf, n * AES_BLOCK_SIZE);
+		bs_load(q, ibuf, n);
+		bs_decrypt(q, sk, rounds);
+		bs_store(obuf, q, n);
+		bs_xor_block(obuf, obuf, c, n * AES_BLOCK_SIZE);
+		memcpy(c, c + n * AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+		ibuf += n * AES_BLOCK_SIZE;
+		obuf += n * AES_BLOCK_SIZE;
+	}
+	memcpy(iv, c, AES_BLOCK_SIZE);
+	return EXIT_SUCCESS;
+}
+
+static AES_RETURN bs_cfb_encrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1])
+{
+	bs_word sk[BS_MAX_KEYS], q[8];
+	int rounds = bs_key_load(sk, cx->ks, cx->inf.b[0] >> 4), b_pos = cx->inf.b[2];
+
+	if(!rounds)
+		return EXIT_FAILURE;
+
+	while(len)
+	{
+		if(!b_pos)
+		{
+			bs_load(q, iv, 1);
+			bs_encrypt(q, sk, rounds);
+			bs_store(iv, q, 1);
+		}
+		for( ; b_pos < AES_BLOCK_SIZE && len; --len)
+		{
+			*obuf++ = (iv[b_pos] ^= *ibuf++);
+			++b_pos;
+		}
+		b_pos &= AES_BLOCK_SIZE - 1;
+	}
+
+	cx->inf.b[2] = (uint8_t)b_pos;
+	return EXIT_SUCCESS;
+}
+
+/* CFB decryption takes the cipher inputs from the ciphertext so whole
+   blocks are done BS_BLOCKS at a time, in place like CBC above */
+
+static AES_RETURN bs_cfb_decrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1])
+{
+	bs_word sk[BS_MAX_KEYS], q[8];
+	unsigned char c[AES_BLOCK_SIZE * (BS_BLOCKS + 1)], u;
+	int rounds = bs_key_load(sk, cx->ks, cx->inf.b[0] >> 4), b_pos = cx->inf.b[2], n;
+
+	if(!rounds)
+		return EXIT_FAILURE;
+
+	if(b_pos)           /* complete any partial block   */
+	{
+		while(b_pos < AES_BLOCK_SIZE && len)
+		{
+			u = *ibuf++;
+			*obuf++ = u ^ iv[b_pos];
+			iv[b_pos++] = u;
+			--len;
+		}
+
+		b_pos &= AES_BLOCK_SIZE - 1;
+	}
+
+	memcpy(c, iv, AES_BLOCK_SIZE);
+	for( ; len >= AES_BLOCK_SIZE; len -= n * AES_BLOCK_SIZE)
+	{
+		n = (len >> 4) < BS_BLOCKS ? (len >> 4) : BS_BLOCKS;
+		memcpy(c + AES_BLOCK_SIZE, ibuf, n * AES_BLOCK_SIZE);
+		bs_load(q, c, n);
+		bs_encrypt(q, sk, rounds);
+		bs_store(obuf, q, n);
+		bs_xor_block(obuf, obuf, c + AES_BLOCK_SIZE, n * AES_BLOCK_SIZE);
+		memcpy(c, c + n * AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+		ibuf += n * AES_BLOCK_SIZE;
+		obuf += n * AES_BLOCK_SIZE;
+	}
+	memcpy(iv, c, AES_BLOCK_SIZE);
+
+	if(len)
+	{
+		bs_load(q, iv, 1);
+		bs_encrypt(q, sk, rounds);
+		bs_store(iv, q, 1);
+		for(b_pos = 0; b_pos < len; ++b_pos)
+		{
+			u = ibuf[b_pos];
+			obuf[b_pos] = u ^ iv[b_pos];
+			iv[b_pos] = u;
+		}
+	}
+
+	cx->inf.b[2] = (uint8_t)b_pos;
+	return EXIT_SUCCESS;
+}
+
+static AES_RETURN bs_ofb_crypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1])
+{
+	bs_word sk[BS_MAX_KEYS], q[8];
+	int rounds = bs_key_load(sk, cx->ks, cx->inf.b[0] >> 4), b_pos = cx->inf.b[2];
+
+	if(!rounds)
+		return EXIT_FAILURE;
+
+	while(len)
+	{
+		if(!b_pos)
+		{
+			bs_load(q, iv, 1);
+			bs_encrypt(q, sk, rounds);
+			bs_store(iv, q, 1);
+		}
+		for( ; b_pos < AES_BLOCK_SIZE && len; --len)
+		{
+			*obuf++ = iv[b_pos] ^ *ibuf++;
+			++b_pos;
+		}
+		b_pos &= AES_BLOCK_SIZE - 1;
+	}
+
+	cx->inf.b[2] = (uint8_t)b_pos;
+	return EXIT_SUCCESS;
+}
+
+/* Both CTR calls build the next counter blocks in ctr[] and encrypt them
+   together; a trailing part block leaves its counter in cbuf and the
+   position in the context just like the table code
+*/
+
+static AES_RETURN bs_ctr_crypt(const unsigned char *ibuf, unsigned char *obuf,
+            int len, unsigned char *cbuf, cbuf_inc ctr_inc, aes_encrypt_ctx cx[1])
+{
+	bs_word sk[BS_MAX_KEYS], q[8];
+	unsigned char ctr[AES_BLOCK_SIZE * BS_BLOCKS];
+	int rounds = bs_key_load(sk, cx->ks, cx->inf.b[0] >> 4), b_pos = cx->inf.b[2], n, i;
+
+	if(!rounds)
+		return EXIT_FAILURE;
+
+	if(b_pos)
+	{
+		bs_load(q, cbuf, 1);
+		bs_encrypt(q, sk, rounds);
+		bs_store(ctr, q, 1);
+		while(b_pos < AES_BLOCK_SIZE && len)
+		{
+			*obuf++ = *ibuf++ ^ ctr[b_pos++];
+			--len;
+		}
+
+		if(len)
+			ctr_inc(cbuf), b_pos = 0;
+	}
+
+	while(len)
+	{
+		n = (len + AES_BLOCK_SIZE - 1) >> 4;
+		n = n < BS_BLOCKS ? n : BS_BLOCKS;
+		for(i = 0; i < n; ++i)
+		{
+			memcpy(ctr + i * AES_BLOCK_SIZE, cbuf, AES_BLOCK_SIZE);
+			if(len >= (i + 1) * AES_BLOCK_SIZE)
+				ctr_inc(cbuf);
+		}
+
+		bs_load(q, ctr, n);
+		bs_encrypt(q, sk, rounds);
+		bs_store(ctr, q, n);
+
+		i = len < n * AES_BLOCK_SIZE ? len : n * AES_BLOCK_SIZE;
+		bs_xor_block(obuf, ibuf, ctr, i);
+		b_pos = i & (AES_BLOCK_SIZE - 1);
+		ibuf += i;
+		obuf += i;
+		len -= i;
+	}
+
+	cx->inf.b[2] = (uint8_t)b_pos;
+	return EXIT_SUCCESS;
+}
+
+static AES_RETURN bs_ctr_crypt_ex(const unsigned char *ibuf, unsigned char *obuf,
+            int len, unsigned char *cbuf, int ctr_mode, aes_encrypt_ctx cx[1])
+{
+	cbuf_inc *ctr_inc = aes_ctr_inc(ctr_mode);
+
+	return ctr_inc ? bs_ctr_crypt(ibuf, obuf, len, cbuf, ctr_inc, cx) : EXIT_FAILURE;
+}
+
+const aes_backend aes_backend_bitslice =
+{
+	"bitslice",
+	bs_encrypt_key,        bs_decrypt_key,
+	NULL,
+	bs_encrypt_one,        bs_decrypt_one,
+	bs_ecb_encrypt,        bs_ecb_decrypt,
+	bs_cbc_encrypt,        bs_cbc_decrypt,
+	bs_cfb_encrypt,        bs_cfb_decrypt,
+	bs_ofb_crypt,
+	bs_ctr_crypt,          bs_ctr_crypt_ex,
+	NULL
+};
+
+#if defined(__cplusplus)
+}
+#endif
@@ -0,0 +1,1158 @@
+/*
+ Whole file encryption and decryption and threaded CTR, see aes_file.h.
+
+ The ring holds job->buffers buffers and three counters of the buffers
+ that went through each stage: read, done (by the mode) and written. A
+ stage waits until the one before it is ahead and the reader waits until
+ the writer has freed a buffer, so buffer i % buffers is only touched by
+ the one stage that owns it. Only the last buffer read may be short.
+*/
+
+#if defined( __linux__ )
+#  if !defined( _GNU_SOURCE )
+#    define _GNU_SOURCE         /* for syscall() */
+#  endif
+#  if !defined( _FILE_OFFSET_BITS )
+#    define _FILE_OFFSET_BITS 64
+#  endif
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "aes_file.h"
+
+#if defined( _WIN32 )
+#  if !defined( _WIN32_WINNT ) || _WIN32_WINNT < 0x0600
+#    undef  _WIN32_WINNT
+#    define _WIN32_WINNT 0x0600  /* for the condition variables */
+#  endif
+#  include <windows.h>
+#else
+#  include <pthread.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/stat.h>
+#endif
+
+/* the io_uring engine, with the system calls made directly */
+#if defined( __linux__ )
+#  include <sys/syscall.h>
+#  if defined( __NR_io_uring_setup ) && defined( __has_include )
+#    if __has_include( <linux/io_uring.h> )
+#      define FILE_URING
+#    endif
+#  endif
+#endif
+
+#if defined( FILE_URING )
+#  include <sys/mman.h>
+#  include <sys/uio.h>
+#  include <linux/io_uring.h>
+#endif
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+/* the start of each buffer, a page so that they can not share cache lines */
+#define FILE_ALIGN 4096
+
+#if defined( _WIN32 )
+
+typedef HANDLE             file_thread;
+typedef CRITICAL_SECTION   file_mutex;
+typedef CONDITION_VARIABLE file_cond;
+
+#define FILE_THREAD_PROC(name, arg) static DWORD WINAPI name(LPVOID arg)
+#define FILE_THREAD_RETURN          return 0
+
+static int file_thread_start(file_thread *t, LPTHREAD_START_ROUTINE proc, void *arg)
+{
+	*t = CreateThread(NULL, 0, proc, arg, 0, NULL);
+	return *t ? 0 : EAGAIN;
+}
+
+static void file_thread_join(file_thread t)
+{
+	WaitForSingleObject(t, INFINITE);
+	CloseHandle(t);
+}
+
+#define file_mutex_init(m)      InitializeCriticalSection(m)
+#define file_mutex_free(m)      DeleteCriticalSection(m)
+#define file_lock(m)            EnterCriticalSection(m)
+#define file_unlock(m)          LeaveCriticalSection(m)
+#define file_cond_init(c)       InitializeConditionVariable(c)
+#define file_cond_free(c)       ((void)(c))
+#define file_wait(c, m)         SleepConditionVariableCS((c), (m), INFINITE)
+#define file_broadcast(c)       WakeAllConditionVariable(c)
+
+#else
+
+typedef pthread_t       file_thread;
+typedef pthread_mutex_t file_mutex;
+typedef pthread_cond_t  file_cond;
+
+#define FILE_THREAD_PROC(name, arg) static void *name(void *arg)
+#define FILE_THREAD_RETURN          return NULL
+
+static int file_thread_start(file_thread *t, void *(*proc)(void*), void *arg)
+{
+	return pthread_create(t, NULL, proc, arg);
+}
+
+static void file_thread_join(file_thread t)
+{
+	pthread_join(t, NULL);
+}
+
+#define file_mutex_init(m)      pthread_mutex_init((m), NULL)
+#define file_mutex_free(m)      pthread_mutex_destroy(m)
+#define file_lock(m)            pthread_mutex_lock(m)
+#define file_unlock(m)          pthread_mutex_unlock(m)
+#define file_cond_init(c)       pthread_cond_init((c), NULL)
+#define file_cond_free(c)       pthread_cond_destroy(c)
+#define file_wait(c, m)         pthread_cond_wait((c), (m))
+#define file_broadcast(c)       pthread_cond_broadcast(c)
+
+#endif
+
+typedef struct file_ring
+{   aes_file_job   *job;
+    FILE           *in;
+    FILE           *out;
+    unsigned char  *buf;
+    size_t         *len;
+    unsigned long   read, done, written;
+    int             eof;    /* the reader is done              */
+    int             end;    /* the mode is done                */
+    int             stop;   /* a stage failed, all of them end */
+    file_mutex      lock;
+    file_cond       changed;
+} file_ring;
+
+/* the buffers of the job at *buf followed by extra bytes, free *mem after */
+/* file_wipe; NULL and the error set if there is not enough memory or if   */
+/* the size does not fit in a size_t                                       */
+
+static unsigned char *file_alloc(aes_file_job *job, size_t extra, unsigned char **mem)
+{
+	unsigned char *buf;
+
+	*mem = NULL;
+	if(job->buffers < 1 || extra > SIZE_MAX - FILE_ALIGN
+		|| job->buffer_size > (SIZE_MAX - extra - FILE_ALIGN) / (size_t)job->buffers)
+	{
+		job->error = "not enough memory";
+		return NULL;
+	}
+	*mem = (unsigned char*)malloc(job->buffers * job->buffer_size + extra + FILE_ALIGN - 1);
+	if(!*mem)
+	{
+		job->error = "not enough memory";
+		return NULL;
+	}
+	buf = *mem + ((FILE_ALIGN - ((size_t)*mem & (FILE_ALIGN - 1))) & (FILE_ALIGN - 1));
+	return buf;
+}
+
+/* the buffers may hold plain text when done, through a volatile pointer */
+/* so that the stores are not dropped as dead before the free             */
+
+static void file_wipe(aes_file_job *job, unsigned char *buf, unsigned char *mem)
+{
+	volatile unsigned char *v = (volatile unsigned char*)buf;
+	size_t n = job->buffers * job->buffer_size;
+	while(n--)
+		*v++ = 0;
+	free(mem);
+}
+
+/* in_path and out_path name the same file, which opening the output */
+/* would truncate before it is read                                  */
+
+static int file_same(const char *in_path, const char *out_path)
+{
+#if defined( _WIN32 )
+	BY_HANDLE_FILE_INFORMATION a, b;
+	HANDLE in, out;
+	int same = 0;
+
+	in  = CreateFileA(in_path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	out = CreateFileA(out_path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(in != INVALID_HANDLE_VALUE && out != INVALID_HANDLE_VALUE
+		&& GetFileInformationByHandle(in, &a) && GetFileInformationByHandle(out, &b))
+		same = a.dwVolumeSerialNumber == b.dwVolumeSerialNumber
+			&& a.nFileIndexHigh == b.nFileIndexHigh && a.nFileIndexLow == b.nFileIndexLow;
+	if(in != INVALID_HANDLE_VALUE)
+		CloseHandle(in);
+	if(out != INVALID_HANDLE_VALUE)
+		CloseHandle(out);
+	return same;
+#else
+	struct stat a, b;
+
+	return !stat(in_path, &a) && !stat(out_path, &b)
+		&& a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+#endif
+}
+
+#define ring_buffer(r, n) ((r)->buf + ((n) % (unsigned long)(r)->job->buffers) * (r)->job->buffer_size)
+#define ring_len(r, n)    ((r)->len[(n) % (unsigned long)(r)->job->buffers])
+
+/* called with the lock held, only the first error is kept */
+static void ring_fail(file_ring *r, const char *error, int err_no)
+{
+	if(!r->job->error)
+	{
+		r->job->error  = error;
+		r->job->err_no = err_no;
+	}
+	r->stop = 1;
+	file_broadcast(&r->changed);
+}
+
+FILE_THREAD_PROC(ring_reader, arg)
+{
+	file_ring *r = (file_ring*)arg;
+	const size_t size = r->job->buffer_size;
+	unsigned char *p;
+	size_t n;
+
+	for(;;)
+	{
+		file_lock(&r->lock);
+		while(!r->stop && r->read - r->written == (unsigned long)r->job->buffers)
+			file_wait(&r->changed, &r->lock);
+		if(r->stop)
+		{
+			file_unlock(&r->lock);
+			break;
+		}
+		p = ring_buffer(r, r->read);
+		file_unlock(&r->lock);
+
+		n = fread(p, 1, size, r->in);
+
+		file_lock(&r->lock);
+		if(n < size && ferror(r->in))
+		{
+			ring_fail(r, "read error", errno);
+			file_unlock(&r->lock);
+			break;
+		}
+		r->job->count += n;
+		ring_len(r, r->read) = n;
+		if(n) ++r->read;
+		if(n < size) r->eof = 1;
+		file_broadcast(&r->changed);
+		file_unlock(&r->lock);
+		if(n < size) break;
+	}
+	FILE_THREAD_RETURN;
+}
+
+FILE_THREAD_PROC(ring_writer, arg)
+{
+	file_ring *r = (file_ring*)arg;
+	unsigned char *p;
+	size_t n;
+
+	for(;;)
+	{
+		file_lock(&r->lock);
+		while(!r->stop && r->written == r->done && !r->end)
+			file_wait(&r->changed, &r->lock);
+		if(r->stop || r->written == r->done)
+		{
+			file_unlock(&r->lock);
+			break;
+		}
+		p = ring_buffer(r, r->written);
+		n = ring_len(r, r->written);
+		file_unlock(&r->lock);
+
+		if(fwrite(p, 1, n, r->out) != n)
+		{
+			int err_no = errno;
+			file_lock(&r->lock);
+			ring_fail(r, "write error", err_no);
+			file_unlock(&r->lock);
+			break;
+		}
+
+		file_lock(&r->lock);
+		++r->written;
+		file_broadcast(&r->changed);
+		file_unlock(&r->lock);
+	}
+	FILE_THREAD_RETURN;
+}
+
+static AES_RETURN ring_crypt(aes_file_job *job, const aes_backend *b, unsigned char *p, int len)
+{
+	switch(job->mode)
+	{
+	case AES_FILE_ECB:
+		if(job->decrypt) return b->ecb_decrypt(p, p, len, job->cx.dctx);
+		return b->ecb_encrypt(p, p, len, job->cx.ectx);
+	case AES_FILE_CBC:
+		if(job->decrypt) return b->cbc_decrypt(p, p, len, job->iv, job->cx.dctx);
+		return b->cbc_encrypt(p, p, len, job->iv, job->cx.ectx);
+	case AES_FILE_CFB:
+		if(job->decrypt) return b->cfb_decrypt(p, p, len, job->iv, job->cx.ectx);
+		return b->cfb_encrypt(p, p, len, job->iv, job->cx.ectx);
+	case AES_FILE_OFB:
+		return b->ofb_crypt(p, p, len, job->iv, job->cx.ectx);
+	case AES_FILE_CTR:
+		return b->ctr_crypt_ex(p, p, len, job->iv, job->ctr_mode, job->cx.ectx);
+	default:
+		return EXIT_FAILURE;
+	}
+}
+
+
+/* the stage of the calling thread */
+static void ring_cipher(file_ring *r)
+{
+	aes_file_job *job = r->job;
+	const aes_backend *b = aes_backend_kernel(job->backend, job->cx.ectx->inf.b[0] >> 4);
+	const int whole_blocks = job->mode == AES_FILE_ECB || job->mode == AES_FILE_CBC;
+	unsigned char *p;
+	size_t n;
+
+	for(;;)
+	{
+		file_lock(&r->lock);
+		while(!r->stop && r->done == r->read && !r->eof)
+			file_wait(&r->changed, &r->lock);
+		if(r->stop || r->done == r->read)
+			break;
+		p = ring_buffer(r, r->done);
+		n = ring_len(r, r->done);
+		file_unlock(&r->lock);
+
+		if((whole_blocks && (n & (AES_BLOCK_SIZE - 1))) || ring_crypt(job, b, p, (int)n) != EXIT_SUCCESS)
+		{
+			file_lock(&r->lock);
+			ring_fail(r, "invalid block length", 0);
+			break;
+		}
+
+		file_lock(&r->lock);
+		++r->done;
+		file_broadcast(&r->changed);
+		file_unlock(&r->lock);
+	}
+
+	/* still locked */
+	r->end = 1;
+	file_broadcast(&r->changed);
+	file_unlock(&r->lock);
+}
+
+static AES_RETURN file_crypt_threads(const char *in_path, const char *out_path, aes_file_job *job)
+{
+	file_ring r;
+	file_thread reader, writer;
+	unsigned char *mem;
+	int err;
+
+	if(file_same(in_path, out_path))
+	{
+		job->error = "input and output are the same file";
+		return EXIT_FAILURE;
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.job = job;
+	if(!(r.buf = file_alloc(job, job->buffers * sizeof(size_t), &mem)))
+		return EXIT_FAILURE;
+	r.len = (size_t*)(r.buf + job->buffers * job->buffer_size);
+
+	if(!(r.in = fopen(in_path, "rb")))
+	{
+		job->error  = "can not open input";
+		job->err_no = errno;
+		file_wipe(job, r.buf, mem);
+		return EXIT_FAILURE;
+	}
+	if(!(r.out = fopen(out_path, "wb")))
+	{
+		job->error  = "can not open output";
+		job->err_no = errno;
+		fclose(r.in);
+		file_wipe(job, r.buf, mem);
+		return EXIT_FAILURE;
+	}
+
+	/* whole buffers go to the system, there is nothing left to buffer */
+	setvbuf(r.in,  NULL, _IONBF, 0);
+	setvbuf(r.out, NULL, _IONBF, 0);
+
+	file_mutex_init(&r.lock);
+	file_cond_init(&r.changed);
+
+	if((err = file_thread_start(&reader, ring_reader, &r)) != 0)
+	{
+		job->error  = "can not start thread";
+		job->err_no = err;
+	}
+	else
+	{
+		if((err = file_thread_start(&writer, ring_writer, &r)) != 0)
+		{
+			file_lock(&r.lock);
+			ring_fail(&r, "can not start thread", err);
+			file_unlock(&r.lock);
+		}
+		else
+		{
+			ring_cipher(&r);
+			file_thread_join(writer);
+		}
+		file_thread_join(reader);
+	}
+
+	file_cond_free(&r.changed);
+	file_mutex_free(&r.lock);
+
+	fclose(r.in);
+	if(fclose(r.out) && !job->error)
+	{
+		job->error  = "write error";
+		job->err_no = errno;
+	}
+
+	file_wipe(job, r.buf, mem);
+
+	if(job->error)
+	{
+		remove(out_path);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+#if defined( FILE_URING )
+
+/* With every block done on its own the buffers can be read, run through */
+/* the mode and written back in any order, so the engine below keeps one */
+/* read or write of each buffer in flight and runs the mode on a buffer   */
+/* as soon as its read completes. It is single threaded. When the system  */
+/* does not allow io_uring it does the same with pread and pwrite, one    */
+/* buffer at a time.                                                      */
+
+typedef struct file_uring
+{   int              fd;
+    unsigned        *sq_tail, *sq_mask, *sq_array;
+    unsigned        *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void            *sq_map, *cq_map;
+    size_t           sq_len, cq_len, sqes_len;
+    unsigned         queued;    /* pushed but not submitted yet */
+    int              fixed;     /* the buffers are registered   */
+} file_uring;
+
+typedef struct uring_slot
+{   uint64_t         off;       /* in the file                  */
+    size_t           len, done;
+    int              writing;
+    struct iovec     iov;       /* for readv/writev when not fixed */
+} uring_slot;
+
+static void uring_close(file_uring *u)
+{
+	if(u->sqes)   munmap(u->sqes, u->sqes_len);
+	if(u->cq_map) munmap(u->cq_map, u->cq_len);
+	if(u->sq_map) munmap(u->sq_map, u->sq_len);
+	close(u->fd);
+}
+
+static int uring_open(file_uring *u, unsigned entries)
+{
+	struct io_uring_params p;
+	unsigned char *sq, *cq;
+
+	memset(u, 0, sizeof(*u));
+	memset(&p, 0, sizeof(p));
+	if((u->fd = (int)syscall(__NR_io_uring_setup, entries, &p)) < 0)
+		return -1;
+
+	u->sq_len   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_len   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sq_map = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	u->cq_map = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+	u->sqes   = (struct io_uring_sqe*)mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if(u->sq_map == MAP_FAILED) u->sq_map = NULL;
+	if(u->cq_map == MAP_FAILED) u->cq_map = NULL;
+	if(u->sqes == MAP_FAILED)   u->sqes   = NULL;
+	if(!u->sq_map || !u->cq_map || !u->sqes)
+	{
+		uring_close(u);
+		return -1;
+	}
+
+	sq = (unsigned char*)u->sq_map;
+	cq = (unsigned char*)u->cq_map;
+	u->sq_tail  = (unsigned*)(sq + p.sq_off.tail);
+	u->sq_mask  = (unsigned*)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned*)(sq + p.sq_off.array);
+	u->cq_head  = (unsigned*)(cq + p.cq_off.head);
+	u->cq_tail  = (unsigned*)(cq + p.cq_off.tail);
+	u->cq_mask  = (unsigned*)(cq + p.cq_off.ring_mask);
+	u->cqes     = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+	return 0;
+}
+
+/* there is never more than one request per buffer, so the submission */
+/* ring of at least as many entries can not be full                   */
+
+static void uring_push(file_uring *u, int op, int fd, void *addr, unsigned len, uint64_t off, int index)
+{
+	unsigned tail = *u->sq_tail, i = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = u->sqes + i;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode    = (unsigned char)op;
+	sqe->fd        = fd;
+	sqe->addr      = (uint64_t)(uintptr_t)addr;
+	sqe->len       = len;
+	sqe->off       = off;
+	sqe->buf_index = (unsigned short)(u->fixed ? index : 0);
+	sqe->user_data = (uint64_t)index;
+	u->sq_array[i] = i;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++u->queued;
+}
+
+/* the rest of the read or write of buffer i */
+static void uring_issue(file_uring *u, uring_slot *s, int i, unsigned char *buf, int fd)
+{
+	unsigned char *p = buf + s->done;
+	unsigned n = (unsigned)(s->len - s->done);
+
+	if(u->fixed)
+	{
+		uring_push(u, s->writing ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED, fd, p, n, s->off + s->done, i);
+		return;
+	}
+	s->iov.iov_base = p;
+	s->iov.iov_len  = n;
+	uring_push(u, s->writing ? IORING_OP_WRITEV : IORING_OP_READV, fd, &s->iov, 1, s->off + s->done, i);
+}
+
+/* submits what is queued unless only waiting, then waits for a completion */
+static int uring_enter(file_uring *u, int wait_only)
+{
+	unsigned submit = wait_only ? 0 : u->queued;
+	int n;
+
+	do
+		n = (int)syscall(__NR_io_uring_enter, u->fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+	while(n < 0 && errno == EINTR);
+	if(n < 0)
+		return -1;
+	u->queued -= (unsigned)n;
+	return 0;
+}
+
+/* the buffer at offset off of the file, CTR takes its counter from there */
+static AES_RETURN file_crypt_at(aes_file_job *job, const aes_backend *b, unsigned char *p, size_t len, uint64_t off)
+{
+	unsigned char cbuf[AES_BLOCK_SIZE];
+
+	if(job->mode == AES_FILE_ECB)
+		return ring_crypt(job, b, p, (int)len);
+
+	memcpy(cbuf, job->iv, AES_BLOCK_SIZE);
+	aes_ctr_add(cbuf, off / AES_BLOCK_SIZE, job->ctr_mode);
+	job->cx.ectx->inf.b[2] = 0;
+	return b->ctr_crypt_ex(p, p, (int)len, cbuf, job->ctr_mode, job->cx.ectx);
+}
+
+static void uring_start(uring_slot *s, uint64_t *next, uint64_t size, size_t buffer_size)
+{
+	s->off     = *next;
+	s->len     = (size - *next < buffer_size) ? (size_t)(size - *next) : buffer_size;
+	s->done    = 0;
+	s->writing = 0;
+	*next += s->len;
+}
+
+/* after an error nothing more is submitted and what the kernel holds is */
+/* reaped, returns -1 if that fails and the buffers may still be in use  */
+
+static int uring_run(file_uring *u, aes_file_job *job, const aes_backend *b,
+	int in, int out, uint64_t size, unsigned char *buf, uring_slot *slot)
+{
+	const size_t bs = job->buffer_size;
+	uint64_t next = 0;
+	unsigned head, tail;
+	int i, busy = 0;    /* pushed, the queued ones included */
+
+	for(i = 0; i < job->buffers && next < size; ++i, ++busy)
+	{
+		uring_start(slot + i, &next, size, bs);
+		uring_issue(u, slot + i, i, buf + i * bs, in);
+	}
+
+	/* the queued ones are never submitted once there is an error */
+	while(busy > (job->error ? (int)u->queued : 0))
+	{
+		if(uring_enter(u, job->error != NULL))
+		{
+			if(job->error && errno != EAGAIN && errno != EBUSY)
+				return -1;
+			if(!job->error)
+			{
+				job->error  = "io_uring error";
+				job->err_no = errno;
+			}
+		}
+
+		head = *u->cq_head;
+		tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		for(; head != tail; ++head)
+		{
+			const struct io_uring_cqe *cqe = u->cqes + (head & *u->cq_mask);
+			uring_slot *s = slot + cqe->user_data;
+
+			i = (int)cqe->user_data;
+			--busy;
+			if(job->error)
+				continue;   /* only waits for what is in flight */
+
+			if(cqe->res <= 0)
+			{
+				job->error  = s->writing ? "write error" : "read error";
+				job->err_no = -cqe->res;
+				continue;
+			}
+
+			s->done += (size_t)cqe->res;
+			if(s->done < s->len)
+				;
+			else if(!s->writing)
+			{
+				if(file_crypt_at(job, b, buf + i * bs, s->len, s->off) != EXIT_SUCCESS)
+				{
+					job->error = "invalid block length";
+					continue;
+				}
+				job->count += s->len;
+				s->writing = 1;
+				s->done    = 0;
+			}
+			else if(next < size)
+				uring_start(s, &next, size, bs);
+			else
+				continue;   /* this buffer is done */
+
+			uring_issue(u, s, i, buf + i * bs, s->writing ? out : in);
+			++busy;
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+static void pread_run(aes_file_job *job, const aes_backend *b, int in, int out, uint64_t size, unsigned char *buf)
+{
+	uring_slot s;
+	uint64_t next = 0;
+	ssize_t n;
+
+	while(next < size)
+	{
+		uring_start(&s, &next, size, job->buffer_size);
+		for(; s.done < s.len; s.done += (size_t)n)
+			if((n = pread(in, buf + s.done, s.len - s.done, (off_t)(s.off + s.done))) <= 0)
+			{
+				if(n < 0 && errno == EINTR) { n = 0; continue; }
+				job->error  = "read error";
+				job->err_no = n ? errno : 0;
+				return;
+			}
+
+		if(file_crypt_at(job, b, buf, s.len, s.off) != EXIT_SUCCESS)
+		{
+			job->error = "invalid block length";
+			return;
+		}
+		job->count += s.len;
+
+		for(s.done = 0; s.done < s.len; s.done += (size_t)n)
+			if((n = pwrite(out, buf + s.done, s.len - s.done, (off_t)(s.off + s.done))) < 0)
+			{
+				if(errno == EINTR) { n = 0; continue; }
+				job->error  = "write error";
+				job->err_no = errno;
+				return;
+			}
+	}
+}
+
+static AES_RETURN file_crypt_uring(const char *in_path, const char *out_path, aes_file_job *job)
+{
+	const aes_backend *b = aes_backend_kernel(job->backend, job->cx.ectx->inf.b[0] >> 4);
+	unsigned char *buf, *mem;
+	struct iovec *iov;
+	struct stat st;
+	file_uring u;
+	uint64_t size;
+	int in, out, i;
+
+	if(file_same(in_path, out_path))
+	{
+		job->error = "input and output are the same file";
+		return EXIT_FAILURE;
+	}
+	if((in = open(in_path, O_RDONLY | O_CLOEXEC)) < 0)
+	{
+		job->error  = "can not open input";
+		job->err_no = errno;
+		return EXIT_FAILURE;
+	}
+	if(fstat(in, &st) || !S_ISREG(st.st_mode))
+	{
+		/* a pipe or a device has no size to split up */
+		close(in);
+		job->engine = AES_FILE_THREADS;
+		return file_crypt_threads(in_path, out_path, job);
+	}
+	size = (uint64_t)st.st_size;
+	if(job->mode == AES_FILE_ECB && (size & (AES_BLOCK_SIZE - 1)))
+	{
+		close(in);
+		job->error = "invalid block length";
+		return EXIT_FAILURE;
+	}
+
+	if(!(buf = file_alloc(job, job->buffers * (sizeof(uring_slot) + sizeof(struct iovec)), &mem)))
+	{
+		close(in);
+		return EXIT_FAILURE;
+	}
+	if((out = open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0)
+	{
+		job->error  = "can not open output";
+		job->err_no = errno;
+		close(in);
+		file_wipe(job, buf, mem);
+		return EXIT_FAILURE;
+	}
+
+	if(uring_open(&u, (unsigned)job->buffers) == 0)
+	{
+		iov = (struct iovec*)(buf + job->buffers * job->buffer_size);
+		for(i = 0; i < job->buffers; ++i)
+		{
+			iov[i].iov_base = buf + i * job->buffer_size;
+			iov[i].iov_len  = job->buffer_size;
+		}
+		/* fails when the buffers are over the locked memory limit */
+		u.fixed = syscall(__NR_io_uring_register, u.fd, IORING_REGISTER_BUFFERS, iov, job->buffers) == 0;
+
+		job->engine = AES_FILE_URING;
+		if(uring_run(&u, job, b, in, out, size, buf, (uring_slot*)(iov + job->buffers)))
+			mem = NULL;     /* left to the kernel rather than freed under it */
+		uring_close(&u);
+	}
+	else
+	{
+		job->engine = AES_FILE_PREAD;
+		pread_run(job, b, in, out, size, buf);
+	}
+
+	close(in);
+	if(close(out) && !job->error)
+	{
+		job->error  = "write error";
+		job->err_no = errno;
+	}
+	if(mem)
+		file_wipe(job, buf, mem);
+
+	if(job->error)
+	{
+		remove(out_path);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+#endif
+
+AES_RETURN aes_file_crypt(const char *in_path, const char *out_path, aes_file_job *job)
+{
+	job->count  = 0;
+	job->error  = NULL;
+	job->err_no = 0;
+
+#if defined( FILE_URING )
+	if(job->engine == AES_FILE_URING && (job->mode == AES_FILE_ECB || job->mode == AES_FILE_CTR))
+		return file_crypt_uring(in_path, out_path, job);
+#endif
+
+	job->engine = AES_FILE_THREADS;
+	return file_crypt_threads(in_path, out_path, job);
+}
+
+typedef struct reader_page
+{   unsigned long long index;   /* of the page in the file          */
+    size_t           len;
+    unsigned long    used;      /* when last asked for, 0 if empty  */
+} reader_page;
+
+struct aes_file_cache
+{
+#if defined( _WIN32 )
+    HANDLE           file;
+#else
+    int              fd;
+#endif
+    const aes_backend *kernel;
+    unsigned long    clock;
+    unsigned char   *data, *mem;
+    reader_page      page[1];   /* r->pages of them */
+};
+
+/* len bytes at off, fewer only at the end of the file; -1 on an error */
+static long long reader_read(aes_file_cache *c, unsigned char *buf, size_t len, unsigned long long off)
+{
+	size_t done = 0;
+
+	while(done < len)
+	{
+#if defined( _WIN32 )
+		OVERLAPPED o;
+		DWORD n;
+
+		memset(&o, 0, sizeof(o));
+		o.Offset     = (DWORD)(off + done);
+		o.OffsetHigh = (DWORD)((off + done) >> 32);
+		if(!ReadFile(c->file, buf + done, (DWORD)(len - done), &n, &o))
+		{
+			if(GetLastError() == ERROR_HANDLE_EOF)
+				break;
+			errno = EIO;
+			return -1;
+		}
+#else
+		ssize_t n = pread(c->fd, buf + done, len - done, (off_t)(off + done));
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+#endif
+		if(n == 0)
+			break;
+		done += (size_t)n;
+	}
+	return (long long)done;
+}
+
+AES_RETURN aes_file_reader_open(aes_file_reader *r, const char *path)
+{
+	aes_file_cache *c;
+	size_t size;
+
+	r->size   = 0;
+	r->error  = NULL;
+	r->err_no = 0;
+	r->cache  = NULL;
+
+	if(r->pages < 1 || (size_t)r->pages > (SIZE_MAX - sizeof(aes_file_cache)) / sizeof(reader_page)
+		|| r->page_size > (SIZE_MAX - FILE_ALIGN) / (size_t)r->pages)
+	{
+		r->error = "not enough memory";
+		return EXIT_FAILURE;
+	}
+	size = sizeof(aes_file_cache) + (r->pages - 1) * sizeof(reader_page);
+	if(!(c = (aes_file_cache*)malloc(size)))
+	{
+		r->error = "not enough memory";
+		return EXIT_FAILURE;
+	}
+	memset(c, 0, size);
+	if(!(c->mem = (unsigned char*)malloc(r->pages * r->page_size + FILE_ALIGN - 1)))
+	{
+		free(c);
+		r->error = "not enough memory";
+		return EXIT_FAILURE;
+	}
+	c->data   = c->mem + ((FILE_ALIGN - ((size_t)c->mem & (FILE_ALIGN - 1))) & (FILE_ALIGN - 1));
+	c->kernel = aes_backend_kernel(r->backend, r->ectx->inf.b[0] >> 4);
+
+#if defined( _WIN32 )
+	{
+		LARGE_INTEGER n;
+
+		c->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if(c->file == INVALID_HANDLE_VALUE)
+		{
+			r->error  = "can not open input";
+			r->err_no = ENOENT;
+		}
+		else if(!GetFileSizeEx(c->file, &n))
+		{
+			CloseHandle(c->file);
+			r->error  = "read error";
+			r->err_no = EIO;
+		}
+		else
+			r->size = (unsigned long long)n.QuadPart;
+	}
+#else
+	{
+		struct stat st;
+
+		if((c->fd = open(path, O_RDONLY)) < 0)
+		{
+			r->error  = "can not open input";
+			r->err_no = errno;
+		}
+		else if(fstat(c->fd, &st))
+		{
+			r->error  = "read error";
+			r->err_no = errno;
+			close(c->fd);
+		}
+		else
+			r->size = (unsigned long long)st.st_size;
+	}
+#endif
+
+	if(r->error)
+	{
+		free(c->mem);
+		free(c);
+		return EXIT_FAILURE;
+	}
+	r->cache = c;
+	return EXIT_SUCCESS;
+}
+
+const unsigned char *aes_file_reader_at(aes_file_reader *r, unsigned long long pos, size_t *len)
+{
+	aes_file_cache *c = r->cache;
+	unsigned long long index = pos / r->page_size, off = index * r->page_size;
+	unsigned char cbuf[AES_BLOCK_SIZE], *p;
+	reader_page *page = c->page;
+	size_t want;
+	long long n;
+	int i;
+
+	*len = 0;
+	if(pos >= r->size)
+		return NULL;
+
+	for(i = 0; i < r->pages; ++i)
+	{
+		if(c->page[i].used && c->page[i].index == index)
+		{
+			page = c->page + i;
+			break;
+		}
+		if(c->page[i].used < page->used)
+			page = c->page + i;
+	}
+	p = c->data + (page - c->page) * r->page_size;
+
+	if(i == r->pages)
+	{
+		page->used = 0;
+		want = r->size - off < r->page_size ? (size_t)(r->size - off) : r->page_size;
+		if((n = reader_read(c, p, want, off)) != (long long)want)
+		{
+			/* a short read is a file cut since it was opened */
+			r->error  = "read error";
+			r->err_no = n < 0 ? errno : 0;
+			return NULL;
+		}
+		memcpy(cbuf, r->iv, AES_BLOCK_SIZE);
+		aes_ctr_add(cbuf, off / AES_BLOCK_SIZE, r->ctr_mode);
+		r->ectx->inf.b[2] = 0;
+		c->kernel->ctr_crypt_ex(p, p, (int)want, cbuf, r->ctr_mode, r->ectx);
+		page->index = index;
+		page->len   = want;
+	}
+
+	page->used = ++c->clock;
+	*len = page->len - (size_t)(pos - off);
+	return p + (pos - off);
+}
+
+void aes_file_reader_close(aes_file_reader *r)
+{
+	aes_file_cache *c = r->cache;
+	volatile unsigned char *v;
+	size_t n;
+
+	if(!c)
+		return;
+#if defined( _WIN32 )
+	CloseHandle(c->file);
+#else
+	close(c->fd);
+#endif
+	for(v = c->data, n = r->pages * r->page_size; n--; )
+		*v++ = 0;
+	free(c->mem);
+	free(c);
+	r->cache = NULL;
+}
+
+/* the most of a range given to one ctr_crypt_ex call, whole blocks */
+#define CTR_SLICE (1 << 30)
+
+/* the parts each on cache lines of their own, which also keeps the */
+/* schedules aligned for the AES-NI loads                            */
+#define CTR_PART_SIZE ((sizeof(ctr_part) + 63) & ~(size_t)63)
+#define ctr_part_at(base, i) ((ctr_part*)((base) + (i) * CTR_PART_SIZE))
+
+typedef struct ctr_part
+{   aes_encrypt_ctx  cx[1];     /* a copy, the mode keeps its position there */
+    const aes_backend *b;
+    const unsigned char *in;
+    unsigned char   *out;
+    size_t           len;
+    unsigned char    cbuf[AES_BLOCK_SIZE];
+    int              ctr_mode;
+    int              started;
+    AES_RETURN       ret;
+    file_thread      thread;
+} ctr_part;
+
+static AES_RETURN ctr_part_run(const aes_backend *b, const unsigned char *in, unsigned char *out,
+	size_t len, unsigned char *cbuf, int ctr_mode, aes_encrypt_ctx cx[1])
+{
+	size_t n;
+
+	for(; len; len -= n, in += n, out += n)
+	{
+		n = len < CTR_SLICE ? len : CTR_SLICE;
+		if(b->ctr_crypt_ex(in, out, (int)n, cbuf, ctr_mode, cx) != EXIT_SUCCESS)
+			return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+FILE_THREAD_PROC(ctr_part_proc, arg)
+{
+	ctr_part *p = (ctr_part*)arg;
+	p->ret = ctr_part_run(p->b, p->in, p->out, p->len, p->cbuf, p->ctr_mode, p->cx);
+	FILE_THREAD_RETURN;
+}
+
+/* the mode leaves a block used up to its end as position 16 of its counter */
+static void ctr_next_block(unsigned char *cbuf, int ctr_mode, aes_encrypt_ctx ctx[1])
+{
+	if(ctx->inf.b[2] == AES_BLOCK_SIZE)
+	{
+		aes_ctr_add(cbuf, 1, ctr_mode);
+		ctx->inf.b[2] = 0;
+	}
+}
+
+int aes_cpu_count(void)
+{
+#if defined( _WIN32 )
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return si.dwNumberOfProcessors > 0 ? (int)si.dwNumberOfProcessors : 1;
+#elif defined( _SC_NPROCESSORS_ONLN )
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+#else
+	return 1;
+#endif
+}
+
+AES_RETURN aes_ctr_crypt_mt(const aes_backend *b, const unsigned char *ibuf, unsigned char *obuf,
+	size_t len, unsigned char *cbuf, int ctr_mode, aes_encrypt_ctx ctx[1], int threads)
+{
+	size_t head, rest, each, off;
+	unsigned char *mem, *base;
+	volatile unsigned char *v;
+	AES_RETURN ret = EXIT_SUCCESS;
+	int i;
+
+	/* up to the end of a block in use, so that the ranges start on blocks */
+	ctr_next_block(cbuf, ctr_mode, ctx);
+	head = ctx->inf.b[2] ? AES_BLOCK_SIZE - ctx->inf.b[2] : 0;
+	if(head > len)
+		head = len;
+	if(head && b->ctr_crypt_ex(ibuf, obuf, (int)head, cbuf, ctr_mode, ctx) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	ctr_next_block(cbuf, ctr_mode, ctx);
+	ibuf += head;
+	obuf += head;
+	rest  = len - head;
+
+	if(threads > AES_CTR_MT_THREADS)
+		threads = AES_CTR_MT_THREADS;
+	if((size_t)threads > rest / AES_CTR_MT_MIN)
+		threads = (int)(rest / AES_CTR_MT_MIN);
+	if(threads < 2)
+		return ctr_part_run(b, ibuf, obuf, rest, cbuf, ctr_mode, ctx);
+
+	if(!(mem = (unsigned char*)malloc(threads * CTR_PART_SIZE + 63)))
+		return ctr_part_run(b, ibuf, obuf, rest, cbuf, ctr_mode, ctx);
+	base = mem + ((64 - ((size_t)mem & 63)) & 63);
+
+	each = (rest / AES_BLOCK_SIZE / threads) * AES_BLOCK_SIZE;
+	for(i = 0, off = 0; i < threads; ++i, off += each)
+	{
+		ctr_part *p = ctr_part_at(base, i);
+
+		memcpy(p->cx, ctx, sizeof(aes_encrypt_ctx));
+		p->cx->inf.b[2] = 0;
+		p->b        = b;
+		p->in       = ibuf + off;
+		p->out      = obuf + off;
+		p->len      = (i == threads - 1) ? rest - off : each;
+		p->ctr_mode = ctr_mode;
+		p->ret      = EXIT_SUCCESS;
+		memcpy(p->cbuf, cbuf, AES_BLOCK_SIZE);
+		aes_ctr_add(p->cbuf, off / AES_BLOCK_SIZE, ctr_mode);
+		/* the first range runs on the calling thread */
+		p->started  = i > 0 && file_thread_start(&p->thread, ctr_part_proc, p) == 0;
+	}
+
+	for(i = 0; i < threads; ++i)
+	{
+		ctr_part *p = ctr_part_at(base, i);
+
+		if(p->started)
+			file_thread_join(p->thread);
+		else
+			p->ret = ctr_part_run(b, p->in, p->out, p->len, p->cbuf, ctr_mode, p->cx);
+		if(p->ret != EXIT_SUCCESS)
+			ret = EXIT_FAILURE;
+	}
+
+	for(v = mem, off = threads * CTR_PART_SIZE + 63; off--; )
+		*v++ = 0;
+	free(mem);
+
+	/* where a single call would have left the counter */
+	aes_ctr_add(cbuf, rest / AES_BLOCK_SIZE, ctr_mode);
+	ctx->inf.b[2] = (uint8_t)(rest % AES_BLOCK_SIZE);
+	return ret;
+}
+
+#if defined(__cplusplus)
+}
+#endif
@@ -0,0 +1,118 @@
+/*
+ Whole file encryption and decryption with the modes of a backend. One
+ thread reads the input and another one writes the output while the
+ calling thread runs the mode, so that the I/O and the cipher overlap.
+ They pass a ring of large aligned buffers between them, each one done in
+ place and in order so the chained modes see the data as one stream.
+
+ On Linux ECB and CTR can instead use io_uring: as each buffer is done on
+ its own offsets, many reads and writes stay in flight from one thread and
+ the mode runs on whichever buffer completes. Where io_uring is not allowed
+ it falls back to pread and pwrite.
+*/
+
+#ifndef _AES_FILE_H
+#define _AES_FILE_H
+
+#include "aes_backend.h"
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+#define AES_FILE_ECB 0
+#define AES_FILE_CBC 1
+#define AES_FILE_CFB 2
+#define AES_FILE_OFB 3
+#define AES_FILE_CTR 4
+
+#define AES_FILE_THREADS 0
+#define AES_FILE_URING   1              /* ECB and CTR of regular files   */
+#define AES_FILE_PREAD   2              /* used when io_uring is not      */
+
+#define AES_FILE_BUFFER_SIZE (1024 * 1024)
+#define AES_FILE_BUFFERS     4
+
+typedef struct aes_file_job
+{   union
+    {   aes_encrypt_ctx ectx[1];
+        aes_decrypt_ctx dctx[1];
+    } cx;                               /* the decryption schedule only   */
+                                        /* for ECB and CBC decryption     */
+    unsigned char  iv[AES_BLOCK_SIZE];  /* updated as for the mode calls */
+    const aes_backend *backend;
+    int            mode;                /* one of AES_FILE_*              */
+    int            decrypt;
+    int            ctr_mode;            /* one of AES_CTR_* for CTR       */
+    size_t         buffer_size;         /* whole blocks, at most INT_MAX  */
+    int            buffers;             /* in the ring, at least 2        */
+    int            engine;              /* one of AES_FILE_THREADS or     */
+                                        /* _URING, set to the one used    */
+
+    unsigned long long count;           /* bytes read                     */
+    const char    *error;               /* NULL or what failed            */
+    int            err_no;              /* the errno of it or 0           */
+} aes_file_job;
+
+/* runs the file at in_path through the mode of the job into a new file at */
+/* out_path; on failure the error fields are set and out_path is removed   */
+/* if it was created. ECB and CBC fail unless the size is whole blocks,    */
+/* and all of them if both paths name the same file.                        */
+
+AES_RETURN aes_file_crypt(const char *in_path, const char *out_path, aes_file_job *job);
+
+/* A CTR encrypted file read at any offset. The page of the file holding */
+/* an offset is read and decrypted with the counter of that offset when  */
+/* it is first asked for and kept in a small cache, where the least      */
+/* recently used page makes room for the next one.                       */
+
+#define AES_FILE_PAGE_SIZE   (64 * 1024)
+#define AES_FILE_PAGES       8
+
+typedef struct aes_file_cache aes_file_cache;
+
+typedef struct aes_file_reader
+{   aes_encrypt_ctx ectx[1];
+    unsigned char  iv[AES_BLOCK_SIZE];  /* the counter at offset 0        */
+    const aes_backend *backend;
+    int            ctr_mode;            /* one of AES_CTR_*               */
+    size_t         page_size;           /* whole blocks, at most INT_MAX  */
+    int            pages;               /* in the cache, at least 1       */
+
+    unsigned long long size;            /* set by aes_file_reader_open    */
+    const char    *error;               /* NULL or what failed            */
+    int            err_no;              /* the errno of it or 0           */
+    aes_file_cache *cache;              /* NULL when closed               */
+} aes_file_reader;
+
+/* opens the file at path for the reader set up as above */
+AES_RETURN aes_file_reader_open(aes_file_reader *r, const char *path);
+
+/* the plain text from pos to the end of its page, *len bytes of it, valid */
+/* until the next call; NULL with *len 0 past the end or on an error       */
+const unsigned char *aes_file_reader_at(aes_file_reader *r, unsigned long long pos, size_t *len);
+
+/* closes the file and wipes the pages, nothing if already closed */
+void aes_file_reader_close(aes_file_reader *r);
+
+/* CTR over a large buffer with the whole blocks shared out in ranges, */
+/* each run by its own thread from the counter of its offset.          */
+
+#define AES_CTR_MT_MIN      (256 * 1024)    /* the least a thread is given */
+#define AES_CTR_MT_THREADS  64
+
+/* the number of processors online, at least 1 */
+int aes_cpu_count(void);
+
+/* the same as the ctr_crypt_ex of the backend b over len bytes, cbuf and */
+/* the position in the block of ctx left as it would, run by up to        */
+/* threads threads, fewer when the ranges would be under AES_CTR_MT_MIN   */
+AES_RETURN aes_ctr_crypt_mt(const aes_backend *b, const unsigned char *ibuf, unsigned char *obuf,
+	size_t len, unsigned char *cbuf, int ctr_mode, aes_encrypt_ctx ctx[1], int threads);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
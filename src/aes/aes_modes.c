@@ -34,6 +34,14 @@ Issue Date: 20/12/2007
 #endif
 
 #include "aesopt.h"
+#include "aes_backend.h"
+
+#if defined( USE_INTEL_AES_IF_PRESENT )
+#  include "aes_ni.h"
+#else
+/* map names here to provide the external API ('name' -> 'aes_name') */
+#  define aes_xi(x) aes_ ## x
+#endif
 
 #if defined( AES_MODES )
 #if defined(__cplusplus)
@@ -138,7 +146,7 @@ AES_RETURN aes_mode_reset(aes_encrypt_ctx ctx[1])
     return EXIT_SUCCESS;
 }
 
-AES_RETURN aes_ecb_encrypt(const unsigned char *ibuf, unsigned char *obuf,
+AES_RETURN aes_xi(ecb_encrypt)(const unsigned char *ibuf, unsigned char *obuf,
                     int len, const aes_encrypt_ctx ctx[1])
 {   int nb = len >> 4;
 
@@ -191,7 +199,7 @@ AES_RETURN aes_ecb_encrypt(const unsigned char *ibuf, unsigned char *obuf,
 #if !defined( ASSUME_VIA_ACE_PRESENT )
     while(nb--)
     {
-        if(aes_encrypt(ibuf, obuf, ctx) != EXIT_SUCCESS)
+        if(aes_xi(encrypt)(ibuf, obuf, ctx) != EXIT_SUCCESS)
             return EXIT_FAILURE;
         ibuf += AES_BLOCK_SIZE;
         obuf += AES_BLOCK_SIZE;
@@ -200,7 +208,7 @@ AES_RETURN aes_ecb_encrypt(const unsigned char *ibuf, unsigned char *obuf,
     return EXIT_SUCCESS;
 }
 
-AES_RETURN aes_ecb_decrypt(const unsigned char *ibuf, unsigned char *obuf,
+AES_RETURN aes_xi(ecb_decrypt)(const unsigned char *ibuf, unsigned char *obuf,
                     int len, const aes_decrypt_ctx ctx[1])
 {   int nb = len >> 4;
 
@@ -253,7 +261,7 @@ AES_RETURN aes_ecb_decrypt(const unsigned char *ibuf, unsigned char *obuf,
 #if !defined( ASSUME_VIA_ACE_PRESENT )
     while(nb--)
     {
-        if(aes_decrypt(ibuf, obuf, ctx) != EXIT_SUCCESS)
+        if(aes_xi(decrypt)(ibuf, obuf, ctx) != EXIT_SUCCESS)
             return EXIT_FAILURE;
         ibuf += AES_BLOCK_SIZE;
         obuf += AES_BLOCK_SIZE;
@@ -262,7 +270,7 @@ AES_RETURN aes_ecb_decrypt(const unsigned char *ibuf, unsigned char *obuf,
     return EXIT_SUCCESS;
 }
 
-AES_RETURN aes_cbc_encrypt(const unsigned char *ibuf, unsigned char *obuf,
+AES_RETURN aes_xi(cbc_encrypt)(const unsigned char *ibuf, unsigned char *obuf,
                     int len, unsigned char *iv, const aes_encrypt_ctx ctx[1])
 {   int nb = len >> 4;
 
@@ -331,7 +339,7 @@ AES_RETURN aes_cbc_encrypt(const unsigned char *ibuf, unsigned char *obuf,
             lp32(iv)[1] ^= lp32(ibuf)[1];
             lp32(iv)[2] ^= lp32(ibuf)[2];
             lp32(iv)[3] ^= lp32(ibuf)[3];
-            if(aes_encrypt(iv, iv, ctx) != EXIT_SUCCESS)
+            if(aes_xi(encrypt)(iv, iv, ctx) != EXIT_SUCCESS)
                 return EXIT_FAILURE;
             memcpy(obuf, iv, AES_BLOCK_SIZE);
             ibuf += AES_BLOCK_SIZE;
@@ -349,7 +357,7 @@ AES_RETURN aes_cbc_encrypt(const unsigned char *ibuf, unsigned char *obuf,
             iv[10] ^= ibuf[10]; iv[11] ^= ibuf[11];
             iv[12] ^= ibuf[12]; iv[13] ^= ibuf[13];
             iv[14] ^= ibuf[14]; iv[15] ^= ibuf[15];
-            if(aes_encrypt(iv, iv, ctx) != EXIT_SUCCESS)
+            if(aes_xi(encrypt)(iv, iv, ctx) != EXIT_SUCCESS)
                 return EXIT_FAILURE;
             memcpy(obuf, iv, AES_BLOCK_SIZE);
             ibuf += AES_BLOCK_SIZE;
@@ -359,7 +367,7 @@ AES_RETURN aes_cbc_encrypt(const unsigned char *ibuf, unsigned char *obuf,
     return EXIT_SUCCESS;
 }
 
-AES_RETURN aes_cbc_decrypt(const unsigned char *ibuf, unsigned char *obuf,
+AES_RETURN aes_xi(cbc_decrypt)(const unsigned char *ibuf, unsigned char *obuf,
                     int len, unsigned char *iv, const aes_decrypt_ctx ctx[1])
 {   unsigned char tmp[AES_BLOCK_SIZE];
     int nb = len >> 4;
@@ -425,7 +433,7 @@ AES_RETURN aes_cbc_decrypt(const unsigned char *ibuf, unsigned char *obuf,
         while(nb--)
         {
             memcpy(tmp, ibuf, AES_BLOCK_SIZE);
-            if(aes_decrypt(ibuf, obuf, ctx) != EXIT_SUCCESS)
+            if(aes_xi(decrypt)(ibuf, obuf, ctx) != EXIT_SUCCESS)
                 return EXIT_FAILURE;
             lp32(obuf)[0] ^= lp32(iv)[0];
             lp32(obuf)[1] ^= lp32(iv)[1];
@@ -440,7 +448,7 @@ AES_RETURN aes_cbc_decrypt(const unsigned char *ibuf, unsigned char *obuf,
         while(nb--)
         {
             memcpy(tmp, ibuf, AES_BLOCK_SIZE);
-            if(aes_decrypt(ibuf, obuf, ctx) != EXIT_SUCCESS)
+            if(aes_xi(decrypt)(ibuf, obuf, ctx) != EXIT_SUCCESS)
                 return EXIT_FAILURE;
             obuf[ 0] ^= iv[ 0]; obuf[ 1] ^= iv[ 1];
             obuf[ 2] ^= iv[ 2]; obuf[ 3] ^= iv[ 3];
@@ -458,7 +466,7 @@ AES_RETURN aes_cbc_decrypt(const unsigned char *ibuf, unsigned char *obuf,
     return EXIT_SUCCESS;
 }
 
-AES_RETURN aes_cfb_encrypt(const unsigned char *ibuf, unsigned char *obuf,
+AES_RETURN aes_xi(cfb_encrypt)(const unsigned char *ibuf, unsigned char *obuf,
                     int len, unsigned char *iv, aes_encrypt_ctx ctx[1])
 {   int cnt = 0, b_pos = (int)ctx->inf.b[2], nb;
 
@@ -533,7 +541,7 @@ AES_RETURN aes_cfb_encrypt(const unsigned char *ibuf, unsigned char *obuf,
             while(cnt + AES_BLOCK_SIZE <= len)
             {
                 assert(b_pos == 0);
-                if(aes_encrypt(iv, iv, ctx) != EXIT_SUCCESS)
+                if(aes_xi(encrypt)(iv, iv, ctx) != EXIT_SUCCESS)
                     return EXIT_FAILURE;
                 lp32(obuf)[0] = lp32(iv)[0] ^= lp32(ibuf)[0];
                 lp32(obuf)[1] = lp32(iv)[1] ^= lp32(ibuf)[1];
@@ -548,7 +556,7 @@ AES_RETURN aes_cfb_encrypt(const unsigned char *ibuf, unsigned char *obuf,
             while(cnt + AES_BLOCK_SIZE <= len)
             {
                 assert(b_pos == 0);
-                if(aes_encrypt(iv, iv, ctx) != EXIT_SUCCESS)
+                if(aes_xi(encrypt)(iv, iv, ctx) != EXIT_SUCCESS)
                     return EXIT_FAILURE;
                 obuf[ 0] = iv[ 0] ^= ibuf[ 0]; obuf[ 1] = iv[ 1] ^= ibuf[ 1];
                 obuf[ 2] = iv[ 2] ^= ibuf[ 2]; obuf[ 3] = iv[ 3] ^= ibuf[ 3];
@@ -567,7 +575,7 @@ AES_RETURN aes_cfb_encrypt(const unsigned char *ibuf, unsigned char *obuf,
 
     while(cnt < len)
     {
-        if(!b_pos && aes_encrypt(iv, iv, ctx) != EXIT_SUCCESS)
+        if(!b_pos && aes_xi(encrypt)(iv, iv, ctx) != EXIT_SUCCESS)
             return EXIT_FAILURE;
 
         while(cnt < len && b_pos < AES_BLOCK_SIZE)
@@ -583,7 +591,7 @@ AES_RETURN aes_cfb_encrypt(const unsigned char *ibuf, unsigned char *obuf,
     return EXIT_SUCCESS;
 }
 
-AES_RETURN aes_cfb_decrypt(const unsigned char *ibuf, unsigned char *obuf,
+AES_RETURN aes_xi(cfb_decrypt)(const unsigned char *ibuf, unsigned char *obuf,
                     int len, unsigned char *iv, aes_encrypt_ctx ctx[1])
 {   int cnt = 0, b_pos = (int)ctx->inf.b[2], nb;
 
@@ -662,7 +670,7 @@ AES_RETURN aes_cfb_decrypt(const unsigned char *ibuf, unsigned char *obuf,
             {   uint32_t t;
 
                 assert(b_pos == 0);
-                if(aes_encrypt(iv, iv, ctx) != EXIT_SUCCESS)
+                if(aes_xi(encrypt)(iv, iv, ctx) != EXIT_SUCCESS)
                     return EXIT_FAILURE;
                 t = lp32(ibuf)[0], lp32(obuf)[0] = t ^ lp32(iv)[0], lp32(iv)[0] = t;
                 t = lp32(ibuf)[1], lp32(obuf)[1] = t ^ lp32(iv)[1], lp32(iv)[1] = t;
@@ -678,7 +686,7 @@ AES_RETURN aes_cfb_decrypt(const unsigned char *ibuf, unsigned char *obuf,
             {   uint8_t t;
 
                 assert(b_pos == 0);
-                if(aes_encrypt(iv, iv, ctx) != EXIT_SUCCESS)
+                if(aes_xi(encrypt)(iv, iv, ctx) != EXIT_SUCCESS)
                     return EXIT_FAILURE;
                 t = ibuf[ 0], obuf[ 0] = t ^ iv[ 0], iv[ 0] = t;
                 t = ibuf[ 1], obuf[ 1] = t ^ iv[ 1], iv[ 1] = t;
@@ -706,7 +714,7 @@ AES_RETURN aes_cfb_decrypt(const unsigned char *ibuf, unsigned char *obuf,
     while(cnt < len)
     {   uint8_t t;
 
-        if(!b_pos && aes_encrypt(iv, iv, ctx) != EXIT_SUCCESS)
+        if(!b_pos && aes_xi(encrypt)(iv, iv, ctx) != EXIT_SUCCESS)
             return EXIT_FAILURE;
 
         while(cnt < len && b_pos < AES_BLOCK_SIZE)
@@ -724,7 +732,7 @@ AES_RETURN aes_cfb_decrypt(const unsigned char *ibuf, unsigned char *obuf,
     return EXIT_SUCCESS;
 }
 
-AES_RETURN aes_ofb_crypt(const unsigned char *ibuf, unsigned char *obuf,
+AES_RETURN aes_xi(ofb_crypt)(const unsigned char *ibuf, unsigned char *obuf,
                     int len, unsigned char *iv, aes_encrypt_ctx ctx[1])
 {   int cnt = 0, b_pos = (int)ctx->inf.b[2], nb;
 
@@ -799,7 +807,7 @@ AES_RETURN aes_ofb_crypt(const unsigned char *ibuf, unsigned char *obuf,
             while(cnt + AES_BLOCK_SIZE <= len)
             {
                 assert(b_pos == 0);
-                if(aes_encrypt(iv, iv, ctx) != EXIT_SUCCESS)
+                if(aes_xi(encrypt)(iv, iv, ctx) != EXIT_SUCCESS)
                     return EXIT_FAILURE;
                 lp32(obuf)[0] = lp32(iv)[0] ^ lp32(ibuf)[0];
                 lp32(obuf)[1] = lp32(iv)[1] ^ lp32(ibuf)[1];
@@ -814,7 +822,7 @@ AES_RETURN aes_ofb_crypt(const unsigned char *ibuf, unsigned char *obuf,
             while(cnt + AES_BLOCK_SIZE <= len)
             {
                 assert(b_pos == 0);
-                if(aes_encrypt(iv, iv, ctx) != EXIT_SUCCESS)
+                if(aes_xi(encrypt)(iv, iv, ctx) != EXIT_SUCCESS)
                     return EXIT_FAILURE;
                 obuf[ 0] = iv[ 0] ^ ibuf[ 0]; obuf[ 1] = iv[ 1] ^ ibuf[ 1];
                 obuf[ 2] = iv[ 2] ^ ibuf[ 2]; obuf[ 3] = iv[ 3] ^ ibuf[ 3];
@@ -833,7 +841,7 @@ AES_RETURN aes_ofb_crypt(const unsigned char *ibuf, unsigned char *obuf,
 
     while(cnt < len)
     {
-        if(!b_pos && aes_encrypt(iv, iv, ctx) != EXIT_SUCCESS)
+        if(!b_pos && aes_xi(encrypt)(iv, iv, ctx) != EXIT_SUCCESS)
             return EXIT_FAILURE;
 
         while(cnt < len && b_pos < AES_BLOCK_SIZE)
@@ -851,7 +859,7 @@ AES_RETURN aes_ofb_crypt(const unsigned char *ibuf, unsigned char *obuf,
 
 #define BFR_LENGTH  (BFR_BLOCKS * AES_BLOCK_SIZE)
 
-AES_RETURN aes_ctr_crypt(const unsigned char *ibuf, unsigned char *obuf,
+AES_RETURN aes_xi(ctr_crypt)(const unsigned char *ibuf, unsigned char *obuf,
             int len, unsigned char *cbuf, cbuf_inc ctr_inc, aes_encrypt_ctx ctx[1])
 {   unsigned char   *ip;
     int             i, blen, b_pos = (int)(ctx->inf.b[2]);
@@ -867,7 +875,7 @@ AES_RETURN aes_ctr_crypt(const unsigned char *ibuf, unsigned char *obuf,
     if(b_pos)
     {
         memcpy(buf, cbuf, AES_BLOCK_SIZE);
-        if(aes_ecb_encrypt(buf, buf, AES_BLOCK_SIZE, ctx) != EXIT_SUCCESS)
+        if(aes_xi(ecb_encrypt)(buf, buf, AES_BLOCK_SIZE, ctx) != EXIT_SUCCESS)
             return EXIT_FAILURE;
 
         while(b_pos < AES_BLOCK_SIZE && len)
@@ -902,7 +910,7 @@ AES_RETURN aes_ctr_crypt(const unsigned char *ibuf, unsigned char *obuf,
         }
         else
 #endif
-        if(aes_ecb_encrypt(buf, buf, i * AES_BLOCK_SIZE, ctx) != EXIT_SUCCESS)
+        if(aes_xi(ecb_encrypt)(buf, buf, i * AES_BLOCK_SIZE, ctx) != EXIT_SUCCESS)
             return EXIT_FAILURE;
 
         i = 0; ip = buf;
@@ -945,6 +953,15 @@ AES_RETURN aes_ctr_crypt(const unsigned char *ibuf, unsigned char *obuf,
     return EXIT_SUCCESS;
 }
 
+AES_RETURN aes_xi(ctr_crypt_ex)(const unsigned char *ibuf, unsigned char *obuf,
+            int len, unsigned char *cbuf, int ctr_mode, aes_encrypt_ctx ctx[1])
+{   cbuf_inc *ctr_inc = aes_ctr_inc(ctr_mode);
+
+    if(!ctr_inc)
+        return EXIT_FAILURE;
+    return aes_xi(ctr_crypt)(ibuf, obuf, len, cbuf, ctr_inc, ctx);
+}
+
 #if defined(__cplusplus)
 }
 #endif
@@ -17,7 +17,9 @@ and fitness for purpose.
 Issue Date: 09/09/2014
 */
 
+#include <string.h>
 #include "aes_ni.h"
+#include "aes_backend.h"
 
 #if defined( USE_INTEL_AES_IF_PRESENT )
 
@@ -26,6 +28,7 @@ Issue Date: 09/09/2014
 #include <intrin.h>
 #pragma intrinsic(__cpuid)
 #define INLINE  __inline
+#define FORCE_INLINE static __forceinline
 
 INLINE int has_aes_ni()
 {
@@ -39,6 +42,34 @@ INLINE int has_aes_ni()
 	return test;
 }
 
+/* VAES needs the OS to save the wider registers as well as the CPU bits */
+INLINE int has_vaes()
+{
+	static int test = -1;
+	if(test < 0)
+	{
+		int cpu_info[4];
+		unsigned __int64 xcr0 = 0;
+
+		test = AES_VAES_NONE;
+		__cpuid(cpu_info, 0);
+		if(cpu_info[0] >= 7)
+		{
+			__cpuid(cpu_info, 1);
+			if((cpu_info[2] & 0x18000000) == 0x18000000)
+				xcr0 = _xgetbv(0);
+			__cpuidex(cpu_info, 7, 0);
+			if((cpu_info[2] & 0x200) && (cpu_info[1] & 0x20) && (xcr0 & 0x06) == 0x06)
+			{
+				test = AES_VAES_256;
+				if((cpu_info[1] & 0x40010000) == 0x40010000 && (xcr0 & 0xe6) == 0xe6)
+					test = AES_VAES_512;
+			}
+		}
+	}
+	return test;
+}
+
 #elif defined( __GNUC__ )
 
 #include <cpuid.h>
@@ -47,6 +78,7 @@ INLINE int has_aes_ni()
 #pragma GCC target ("aes")
 #include <x86intrin.h>
 #define INLINE  static __inline
+#define FORCE_INLINE static __inline __attribute__((always_inline))
 
 INLINE int has_aes_ni()
 {
@@ -62,6 +94,31 @@ INLINE int has_aes_ni()
     return test;
 }
 
+/* VAES needs the OS to save the wider registers as well as the CPU bits */
+INLINE int has_vaes()
+{
+    static int test = -1;
+    if(test < 0)
+    {
+        unsigned int a, b, c, d, xcr0 = 0;
+
+        test = AES_VAES_NONE;
+        if(__get_cpuid_max(0, 0) >= 7)
+        {
+            if(__get_cpuid(1, &a, &b, &c, &d) && (c & 0x18000000) == 0x18000000)
+                __asm__ ("xgetbv" : "=a" (xcr0), "=d" (d) : "c" (0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if((c & 0x200) && (b & 0x20) && (xcr0 & 0x06) == 0x06)
+            {
+                test = AES_VAES_256;
+                if((b & 0x40010000) == 0x40010000 && (xcr0 & 0xe6) == 0xe6)
+                    test = AES_VAES_512;
+            }
+        }
+    }
+    return test;
+}
+
 #else
 #error AES New Instructions require Microsoft, Intel, GNU C, or CLANG
 #endif
@@ -441,6 +498,1100 @@ AES_RETURN aes_ni(decrypt)(const unsigned char *in, unsigned char *out, const ae
 	return EXIT_SUCCESS;
 }
 
+#if defined( AES_MODES )
+
+/* The mode functions below keep PAR_BLOCKS independent blocks in flight
+   so that the latency of each AESENC/AESDEC is hidden behind the others.
+
+   Each of them is written once for any number of rounds and forced inline
+   into the kernels of ni_kernels() below, one set for each of 10, 12 and
+   14 rounds. With the number of rounds a constant the round sequences are
+   fully unrolled, and for the blocks done one at a time the round keys
+   are copied into k[] at the start of the call and held in registers
+   across the whole buffer instead of being reloaded for every block.
+*/
+
+#define PAR_BLOCKS  8
+
+#define par_op(op, b, k) \
+    b[0] = op(b[0], k); b[1] = op(b[1], k); b[2] = op(b[2], k); b[3] = op(b[3], k); \
+    b[4] = op(b[4], k); b[5] = op(b[5], k); b[6] = op(b[6], k); b[7] = op(b[7], k)
+
+/* the middle rounds 1 .. rounds - 1 with the round step s(j) */
+#define ni_rounds(s, rounds) \
+    s(1) s(2) s(3) s(4) s(5) s(6) s(7) s(8) s(9) \
+    if(rounds > 10) { s(10) s(11) } \
+    if(rounds > 12) { s(12) s(13) }
+
+/* the decryption schedule is read backwards so that both directions use
+   the round keys in the order k[0], k[1] .. k[rounds]
+*/
+FORCE_INLINE void ni_keys(__m128i k[15], const uint32_t *ks, int rounds, int dec)
+{
+	const __m128i *key = (const __m128i*)ks;
+
+#define ni_key(j) if(j <= rounds) k[j] = _mm_loadu_si128(key + (dec ? rounds - j : j));
+	ni_key(0) ni_key(1) ni_key(2) ni_key(3) ni_key(4) ni_key(5) ni_key(6) ni_key(7)
+	ni_key(8) ni_key(9) ni_key(10) ni_key(11) ni_key(12) ni_key(13) ni_key(14)
+#undef ni_key
+}
+
+/* with PAR_BLOCKS blocks in registers there are not enough left for the
+   round keys, so the parallel rounds take them from the key schedule: one
+   load per round for all the blocks costs nothing
+*/
+FORCE_INLINE void aes_ni_enc_par(__m128i b[PAR_BLOCKS], const __m128i *key, int rounds)
+{
+#define ni_step(j) par_op(_mm_aesenc_si128, b, key[j]);
+	par_op(_mm_xor_si128, b, key[0]);
+	ni_rounds(ni_step, rounds)
+	par_op(_mm_aesenclast_si128, b, key[rounds]);
+#undef ni_step
+}
+
+FORCE_INLINE __m128i aes_ni_enc_one(__m128i t, const __m128i k[15], int rounds)
+{
+#define ni_step(j) t = _mm_aesenc_si128(t, k[j]);
+	t = _mm_xor_si128(t, k[0]);
+	ni_rounds(ni_step, rounds)
+	return _mm_aesenclast_si128(t, k[rounds]);
+#undef ni_step
+}
+
+FORCE_INLINE void aes_ni_dec_par(__m128i b[PAR_BLOCKS], const __m128i *key, int rounds)
+{
+#define ni_step(j) par_op(_mm_aesdec_si128, b, key[rounds - j]);
+	par_op(_mm_xor_si128, b, key[rounds]);
+	ni_rounds(ni_step, rounds)
+	par_op(_mm_aesdeclast_si128, b, key[0]);
+#undef ni_step
+}
+
+FORCE_INLINE __m128i aes_ni_dec_one(__m128i t, const __m128i k[15], int rounds)
+{
+#define ni_step(j) t = _mm_aesdec_si128(t, k[j]);
+	t = _mm_xor_si128(t, k[0]);
+	ni_rounds(ni_step, rounds)
+	return _mm_aesdeclast_si128(t, k[rounds]);
+#undef ni_step
+}
+
+INLINE void par_load(__m128i b[PAR_BLOCKS], const unsigned char *ibuf)
+{
+	int i;
+
+	for(i = 0; i < PAR_BLOCKS; ++i)
+		b[i] = _mm_loadu_si128((const __m128i*)ibuf + i);
+}
+
+INLINE void par_store(unsigned char *obuf, const __m128i b[PAR_BLOCKS])
+{
+	int i;
+
+	for(i = 0; i < PAR_BLOCKS; ++i)
+		_mm_storeu_si128((__m128i*)obuf + i, b[i]);
+}
+
+FORCE_INLINE AES_RETURN ni_encrypt_r(const unsigned char *in, unsigned char *out,
+                    const aes_encrypt_ctx cx[1], int rounds)
+{
+	__m128i k[15];
+
+	ni_keys(k, cx->ks, rounds, 0);
+	_mm_storeu_si128((__m128i*)out, aes_ni_enc_one(_mm_loadu_si128((const __m128i*)in), k, rounds));
+	return EXIT_SUCCESS;
+}
+
+FORCE_INLINE AES_RETURN ni_decrypt_r(const unsigned char *in, unsigned char *out,
+                    const aes_decrypt_ctx cx[1], int rounds)
+{
+	__m128i k[15];
+
+	ni_keys(k, cx->ks, rounds, 1);
+	_mm_storeu_si128((__m128i*)out, aes_ni_dec_one(_mm_loadu_si128((const __m128i*)in), k, rounds));
+	return EXIT_SUCCESS;
+}
+
+FORCE_INLINE AES_RETURN ni_ecb_encrypt_r(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, const aes_encrypt_ctx cx[1], int vaes, int rounds)
+{
+	int nb = len >> 4, i;
+	__m128i k[15], b[PAR_BLOCKS];
+
+	if(len & (AES_BLOCK_SIZE - 1))
+		return EXIT_FAILURE;
+
+	switch(vaes)
+	{
+	case AES_VAES_512: i = aes_vaes512_ecb_encrypt(ibuf, obuf, nb, cx); break;
+	case AES_VAES_256: i = aes_vaes256_ecb_encrypt(ibuf, obuf, nb, cx); break;
+	default: i = 0;
+	}
+	ibuf += i * AES_BLOCK_SIZE;
+	obuf += i * AES_BLOCK_SIZE;
+	nb -= i;
+
+	ni_keys(k, cx->ks, rounds, 0);
+
+	for( ; nb >= PAR_BLOCKS; nb -= PAR_BLOCKS)
+	{
+		par_load(b, ibuf);
+		aes_ni_enc_par(b, (const __m128i*)cx->ks, rounds);
+		par_store(obuf, b);
+		ibuf += PAR_BLOCKS * AES_BLOCK_SIZE;
+		obuf += PAR_BLOCKS * AES_BLOCK_SIZE;
+	}
+
+	for( ; nb; --nb)
+	{
+		_mm_storeu_si128((__m128i*)obuf,
+			aes_ni_enc_one(_mm_loadu_si128((const __m128i*)ibuf), k, rounds));
+		ibuf += AES_BLOCK_SIZE;
+		obuf += AES_BLOCK_SIZE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+FORCE_INLINE AES_RETURN ni_ecb_decrypt_r(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, const aes_decrypt_ctx cx[1], int vaes, int rounds)
+{
+	int nb = len >> 4, i;
+	__m128i k[15], b[PAR_BLOCKS];
+
+	if(len & (AES_BLOCK_SIZE - 1))
+		return EXIT_FAILURE;
+
+	switch(vaes)
+	{
+	case AES_VAES_512: i = aes_vaes512_ecb_decrypt(ibuf, obuf, nb, cx); break;
+	case AES_VAES_256: i = aes_vaes256_ecb_decrypt(ibuf, obuf, nb, cx); break;
+	default: i = 0;
+	}
+	ibuf += i * AES_BLOCK_SIZE;
+	obuf += i * AES_BLOCK_SIZE;
+	nb -= i;
+
+	ni_keys(k, cx->ks, rounds, 1);
+
+	for( ; nb >= PAR_BLOCKS; nb -= PAR_BLOCKS)
+	{
+		par_load(b, ibuf);
+		aes_ni_dec_par(b, (const __m128i*)cx->ks, rounds);
+		par_store(obuf, b);
+		ibuf += PAR_BLOCKS * AES_BLOCK_SIZE;
+		obuf += PAR_BLOCKS * AES_BLOCK_SIZE;
+	}
+
+	for( ; nb; --nb)
+	{
+		_mm_storeu_si128((__m128i*)obuf,
+			aes_ni_dec_one(_mm_loadu_si128((const __m128i*)ibuf), k, rounds));
+		ibuf += AES_BLOCK_SIZE;
+		obuf += AES_BLOCK_SIZE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* CBC decryption of the blocks is independent; only the XOR with the
+   previous ciphertext links them. All PAR_BLOCKS ciphertext blocks are
+   loaded before anything is stored so that ibuf may equal obuf
+*/
+
+FORCE_INLINE AES_RETURN ni_cbc_decrypt_r(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, const aes_decrypt_ctx cx[1], int vaes, int rounds)
+{
+	int nb = len >> 4, i;
+	__m128i k[15], b[PAR_BLOCKS], c[PAR_BLOCKS], fb, t;
+
+	if(len & (AES_BLOCK_SIZE - 1))
+		return EXIT_FAILURE;
+
+	switch(vaes)
+	{
+	case AES_VAES_512: i = aes_vaes512_cbc_decrypt(ibuf, obuf, nb, iv, cx); break;
+	case AES_VAES_256: i = aes_vaes256_cbc_decrypt(ibuf, obuf, nb, iv, cx); break;
+	default: i = 0;
+	}
+	ibuf += i * AES_BLOCK_SIZE;
+	obuf += i * AES_BLOCK_SIZE;
+	nb -= i;
+
+	ni_keys(k, cx->ks, rounds, 1);
+	fb = _mm_loadu_si128((const __m128i*)iv);
+
+	for( ; nb >= PAR_BLOCKS; nb -= PAR_BLOCKS)
+	{
+		par_load(c, ibuf);
+		for(i = 0; i < PAR_BLOCKS; ++i)
+			b[i] = c[i];
+
+		aes_ni_dec_par(b, (const __m128i*)cx->ks, rounds);
+
+		b[0] = _mm_xor_si128(b[0], fb);
+		for(i = 1; i < PAR_BLOCKS; ++i)
+			b[i] = _mm_xor_si128(b[i], c[i - 1]);
+		fb = c[PAR_BLOCKS - 1];
+
+		par_store(obuf, b);
+		ibuf += PAR_BLOCKS * AES_BLOCK_SIZE;
+		obuf += PAR_BLOCKS * AES_BLOCK_SIZE;
+	}
+
+	for( ; nb; --nb)
+	{
+		t = _mm_loadu_si128((const __m128i*)ibuf);
+		_mm_storeu_si128((__m128i*)obuf, _mm_xor_si128(aes_ni_dec_one(t, k, rounds), fb));
+		fb = t;
+		ibuf += AES_BLOCK_SIZE;
+		obuf += AES_BLOCK_SIZE;
+	}
+
+	_mm_storeu_si128((__m128i*)iv, fb);
+	return EXIT_SUCCESS;
+}
+
+#if defined(_MSC_VER)
+#  define aes_bswap64(x) _byteswap_uint64(x)
+#else
+#  define aes_bswap64(x) __builtin_bswap64(x)
+#endif
+
+/* The counter is held as a native 128-bit integer in two 64-bit halves
+   and is converted to and from the byte order of the counter block when
+   it is loaded, stored or turned into a block to encrypt
+*/
+
+INLINE void ctr_load(const unsigned char *cbuf, int be, uint64_t c[2])
+{
+	uint64_t lo, hi;
+
+	memcpy(&lo, cbuf + (be ? 8 : 0), 8);
+	memcpy(&hi, cbuf + (be ? 0 : 8), 8);
+	c[0] = be ? aes_bswap64(lo) : lo;
+	c[1] = be ? aes_bswap64(hi) : hi;
+}
+
+INLINE void ctr_store(unsigned char *cbuf, int be, const uint64_t c[2])
+{
+	uint64_t lo = be ? aes_bswap64(c[0]) : c[0], hi = be ? aes_bswap64(c[1]) : c[1];
+
+	memcpy(cbuf + (be ? 8 : 0), &lo, 8);
+	memcpy(cbuf + (be ? 0 : 8), &hi, 8);
+}
+
+INLINE void ctr_add(uint64_t c[2], int up, uint64_t n)
+{
+	if(up)
+	{
+		c[0] += n;
+		c[1] += (c[0] < n);
+	}
+	else
+	{
+		c[1] -= (c[0] < n);
+		c[0] -= n;
+	}
+}
+
+INLINE __m128i ctr_block(const uint64_t c[2], __m128i bswap)
+{
+	return _mm_shuffle_epi8(_mm_set_epi64x((long long)c[1], (long long)c[0]), bswap);
+}
+
+FORCE_INLINE AES_RETURN ni_ctr_crypt_ex_r(const unsigned char *ibuf, unsigned char *obuf,
+            int len, unsigned char *cbuf, int ctr_mode, aes_encrypt_ctx cx[1], int vaes, int rounds)
+{
+	int b_pos = cx->inf.b[2], be, up, i;
+	__m128i k[15], bswap, step[PAR_BLOCKS], b[PAR_BLOCKS], t;
+	uint64_t c[2];
+	unsigned char ks[AES_BLOCK_SIZE];
+
+	/* no arithmetic for the legacy decrements, see AES_CTR_DEC_BE_LEGACY */
+	if(ctr_mode == AES_CTR_DEC_BE_LEGACY || ctr_mode == AES_CTR_DEC_LE_LEGACY)
+		return aes_xi(ctr_crypt_ex)(ibuf, obuf, len, cbuf, ctr_mode, cx);
+	if(ctr_mode < AES_CTR_INC_BE || ctr_mode > AES_CTR_DEC_LE)
+		return EXIT_FAILURE;
+
+	be = (ctr_mode == AES_CTR_INC_BE || ctr_mode == AES_CTR_DEC_BE);
+	up = (ctr_mode == AES_CTR_INC_BE || ctr_mode == AES_CTR_INC_LE);
+	bswap = be ? _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+	           : _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	for(i = 0; i < PAR_BLOCKS; ++i)
+		step[i] = _mm_set_epi64x(0, up ? i : -i);
+
+	ni_keys(k, cx->ks, rounds, 0);
+	ctr_load(cbuf, be, c);
+
+	/* finish the block left over from the previous call */
+	if(b_pos)
+	{
+		_mm_storeu_si128((__m128i*)ks, aes_ni_enc_one(ctr_block(c, bswap), k, rounds));
+		while(b_pos < AES_BLOCK_SIZE && len)
+		{
+			*obuf++ = *ibuf++ ^ ks[b_pos++];
+			--len;
+		}
+
+		if(len)
+			ctr_add(c, up, 1), b_pos = 0;
+	}
+
+	switch(vaes)
+	{
+	case AES_VAES_512: i = aes_vaes512_ctr_crypt(ibuf, obuf, len >> 4, c, be, up, cx); break;
+	case AES_VAES_256: i = aes_vaes256_ctr_crypt(ibuf, obuf, len >> 4, c, be, up, cx); break;
+	default: i = 0;
+	}
+	ibuf += i * AES_BLOCK_SIZE;
+	obuf += i * AES_BLOCK_SIZE;
+	len -= i * AES_BLOCK_SIZE;
+
+	while(len >= PAR_BLOCKS * AES_BLOCK_SIZE)
+	{
+		/* the low halves of the next PAR_BLOCKS counters can be made with
+		   a single SIMD add unless that would carry into the high half */
+		if(up ? c[0] <= ~(uint64_t)0 - (PAR_BLOCKS - 1) : c[0] >= PAR_BLOCKS - 1)
+		{
+			t = _mm_set_epi64x((long long)c[1], (long long)c[0]);
+			for(i = 0; i < PAR_BLOCKS; ++i)
+				b[i] = _mm_shuffle_epi8(_mm_add_epi64(t, step[i]), bswap);
+			ctr_add(c, up, PAR_BLOCKS);
+		}
+		else for(i = 0; i < PAR_BLOCKS; ++i)
+		{
+			b[i] = ctr_block(c, bswap);
+			ctr_add(c, up, 1);
+		}
+
+		aes_ni_enc_par(b, (const __m128i*)cx->ks, rounds);
+
+		for(i = 0; i < PAR_BLOCKS; ++i)
+			_mm_storeu_si128((__m128i*)obuf + i,
+				_mm_xor_si128(b[i], _mm_loadu_si128((const __m128i*)ibuf + i)));
+
+		ibuf += PAR_BLOCKS * AES_BLOCK_SIZE;
+		obuf += PAR_BLOCKS * AES_BLOCK_SIZE;
+		len -= PAR_BLOCKS * AES_BLOCK_SIZE;
+	}
+
+	while(len >= AES_BLOCK_SIZE)
+	{
+		t = aes_ni_enc_one(ctr_block(c, bswap), k, rounds);
+		_mm_storeu_si128((__m128i*)obuf, _mm_xor_si128(t, _mm_loadu_si128((const __m128i*)ibuf)));
+		ctr_add(c, up, 1);
+		ibuf += AES_BLOCK_SIZE;
+		obuf += AES_BLOCK_SIZE;
+		len -= AES_BLOCK_SIZE;
+	}
+
+	/* a trailing part block leaves its counter in cbuf for the next call */
+	if(len)
+	{
+		_mm_storeu_si128((__m128i*)ks, aes_ni_enc_one(ctr_block(c, bswap), k, rounds));
+		for(b_pos = 0; b_pos < len; ++b_pos)
+			obuf[b_pos] = ibuf[b_pos] ^ ks[b_pos];
+	}
+
+	ctr_store(cbuf, be, c);
+	cx->inf.b[2] = (uint8_t)b_pos;
+	return EXIT_SUCCESS;
+}
+
+/* The chained modes can not overlap the encryption of consecutive blocks
+   but keeping the chaining value in a register still saves the per block
+   call and CPU test of aes_ni(encrypt); CFB decryption is parallel again
+*/
+
+FORCE_INLINE AES_RETURN ni_cbc_encrypt_r(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, const aes_encrypt_ctx cx[1], int rounds)
+{
+	int nb = len >> 4;
+	__m128i k[15], fb;
+
+	if(len & (AES_BLOCK_SIZE - 1))
+		return EXIT_FAILURE;
+
+	ni_keys(k, cx->ks, rounds, 0);
+	fb = _mm_loadu_si128((const __m128i*)iv);
+	for( ; nb; --nb)
+	{
+		fb = aes_ni_enc_one(_mm_xor_si128(fb, _mm_loadu_si128((const __m128i*)ibuf)), k, rounds);
+		_mm_storeu_si128((__m128i*)obuf, fb);
+		ibuf += AES_BLOCK_SIZE;
+		obuf += AES_BLOCK_SIZE;
+	}
+
+	_mm_storeu_si128((__m128i*)iv, fb);
+	return EXIT_SUCCESS;
+}
+
+FORCE_INLINE AES_RETURN ni_cfb_encrypt_r(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1], int rounds)
+{
+	int b_pos = cx->inf.b[2];
+	__m128i k[15], fb;
+
+	if(b_pos)           /* complete any partial block   */
+	{
+		while(b_pos < AES_BLOCK_SIZE && len)
+		{
+			*obuf++ = (iv[b_pos++] ^= *ibuf++);
+			--len;
+		}
+
+		b_pos = (b_pos == AES_BLOCK_SIZE ? 0 : b_pos);
+	}
+
+	ni_keys(k, cx->ks, rounds, 0);
+
+	if(len >= AES_BLOCK_SIZE)
+	{
+		fb = _mm_loadu_si128((const __m128i*)iv);
+		for( ; len >= AES_BLOCK_SIZE; len -= AES_BLOCK_SIZE)
+		{
+			fb = _mm_xor_si128(aes_ni_enc_one(fb, k, rounds), _mm_loadu_si128((const __m128i*)ibuf));
+			_mm_storeu_si128((__m128i*)obuf, fb);
+			ibuf += AES_BLOCK_SIZE;
+			obuf += AES_BLOCK_SIZE;
+		}
+		_mm_storeu_si128((__m128i*)iv, fb);
+	}
+
+	if(len)
+	{
+		_mm_storeu_si128((__m128i*)iv, aes_ni_enc_one(_mm_loadu_si128((const __m128i*)iv), k, rounds));
+		for(b_pos = 0; b_pos < len; ++b_pos)
+			obuf[b_pos] = (iv[b_pos] ^= ibuf[b_pos]);
+	}
+
+	cx->inf.b[2] = (uint8_t)b_pos;
+	return EXIT_SUCCESS;
+}
+
+FORCE_INLINE AES_RETURN ni_cfb_decrypt_r(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1], int rounds)
+{
+	int b_pos = cx->inf.b[2], i;
+	__m128i k[15], b[PAR_BLOCKS], c[PAR_BLOCKS], fb, t;
+	uint8_t u;
+
+	if(b_pos)           /* complete any partial block   */
+	{
+		while(b_pos < AES_BLOCK_SIZE && len)
+		{
+			u = *ibuf++;
+			*obuf++ = u ^ iv[b_pos];
+			iv[b_pos++] = u;
+			--len;
+		}
+
+		b_pos = (b_pos == AES_BLOCK_SIZE ? 0 : b_pos);
+	}
+
+	ni_keys(k, cx->ks, rounds, 0);
+
+	if(len >= AES_BLOCK_SIZE)
+	{
+		fb = _mm_loadu_si128((const __m128i*)iv);
+		for( ; len >= PAR_BLOCKS * AES_BLOCK_SIZE; len -= PAR_BLOCKS * AES_BLOCK_SIZE)
+		{
+			par_load(c, ibuf);
+			b[0] = fb;
+			for(i = 1; i < PAR_BLOCKS; ++i)
+				b[i] = c[i - 1];
+
+			aes_ni_enc_par(b, (const __m128i*)cx->ks, rounds);
+
+			for(i = 0; i < PAR_BLOCKS; ++i)
+				b[i] = _mm_xor_si128(b[i], c[i]);
+			fb = c[PAR_BLOCKS - 1];
+
+			par_store(obuf, b);
+			ibuf += PAR_BLOCKS * AES_BLOCK_SIZE;
+			obuf += PAR_BLOCKS * AES_BLOCK_SIZE;
+		}
+
+		for( ; len >= AES_BLOCK_SIZE; len -= AES_BLOCK_SIZE)
+		{
+			t = _mm_loadu_si128((const __m128i*)ibuf);
+			_mm_storeu_si128((__m128i*)obuf, _mm_xor_si128(aes_ni_enc_one(fb, k, rounds), t));
+			fb = t;
+			ibuf += AES_BLOCK_SIZE;
+			obuf += AES_BLOCK_SIZE;
+		}
+		_mm_storeu_si128((__m128i*)iv, fb);
+	}
+
+	if(len)
+	{
+		_mm_storeu_si128((__m128i*)iv, aes_ni_enc_one(_mm_loadu_si128((const __m128i*)iv), k, rounds));
+		for(b_pos = 0; b_pos < len; ++b_pos)
+		{
+			u = ibuf[b_pos];
+			obuf[b_pos] = u ^ iv[b_pos];
+			iv[b_pos] = u;
+		}
+	}
+
+	cx->inf.b[2] = (uint8_t)b_pos;
+	return EXIT_SUCCESS;
+}
+
+FORCE_INLINE AES_RETURN ni_ofb_crypt_r(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1], int rounds)
+{
+	int b_pos = cx->inf.b[2];
+	__m128i k[15], fb;
+
+	if(b_pos)           /* complete any partial block   */
+	{
+		while(b_pos < AES_BLOCK_SIZE && len)
+		{
+			*obuf++ = iv[b_pos++] ^ *ibuf++;
+			--len;
+		}
+
+		b_pos = (b_pos == AES_BLOCK_SIZE ? 0 : b_pos);
+	}
+
+	ni_keys(k, cx->ks, rounds, 0);
+
+	if(len >= AES_BLOCK_SIZE)
+	{
+		fb = _mm_loadu_si128((const __m128i*)iv);
+		for( ; len >= AES_BLOCK_SIZE; len -= AES_BLOCK_SIZE)
+		{
+			fb = aes_ni_enc_one(fb, k, rounds);
+			_mm_storeu_si128((__m128i*)obuf, _mm_xor_si128(fb, _mm_loadu_si128((const __m128i*)ibuf)));
+			ibuf += AES_BLOCK_SIZE;
+			obuf += AES_BLOCK_SIZE;
+		}
+		_mm_storeu_si128((__m128i*)iv, fb);
+	}
+
+	if(len)
+	{
+		_mm_storeu_si128((__m128i*)iv, aes_ni_enc_one(_mm_loadu_si128((const __m128i*)iv), k, rounds));
+		for(b_pos = 0; b_pos < len; ++b_pos)
+			obuf[b_pos] = iv[b_pos] ^ ibuf[b_pos];
+	}
+
+	cx->inf.b[2] = (uint8_t)b_pos;
+	return EXIT_SUCCESS;
+}
+
+/* CTR with a caller supplied counter update: the counters are still
+   produced one at a time but PAR_BLOCKS of them are encrypted together */
+
+FORCE_INLINE AES_RETURN ni_ctr_crypt_r(const unsigned char *ibuf, unsigned char *obuf,
+            int len, unsigned char *cbuf, cbuf_inc ctr_inc, aes_encrypt_ctx cx[1], int rounds)
+{
+	int b_pos = cx->inf.b[2], i;
+	__m128i k[15], b[PAR_BLOCKS], t;
+	unsigned char ks[AES_BLOCK_SIZE];
+
+	ni_keys(k, cx->ks, rounds, 0);
+
+	if(b_pos)
+	{
+		_mm_storeu_si128((__m128i*)ks, aes_ni_enc_one(_mm_loadu_si128((const __m128i*)cbuf), k, rounds));
+		while(b_pos < AES_BLOCK_SIZE && len)
+		{
+			*obuf++ = *ibuf++ ^ ks[b_pos++];
+			--len;
+		}
+
+		if(len)
+			ctr_inc(cbuf), b_pos = 0;
+	}
+
+	for( ; len >= PAR_BLOCKS * AES_BLOCK_SIZE; len -= PAR_BLOCKS * AES_BLOCK_SIZE)
+	{
+		for(i = 0; i < PAR_BLOCKS; ++i)
+		{
+			b[i] = _mm_loadu_si128((const __m128i*)cbuf);
+			ctr_inc(cbuf);
+		}
+
+		aes_ni_enc_par(b, (const __m128i*)cx->ks, rounds);
+
+		for(i = 0; i < PAR_BLOCKS; ++i)
+			_mm_storeu_si128((__m128i*)obuf + i,
+				_mm_xor_si128(b[i], _mm_loadu_si128((const __m128i*)ibuf + i)));
+
+		ibuf += PAR_BLOCKS * AES_BLOCK_SIZE;
+		obuf += PAR_BLOCKS * AES_BLOCK_SIZE;
+	}
+
+	for( ; len >= AES_BLOCK_SIZE; len -= AES_BLOCK_SIZE)
+	{
+		t = aes_ni_enc_one(_mm_loadu_si128((const __m128i*)cbuf), k, rounds);
+		_mm_storeu_si128((__m128i*)obuf, _mm_xor_si128(t, _mm_loadu_si128((const __m128i*)ibuf)));
+		ctr_inc(cbuf);
+		ibuf += AES_BLOCK_SIZE;
+		obuf += AES_BLOCK_SIZE;
+	}
+
+	if(len)
+	{
+		_mm_storeu_si128((__m128i*)ks, aes_ni_enc_one(_mm_loadu_si128((const __m128i*)cbuf), k, rounds));
+		for(b_pos = 0; b_pos < len; ++b_pos)
+			obuf[b_pos] = ibuf[b_pos] ^ ks[b_pos];
+	}
+
+	cx->inf.b[2] = (uint8_t)b_pos;
+	return EXIT_SUCCESS;
+}
+
+/* The kernels for one number of rounds. They refuse a context with any
+   other key size, so a kernel picked for a key must be picked again
+   when the key changes. The ECB, CBC decryption and CTR kernels still
+   take the VAES width used for their bulk work.
+*/
+
+#define ni_kernels(R) \
+static AES_RETURN ni##R##_encrypt(const unsigned char *in, unsigned char *out, \
+                    const aes_encrypt_ctx cx[1]) \
+{ return cx->inf.b[0] == R * 16 ? ni_encrypt_r(in, out, cx, R) : EXIT_FAILURE; } \
+static AES_RETURN ni##R##_decrypt(const unsigned char *in, unsigned char *out, \
+                    const aes_decrypt_ctx cx[1]) \
+{ return cx->inf.b[0] == R * 16 ? ni_decrypt_r(in, out, cx, R) : EXIT_FAILURE; } \
+static AES_RETURN ni##R##_ecb_encrypt(const unsigned char *ibuf, unsigned char *obuf, \
+                    int len, const aes_encrypt_ctx cx[1], int vaes) \
+{ return cx->inf.b[0] == R * 16 ? ni_ecb_encrypt_r(ibuf, obuf, len, cx, vaes, R) : EXIT_FAILURE; } \
+static AES_RETURN ni##R##_ecb_decrypt(const unsigned char *ibuf, unsigned char *obuf, \
+                    int len, const aes_decrypt_ctx cx[1], int vaes) \
+{ return cx->inf.b[0] == R * 16 ? ni_ecb_decrypt_r(ibuf, obuf, len, cx, vaes, R) : EXIT_FAILURE; } \
+static AES_RETURN ni##R##_cbc_encrypt(const unsigned char *ibuf, unsigned char *obuf, \
+                    int len, unsigned char *iv, const aes_encrypt_ctx cx[1]) \
+{ return cx->inf.b[0] == R * 16 ? ni_cbc_encrypt_r(ibuf, obuf, len, iv, cx, R) : EXIT_FAILURE; } \
+static AES_RETURN ni##R##_cbc_decrypt(const unsigned char *ibuf, unsigned char *obuf, \
+                    int len, unsigned char *iv, const aes_decrypt_ctx cx[1], int vaes) \
+{ return cx->inf.b[0] == R * 16 ? ni_cbc_decrypt_r(ibuf, obuf, len, iv, cx, vaes, R) : EXIT_FAILURE; } \
+static AES_RETURN ni##R##_cfb_encrypt(const unsigned char *ibuf, unsigned char *obuf, \
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1]) \
+{ return cx->inf.b[0] == R * 16 ? ni_cfb_encrypt_r(ibuf, obuf, len, iv, cx, R) : EXIT_FAILURE; } \
+static AES_RETURN ni##R##_cfb_decrypt(const unsigned char *ibuf, unsigned char *obuf, \
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1]) \
+{ return cx->inf.b[0] == R * 16 ? ni_cfb_decrypt_r(ibuf, obuf, len, iv, cx, R) : EXIT_FAILURE; } \
+static AES_RETURN ni##R##_ofb_crypt(const unsigned char *ibuf, unsigned char *obuf, \
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1]) \
+{ return cx->inf.b[0] == R * 16 ? ni_ofb_crypt_r(ibuf, obuf, len, iv, cx, R) : EXIT_FAILURE; } \
+static AES_RETURN ni##R##_ctr_crypt(const unsigned char *ibuf, unsigned char *obuf, \
+            int len, unsigned char *cbuf, cbuf_inc ctr_inc, aes_encrypt_ctx cx[1]) \
+{ return cx->inf.b[0] == R * 16 ? ni_ctr_crypt_r(ibuf, obuf, len, cbuf, ctr_inc, cx, R) : EXIT_FAILURE; } \
+static AES_RETURN ni##R##_ctr_crypt_ex(const unsigned char *ibuf, unsigned char *obuf, \
+            int len, unsigned char *cbuf, int ctr_mode, aes_encrypt_ctx cx[1], int vaes) \
+{ return cx->inf.b[0] == R * 16 ? ni_ctr_crypt_ex_r(ibuf, obuf, len, cbuf, ctr_mode, cx, vaes, R) : EXIT_FAILURE; }
+
+ni_kernels(10)
+ni_kernels(12)
+ni_kernels(14)
+
+/* the calls for any key size pick the kernel on every call */
+
+#define ni_select(cx, f, args) \
+	switch(cx->inf.b[0]) \
+	{ \
+	case 10 * 16: return ni10_##f args; \
+	case 12 * 16: return ni12_##f args; \
+	case 14 * 16: return ni14_##f args; \
+	default: return EXIT_FAILURE; \
+	}
+
+static AES_RETURN ni_ecb_encrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, const aes_encrypt_ctx cx[1], int vaes)
+{
+	ni_select(cx, ecb_encrypt, (ibuf, obuf, len, cx, vaes))
+}
+
+static AES_RETURN ni_ecb_decrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, const aes_decrypt_ctx cx[1], int vaes)
+{
+	ni_select(cx, ecb_decrypt, (ibuf, obuf, len, cx, vaes))
+}
+
+static AES_RETURN ni_cbc_encrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, const aes_encrypt_ctx cx[1])
+{
+	ni_select(cx, cbc_encrypt, (ibuf, obuf, len, iv, cx))
+}
+
+static AES_RETURN ni_cbc_decrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, const aes_decrypt_ctx cx[1], int vaes)
+{
+	ni_select(cx, cbc_decrypt, (ibuf, obuf, len, iv, cx, vaes))
+}
+
+static AES_RETURN ni_cfb_encrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1])
+{
+	ni_select(cx, cfb_encrypt, (ibuf, obuf, len, iv, cx))
+}
+
+static AES_RETURN ni_cfb_decrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1])
+{
+	ni_select(cx, cfb_decrypt, (ibuf, obuf, len, iv, cx))
+}
+
+static AES_RETURN ni_ofb_crypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1])
+{
+	ni_select(cx, ofb_crypt, (ibuf, obuf, len, iv, cx))
+}
+
+static AES_RETURN ni_ctr_crypt(const unsigned char *ibuf, unsigned char *obuf,
+            int len, unsigned char *cbuf, cbuf_inc ctr_inc, aes_encrypt_ctx cx[1])
+{
+	ni_select(cx, ctr_crypt, (ibuf, obuf, len, cbuf, ctr_inc, cx))
+}
+
+static AES_RETURN ni_ctr_crypt_ex(const unsigned char *ibuf, unsigned char *obuf,
+            int len, unsigned char *cbuf, int ctr_mode, aes_encrypt_ctx cx[1], int vaes)
+{
+	ni_select(cx, ctr_crypt_ex, (ibuf, obuf, len, cbuf, ctr_mode, cx, vaes))
+}
+
+/* the public mode calls fall back to the table code without AES-NI and
+   use the widest VAES kernels that the machine supports */
+
+AES_RETURN aes_ni(ecb_encrypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, const aes_encrypt_ctx cx[1])
+{
+	if(!has_aes_ni())
+		return aes_xi(ecb_encrypt)(ibuf, obuf, len, cx);
+	return ni_ecb_encrypt(ibuf, obuf, len, cx, has_vaes());
+}
+
+AES_RETURN aes_ni(ecb_decrypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, const aes_decrypt_ctx cx[1])
+{
+	if(!has_aes_ni())
+		return aes_xi(ecb_decrypt)(ibuf, obuf, len, cx);
+	return ni_ecb_decrypt(ibuf, obuf, len, cx, has_vaes());
+}
+
+AES_RETURN aes_ni(cbc_encrypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, const aes_encrypt_ctx cx[1])
+{
+	if(!has_aes_ni())
+		return aes_xi(cbc_encrypt)(ibuf, obuf, len, iv, cx);
+	return ni_cbc_encrypt(ibuf, obuf, len, iv, cx);
+}
+
+AES_RETURN aes_ni(cbc_decrypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, const aes_decrypt_ctx cx[1])
+{
+	if(!has_aes_ni())
+		return aes_xi(cbc_decrypt)(ibuf, obuf, len, iv, cx);
+	return ni_cbc_decrypt(ibuf, obuf, len, iv, cx, has_vaes());
+}
+
+AES_RETURN aes_ni(cfb_encrypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1])
+{
+	if(!has_aes_ni())
+		return aes_xi(cfb_encrypt)(ibuf, obuf, len, iv, cx);
+	return ni_cfb_encrypt(ibuf, obuf, len, iv, cx);
+}
+
+AES_RETURN aes_ni(cfb_decrypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1])
+{
+	if(!has_aes_ni())
+		return aes_xi(cfb_decrypt)(ibuf, obuf, len, iv, cx);
+	return ni_cfb_decrypt(ibuf, obuf, len, iv, cx);
+}
+
+AES_RETURN aes_ni(ofb_crypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1])
+{
+	if(!has_aes_ni())
+		return aes_xi(ofb_crypt)(ibuf, obuf, len, iv, cx);
+	return ni_ofb_crypt(ibuf, obuf, len, iv, cx);
+}
+
+AES_RETURN aes_ni(ctr_crypt)(const unsigned char *ibuf, unsigned char *obuf,
+            int len, unsigned char *cbuf, cbuf_inc ctr_inc, aes_encrypt_ctx cx[1])
+{
+	if(!has_aes_ni())
+		return aes_xi(ctr_crypt)(ibuf, obuf, len, cbuf, ctr_inc, cx);
+	return ni_ctr_crypt(ibuf, obuf, len, cbuf, ctr_inc, cx);
+}
+
+AES_RETURN aes_ni(ctr_crypt_ex)(const unsigned char *ibuf, unsigned char *obuf,
+            int len, unsigned char *cbuf, int ctr_mode, aes_encrypt_ctx cx[1])
+{
+	if(!has_aes_ni())
+		return aes_xi(ctr_crypt_ex)(ibuf, obuf, len, cbuf, ctr_mode, cx);
+	return ni_ctr_crypt_ex(ibuf, obuf, len, cbuf, ctr_mode, cx, has_vaes());
+}
+
+/* The dispatch tables for aes_backend.h. They are only listed when the CPU
+   has the instructions they need so none of their entries test for them
+*/
+
+int aes_ni_support(void)
+{
+	return has_aes_ni() ? AES_NI_128 + has_vaes() : AES_NI_NONE;
+}
+
+static AES_RETURN ni_encrypt_key(const unsigned char *key, int key_len, aes_encrypt_ctx cx[1])
+{
+	switch(key_len)
+	{
+	case 16: case 128: return aes_ni(encrypt_key128)(key, cx);
+	case 24: case 192: return aes_ni(encrypt_key192)(key, cx);
+	case 32: case 256: return aes_ni(encrypt_key256)(key, cx);
+	default: return EXIT_FAILURE;
+	}
+}
+
+static AES_RETURN ni_decrypt_key(const unsigned char *key, int key_len, aes_decrypt_ctx cx[1])
+{
+	switch(key_len)
+	{
+	case 16: case 128: return aes_ni(decrypt_key128)(key, cx);
+	case 24: case 192: return aes_ni(decrypt_key192)(key, cx);
+	case 32: case 256: return aes_ni(decrypt_key256)(key, cx);
+	default: return EXIT_FAILURE;
+	}
+}
+
+/* Key expansion for several keys at once. Each schedule is a chain of
+   steps that all depend on the one before, so NI_KEYS of them are run in
+   step to fill the latency of each other. The S-box word is taken with a
+   byte shuffle and aesenclast rather than aeskeygenassist, which is slow
+   to issue on most cores: with the word copied to all four columns the
+   ShiftRows of aesenclast has no effect and the round key adds the rcon.
+*/
+
+#define NI_KEYS 4
+
+/* a statement for each key with i constant so the arrays stay in registers */
+#define ni_keys_each(s) \
+	{ const int i = 0; s } { const int i = 1; s } { const int i = 2; s } { const int i = 3; s }
+
+#define ni_key_word(w, rot) (rot \
+	? _mm_setr_epi8(4*w+1, 4*w+2, 4*w+3, 4*w, 4*w+1, 4*w+2, 4*w+3, 4*w, \
+	                4*w+1, 4*w+2, 4*w+3, 4*w, 4*w+1, 4*w+2, 4*w+3, 4*w) \
+	: _mm_setr_epi8(4*w, 4*w+1, 4*w+2, 4*w+3, 4*w, 4*w+1, 4*w+2, 4*w+3, \
+	                4*w, 4*w+1, 4*w+2, 4*w+3, 4*w, 4*w+1, 4*w+2, 4*w+3))
+
+/* SubWord (and RotWord) of the word selected by mask in all columns ^ rcon */
+#define ni_sub_word(t, mask, rc) \
+	_mm_aesenclast_si128(_mm_shuffle_epi8(t, mask), _mm_set1_epi32(rc))
+
+/* each word xor all the words below it */
+INLINE __m128i ni_key_xor(__m128i t)
+{
+	t = _mm_xor_si128(t, _mm_slli_si128(t, 0x4));
+	return _mm_xor_si128(t, _mm_slli_si128(t, 0x8));
+}
+
+static void ni_expand_keys128(const unsigned char *const key[NI_KEYS], __m128i *const ks[NI_KEYS])
+{
+	const __m128i rot3 = ni_key_word(3, 1);
+	__m128i t1[NI_KEYS], t2[NI_KEYS];
+
+	ni_keys_each( ks[i][0] = t1[i] = _mm_loadu_si128((const __m128i*)key[i]); )
+
+#define ni_step(j, rc) \
+	ni_keys_each( t2[i] = ni_sub_word(t1[i], rot3, rc); ) \
+	ni_keys_each( ks[i][j] = t1[i] = _mm_xor_si128(ni_key_xor(t1[i]), t2[i]); )
+
+	ni_step( 1, 0x01) ni_step( 2, 0x02) ni_step( 3, 0x04) ni_step( 4, 0x08)
+	ni_step( 5, 0x10) ni_step( 6, 0x20) ni_step( 7, 0x40) ni_step( 8, 0x80)
+	ni_step( 9, 0x1b) ni_step(10, 0x36)
+#undef ni_step
+}
+
+static void ni_expand_keys192(const unsigned char *const key[NI_KEYS], __m128i *const ks[NI_KEYS])
+{
+	const __m128i rot1 = ni_key_word(1, 1);
+	__m128i t1[NI_KEYS], t2[NI_KEYS], t3[NI_KEYS];
+
+	ni_keys_each(
+		ks[i][0] = t1[i] = _mm_loadu_si128((const __m128i*)key[i]);
+		ks[i][1] = t3[i] = _mm_loadu_si128((const __m128i*)(key[i] + 16));
+	)
+
+	/* six words per step, t3 only holds two of them */
+#define ni_step(rc) \
+	ni_keys_each( t2[i] = ni_sub_word(t3[i], rot1, rc); ) \
+	ni_keys_each( \
+		t1[i] = _mm_xor_si128(ni_key_xor(t1[i]), t2[i]); \
+		t3[i] = _mm_xor_si128(_mm_xor_si128(t3[i], _mm_slli_si128(t3[i], 0x4)), \
+		                      _mm_shuffle_epi32(t1[i], 0xff)); )
+
+	/* so the round keys straddle the steps in turn */
+#define ni_step_a(j, rc) ni_step(rc) ni_keys_each( \
+	ks[i][j] = _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(ks[i][j]), _mm_castsi128_pd(t1[i]), 0)); \
+	ks[i][j + 1] = _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(t1[i]), _mm_castsi128_pd(t3[i]), 1)); )
+#define ni_step_b(j, rc) ni_step(rc) ni_keys_each( ks[i][j] = t1[i]; ks[i][j + 1] = t3[i]; )
+
+	ni_step_a( 1, 0x01) ni_step_b( 3, 0x02)
+	ni_step_a( 4, 0x04) ni_step_b( 6, 0x08)
+	ni_step_a( 7, 0x10) ni_step_b( 9, 0x20)
+	ni_step_a(10, 0x40)
+	ni_step(0x80) ni_keys_each( ks[i][12] = t1[i]; )
+#undef ni_step_b
+#undef ni_step_a
+#undef ni_step
+}
+
+static void ni_expand_keys256(const unsigned char *const key[NI_KEYS], __m128i *const ks[NI_KEYS])
+{
+	const __m128i rot3 = ni_key_word(3, 1), sub3 = ni_key_word(3, 0);
+	__m128i t1[NI_KEYS], t2[NI_KEYS], t3[NI_KEYS];
+
+	ni_keys_each(
+		ks[i][0] = t1[i] = _mm_loadu_si128((const __m128i*)key[i]);
+		ks[i][1] = t3[i] = _mm_loadu_si128((const __m128i*)(key[i] + 16));
+	)
+
+#define ni_step(j, rc) \
+	ni_keys_each( t2[i] = ni_sub_word(t3[i], rot3, rc); ) \
+	ni_keys_each( ks[i][j] = t1[i] = _mm_xor_si128(ni_key_xor(t1[i]), t2[i]); ) \
+	if(j < 14) \
+	{ \
+		ni_keys_each( t2[i] = ni_sub_word(t1[i], sub3, 0); ) \
+		ni_keys_each( ks[i][j + 1] = t3[i] = _mm_xor_si128(ni_key_xor(t3[i]), t2[i]); ) \
+	}
+
+	ni_step( 2, 0x01) ni_step( 4, 0x02) ni_step( 6, 0x04) ni_step( 8, 0x08)
+	ni_step(10, 0x10) ni_step(12, 0x20) ni_step(14, 0x40)
+#undef ni_step
+}
+
+static AES_RETURN ni_encrypt_keys(const unsigned char *const key[], int key_len,
+                    aes_encrypt_ctx *const cx[], int n)
+{
+	const unsigned char *k[NI_KEYS];
+	__m128i *ks[NI_KEYS];
+	aes_encrypt_ctx pad[1];
+	int i, j, rounds;
+
+	switch(key_len)
+	{
+	case 16: case 128: rounds = 10; break;
+	case 24: case 192: rounds = 12; break;
+	case 32: case 256: rounds = 14; break;
+	default: return EXIT_FAILURE;
+	}
+
+	for(i = 0; i < n; i += NI_KEYS)
+	{
+		/* a short group is filled up with its first key into pad */
+		for(j = 0; j < NI_KEYS; ++j)
+		{
+			k[j]  = key[i + j < n ? i + j : i];
+			ks[j] = (__m128i*)(i + j < n ? cx[i + j] : pad)->ks;
+		}
+
+		switch(rounds)
+		{
+		case 10: ni_expand_keys128(k, ks); break;
+		case 12: ni_expand_keys192(k, ks); break;
+		case 14: ni_expand_keys256(k, ks); break;
+		}
+
+		for(j = i; j < n && j < i + NI_KEYS; ++j)
+		{
+			cx[j]->inf.l = 0;
+			cx[j]->inf.b[0] = rounds * 16;
+		}
+	}
+
+	if(n % NI_KEYS)
+		memset(pad, 0, sizeof(pad));
+	return EXIT_SUCCESS;
+}
+
+static AES_RETURN ni_encrypt(const unsigned char *in, unsigned char *out, const aes_encrypt_ctx cx[1])
+{
+	ni_select(cx, encrypt, (in, out, cx))
+}
+
+static AES_RETURN ni_decrypt(const unsigned char *in, unsigned char *out, const aes_decrypt_ctx cx[1])
+{
+	ni_select(cx, decrypt, (in, out, cx))
+}
+
+/* the engines differ only in the VAES width used by the bulk modes; each
+   has a table for any key size and one for each number of rounds, see
+   aes_backend_kernel()
+*/
+
+#define ni_backend_kernel(name, vaes, R) \
+static AES_RETURN name##R##_ecb_encrypt(const unsigned char *ibuf, unsigned char *obuf, \
+                    int len, const aes_encrypt_ctx cx[1]) \
+{ return ni##R##_ecb_encrypt(ibuf, obuf, len, cx, vaes); } \
+static AES_RETURN name##R##_ecb_decrypt(const unsigned char *ibuf, unsigned char *obuf, \
+                    int len, const aes_decrypt_ctx cx[1]) \
+{ return ni##R##_ecb_decrypt(ibuf, obuf, len, cx, vaes); } \
+static AES_RETURN name##R##_cbc_decrypt(const unsigned char *ibuf, unsigned char *obuf, \
+                    int len, unsigned char *iv, const aes_decrypt_ctx cx[1]) \
+{ return ni##R##_cbc_decrypt(ibuf, obuf, len, iv, cx, vaes); } \
+static AES_RETURN name##R##_ctr_crypt_ex(const unsigned char *ibuf, unsigned char *obuf, \
+            int len, unsigned char *cbuf, int ctr_mode, aes_encrypt_ctx cx[1]) \
+{ return ni##R##_ctr_crypt_ex(ibuf, obuf, len, cbuf, ctr_mode, cx, vaes); } \
+static const aes_backend name##R##_kernel = \
+{ \
+	#name, \
+	ni_encrypt_key,        ni_decrypt_key, \
+	ni_encrypt_keys, \
+	ni##R##_encrypt,       ni##R##_decrypt, \
+	name##R##_ecb_encrypt, name##R##_ecb_decrypt, \
+	ni##R##_cbc_encrypt,   name##R##_cbc_decrypt, \
+	ni##R##_cfb_encrypt,   ni##R##_cfb_decrypt, \
+	ni##R##_ofb_crypt, \
+	ni##R##_ctr_crypt,     name##R##_ctr_crypt_ex, \
+	NULL \
+};
+
+#define ni_backend(name, vaes) \
+ni_backend_kernel(name, vaes, 10) \
+ni_backend_kernel(name, vaes, 12) \
+ni_backend_kernel(name, vaes, 14) \
+static const aes_backend *const name##_kernels[3] = \
+	{ &name##10_kernel, &name##12_kernel, &name##14_kernel }; \
+static AES_RETURN name##_ecb_encrypt(const unsigned char *ibuf, unsigned char *obuf, \
+                    int len, const aes_encrypt_ctx cx[1]) \
+{ return ni_ecb_encrypt(ibuf, obuf, len, cx, vaes); } \
+static AES_RETURN name##_ecb_decrypt(const unsigned char *ibuf, unsigned char *obuf, \
+                    int len, const aes_decrypt_ctx cx[1]) \
+{ return ni_ecb_decrypt(ibuf, obuf, len, cx, vaes); } \
+static AES_RETURN name##_cbc_decrypt(const unsigned char *ibuf, unsigned char *obuf, \
+                    int len, unsigned char *iv, const aes_decrypt_ctx cx[1]) \
+{ return ni_cbc_decrypt(ibuf, obuf, len, iv, cx, vaes); } \
+static AES_RETURN name##_ctr_crypt_ex(const unsigned char *ibuf, unsigned char *obuf, \
+            int len, unsigned char *cbuf, int ctr_mode, aes_encrypt_ctx cx[1]) \
+{ return ni_ctr_crypt_ex(ibuf, obuf, len, cbuf, ctr_mode, cx, vaes); } \
+const aes_backend aes_backend_##name = \
+{ \
+	#name, \
+	ni_encrypt_key,        ni_decrypt_key, \
+	ni_encrypt_keys, \
+	ni_encrypt,            ni_decrypt, \
+	name##_ecb_encrypt,    name##_ecb_decrypt, \
+	ni_cbc_encrypt,        name##_cbc_decrypt, \
+	ni_cfb_encrypt,        ni_cfb_decrypt, \
+	ni_ofb_crypt, \
+	ni_ctr_crypt,          name##_ctr_crypt_ex, \
+	name##_kernels \
+}
+
+ni_backend(aesni,   AES_VAES_NONE);
+ni_backend(vaes256, AES_VAES_256);
+ni_backend(vaes512, AES_VAES_512);
+
+
+#endif
+
 #ifdef ADD_AESNI_MODE_CALLS
 #ifdef USE_AES_CONTEXT
 
@@ -54,6 +54,102 @@ AES_RETURN aes_xi(decrypt_key256)(const unsigned char *key, aes_decrypt_ctx cx[1
 AES_RETURN aes_xi(encrypt)(const unsigned char *in, unsigned char *out, const aes_encrypt_ctx cx[1]);
 AES_RETURN aes_xi(decrypt)(const unsigned char *in, unsigned char *out, const aes_decrypt_ctx cx[1]);
 
+#if defined( AES_MODES )
+
+AES_RETURN aes_ni(ecb_encrypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, const aes_encrypt_ctx cx[1]);
+
+AES_RETURN aes_ni(ecb_decrypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, const aes_decrypt_ctx cx[1]);
+
+AES_RETURN aes_xi(ecb_encrypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, const aes_encrypt_ctx cx[1]);
+
+AES_RETURN aes_xi(ecb_decrypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, const aes_decrypt_ctx cx[1]);
+
+AES_RETURN aes_ni(cbc_encrypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, const aes_encrypt_ctx cx[1]);
+
+AES_RETURN aes_xi(cbc_encrypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, const aes_encrypt_ctx cx[1]);
+
+AES_RETURN aes_ni(cbc_decrypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, const aes_decrypt_ctx cx[1]);
+
+AES_RETURN aes_xi(cbc_decrypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, const aes_decrypt_ctx cx[1]);
+
+AES_RETURN aes_ni(cfb_encrypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1]);
+
+AES_RETURN aes_xi(cfb_encrypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1]);
+
+AES_RETURN aes_ni(cfb_decrypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1]);
+
+AES_RETURN aes_xi(cfb_decrypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1]);
+
+AES_RETURN aes_ni(ofb_crypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1]);
+
+AES_RETURN aes_xi(ofb_crypt)(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1]);
+
+AES_RETURN aes_ni(ctr_crypt)(const unsigned char *ibuf, unsigned char *obuf,
+            int len, unsigned char *cbuf, cbuf_inc ctr_inc, aes_encrypt_ctx cx[1]);
+
+AES_RETURN aes_xi(ctr_crypt)(const unsigned char *ibuf, unsigned char *obuf,
+            int len, unsigned char *cbuf, cbuf_inc ctr_inc, aes_encrypt_ctx cx[1]);
+
+AES_RETURN aes_ni(ctr_crypt_ex)(const unsigned char *ibuf, unsigned char *obuf,
+            int len, unsigned char *cbuf, int ctr_mode, aes_encrypt_ctx cx[1]);
+
+AES_RETURN aes_xi(ctr_crypt_ex)(const unsigned char *ibuf, unsigned char *obuf,
+            int len, unsigned char *cbuf, int ctr_mode, aes_encrypt_ctx cx[1]);
+
+/* the dispatch tables for the AES-NI engines in aes_ni.c, see aes_backend.h */
+/* aes_ni_support() returns AES_NI_NONE when none of them can be used, else */
+/* AES_NI_128 plus one of the AES_VAES_* values below                       */
+
+#define AES_NI_NONE     0
+#define AES_NI_128      1
+
+int aes_ni_support(void);
+
+extern const struct aes_backend aes_backend_aesni;
+extern const struct aes_backend aes_backend_vaes256;
+extern const struct aes_backend aes_backend_vaes512;
+
+/* the VAES kernels in aes_vaes.c take a count of blocks and return the */
+/* number of blocks they have processed, the AES-NI code does the rest  */
+
+#define AES_VAES_NONE   0
+#define AES_VAES_256    1
+#define AES_VAES_512    2
+
+int aes_vaes256_ecb_encrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int nb, const aes_encrypt_ctx cx[1]);
+int aes_vaes256_ecb_decrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int nb, const aes_decrypt_ctx cx[1]);
+int aes_vaes256_cbc_decrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int nb, unsigned char *iv, const aes_decrypt_ctx cx[1]);
+int aes_vaes256_ctr_crypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int nb, uint64_t c[2], int be, int up, const aes_encrypt_ctx cx[1]);
+
+int aes_vaes512_ecb_encrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int nb, const aes_encrypt_ctx cx[1]);
+int aes_vaes512_ecb_decrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int nb, const aes_decrypt_ctx cx[1]);
+int aes_vaes512_cbc_decrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int nb, unsigned char *iv, const aes_decrypt_ctx cx[1]);
+int aes_vaes512_ctr_crypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int nb, uint64_t c[2], int be, int up, const aes_encrypt_ctx cx[1]);
+
+#endif
+
 #endif
 
 #endif
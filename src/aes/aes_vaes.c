@@ -0,0 +1,406 @@
+/*
+ Wide VAES kernels for the bulk part of the ECB, CBC decrypt and CTR mode
+ calls in aes_ni.c. The 256-bit kernels (AVX2 + VAES) work on 2 blocks per
+ instruction and the 512-bit kernels (AVX-512 + VAES) on 4. Each kernel
+ keeps VAES_VECS vectors in flight, handles only whole groups of blocks
+ and returns the number of blocks it processed; the caller finishes the
+ rest with the 128-bit AES-NI code. They must only be called when
+ has_vaes() in aes_ni.c reports the matching width.
+*/
+
+#include "aes_ni.h"
+
+#if defined( USE_INTEL_AES_IF_PRESENT ) && defined( AES_MODES )
+
+#if defined(_MSC_VER)
+
+#include <intrin.h>
+#define INLINE  __inline
+#define VAES_256
+#define VAES_512
+#define VAES_END
+
+#elif defined( __GNUC__ )
+
+#include <x86intrin.h>
+#define INLINE  static __inline
+
+/* only the kernels themselves may use the wider instruction sets, the
+   rest of the library has to keep running on plain AES-NI machines */
+#define VAES_256 _Pragma("GCC push_options") \
+                 _Pragma("GCC target (\"avx2,vaes\")")
+#define VAES_512 _Pragma("GCC push_options") \
+                 _Pragma("GCC target (\"avx2,vaes,avx512f,avx512bw\")")
+#define VAES_END _Pragma("GCC pop_options")
+
+#else
+#error AES New Instructions require Microsoft, Intel, GNU C, or CLANG
+#endif
+
+#define VAES_VECS   8
+
+#define vec_op(op, b, k) \
+    b[0] = op(b[0], k); b[1] = op(b[1], k); b[2] = op(b[2], k); b[3] = op(b[3], k); \
+    b[4] = op(b[4], k); b[5] = op(b[5], k); b[6] = op(b[6], k); b[7] = op(b[7], k)
+
+VAES_256
+
+#define V256_BLOCKS (2 * VAES_VECS)
+
+INLINE __m256i v256_key(const unsigned char *ks, int j)
+{
+	return _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)ks + j));
+}
+
+INLINE void v256_enc(__m256i b[VAES_VECS], const unsigned char *ks, int rounds)
+{
+	__m256i k = v256_key(ks, 0);
+	int j;
+
+	vec_op(_mm256_xor_si256, b, k);
+	for(j = 1; j < rounds; ++j)
+	{
+		k = v256_key(ks, j);
+		vec_op(_mm256_aesenc_epi128, b, k);
+	}
+	k = v256_key(ks, rounds);
+	vec_op(_mm256_aesenclast_epi128, b, k);
+}
+
+INLINE void v256_dec(__m256i b[VAES_VECS], const unsigned char *ks, int rounds)
+{
+	__m256i k = v256_key(ks, rounds);
+	int j;
+
+	vec_op(_mm256_xor_si256, b, k);
+	for(j = rounds - 1; j > 0; --j)
+	{
+		k = v256_key(ks, j);
+		vec_op(_mm256_aesdec_epi128, b, k);
+	}
+	k = v256_key(ks, 0);
+	vec_op(_mm256_aesdeclast_epi128, b, k);
+}
+
+INLINE void v256_load(__m256i b[VAES_VECS], const unsigned char *ibuf)
+{
+	int i;
+
+	for(i = 0; i < VAES_VECS; ++i)
+		b[i] = _mm256_loadu_si256((const __m256i*)ibuf + i);
+}
+
+INLINE void v256_store(unsigned char *obuf, const __m256i b[VAES_VECS])
+{
+	int i;
+
+	for(i = 0; i < VAES_VECS; ++i)
+		_mm256_storeu_si256((__m256i*)obuf + i, b[i]);
+}
+
+int aes_vaes256_ecb_encrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int nb, const aes_encrypt_ctx cx[1])
+{
+	const unsigned char *ks = (const unsigned char*)cx->ks;
+	int rounds = cx->inf.b[0] >> 4, done;
+	__m256i b[VAES_VECS];
+
+	for(done = 0; nb - done >= V256_BLOCKS; done += V256_BLOCKS)
+	{
+		v256_load(b, ibuf);
+		v256_enc(b, ks, rounds);
+		v256_store(obuf, b);
+		ibuf += V256_BLOCKS * AES_BLOCK_SIZE;
+		obuf += V256_BLOCKS * AES_BLOCK_SIZE;
+	}
+
+	return done;
+}
+
+int aes_vaes256_ecb_decrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int nb, const aes_decrypt_ctx cx[1])
+{
+	const unsigned char *ks = (const unsigned char*)cx->ks;
+	int rounds = cx->inf.b[0] >> 4, done;
+	__m256i b[VAES_VECS];
+
+	for(done = 0; nb - done >= V256_BLOCKS; done += V256_BLOCKS)
+	{
+		v256_load(b, ibuf);
+		v256_dec(b, ks, rounds);
+		v256_store(obuf, b);
+		ibuf += V256_BLOCKS * AES_BLOCK_SIZE;
+		obuf += V256_BLOCKS * AES_BLOCK_SIZE;
+	}
+
+	return done;
+}
+
+/* the vector of previous ciphertexts for c[i] is the high lane of c[i-1]
+   followed by the low lane of c[i]; fb carries the last ciphertext block
+   of the previous group (or the iv) in its high lane */
+
+int aes_vaes256_cbc_decrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int nb, unsigned char *iv, const aes_decrypt_ctx cx[1])
+{
+	const unsigned char *ks = (const unsigned char*)cx->ks;
+	int rounds = cx->inf.b[0] >> 4, done, i;
+	__m256i b[VAES_VECS], c[VAES_VECS], fb;
+
+	if(nb < V256_BLOCKS)
+		return 0;
+
+	fb = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)iv));
+	for(done = 0; nb - done >= V256_BLOCKS; done += V256_BLOCKS)
+	{
+		v256_load(c, ibuf);
+		for(i = 0; i < VAES_VECS; ++i)
+			b[i] = c[i];
+
+		v256_dec(b, ks, rounds);
+
+		b[0] = _mm256_xor_si256(b[0], _mm256_permute2x128_si256(fb, c[0], 0x21));
+		for(i = 1; i < VAES_VECS; ++i)
+			b[i] = _mm256_xor_si256(b[i], _mm256_permute2x128_si256(c[i - 1], c[i], 0x21));
+		fb = c[VAES_VECS - 1];
+
+		v256_store(obuf, b);
+		ibuf += V256_BLOCKS * AES_BLOCK_SIZE;
+		obuf += V256_BLOCKS * AES_BLOCK_SIZE;
+	}
+
+	_mm_storeu_si128((__m128i*)iv, _mm256_extracti128_si256(fb, 1));
+	return done;
+}
+
+/* c[] is the native counter kept by aes_ni(ctr_crypt_ex); a group is only
+   generated with SIMD adds when its low half can not carry or borrow, the
+   counter after the group may still carry into the high half */
+
+int aes_vaes256_ctr_crypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int nb, uint64_t c[2], int be, int up, const aes_encrypt_ctx cx[1])
+{
+	const unsigned char *ks = (const unsigned char*)cx->ks;
+	int rounds = cx->inf.b[0] >> 4, done, i;
+	__m256i bswap, step[VAES_VECS], b[VAES_VECS], t;
+
+	bswap = be ? _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+	                              15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+	           : _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+	                              0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	for(i = 0; i < VAES_VECS; ++i)
+		step[i] = up ? _mm256_set_epi64x(0, 2 * i + 1, 0, 2 * i)
+		             : _mm256_set_epi64x(0, -(2 * i + 1), 0, -(2 * i));
+
+	for(done = 0; nb - done >= V256_BLOCKS; done += V256_BLOCKS)
+	{
+		if(up ? c[0] > ~(uint64_t)0 - (V256_BLOCKS - 1) : c[0] < V256_BLOCKS - 1)
+			break;
+
+		t = _mm256_set_epi64x((long long)c[1], (long long)c[0], (long long)c[1], (long long)c[0]);
+		for(i = 0; i < VAES_VECS; ++i)
+			b[i] = _mm256_shuffle_epi8(_mm256_add_epi64(t, step[i]), bswap);
+		if(up)
+		{
+			c[0] += V256_BLOCKS;
+			c[1] += (c[0] < V256_BLOCKS);
+		}
+		else
+		{
+			c[1] -= (c[0] < V256_BLOCKS);
+			c[0] -= V256_BLOCKS;
+		}
+
+		v256_enc(b, ks, rounds);
+
+		for(i = 0; i < VAES_VECS; ++i)
+			_mm256_storeu_si256((__m256i*)obuf + i,
+				_mm256_xor_si256(b[i], _mm256_loadu_si256((const __m256i*)ibuf + i)));
+
+		ibuf += V256_BLOCKS * AES_BLOCK_SIZE;
+		obuf += V256_BLOCKS * AES_BLOCK_SIZE;
+	}
+
+	return done;
+}
+
+VAES_END
+
+VAES_512
+
+#define V512_BLOCKS (4 * VAES_VECS)
+
+INLINE __m512i v512_key(const unsigned char *ks, int j)
+{
+	return _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i*)ks + j));
+}
+
+INLINE void v512_enc(__m512i b[VAES_VECS], const unsigned char *ks, int rounds)
+{
+	__m512i k = v512_key(ks, 0);
+	int j;
+
+	vec_op(_mm512_xor_si512, b, k);
+	for(j = 1; j < rounds; ++j)
+	{
+		k = v512_key(ks, j);
+		vec_op(_mm512_aesenc_epi128, b, k);
+	}
+	k = v512_key(ks, rounds);
+	vec_op(_mm512_aesenclast_epi128, b, k);
+}
+
+INLINE void v512_dec(__m512i b[VAES_VECS], const unsigned char *ks, int rounds)
+{
+	__m512i k = v512_key(ks, rounds);
+	int j;
+
+	vec_op(_mm512_xor_si512, b, k);
+	for(j = rounds - 1; j > 0; --j)
+	{
+		k = v512_key(ks, j);
+		vec_op(_mm512_aesdec_epi128, b, k);
+	}
+	k = v512_key(ks, 0);
+	vec_op(_mm512_aesdeclast_epi128, b, k);
+}
+
+INLINE void v512_load(__m512i b[VAES_VECS], const unsigned char *ibuf)
+{
+	int i;
+
+	for(i = 0; i < VAES_VECS; ++i)
+		b[i] = _mm512_loadu_si512((const __m512i*)ibuf + i);
+}
+
+INLINE void v512_store(unsigned char *obuf, const __m512i b[VAES_VECS])
+{
+	int i;
+
+	for(i = 0; i < VAES_VECS; ++i)
+		_mm512_storeu_si512((__m512i*)obuf + i, b[i]);
+}
+
+int aes_vaes512_ecb_encrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int nb, const aes_encrypt_ctx cx[1])
+{
+	const unsigned char *ks = (const unsigned char*)cx->ks;
+	int rounds = cx->inf.b[0] >> 4, done;
+	__m512i b[VAES_VECS];
+
+	for(done = 0; nb - done >= V512_BLOCKS; done += V512_BLOCKS)
+	{
+		v512_load(b, ibuf);
+		v512_enc(b, ks, rounds);
+		v512_store(obuf, b);
+		ibuf += V512_BLOCKS * AES_BLOCK_SIZE;
+		obuf += V512_BLOCKS * AES_BLOCK_SIZE;
+	}
+
+	return done;
+}
+
+int aes_vaes512_ecb_decrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int nb, const aes_decrypt_ctx cx[1])
+{
+	const unsigned char *ks = (const unsigned char*)cx->ks;
+	int rounds = cx->inf.b[0] >> 4, done;
+	__m512i b[VAES_VECS];
+
+	for(done = 0; nb - done >= V512_BLOCKS; done += V512_BLOCKS)
+	{
+		v512_load(b, ibuf);
+		v512_dec(b, ks, rounds);
+		v512_store(obuf, b);
+		ibuf += V512_BLOCKS * AES_BLOCK_SIZE;
+		obuf += V512_BLOCKS * AES_BLOCK_SIZE;
+	}
+
+	return done;
+}
+
+/* as for the 256-bit version but the previous ciphertexts are the top
+   lane of c[i-1] followed by the three low lanes of c[i] */
+
+int aes_vaes512_cbc_decrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int nb, unsigned char *iv, const aes_decrypt_ctx cx[1])
+{
+	const unsigned char *ks = (const unsigned char*)cx->ks;
+	int rounds = cx->inf.b[0] >> 4, done, i;
+	__m512i b[VAES_VECS], c[VAES_VECS], fb;
+
+	if(nb < V512_BLOCKS)
+		return 0;
+
+	fb = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i*)iv));
+	for(done = 0; nb - done >= V512_BLOCKS; done += V512_BLOCKS)
+	{
+		v512_load(c, ibuf);
+		for(i = 0; i < VAES_VECS; ++i)
+			b[i] = c[i];
+
+		v512_dec(b, ks, rounds);
+
+		b[0] = _mm512_xor_si512(b[0], _mm512_alignr_epi64(c[0], fb, 6));
+		for(i = 1; i < VAES_VECS; ++i)
+			b[i] = _mm512_xor_si512(b[i], _mm512_alignr_epi64(c[i], c[i - 1], 6));
+		fb = c[VAES_VECS - 1];
+
+		v512_store(obuf, b);
+		ibuf += V512_BLOCKS * AES_BLOCK_SIZE;
+		obuf += V512_BLOCKS * AES_BLOCK_SIZE;
+	}
+
+	_mm_storeu_si128((__m128i*)iv, _mm512_extracti32x4_epi32(fb, 3));
+	return done;
+}
+
+int aes_vaes512_ctr_crypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int nb, uint64_t c[2], int be, int up, const aes_encrypt_ctx cx[1])
+{
+	const unsigned char *ks = (const unsigned char*)cx->ks;
+	int rounds = cx->inf.b[0] >> 4, done, i;
+	__m512i bswap, step[VAES_VECS], b[VAES_VECS], t;
+
+	bswap = _mm512_broadcast_i32x4(be
+		? _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+		: _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+	for(i = 0; i < VAES_VECS; ++i)
+		step[i] = up ? _mm512_set_epi64(0, 4 * i + 3, 0, 4 * i + 2, 0, 4 * i + 1, 0, 4 * i)
+		             : _mm512_set_epi64(0, -(4 * i + 3), 0, -(4 * i + 2), 0, -(4 * i + 1), 0, -(4 * i));
+
+	for(done = 0; nb - done >= V512_BLOCKS; done += V512_BLOCKS)
+	{
+		if(up ? c[0] > ~(uint64_t)0 - (V512_BLOCKS - 1) : c[0] < V512_BLOCKS - 1)
+			break;
+
+		t = _mm512_broadcast_i32x4(_mm_set_epi64x((long long)c[1], (long long)c[0]));
+		for(i = 0; i < VAES_VECS; ++i)
+			b[i] = _mm512_shuffle_epi8(_mm512_add_epi64(t, step[i]), bswap);
+		if(up)
+		{
+			c[0] += V512_BLOCKS;
+			c[1] += (c[0] < V512_BLOCKS);
+		}
+		else
+		{
+			c[1] -= (c[0] < V512_BLOCKS);
+			c[0] -= V512_BLOCKS;
+		}
+
+		v512_enc(b, ks, rounds);
+
+		for(i = 0; i < VAES_VECS; ++i)
+			_mm512_storeu_si512((__m512i*)obuf + i,
+				_mm512_xor_si512(b[i], _mm512_loadu_si512((const __m512i*)ibuf + i)));
+
+		ibuf += V512_BLOCKS * AES_BLOCK_SIZE;
+		obuf += V512_BLOCKS * AES_BLOCK_SIZE;
+	}
+
+	return done;
+}
+
+VAES_END
+
+#endif
@@ -0,0 +1,667 @@
+/*
+ Constant time AES engine for x86 machines with SSSE3 but without AES-NI.
+
+ This is the vector permute technique of M. Hamburg, "Accelerating AES
+ with Vector Permute Instructions" (CHES 2009): pshufb is used as a 16
+ entry table lookup indexed by the nibbles of every byte, so SubBytes is
+ done with a handful of shuffles and no memory access depends on the key
+ or the data. Each byte is mapped into GF(16)[t]/(t^2 + 2t + 2) by two
+ nibble lookups, inverted there with five more and mapped back, with the
+ affine part of the S-box (and for encryption the doubling needed by
+ MixColumns) folded into the output tables. The 0x63 of the S-box affine
+ map is added to the round keys instead.
+
+ Unlike the bitsliced engine of aes_bs.c this works on one block per
+ register, so the chained modes (CBC and CFB encryption, OFB) run at
+ nearly the speed of the parallel ones. The latter take VP_BLOCKS blocks
+ per pass to hide the latency of the shuffles. The key schedule is the
+ constant time one of aes_bs.c.
+*/
+
+#include <string.h>
+#include "aes_backend.h"
+#include "aesopt.h"
+
+#if defined( INTEL_AES_POSSIBLE )
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+#if defined(_MSC_VER)
+
+#include <intrin.h>
+#pragma intrinsic(__cpuid)
+#define INLINE  static __inline
+
+INLINE int has_ssse3()
+{
+	static int test = -1;
+	if(test < 0)
+	{
+		int cpu_info[4];
+		__cpuid(cpu_info, 1);
+		test = cpu_info[2] & 0x00000200;
+	}
+	return test;
+}
+
+#elif defined( __GNUC__ )
+
+#include <cpuid.h>
+#pragma GCC target ("ssse3")
+#include <x86intrin.h>
+#define INLINE  static __inline
+
+INLINE int has_ssse3()
+{
+	static int test = -1;
+	if(test < 0)
+	{
+		unsigned int a, b, c, d;
+		if(!__get_cpuid(1, &a, &b, &c, &d))
+			test = 0;
+		else
+			test = (c & 0x00000200);
+	}
+	return test;
+}
+
+#else
+#error SSSE3 support requires Microsoft, Intel, GNU C, or CLANG
+#endif
+
+#define VP_BLOCKS   4
+
+/* nibble tables: the low and high nibble lookups that give the two GF(16)
+   halves (i, k) of each input byte, the S-box inversion in GF(16) (0x80
+   stands for the inverse of zero and makes pshufb return 0), and the
+   output tables mapping (io, jo) back to bytes, for encryption to S(x)
+   and 2.S(x) and for decryption to InvS(x) and 4.InvS(x)              */
+
+static const unsigned char vp_enc_in[4][16] =
+{
+	{0x00, 0x00, 0x01, 0x01, 0x02, 0x02, 0x03, 0x03, 0x02, 0x02, 0x03, 0x03, 0x00, 0x00, 0x01, 0x01},
+	{0x00, 0x08, 0x0f, 0x07, 0x08, 0x00, 0x07, 0x0f, 0x07, 0x0f, 0x08, 0x00, 0x0f, 0x07, 0x00, 0x08},
+	{0x00, 0x01, 0x0c, 0x0d, 0x0d, 0x0c, 0x01, 0x00, 0x07, 0x06, 0x0b, 0x0a, 0x0a, 0x0b, 0x06, 0x07},
+	{0x00, 0x06, 0x0d, 0x0b, 0x0e, 0x08, 0x03, 0x05, 0x07, 0x01, 0x0a, 0x0c, 0x09, 0x0f, 0x04, 0x02}
+};
+
+static const unsigned char vp_dec_in[4][16] =
+{
+	{0x00, 0x0b, 0x0d, 0x06, 0x0d, 0x06, 0x00, 0x0b, 0x01, 0x0a, 0x0c, 0x07, 0x0c, 0x07, 0x01, 0x0a},
+	{0x00, 0x0a, 0x0a, 0x00, 0x0e, 0x04, 0x04, 0x0e, 0x0d, 0x07, 0x07, 0x0d, 0x03, 0x09, 0x09, 0x03},
+	{0x00, 0x05, 0x0c, 0x09, 0x0b, 0x0e, 0x07, 0x02, 0x04, 0x01, 0x08, 0x0d, 0x0f, 0x0a, 0x03, 0x06},
+	{0x00, 0x07, 0x08, 0x0f, 0x0d, 0x0a, 0x05, 0x02, 0x01, 0x06, 0x09, 0x0e, 0x0c, 0x0b, 0x04, 0x03}
+};
+
+static const unsigned char vp_inv[2][16] =
+{
+	{0x80, 0x01, 0x09, 0x0e, 0x0d, 0x0b, 0x07, 0x06, 0x0f, 0x02, 0x0c, 0x05, 0x0a, 0x04, 0x03, 0x08},
+	{0x80, 0x02, 0x01, 0x0f, 0x09, 0x05, 0x0e, 0x0c, 0x0d, 0x04, 0x0b, 0x0a, 0x07, 0x08, 0x06, 0x03}
+};
+
+static const unsigned char vp_enc_out[4][16] =
+{
+	{0x00, 0xcb, 0xd7, 0xb0, 0x21, 0x8d, 0x67, 0xac, 0x7b, 0x5a, 0xea, 0x3d, 0x46, 0xf6, 0x91, 0x1c},
+	{0x00, 0x9f, 0x61, 0x16, 0xc2, 0x2a, 0x77, 0xe8, 0x89, 0x4b, 0x5d, 0x3c, 0xb5, 0xa3, 0xd4, 0xfe},
+	{0x00, 0x8d, 0xb5, 0x7b, 0x42, 0x01, 0xce, 0x43, 0xf6, 0xb4, 0xcf, 0x7a, 0x8c, 0xf7, 0x39, 0x38},
+	{0x00, 0x25, 0xc2, 0x2c, 0x9f, 0x54, 0xee, 0xcb, 0x09, 0x96, 0xba, 0x78, 0x71, 0x5d, 0xb3, 0xe7}
+};
+
+static const unsigned char vp_dec_out[4][16] =
+{
+	{0x00, 0x3b, 0xe4, 0xc8, 0x03, 0x14, 0x2c, 0x17, 0xf3, 0xf0, 0x38, 0xdc, 0x2f, 0xe7, 0xcb, 0xdf},
+	{0x00, 0x24, 0x91, 0x19, 0x23, 0x8f, 0x88, 0xac, 0x3d, 0x1e, 0x07, 0x96, 0xab, 0xb2, 0x3a, 0xb5},
+	{0x00, 0xec, 0xbd, 0x0d, 0x0c, 0x50, 0xb0, 0x5c, 0xe1, 0xed, 0xe0, 0x5d, 0xbc, 0xb1, 0x01, 0x51},
+	{0x00, 0x90, 0x72, 0x64, 0x8c, 0x0a, 0x16, 0x86, 0xf4, 0x78, 0x1c, 0x6e, 0x9a, 0xfe, 0xe8, 0xe2}
+};
+
+/* byte permutations: ShiftRows, InvShiftRows and the rotation of the bytes
+   of each column by one and two places                                 */
+
+static const unsigned char vp_perm[4][16] =
+{
+	{0x00, 0x05, 0x0a, 0x0f, 0x04, 0x09, 0x0e, 0x03, 0x08, 0x0d, 0x02, 0x07, 0x0c, 0x01, 0x06, 0x0b},
+	{0x00, 0x0d, 0x0a, 0x07, 0x04, 0x01, 0x0e, 0x0b, 0x08, 0x05, 0x02, 0x0f, 0x0c, 0x09, 0x06, 0x03},
+	{0x01, 0x02, 0x03, 0x00, 0x05, 0x06, 0x07, 0x04, 0x09, 0x0a, 0x0b, 0x08, 0x0d, 0x0e, 0x0f, 0x0c},
+	{0x02, 0x03, 0x00, 0x01, 0x06, 0x07, 0x04, 0x05, 0x0a, 0x0b, 0x08, 0x09, 0x0e, 0x0f, 0x0c, 0x0d}
+};
+
+/* the tables for one direction and the round keys, loaded once per call */
+
+typedef struct
+{
+	__m128i m0f, il, ih, kl, kh, inv, ainv, ou, ot, o2u, o2t, sr, r1, r2;
+	__m128i k[15];
+	int rounds;
+} vp_state;
+
+#define vp_ld(p)        _mm_loadu_si128((const __m128i*)(p))
+#define vp_st(p, x)     _mm_storeu_si128((__m128i*)(p), x)
+#define vp_lookup(t, x) _mm_shuffle_epi8(t, x)
+
+static int vp_init(vp_state *s, const uint32_t *ks, int rounds, int enc)
+{
+	const unsigned char (*in)[16] = enc ? vp_enc_in : vp_dec_in;
+	const unsigned char (*out)[16] = enc ? vp_enc_out : vp_dec_out;
+	__m128i c63 = _mm_set1_epi8(0x63);
+	int i;
+
+	if(rounds != 10 && rounds != 12 && rounds != 14)
+		return 0;
+
+	s->m0f = _mm_set1_epi8(0x0f);
+	s->il = vp_ld(in[0]);   s->ih = vp_ld(in[1]);
+	s->kl = vp_ld(in[2]);   s->kh = vp_ld(in[3]);
+	s->inv = vp_ld(vp_inv[0]); s->ainv = vp_ld(vp_inv[1]);
+	s->ou = vp_ld(out[0]);  s->ot = vp_ld(out[1]);
+	s->o2u = vp_ld(out[2]); s->o2t = vp_ld(out[3]);
+	s->sr = vp_ld(vp_perm[enc ? 0 : 1]);
+	s->r1 = vp_ld(vp_perm[2]);
+	s->r2 = vp_ld(vp_perm[3]);
+
+	s->k[0] = vp_ld(ks);
+	for(i = 1; i <= rounds; ++i)
+		s->k[i] = _mm_xor_si128(vp_ld(ks + 4 * i), c63);
+	s->rounds = rounds;
+	return rounds;
+}
+
+static void vp_wipe(vp_state *s)
+{
+	volatile unsigned char *p = (volatile unsigned char*)s->k;
+	size_t n = sizeof(s->k);
+
+	while(n--)
+		*p++ = 0;
+}
+
+/* (Inv)SubBytes of the shifted state x without the 0x63 constant, also
+   returns the second output table (2.S(x) or 4.InvS(x)) in x2          */
+
+INLINE __m128i vp_sub(const vp_state *s, __m128i x, __m128i *x2)
+{
+	__m128i xl = _mm_and_si128(x, s->m0f);
+	__m128i xh = _mm_and_si128(_mm_srli_epi16(x, 4), s->m0f);
+	__m128i i  = _mm_xor_si128(vp_lookup(s->il, xl), vp_lookup(s->ih, xh));
+	__m128i k  = _mm_xor_si128(vp_lookup(s->kl, xl), vp_lookup(s->kh, xh));
+	__m128i ak = vp_lookup(s->ainv, k);
+	__m128i j  = _mm_xor_si128(i, k);
+	__m128i io = _mm_xor_si128(vp_lookup(s->inv, _mm_xor_si128(vp_lookup(s->inv, i), ak)), j);
+	__m128i jo = _mm_xor_si128(vp_lookup(s->inv, _mm_xor_si128(vp_lookup(s->inv, j), ak)), i);
+
+	*x2 = _mm_xor_si128(vp_lookup(s->o2u, io), vp_lookup(s->o2t, jo));
+	return _mm_xor_si128(vp_lookup(s->ou, io), vp_lookup(s->ot, jo));
+}
+
+/* MixColumns of a state given as x and 2.x */
+
+INLINE __m128i vp_mix(const vp_state *s, __m128i x, __m128i x2)
+{
+	__m128i t = _mm_xor_si128(x2, vp_lookup(_mm_xor_si128(x2, x), s->r1));
+	return _mm_xor_si128(t, vp_lookup(_mm_xor_si128(x, vp_lookup(x, s->r1)), s->r2));
+}
+
+INLINE __m128i vp_enc_round(const vp_state *s, __m128i x, int r)
+{
+	__m128i x2;
+
+	x = vp_sub(s, vp_lookup(x, s->sr), &x2);
+	return _mm_xor_si128(vp_mix(s, x, x2), s->k[r]);
+}
+
+INLINE __m128i vp_enc_last(const vp_state *s, __m128i x)
+{
+	__m128i x2;
+
+	return _mm_xor_si128(vp_sub(s, vp_lookup(x, s->sr), &x2), s->k[s->rounds]);
+}
+
+/* InvMixColumns is MixColumns after x[r] ^= 4.(x[r] ^ x[r + 2]) */
+
+INLINE __m128i vp_dec_round(const vp_state *s, __m128i x, int r)
+{
+	__m128i x4, x2;
+
+	x = vp_sub(s, vp_lookup(x, s->sr), &x4);
+	x = _mm_xor_si128(x, _mm_xor_si128(x4, vp_lookup(x4, s->r2)));
+	x2 = _mm_xor_si128(_mm_add_epi8(x, x),
+			_mm_and_si128(_mm_cmpgt_epi8(_mm_setzero_si128(), x), _mm_set1_epi8(0x1b)));
+	return _mm_xor_si128(vp_mix(s, x, x2), s->k[r]);
+}
+
+INLINE __m128i vp_dec_last(const vp_state *s, __m128i x)
+{
+	__m128i x4;
+
+	return _mm_xor_si128(vp_sub(s, vp_lookup(x, s->sr), &x4), s->k[0]);
+}
+
+static __m128i vp_encrypt(const vp_state *s, __m128i x)
+{
+	int r;
+
+	x = _mm_xor_si128(x, s->k[0]);
+	for(r = 1; r < s->rounds; ++r)
+		x = vp_enc_round(s, x, r);
+	return vp_enc_last(s, x);
+}
+
+static __m128i vp_decrypt(const vp_state *s, __m128i x)
+{
+	int r;
+
+	x = _mm_xor_si128(x, s->k[s->rounds]);
+	for(r = s->rounds - 1; r > 0; --r)
+		x = vp_dec_round(s, x, r);
+	return vp_dec_last(s, x);
+}
+
+/* VP_BLOCKS blocks in step so that their shuffles can overlap */
+
+static void vp_encrypt4(const vp_state *s, __m128i b[VP_BLOCKS])
+{
+	int r;
+
+	b[0] = _mm_xor_si128(b[0], s->k[0]); b[1] = _mm_xor_si128(b[1], s->k[0]);
+	b[2] = _mm_xor_si128(b[2], s->k[0]); b[3] = _mm_xor_si128(b[3], s->k[0]);
+	for(r = 1; r < s->rounds; ++r)
+	{
+		b[0] = vp_enc_round(s, b[0], r); b[1] = vp_enc_round(s, b[1], r);
+		b[2] = vp_enc_round(s, b[2], r); b[3] = vp_enc_round(s, b[3], r);
+	}
+	b[0] = vp_enc_last(s, b[0]); b[1] = vp_enc_last(s, b[1]);
+	b[2] = vp_enc_last(s, b[2]); b[3] = vp_enc_last(s, b[3]);
+}
+
+static void vp_decrypt4(const vp_state *s, __m128i b[VP_BLOCKS])
+{
+	int r;
+
+	b[0] = _mm_xor_si128(b[0], s->k[s->rounds]); b[1] = _mm_xor_si128(b[1], s->k[s->rounds]);
+	b[2] = _mm_xor_si128(b[2], s->k[s->rounds]); b[3] = _mm_xor_si128(b[3], s->k[s->rounds]);
+	for(r = s->rounds - 1; r > 0; --r)
+	{
+		b[0] = vp_dec_round(s, b[0], r); b[1] = vp_dec_round(s, b[1], r);
+		b[2] = vp_dec_round(s, b[2], r); b[3] = vp_dec_round(s, b[3], r);
+	}
+	b[0] = vp_dec_last(s, b[0]); b[1] = vp_dec_last(s, b[1]);
+	b[2] = vp_dec_last(s, b[2]); b[3] = vp_dec_last(s, b[3]);
+}
+
+/* the key schedules are those of the bitsliced engine, which are built
+   without table lookups; this file only adds the encryption code     */
+
+static AES_RETURN vp_encrypt_key(const unsigned char *key, int key_len, aes_encrypt_ctx cx[1])
+{
+	return aes_backend_bitslice.encrypt_key(key, key_len, cx);
+}
+
+static AES_RETURN vp_decrypt_key(const unsigned char *key, int key_len, aes_decrypt_ctx cx[1])
+{
+	return aes_backend_bitslice.decrypt_key(key, key_len, cx);
+}
+
+static AES_RETURN vp_encrypt_one(const unsigned char *in, unsigned char *out, const aes_encrypt_ctx cx[1])
+{
+	vp_state s;
+
+	if(!vp_init(&s, cx->ks, cx->inf.b[0] >> 4, 1))
+		return EXIT_FAILURE;
+
+	vp_st(out, vp_encrypt(&s, vp_ld(in)));
+	vp_wipe(&s);
+	return EXIT_SUCCESS;
+}
+
+static AES_RETURN vp_decrypt_one(const unsigned char *in, unsigned char *out, const aes_decrypt_ctx cx[1])
+{
+	vp_state s;
+
+	if(!vp_init(&s, cx->ks, cx->inf.b[0] >> 4, 0))
+		return EXIT_FAILURE;
+
+	vp_st(out, vp_decrypt(&s, vp_ld(in)));
+	vp_wipe(&s);
+	return EXIT_SUCCESS;
+}
+
+static AES_RETURN vp_ecb_encrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, const aes_encrypt_ctx cx[1])
+{
+	vp_state s;
+	__m128i b[VP_BLOCKS];
+	int nb = len >> 4;
+
+	if(len & (AES_BLOCK_SIZE - 1) || !vp_init(&s, cx->ks, cx->inf.b[0] >> 4, 1))
+		return EXIT_FAILURE;
+
+	for( ; nb >= VP_BLOCKS; nb -= VP_BLOCKS)
+	{
+		b[0] = vp_ld(ibuf);      b[1] = vp_ld(ibuf + 16);
+		b[2] = vp_ld(ibuf + 32); b[3] = vp_ld(ibuf + 48);
+		vp_encrypt4(&s, b);
+		vp_st(obuf, b[0]);      vp_st(obuf + 16, b[1]);
+		vp_st(obuf + 32, b[2]); vp_st(obuf + 48, b[3]);
+		ibuf += VP_BLOCKS * AES_BLOCK_SIZE;
+		obuf += VP_BLOCKS * AES_BLOCK_SIZE;
+	}
+	for( ; nb; --nb)
+	{
+		vp_st(obuf, vp_encrypt(&s, vp_ld(ibuf)));
+		ibuf += AES_BLOCK_SIZE;
+		obuf += AES_BLOCK_SIZE;
+	}
+	vp_wipe(&s);
+	return EXIT_SUCCESS;
+}
+
+static AES_RETURN vp_ecb_decrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, const aes_decrypt_ctx cx[1])
+{
+	vp_state s;
+	__m128i b[VP_BLOCKS];
+	int nb = len >> 4;
+
+	if(len & (AES_BLOCK_SIZE - 1) || !vp_init(&s, cx->ks, cx->inf.b[0] >> 4, 0))
+		return EXIT_FAILURE;
+
+	for( ; nb >= VP_BLOCKS; nb -= VP_BLOCKS)
+	{
+		b[0] = vp_ld(ibuf);      b[1] = vp_ld(ibuf + 16);
+		b[2] = vp_ld(ibuf + 32); b[3] = vp_ld(ibuf + 48);
+		vp_decrypt4(&s, b);
+		vp_st(obuf, b[0]);      vp_st(obuf + 16, b[1]);
+		vp_st(obuf + 32, b[2]); vp_st(obuf + 48, b[3]);
+		ibuf += VP_BLOCKS * AES_BLOCK_SIZE;
+		obuf += VP_BLOCKS * AES_BLOCK_SIZE;
+	}
+	for( ; nb; --nb)
+	{
+		vp_st(obuf, vp_decrypt(&s, vp_ld(ibuf)));
+		ibuf += AES_BLOCK_SIZE;
+		obuf += AES_BLOCK_SIZE;
+	}
+	vp_wipe(&s);
+	return EXIT_SUCCESS;
+}
+
+static AES_RETURN vp_cbc_encrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, const aes_encrypt_ctx cx[1])
+{
+	vp_state s;
+	__m128i v;
+	int nb = len >> 4;
+
+	if(len & (AES_BLOCK_SIZE - 1) || !vp_init(&s, cx->ks, cx->inf.b[0] >> 4, 1))
+		return EXIT_FAILURE;
+
+	v = vp_ld(iv);
+	for( ; nb; --nb)
+	{
+		v = vp_encrypt(&s, _mm_xor_si128(v, vp_ld(ibuf)));
+		vp_st(obuf, v);
+		ibuf += AES_BLOCK_SIZE;
+		obuf += AES_BLOCK_SIZE;
+	}
+	vp_st(iv, v);
+	vp_wipe(&s);
+	return EXIT_SUCCESS;
+}
+
+/* the ciphertext is read before the decrypted blocks are stored so that
+   ibuf may equal obuf */
+
+static AES_RETURN vp_cbc_decrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, const aes_decrypt_ctx cx[1])
+{
+	vp_state s;
+	__m128i b[VP_BLOCKS], c[VP_BLOCKS], v;
+	int nb = len >> 4;
+
+	if(len & (AES_BLOCK_SIZE - 1) || !vp_init(&s, cx->ks, cx->inf.b[0] >> 4, 0))
+		return EXIT_FAILURE;
+
+	v = vp_ld(iv);
+	for( ; nb >= VP_BLOCKS; nb -= VP_BLOCKS)
+	{
+		b[0] = c[0] = vp_ld(ibuf);      b[1] = c[1] = vp_ld(ibuf + 16);
+		b[2] = c[2] = vp_ld(ibuf + 32); b[3] = c[3] = vp_ld(ibuf + 48);
+		vp_decrypt4(&s, b);
+		vp_st(obuf, _mm_xor_si128(b[0], v));
+		vp_st(obuf + 16, _mm_xor_si128(b[1], c[0]));
+		vp_st(obuf + 32, _mm_xor_si128(b[2], c[1]));
+		vp_st(obuf + 48, _mm_xor_si128(b[3], c[2]));
+		v = c[3];
+		ibuf += VP_BLOCKS * AES_BLOCK_SIZE;
+		obuf += VP_BLOCKS * AES_BLOCK_SIZE;
+	}
+	for( ; nb; --nb)
+	{
+		c[0] = vp_ld(ibuf);
+		vp_st(obuf, _mm_xor_si128(vp_decrypt(&s, c[0]), v));
+		v = c[0];
+		ibuf += AES_BLOCK_SIZE;
+		obuf += AES_BLOCK_SIZE;
+	}
+	vp_st(iv, v);
+	vp_wipe(&s);
+	return EXIT_SUCCESS;
+}
+
+static AES_RETURN vp_cfb_encrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1])
+{
+	vp_state s;
+	int b_pos = cx->inf.b[2];
+
+	if(!vp_init(&s, cx->ks, cx->inf.b[0] >> 4, 1))
+		return EXIT_FAILURE;
+
+	while(len)
+	{
+		if(!b_pos)
+			vp_st(iv, vp_encrypt(&s, vp_ld(iv)));
+		for( ; b_pos < AES_BLOCK_SIZE && len; --len)
+		{
+			*obuf++ = (iv[b_pos] ^= *ibuf++);
+			++b_pos;
+		}
+		b_pos &= AES_BLOCK_SIZE - 1;
+	}
+
+	cx->inf.b[2] = (uint8_t)b_pos;
+	vp_wipe(&s);
+	return EXIT_SUCCESS;
+}
+
+/* CFB decryption takes the cipher inputs from the ciphertext so whole
+   blocks are done VP_BLOCKS at a time, in place like CBC above */
+
+static AES_RETURN vp_cfb_decrypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1])
+{
+	vp_state s;
+	__m128i b[VP_BLOCKS], c[VP_BLOCKS], v;
+	unsigned char u;
+	int b_pos = cx->inf.b[2];
+
+	if(!vp_init(&s, cx->ks, cx->inf.b[0] >> 4, 1))
+		return EXIT_FAILURE;
+
+	if(b_pos)           /* complete any partial block   */
+	{
+		while(b_pos < AES_BLOCK_SIZE && len)
+		{
+			u = *ibuf++;
+			*obuf++ = u ^ iv[b_pos];
+			iv[b_pos++] = u;
+			--len;
+		}
+
+		b_pos &= AES_BLOCK_SIZE - 1;
+	}
+
+	v = vp_ld(iv);
+	for( ; len >= VP_BLOCKS * AES_BLOCK_SIZE; len -= VP_BLOCKS * AES_BLOCK_SIZE)
+	{
+		c[0] = vp_ld(ibuf);      c[1] = vp_ld(ibuf + 16);
+		c[2] = vp_ld(ibuf + 32); c[3] = vp_ld(ibuf + 48);
+		b[0] = v;    b[1] = c[0];
+		b[2] = c[1]; b[3] = c[2];
+		vp_encrypt4(&s, b);
+		vp_st(obuf, _mm_xor_si128(b[0], c[0]));
+		vp_st(obuf + 16, _mm_xor_si128(b[1], c[1]));
+		vp_st(obuf + 32, _mm_xor_si128(b[2], c[2]));
+		vp_st(obuf + 48, _mm_xor_si128(b[3], c[3]));
+		v = c[3];
+		ibuf += VP_BLOCKS * AES_BLOCK_SIZE;
+		obuf += VP_BLOCKS * AES_BLOCK_SIZE;
+	}
+	for( ; len >= AES_BLOCK_SIZE; len -= AES_BLOCK_SIZE)
+	{
+		c[0] = vp_ld(ibuf);
+		vp_st(obuf, _mm_xor_si128(vp_encrypt(&s, v), c[0]));
+		v = c[0];
+		ibuf += AES_BLOCK_SIZE;
+		obuf += AES_BLOCK_SIZE;
+	}
+	vp_st(iv, v);
+
+	if(len)
+	{
+		vp_st(iv, vp_encrypt(&s, v));
+		for(b_pos = 0; b_pos < len; ++b_pos)
+		{
+			u = ibuf[b_pos];
+			obuf[b_pos] = u ^ iv[b_pos];
+			iv[b_pos] = u;
+		}
+	}
+
+	cx->inf.b[2] = (uint8_t)b_pos;
+	vp_wipe(&s);
+	return EXIT_SUCCESS;
+}
+
+static AES_RETURN vp_ofb_crypt(const unsigned char *ibuf, unsigned char *obuf,
+                    int len, unsigned char *iv, aes_encrypt_ctx cx[1])
+{
+	vp_state s;
+	int b_pos = cx->inf.b[2];
+
+	if(!vp_init(&s, cx->ks, cx->inf.b[0] >> 4, 1))
+		return EXIT_FAILURE;
+
+	while(len)
+	{
+		if(!b_pos)
+			vp_st(iv, vp_encrypt(&s, vp_ld(iv)));
+		for( ; b_pos < AES_BLOCK_SIZE && len; --len)
+		{
+			*obuf++ = iv[b_pos] ^ *ibuf++;
+			++b_pos;
+		}
+		b_pos &= AES_BLOCK_SIZE - 1;
+	}
+
+	cx->inf.b[2] = (uint8_t)b_pos;
+	vp_wipe(&s);
+	return EXIT_SUCCESS;
+}
+
+/* the counter blocks are built in ctr[] as in aes_bs.c; a trailing part
+   block leaves its counter in cbuf and the position in the context just
+   like the table code */
+
+static AES_RETURN vp_ctr_crypt(const unsigned char *ibuf, unsigned char *obuf,
+            int len, unsigned char *cbuf, cbuf_inc ctr_inc, aes_encrypt_ctx cx[1])
+{
+	vp_state s;
+	__m128i b[VP_BLOCKS];
+	unsigned char ctr[AES_BLOCK_SIZE * VP_BLOCKS];
+	int b_pos = cx->inf.b[2], n, i;
+
+	if(!vp_init(&s, cx->ks, cx->inf.b[0] >> 4, 1))
+		return EXIT_FAILURE;
+
+	if(b_pos)
+	{
+		vp_st(ctr, vp_encrypt(&s, vp_ld(cbuf)));
+		while(b_pos < AES_BLOCK_SIZE && len)
+		{
+			*obuf++ = *ibuf++ ^ ctr[b_pos++];
+			--len;
+		}
+
+		if(len)
+			ctr_inc(cbuf), b_pos = 0;
+	}
+
+	for( ; len >= VP_BLOCKS * AES_BLOCK_SIZE; len -= VP_BLOCKS * AES_BLOCK_SIZE)
+	{
+		for(i = 0; i < VP_BLOCKS; ++i)
+		{
+			b[i] = vp_ld(cbuf);
+			ctr_inc(cbuf);
+		}
+		vp_encrypt4(&s, b);
+		for(i = 0; i < VP_BLOCKS; ++i)
+			vp_st(obuf + 16 * i, _mm_xor_si128(b[i], vp_ld(ibuf + 16 * i)));
+		ibuf += VP_BLOCKS * AES_BLOCK_SIZE;
+		obuf += VP_BLOCKS * AES_BLOCK_SIZE;
+	}
+
+	while(len)
+	{
+		vp_st(ctr, vp_encrypt(&s, vp_ld(cbuf)));
+		n = len < AES_BLOCK_SIZE ? len : AES_BLOCK_SIZE;
+		for(i = 0; i < n; ++i)
+			obuf[i] = ibuf[i] ^ ctr[i];
+		if(n == AES_BLOCK_SIZE)
+			ctr_inc(cbuf);
+		b_pos = n & (AES_BLOCK_SIZE - 1);
+		ibuf += n;
+		obuf += n;
+		len -= n;
+	}
+
+	cx->inf.b[2] = (uint8_t)b_pos;
+	vp_wipe(&s);
+	return EXIT_SUCCESS;
+}
+
+static AES_RETURN vp_ctr_crypt_ex(const unsigned char *ibuf, unsigned char *obuf,
+            int len, unsigned char *cbuf, int ctr_mode, aes_encrypt_ctx cx[1])
+{
+	cbuf_inc *ctr_inc = aes_ctr_inc(ctr_mode);
+
+	return ctr_inc ? vp_ctr_crypt(ibuf, obuf, len, cbuf, ctr_inc, cx) : EXIT_FAILURE;
+}
+
+int aes_vpaes_support(void)
+{
+	return has_ssse3() != 0;
+}
+
+const aes_backend aes_backend_vpaes =
+{
+	"vpaes",
+	vp_encrypt_key,        vp_decrypt_key,
+	NULL,
+	vp_encrypt_one,        vp_decrypt_one,
+	vp_ecb_encrypt,        vp_ecb_decrypt,
+	vp_cbc_encrypt,        vp_cbc_decrypt,
+	vp_cfb_encrypt,        vp_cfb_decrypt,
+	vp_ofb_crypt,
+	vp_ctr_crypt,          vp_ctr_crypt_ex,
+	NULL
+};
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
@@ -1,9 +1,16 @@
 #include "lua.h"
 #include "aes.h"
+#include "aes_backend.h"
+#include "aes_file.h"
 #include "aesopt.h"
 #include "l52util.h"
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
 #include <memory.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 #define FLAG_TYPE      unsigned char
 #define FLAG_DESTROYED (FLAG_TYPE)1 << 0
@@ -24,6 +31,9 @@
 
 #define IV_SIZE AES_BLOCK_SIZE
 
+/* the most the engines take in one call, they count bytes in an int */
+#define MAX_CHUNK_SIZE ((size_t)INT_MAX & ~(size_t)(AES_BLOCK_SIZE - 1))
+
 #ifndef DEFAULT_BUFFER_SIZE
 #  define DEFAULT_BUFFER_SIZE 4096
 #else
@@ -32,120 +42,1645 @@
 #  endif
 #endif
 
-#if LUA_VERSION_NUM >= 502 /* Lua 5.2 */
+#if LUA_VERSION_NUM >= 502 /* Lua 5.2 */
+
+#if LUA_VERSION_NUM < 503 /* Lua 5.2 */
+
+typedef int lua_KContext;
+
+typedef lua_CFunction lua_KFunction;
+
+#endif
+
+#if LUA_VERSION_NUM < 503
+#  define KFUNCTION(F) F(lua_State *L)
+#else
+#  define KFUNCTION(F) F(lua_State *L, int status, lua_KContext ctx)
+#endif
+
+#endif
+
+#define L_AES_ALIGN_INT(V, A) (((V) & (A - 1)) ? (((V) | (A - 1)) + 0x01) : (V))
+
+#if defined( USE_INTEL_AES_IF_PRESENT )
+#  define L_AES_ALIGN_CTX_VALUE 16
+#else
+#  define L_AES_ALIGN_CTX_VALUE 0
+#endif
+
+#if L_AES_ALIGN_CTX_VALUE == 0
+#  define L_AES_ALIGNED_SIZE(size) size
+#  define L_AES_ALIGNED_CTX(T, ctx) (T*)ctx
+#else
+#  define L_AES_ALIGNED_SIZE(size) (L_AES_ALIGN_CTX_VALUE + size - 1)
+#  define L_AES_ALIGNED_CTX(T, ctx) (T*)L_AES_ALIGN_INT((uintptr_t)(ctx), L_AES_ALIGN_CTX_VALUE)
+#endif
+
+static void *laes_aligned_newudatap(lua_State *L, size_t size, const void *p) {
+  void* ptr = lutil_newudatap_impl(L, L_AES_ALIGNED_SIZE(size), p);
+  return L_AES_ALIGNED_CTX(void, ptr);
+}
+
+static void *laes_aligned_checkudatap(lua_State *L, int i, const void *p) {
+  void* ptr = lutil_checkudatap(L, i, p);
+  if (!ptr) return NULL;
+  return L_AES_ALIGNED_CTX(void, ptr);
+}
+
+//! @fixme on mingw32 (gcc 4.8.1) this does not work
+#define L_AES_STATIC_ASSERT(A) {(void)(int(*)[(A)?1:0])0;}
+
+static int fail(lua_State *L, const char *msg){
+  lua_pushnil(L);
+  lua_pushstring(L, msg);
+  return 2;
+}
+
+static int pass(lua_State *L){
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* return [ buffer[be], buffer[en] ] */
+static const char* correct_range(lua_State *L, int idx, size_t *size){
+  if(lua_islightuserdata(L, idx)){
+    /* (ud, [offset=0,] size) */
+    const char *input = (const char*)lua_touserdata(L, idx);
+    int of, sz;
+
+    if(lua_isnumber(L, idx + 1) && lua_isnumber(L, idx + 2)){
+      of = lua_tointeger(L, idx + 1);
+      sz = lua_tointeger(L, idx + 2);
+      lua_remove(L, idx + 1);
+      lua_remove(L, idx + 1);
+    }
+    else{
+      of = 0;
+      sz = luaL_checkinteger(L, idx + 1);
+      lua_remove(L, idx + 1);
+    }
+
+    luaL_argcheck(L, of >= 0, idx+1, "invalid offset");
+    luaL_argcheck(L, sz >= 0, idx+2, "invalid size"  );
+
+    *size = sz;
+    return input + of;
+  }
+  else{
+    /* (str, [be=1[, size=(#str-be+1)]]) */
+    size_t len; const char *input = luaL_checklstring(L, idx, &len);
+    int be, sz;
+    if(lua_isnumber(L, idx+1)){
+      be = lua_tointeger(L, idx+1);
+      lua_remove(L, idx+1);
+      luaL_argcheck(L, be > 0, idx+1, "invalid begin index");
+    }else be = 1;
+
+    if(lua_isnumber(L, idx+1)){
+      sz = lua_tointeger(L, idx+1);
+      lua_remove(L, idx+1);
+      luaL_argcheck(L, sz >= 0, idx+2, "invalid size");
+    }else sz = len;
+
+    if((size_t)be > len){
+      *size = 0;
+      return input;
+    }
+
+    len = len - be + 1;
+
+    if((size_t)sz > len) sz = len;
+
+    *size = sz;
+    return input + be - 1;
+  }
+}
+
+/* (ud, offset) the destination of write_into and transform. Only a full
+ * userdata has a known size, for a light one the caller has to provide the
+ * room.
+ */
+static unsigned char *dst_range(lua_State *L, int idx, size_t *size){
+  lua_Integer of = luaL_checkinteger(L, idx + 1);
+  unsigned char *dst = (unsigned char*)lua_touserdata(L, idx);
+
+  luaL_argcheck(L, dst != NULL, idx, "userdata expected");
+  luaL_argcheck(L, of >= 0, idx + 1, "invalid offset");
+
+  if(lua_islightuserdata(L, idx)) *size = (size_t)-1;
+  else{
+    size_t len = lua_objlen(L, idx);
+    luaL_argcheck(L, (size_t)of <= len, idx + 1, "invalid offset");
+    *size = len - (size_t)of;
+  }
+  return dst + of;
+}
+
+/* (ud, offset[, size]) the region transform works on in place, the size
+ * is required for a light userdata and defaults to the rest of a full one
+ */
+static unsigned char *ud_range(lua_State *L, int idx, size_t *size){
+  size_t len; unsigned char *data = dst_range(L, idx, &len);
+  lua_Integer sz;
+
+  if(lua_islightuserdata(L, idx)) sz = luaL_checkinteger(L, idx + 2);
+  else sz = luaL_optinteger(L, idx + 2, (lua_Integer)len);
+  luaL_argcheck(L, sz >= 0 && (size_t)sz <= len, idx + 2, "invalid size");
+
+  *size = (size_t)sz;
+  return data;
+}
+
+//{ Backend
+
+/* engine used by the contexts of a Lua state, kept in its registry so that
+ * states running on different threads each have their own. Every backend
+ * builds the same key schedule so it can be changed while contexts are open.
+ */
+static const char * L_BACKEND_REF = "AES backend";
+
+static const aes_backend **l_backend_slot(lua_State *L){
+  const aes_backend **slot;
+  lua_rawgetp(L, LUA_REGISTRYINDEX, L_BACKEND_REF);
+  slot = (const aes_backend **)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return slot;
+}
+
+#define l_backend(L) (*l_backend_slot(L))
+
+static int l_aes_backend(lua_State *L){
+  lua_pushstring(L, l_backend(L)->name);
+  return 1;
+}
+
+static int l_aes_backends(lua_State *L){
+  const aes_backend *const *b = aes_backend_list();
+  int i;
+
+  lua_newtable(L);
+  for(i = 0; b[i]; ++i){
+    lua_pushstring(L, b[i]->name);
+    lua_rawseti(L, -2, i + 1);
+  }
+  return 1;
+}
+
+static int l_aes_set_backend(lua_State *L){
+  const char *name = luaL_checkstring(L, 1);
+  const aes_backend *b = aes_backend_find(name);
+
+  if(!b){
+    lua_pushnil(L);
+    lua_pushfstring(L, "unsupported backend: %s", name);
+    return 2;
+  }
+
+  *l_backend_slot(L) = b;
+  return pass(L);
+}
+
+/* the backend table used by a context, specialised for its key size when
+ * the backend has such tables (see aes_backend_kernel). It is picked when
+ * the key is set and again on first use after aes.set_backend().
+ */
+typedef struct l_engine_tag{
+  const aes_backend *const *slot; /* the backend of the state */
+  const aes_backend *backend;
+  const aes_backend *kernel;
+} l_engine;
+
+static void l_engine_init(lua_State *L, l_engine *e){
+  e->slot = l_backend_slot(L);
+}
+
+static void l_engine_select(l_engine *e, const aes_encrypt_ctx *cx){
+  e->backend = *e->slot;
+  e->kernel  = aes_backend_kernel(e->backend, cx->inf.b[0] >> 4);
+}
+
+static const aes_backend *l_engine_get(l_engine *e, const aes_encrypt_ctx *cx){
+  if(e->backend != *e->slot) l_engine_select(e, cx);
+  return e->kernel;
+}
+
+#define L_ENGINE(ctx) l_engine_get(&(ctx)->engine, L_ECTX(ctx))
+
+//}
+
+//{ Key cache
+
+/* optional cache of expanded keys for aes.set_key_cache(). It belongs to
+ * the Lua state so states in other threads never share it. Entries are
+ * found by a keyed hash of the key, so which keys collide can not be
+ * predicted, kept in LRU order and wiped when evicted or dropped.
+ */
+
+#define L_KCACHE_NAME "AES key cache"
+static const char * L_KCACHE_CTX = L_KCACHE_NAME;
+static const char * L_KCACHE_REF = L_KCACHE_NAME " instance";
+
+#define L_KCACHE_MAX 65536
+
+#define L_KCACHE_ENC 1
+#define L_KCACHE_DEC 2
+
+typedef struct l_kcache_entry_tag{
+  aes_encrypt_ctx ectx[1];
+  aes_decrypt_ctx dctx[1];
+  unsigned char   key[32];
+  int             key_len;
+  int             schedules;  /* L_KCACHE_ENC | L_KCACHE_DEC when set */
+  int             bucket, next;
+  int             lru_prev, lru_next;
+} l_kcache_entry;
+
+typedef struct l_kcache_tag{
+  uint64_t        seed[2];
+  size_t          hits, misses;
+  int             size, used, mask;
+  int             lru_head, lru_tail;  /* most and least recently used */
+  int            *buckets;
+  l_kcache_entry *entries;
+} l_kcache;
+
+static void l_secure_zero(void *p, size_t n){
+  volatile unsigned char *v = (volatile unsigned char *)p;
+  while(n--) *v++ = 0;
+}
+
+#define L_ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define L_SIPROUND(v0, v1, v2, v3) do{                            \
+  v0 += v1; v1 = L_ROTL64(v1, 13); v1 ^= v0; v0 = L_ROTL64(v0, 32); \
+  v2 += v3; v3 = L_ROTL64(v3, 16); v3 ^= v2;                        \
+  v0 += v3; v3 = L_ROTL64(v3, 21); v3 ^= v0;                        \
+  v2 += v1; v1 = L_ROTL64(v1, 17); v1 ^= v2; v2 = L_ROTL64(v2, 32); \
+}while(0)
+
+/* SipHash-1-3 of a key, whose length is always a multiple of 8 */
+static uint64_t l_kcache_hash(const uint64_t seed[2], const unsigned char *p, size_t len){
+  uint64_t v0 = seed[0] ^ 0x736f6d6570736575ULL, v1 = seed[1] ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = seed[0] ^ 0x6c7967656e657261ULL, v3 = seed[1] ^ 0x7465646279746573ULL;
+  uint64_t m;
+  size_t i;
+
+  for(i = 0; i < len; i += 8){
+    memcpy(&m, p + i, 8);
+    v3 ^= m; L_SIPROUND(v0, v1, v2, v3); v0 ^= m;
+  }
+  m = (uint64_t)len << 56;
+  v3 ^= m; L_SIPROUND(v0, v1, v2, v3); v0 ^= m;
+  v2 ^= 0xff;
+  L_SIPROUND(v0, v1, v2, v3); L_SIPROUND(v0, v1, v2, v3); L_SIPROUND(v0, v1, v2, v3);
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static void l_kcache_seed(lua_State *L, uint64_t seed[2]){
+  FILE *f = fopen("/dev/urandom", "rb");
+  int ok = f && fread(seed, sizeof(uint64_t), 2, f) == 2;
+
+  if(f) fclose(f);
+  if(!ok){ /* no system source, mix what differs between runs */
+    uint64_t v[4];
+    v[0] = (uint64_t)time(NULL);
+    v[1] = (uint64_t)clock();
+    v[2] = (uint64_t)(uintptr_t)L;
+    v[3] = (uint64_t)(uintptr_t)&v;
+    seed[0] = seed[1] = (uint64_t)(uintptr_t)seed;
+    seed[0] = l_kcache_hash(seed, (const unsigned char*)v, sizeof(v));
+    seed[1] = l_kcache_hash(seed, (const unsigned char*)v, sizeof(v));
+  }
+}
+
+static int l_kcache_equal(const unsigned char *a, const unsigned char *b, size_t len){
+  unsigned char d = 0;
+  size_t i;
+  for(i = 0; i < len; ++i) d |= a[i] ^ b[i];
+  return d == 0;
+}
+
+static void l_kcache_lru_unlink(l_kcache *c, int i){
+  l_kcache_entry *e = &c->entries[i];
+  if(e->lru_prev >= 0) c->entries[e->lru_prev].lru_next = e->lru_next; else c->lru_head = e->lru_next;
+  if(e->lru_next >= 0) c->entries[e->lru_next].lru_prev = e->lru_prev; else c->lru_tail = e->lru_prev;
+}
+
+static void l_kcache_lru_push(l_kcache *c, int i){
+  l_kcache_entry *e = &c->entries[i];
+  e->lru_prev = -1;
+  e->lru_next = c->lru_head;
+  if(c->lru_head >= 0) c->entries[c->lru_head].lru_prev = i; else c->lru_tail = i;
+  c->lru_head = i;
+}
+
+/* drops the least recently used entry and returns its slot */
+static int l_kcache_evict(l_kcache *c){
+  int i = c->lru_tail, *p;
+  l_kcache_entry *e = &c->entries[i];
+
+  l_kcache_lru_unlink(c, i);
+  for(p = &c->buckets[e->bucket]; *p != i; p = &c->entries[*p].next);
+  *p = e->next;
+  l_secure_zero(e, sizeof(l_kcache_entry));
+  return i;
+}
+
+static l_kcache *l_kcache_get(lua_State *L){
+  l_kcache *c;
+  lua_rawgetp(L, LUA_REGISTRYINDEX, L_KCACHE_REF);
+  c = (l_kcache *)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return c;
+}
+
+/* l_key_setup for a key string through the cache */
+static int l_kcache_setup(l_kcache *c, const aes_backend *backend, const unsigned char *key, size_t key_len, int decrypt, aes_encrypt_ctx *cx){
+  int need = decrypt ? L_KCACHE_DEC : L_KCACHE_ENC;
+  int b, i, result;
+  l_kcache_entry *e = NULL;
+
+  if(key_len != 16 && key_len != 24 && key_len != 32) return EXIT_FAILURE;
+
+  b = (int)(l_kcache_hash(c->seed, key, key_len) & (uint64_t)c->mask);
+  for(i = c->buckets[b]; i >= 0; i = e->next){
+    e = &c->entries[i];
+    if(e->key_len == (int)key_len && l_kcache_equal(e->key, key, key_len)) break;
+  }
+
+  if(i >= 0){
+    l_kcache_lru_unlink(c, i);
+    l_kcache_lru_push(c, i);
+    if(e->schedules & need){
+      c->hits += 1;
+      if(decrypt) memcpy(cx, e->dctx, sizeof(aes_decrypt_ctx));
+      else memcpy(cx, e->ectx, sizeof(aes_encrypt_ctx));
+      return EXIT_SUCCESS;
+    }
+  }
+
+  c->misses += 1;
+  if(decrypt)
+    result = backend->decrypt_key(key, key_len, (aes_decrypt_ctx*)cx);
+  else
+    result = backend->encrypt_key(key, key_len, cx);
+  if(result != EXIT_SUCCESS) return result;
+
+  if(i < 0){
+    i = (c->used < c->size) ? c->used++ : l_kcache_evict(c);
+    e = &c->entries[i];
+    memcpy(e->key, key, key_len);
+    e->key_len   = (int)key_len;
+    e->schedules = 0;
+    e->bucket    = b;
+    e->next      = c->buckets[b];
+    c->buckets[b] = i;
+    l_kcache_lru_push(c, i);
+  }
+
+  if(decrypt) memcpy(e->dctx, cx, sizeof(aes_decrypt_ctx));
+  else memcpy(e->ectx, cx, sizeof(aes_encrypt_ctx));
+  e->schedules |= need;
+
+  return EXIT_SUCCESS;
+}
+
+static int l_kcache_destroy(lua_State *L){
+  l_kcache *c = (l_kcache *)lutil_checkudatap(L, 1, L_KCACHE_CTX);
+  int i;
+  if(c->entries) l_secure_zero(c->entries, c->size * sizeof(l_kcache_entry));
+  /* an empty cache that is still safe to look up */
+  if(c->buckets) for(i = 0; i <= c->mask; ++i) c->buckets[i] = -1;
+  c->lru_head = c->lru_tail = -1;
+  c->size = c->used = 0;
+  return 0;
+}
+
+static int l_aes_set_key_cache(lua_State *L){
+  int n = (int)luaL_checkinteger(L, 1);
+  int nb = 2, i;
+  l_kcache *c;
+
+  luaL_argcheck(L, n >= 0 && n <= L_KCACHE_MAX, 1, "invalid cache size");
+
+  /* the new cache first, so that the old one is left as it is if there is
+   * not enough memory for it
+   */
+  if(n > 0){
+    while(nb < n) nb <<= 1;
+
+    c = (l_kcache *)lutil_newudatap_impl(L,
+      sizeof(l_kcache) + nb * sizeof(int) + n * sizeof(l_kcache_entry), L_KCACHE_CTX);
+    memset(c, 0, sizeof(l_kcache));
+    c->buckets  = (int *)(c + 1);
+    c->entries  = (l_kcache_entry *)(c->buckets + nb);
+    c->size     = n;
+    c->mask     = nb - 1;
+    c->lru_head = c->lru_tail = -1;
+    for(i = 0; i < nb; ++i) c->buckets[i] = -1;
+    memset(c->entries, 0, n * sizeof(l_kcache_entry));
+    l_kcache_seed(L, c->seed);
+  }
+  else lua_pushnil(L);
+
+  /* the old entries are wiped now rather than whenever it is collected */
+  lua_rawgetp(L, LUA_REGISTRYINDEX, L_KCACHE_REF);
+  if(lua_touserdata(L, -1)){
+    lua_pushcfunction(L, l_kcache_destroy);
+    lua_insert(L, -2);
+    lua_call(L, 1, 0);
+  }
+  else lua_pop(L, 1);
+
+  lua_rawsetp(L, LUA_REGISTRYINDEX, L_KCACHE_REF);
+  return pass(L);
+}
+
+static int l_aes_key_cache(lua_State *L){
+  l_kcache *c = l_kcache_get(L);
+  lua_pushinteger(L, c ? c->size : 0);
+  lua_pushinteger(L, c ? (lua_Integer)c->hits : 0);
+  lua_pushinteger(L, c ? (lua_Integer)c->misses : 0);
+  return 3;
+}
+
+static const struct luaL_Reg l_kcache_meth[] = {
+  {"__gc",       l_kcache_destroy },
+
+  {NULL, NULL}
+};
+
+//}
+
+//{ Key
+
+#define L_KEY_NAME "AES key"
+static const char * L_KEY_CTX = L_KEY_NAME;
+
+/* keys expanded in one batch per key size, see aes_backend_encrypt_keys */
+#define L_KEY_BATCH 8
+
+/* expanded key returned by aes.key() and aes.expand_keys(). It is never
+ * changed once built, so open and reset of any context accept it in place
+ * of the key string and run with its schedule instead of building one;
+ * each context holding it keeps a reference so it lives as long as the
+ * last of them. The decryption schedule is derived on first use.
+ */
+typedef struct l_key_tag{
+  aes_encrypt_ctx ectx[1];
+  aes_decrypt_ctx dctx[1];
+  FLAG_TYPE       flags;
+} l_key;
+
+static l_key *l_key_new(lua_State *L){
+  l_key *key = (l_key*)laes_aligned_newudatap(L, sizeof(l_key), L_KEY_CTX);
+  memset(key, 0, sizeof(l_key));
+  return key;
+}
+
+static l_key *l_test_key_at(lua_State *L, int i){
+  if(!lutil_isudatap(L, i, L_KEY_CTX)) return NULL;
+  return (l_key *)laes_aligned_checkudatap(L, i, L_KEY_CTX);
+}
+
+static const aes_decrypt_ctx *l_key_dctx(l_key *key){
+  if(!(key->flags & FLAG_DECRYPT)){
+    aes_backend_decrypt_schedule(key->ectx, key->dctx);
+    key->flags |= FLAG_DECRYPT;
+  }
+  return key->dctx;
+}
+
+/* the schedule a context runs with: its own one or that of the key object
+ * it holds a reference to. The position in a partial block (inf.b[2]) of
+ * the CFB, OFB and CTR modes always lives in the own schedule and is moved
+ * to the shared one only for the duration of a call, see l_sched_enter.
+ */
+typedef struct l_sched_tag{
+  aes_encrypt_ctx *cx;
+  int              key_ref;
+} l_sched;
+
+#define L_ECTX(ctx) ((ctx)->sched.cx)
+#define L_DCTX(ctx) ((aes_decrypt_ctx*)(ctx)->sched.cx)
+
+static void l_sched_init(l_sched *s, aes_encrypt_ctx *own){
+  s->cx      = own;
+  s->key_ref = LUA_NOREF;
+}
+
+static void l_sched_release(lua_State *L, l_sched *s, aes_encrypt_ctx *own){
+  luaL_unref(L, LUA_REGISTRYINDEX, s->key_ref);
+  l_sched_init(s, own);
+}
+
+/* a clone shares the key object of its source */
+static void l_sched_copy(lua_State *L, l_sched *dst, const l_sched *src){
+  if(src->key_ref == LUA_NOREF) return;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, src->key_ref);
+  dst->key_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  dst->cx      = src->cx;
+}
+
+/* moves the own schedule of a context to a new key object it then holds,
+ * so that its clones can share the schedule instead of copying it
+ */
+static void l_sched_share(lua_State *L, l_sched *s, aes_encrypt_ctx *own, int decrypt){
+  l_key *key;
+
+  if(s->cx != own || !own->inf.b[0]) return;
+
+  key = l_key_new(L);
+  if(decrypt){
+    memcpy(key->dctx, own, sizeof(aes_decrypt_ctx));
+    key->ectx->inf.l = own->inf.l;
+    key->flags |= FLAG_DECRYPT;
+    s->cx = (aes_encrypt_ctx*)key->dctx;
+  }
+  else{
+    memcpy(key->ectx, own, sizeof(aes_encrypt_ctx));
+    s->cx = key->ectx;
+  }
+  s->key_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  l_secure_zero(own->ks, sizeof(own->ks));
+}
+
+static void l_sched_enter(l_sched *s, const aes_encrypt_ctx *own){
+  if(s->cx != own) s->cx->inf.b[2] = own->inf.b[2];
+}
+
+static void l_sched_leave(const l_sched *s, aes_encrypt_ctx *own){
+  if(s->cx != own) own->inf.b[2] = s->cx->inf.b[2];
+}
+
+/* set the schedule of a context from the key string or key object at i */
+static int l_key_setup(lua_State *L, int i, int decrypt, l_sched *s, aes_encrypt_ctx *own){
+  l_key *key = l_test_key_at(L, i);
+  size_t key_len; const unsigned char *k;
+  l_kcache *cache;
+
+  if(key){
+    aes_encrypt_ctx *cx = decrypt ? (aes_encrypt_ctx*)l_key_dctx(key) : key->ectx;
+    if(s->cx != cx){ /* else it already holds this key */
+      l_sched_release(L, s, own);
+      lua_pushvalue(L, i);
+      s->key_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+      s->cx = cx;
+    }
+    own->inf.l = cx->inf.l;
+    own->inf.b[2] = 0;
+    return EXIT_SUCCESS;
+  }
+
+  l_sched_release(L, s, own);
+  k = (unsigned char *)luaL_checklstring(L, i, &key_len);
+  if((cache = l_kcache_get(L)) != NULL && cache->size > 0)
+    return l_kcache_setup(cache, l_backend(L), k, key_len, decrypt, own);
+  if(decrypt)
+    return l_backend(L)->decrypt_key(k, key_len, (aes_decrypt_ctx*)own);
+  return l_backend(L)->encrypt_key(k, key_len, own);
+}
+
+static int l_key_destroy(lua_State *L){
+  l_key *key = (l_key *)laes_aligned_checkudatap(L, 1, L_KEY_CTX);
+  l_secure_zero(key, sizeof(l_key));
+  return 0;
+}
+
+static int l_key_tostring(lua_State *L){
+  l_key *key = (l_key *)laes_aligned_checkudatap(L, 1, L_KEY_CTX);
+  lua_pushfstring(L, L_KEY_NAME " (%d bit): %p", 32 * ((key->ectx->inf.b[0] >> 4) - 6), key);
+  return 1;
+}
+
+static int l_aes_key(lua_State *L){
+  size_t key_len; const unsigned char *k = (unsigned char *)luaL_checklstring(L, 1, &key_len);
+  l_key *key = l_key_new(L);
+
+  if(l_backend(L)->encrypt_key(k, key_len, key->ectx) != EXIT_SUCCESS){
+    luaL_argcheck(L, 0, 1, "invalid key length");
+    return 0;
+  }
+
+  return 1;
+}
+
+static int l_aes_expand_keys(lua_State *L){
+  const unsigned char *keys[3][L_KEY_BATCH];
+  aes_encrypt_ctx *cx[3][L_KEY_BATCH];
+  const aes_backend *backend = l_backend(L);
+  int count[3] = {0, 0, 0};
+  int i, j, n;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  n = (int)lua_objlen(L, 1);
+  lua_settop(L, 1);
+  lua_createtable(L, n, 0);
+
+  for(i = 1; i <= n; ++i){
+    size_t key_len = 0; const char *k = NULL;
+    l_key *key;
+
+    /* the strings stay referenced by the argument until they are expanded */
+    lua_rawgeti(L, 1, i);
+    if(lua_type(L, -1) == LUA_TSTRING) k = lua_tolstring(L, -1, &key_len);
+    if(key_len != 16 && key_len != 24 && key_len != 32)
+      return luaL_argerror(L, 1, lua_pushfstring(L, "invalid key at index %d", i));
+    lua_pop(L, 1);
+
+    key = l_key_new(L);
+    lua_rawseti(L, 2, i);
+
+    j = (int)(key_len - 16) >> 3;
+    keys[j][count[j]] = (const unsigned char*)k;
+    cx[j][count[j]] = key->ectx;
+
+    if(++count[j] == L_KEY_BATCH){
+      aes_backend_encrypt_keys(backend, keys[j], (int)key_len, cx[j], count[j]);
+      count[j] = 0;
+    }
+  }
+
+  for(j = 0; j < 3; ++j){
+    if(count[j]) aes_backend_encrypt_keys(backend, keys[j], 16 + 8 * j, cx[j], count[j]);
+  }
+
+  return 1;
+}
+
+static const struct luaL_Reg l_key_meth[] = {
+  {"__gc",       l_key_destroy  },
+  {"__tostring", l_key_tostring },
+
+  {NULL, NULL}
+};
+
+//}
+
+//{ Buffer
+
+/* the scratch buffer of the mode contexts. A new context points it at the
+ * space allocated along with the context; a clone starts without one and
+ * allocates it on its first write, growing it to what the writes need up
+ * to buffer_size. Writes go through it in chunks of buffer_cap bytes.
+ */
+static void l_buffer_reserve(lua_State *L, unsigned char **buf, size_t *cap, size_t size, size_t need){
+  void *ud; lua_Alloc allocf;
+  unsigned char *p;
+  size_t n;
+
+  if(*buf && (*cap >= size || *cap >= need)) return;
+
+  if(need > size) need = size;
+  n = 2 * *cap;
+  if(n < need) n = need;
+  if(n < 2 * AES_BLOCK_SIZE) n = 2 * AES_BLOCK_SIZE;
+  n = (n + AES_BLOCK_SIZE - 1) & ~(size_t)(AES_BLOCK_SIZE - 1);
+  if(n > size) n = size;
+
+  allocf = lua_getallocf(L, &ud);
+  p = (unsigned char*)allocf(ud, *buf, *buf ? *cap : 0, n);
+  if(!p) luaL_error(L, "not enough memory");
+  *buf = p;
+  *cap = n;
+}
+
+static void l_buffer_free(lua_State *L, unsigned char **buf, size_t *cap, unsigned char *own){
+  void *ud; lua_Alloc allocf;
+
+  if(*buf && *buf != own){
+    allocf = lua_getallocf(L, &ud);
+    allocf(ud, *buf, *cap, 0);
+  }
+  *buf = NULL;
+  *cap = 0;
+}
+
+#define L_BUFFER_RESERVE(L, ctx, n) l_buffer_reserve((L), &(ctx)->buffer, &(ctx)->buffer_cap, (ctx)->buffer_size, (n))
+#define L_BUFFER_FREE(L, ctx) l_buffer_free((L), &(ctx)->buffer, &(ctx)->buffer_cap, (ctx)->buffer_data)
+
+/* the result string of a write without a writer. The modes keep the length
+ * so its size is known up front and they run straight into it; Lua 5.1 has
+ * no presized buffers, there it is built in a userdata and copied once.
+ */
+#if LUA_VERSION_NUM >= 502
+#  define l_result_init(L, B, n) ((unsigned char*)luaL_buffinitsize((L), (B), (n)))
+#  define l_result_push(B, n)    luaL_pushresultsize((B), (n))
+#else
+static unsigned char *l_result_init(lua_State *L, luaL_Buffer *B, size_t n){
+  luaL_buffinit(L, B);
+  return (unsigned char*)lua_newuserdata(L, n);
+}
+
+static void l_result_push(luaL_Buffer *B, size_t n){
+  lua_pushlstring(B->L, (char*)lua_touserdata(B->L, -1), n);
+  lua_remove(B->L, -2);
+}
+#endif
+
+//}
+
+//{ Flush
+
+/* output kept for the writer of a mode context until size bytes are
+ * ready, see set_flush. With size 0 every chunk goes to the writer as it
+ * is done, else the chunks are done straight into buf and it is handed
+ * over when full or on flush(); len is always 0 without a writer.
+ * A raw writer gets a pointer and a length in place of a string, and
+ * the write method of a Lua file is skipped for fwrite on its stream.
+ */
+typedef struct l_flush_tag{
+  unsigned char *buf;
+  size_t         size;
+  size_t         len;
+  int            raw;
+  void          *file;
+} l_flush;
+
+#define L_FLUSH_ON(f) ((f) && (f)->size)
+
+/* where the next output goes, buffer when it is not kept */
+static unsigned char *l_flush_out(l_flush *f, unsigned char *buffer){
+  return L_FLUSH_ON(f) ? f->buf + f->len : buffer;
+}
+
+/* how much output fits there, cap when it is not kept */
+static size_t l_flush_room(l_flush *f, size_t cap){
+  return L_FLUSH_ON(f) ? f->size - f->len : cap;
+}
+
+/* adds n bytes done at l_flush_out, returns how many are ready for the
+ * writer at l_flush_data or 0 if they are kept
+ */
+static size_t l_flush_done(l_flush *f, size_t n){
+  if(!L_FLUSH_ON(f)) return n;
+  f->len += n;
+  if(f->len < f->size) return 0;
+  n = f->len;
+  f->len = 0;
+  return n;
+}
+
+static const unsigned char *l_flush_data(l_flush *f, const unsigned char *out){
+  return L_FLUSH_ON(f) ? f->buf : out;
+}
+
+/* drops any kept output and sets the threshold, rounded up to whole blocks */
+static void l_flush_resize(lua_State *L, l_flush *f, size_t size){
+  void *ud; lua_Alloc allocf = lua_getallocf(L, &ud);
+  unsigned char *p = NULL;
+
+  size = (size + AES_BLOCK_SIZE - 1) & ~(size_t)(AES_BLOCK_SIZE - 1);
+  f->len = 0;
+  if(size == f->size) return;
+
+  if(size){
+    p = (unsigned char*)allocf(ud, f->buf, f->buf ? f->size : 0, size);
+    if(!p) luaL_error(L, "not enough memory");
+  }
+  else allocf(ud, f->buf, f->size, 0);
+
+  f->buf  = p;
+  f->size = size;
+}
+
+static const char *const l_writer_kinds[] = {"string", "raw", NULL};
+
+/* the optional writer options at idx, either the kind of writer or a
+ * table with the fields flush_bytes (def when absent) and raw
+ */
+static size_t l_flush_opt(lua_State *L, int idx, size_t def, int *raw){
+  lua_Integer size;
+
+  *raw = 0;
+  if(lua_isnoneornil(L, idx)) return def;
+  if(lua_type(L, idx) == LUA_TSTRING){
+    *raw = luaL_checkoption(L, idx, NULL, l_writer_kinds);
+    return def;
+  }
+  luaL_checktype(L, idx, LUA_TTABLE);
+
+  lua_getfield(L, idx, "raw");
+  *raw = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  lua_getfield(L, idx, "flush_bytes");
+  if(lua_isnil(L, -1)){
+    lua_pop(L, 1);
+    return def;
+  }
+  size = luaL_checkinteger(L, -1);
+  luaL_argcheck(L, size >= 0, idx, "invalid flush_bytes");
+  lua_pop(L, 1);
+  return (size_t)size;
+}
+
+#if LUA_VERSION_NUM >= 502
+static int KFUNCTION(l_flush_k){
+#if LUA_VERSION_NUM >= 503
+  (void)status; (void)ctx;
+#endif
+  lua_settop(L, 1);
+  return 1;
+}
+#endif
+
+/* pushes the len bytes of output at out, or the kept output, for a writer
+ * pushed to be called with n arguments, the output counted as one, and
+ * returns the number of arguments. For a raw writer they are a light
+ * userdata and the length that point into the context and are only valid
+ * until the writer returns.
+ */
+static int l_flush_push(lua_State *L, l_flush *f, int n, unsigned char *out, size_t len){
+  unsigned char *data = (unsigned char*)l_flush_data(f, out);
+  if(f->raw){
+    lua_pushlightuserdata(L, data);
+    lua_pushinteger(L, (lua_Integer)len);
+    return n + 1;
+  }
+  lua_pushlstring(L, (char*)data, len);
+  return n;
+}
+
+#ifndef LUA_FILEHANDLE /* Lua 5.1 has it in lualib.h */
+#  define LUA_FILEHANDLE "FILE*"
+#endif
+
+#if LUA_VERSION_NUM >= 502
+#  define l_file_stream(p) (((luaL_Stream*)(p))->closef ? ((luaL_Stream*)(p))->f : NULL)
+#else
+#  define l_file_stream(p) (*(FILE**)(p))
+#endif
+
+/* the Lua file at idx or NULL */
+static void *l_file_handle(lua_State *L, int idx){
+  void *p = lua_touserdata(L, idx);
+  int is_file;
+
+  if(!p || !lua_getmetatable(L, idx)) return NULL;
+  luaL_getmetatable(L, LUA_FILEHANDLE);
+  is_file = lua_rawequal(L, -2, -1);
+  lua_pop(L, 2);
+  return is_file ? p : NULL;
+}
+
+/* the file handle at ud when the writer at cb is its own write method,
+ * else NULL; the writer references keep it alive while it is used
+ */
+static void *l_file_writer(lua_State *L, int cb, int ud){
+  void *p = l_file_handle(L, ud);
+  int is_write;
+
+  if(!p) return NULL;
+  lua_getfield(L, ud, "write");
+  is_write = lua_rawequal(L, -1, cb);
+  lua_pop(L, 1);
+  return is_write ? p : NULL;
+}
+
+/* writes the len bytes of output at out, or the kept output, to the
+ * stream of a file writer; returns 0 and does nothing for other writers
+ */
+static int l_flush_file(lua_State *L, l_flush *f, unsigned char *out, size_t len){
+  FILE *file;
+
+  if(!f->file) return 0;
+  file = l_file_stream(f->file);
+  if(!file) return luaL_error(L, "attempt to use a closed file");
+  if(fwrite(l_flush_data(f, out), 1, len, file) != len)
+    return luaL_error(L, "write error: %s", strerror(errno));
+  return 1;
+}
+
+/* hands the kept output to the writer already pushed as n values; only
+ * flush() may let it yield as the other callers have more to do after it
+ */
+static void l_flush_write(lua_State *L, l_flush *f, int n, int yieldable){
+  if(l_flush_file(L, f, f->buf, f->len)){
+    lua_pop(L, n);
+    f->len = 0;
+    return;
+  }
+  n = l_flush_push(L, f, n, f->buf, f->len);
+  f->len = 0;
+#if LUA_VERSION_NUM >= 502
+  if(yieldable){
+    lua_callk(L, n, 0, 0, l_flush_k);
+    return;
+  }
+#else
+  (void)yieldable;
+#endif
+  lua_call(L, n, 0);
+}
+
+//}
+
+//{ Writev
+
+/* what writev needs to know of a mode context: its buffer and pending
+ * tail (ECB and CBC only), the writer and a way to run the mode in place
+ */
+typedef struct l_stream_tag{
+  void           *ctx;
+  unsigned char **buffer;
+  size_t         *buffer_cap;
+  size_t          buffer_size;
+  unsigned char  *tail;
+  l_flush        *flush;
+  int             writer_cb_ref;
+  int             writer_ud_ref;
+  int           (*crypt)(void *ctx, unsigned char *buf, int len);
+#if LUA_VERSION_NUM >= 502
+  lua_KFunction   k;
+#endif
+} l_stream;
+
+static int l_stream_crypt(const l_stream *s, unsigned char *buf, size_t len){
+  while(len){
+    size_t left = (len > MAX_CHUNK_SIZE) ? MAX_CHUNK_SIZE : len;
+    if(s->crypt(s->ctx, buf, (int)left) != EXIT_SUCCESS) return EXIT_FAILURE;
+    buf += left;
+    len -= left;
+  }
+  return EXIT_SUCCESS;
+}
+
+static int l_stream_push_writer(lua_State *L, const l_stream *s){
+  assert(s->writer_cb_ref != LUA_NOREF);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, s->writer_cb_ref);
+  if(s->writer_ud_ref != LUA_NOREF){
+    lua_rawgeti(L, LUA_REGISTRYINDEX, s->writer_ud_ref);
+    return 2;
+  }
+  return 1;
+}
+
+/* where the input is gathered before it is run in place: after the output
+ * kept for the writer or else in the context buffer, whole blocks of it
+ */
+static unsigned char *l_writev_stage(const l_stream *s, size_t *room){
+  if(L_FLUSH_ON(s->flush)){
+    *room = s->flush->size - s->flush->len;
+    return s->flush->buf + s->flush->len;
+  }
+  *room = s->tail ? (*s->buffer_cap & ~(size_t)(AES_BLOCK_SIZE - 1)) : *s->buffer_cap;
+  return *s->buffer;
+}
+
+/* the elements i..j of the table at 2 gathered into as few runs of the
+ * mode and writer calls as the stage allows. The state lives at 3 (j),
+ * 4 (element) and 5 (offset in it) so it can go on after a yield.
+ */
+static int l_writev_writer(lua_State *L, const l_stream *s){
+  lua_Integer k = lua_tointeger(L, 4), j = lua_tointeger(L, 3);
+  size_t off = (size_t)lua_tointeger(L, 5);
+  size_t fill = 0, room, blocks, ready;
+  unsigned char *stage = l_writev_stage(s, &room);
+  int n = 0;
+
+  if(s->tail){ /* the pending tail goes first */
+    fill = *s->tail;
+    if(stage != *s->buffer) memcpy(stage, *s->buffer, fill);
+    *s->tail = 0;
+  }
+
+  for(; k <= j; ++k, off = 0){
+    size_t len; const char *str;
+
+    lua_settop(L, 5);
+    lua_rawgeti(L, 2, k);
+    str = lua_tolstring(L, 6, &len);
+    if(!str) return luaL_argerror(L, 2, lua_pushfstring(L, "string expected at index %d", (int)k));
+
+    while(off < len){
+      size_t chunk = room - fill;
+      if(chunk > len - off) chunk = len - off;
+      memcpy(stage + fill, str + off, chunk);
+      fill += chunk;
+      off  += chunk;
+      if(fill < room) continue;
+
+      if(l_stream_crypt(s, stage, fill) != EXIT_SUCCESS) return fail(L, "invalid block length");
+      ready = l_flush_done(s->flush, fill);
+      fill  = 0;
+      if(ready && !l_flush_file(L, s->flush, stage, ready)){
+        lua_pushinteger(L, k);   lua_replace(L, 4);
+        lua_pushinteger(L, (lua_Integer)off); lua_replace(L, 5);
+        n = l_stream_push_writer(L, s);
+        n = l_flush_push(L, s->flush, n, stage, ready);
+#if LUA_VERSION_NUM >= 502
+        lua_callk(L, n, 0, 0, s->k);
+#else
+        lua_call(L, n, 0);
+#endif
+      }
+      stage = l_writev_stage(s, &room);
+    }
+  }
+
+  blocks = s->tail ? (fill & ~(size_t)(AES_BLOCK_SIZE - 1)) : fill;
+  if(l_stream_crypt(s, stage, blocks) != EXIT_SUCCESS) return fail(L, "invalid block length");
+  ready = blocks ? l_flush_done(s->flush, blocks) : 0;
+  if(ready && l_flush_file(L, s->flush, stage, ready)) ready = 0;
+  if(ready){
+    n = l_stream_push_writer(L, s);
+    n = l_flush_push(L, s->flush, n, stage, ready);
+  }
+  if(s->tail){ /* after the output is pushed as it may share the buffer */
+    *s->tail = (unsigned char)(fill - blocks);
+    memmove(*s->buffer, stage + blocks, *s->tail);
+  }
+  if(ready){
+#if LUA_VERSION_NUM >= 502
+    lua_callk(L, n, 0, 1, s->k);
+#else
+    lua_call(L, n, 0);
+#endif
+  }
+  return 0;
+}
+
+#if LUA_VERSION_NUM >= 502
+static int l_writev_k(lua_State *L, const l_stream *s, lua_KContext lctx){
+  if(lctx) return 0; /* the last writer call */
+  return l_writev_writer(L, s);
+}
+#endif
+
+/* the elements i..j of the table at 2 as one string */
+static int l_writev_result(lua_State *L, const l_stream *s, lua_Integer i, lua_Integer j, size_t total){
+  const size_t tail = s->tail ? *s->tail : 0;
+  const size_t res_len = s->tail ? ((tail + total) >> AES_BLOCK_NB) << AES_BLOCK_NB : total;
+  luaL_Buffer buffer;
+  unsigned char *res, *p;
+
+  if(s->tail && !res_len){ /* still no whole block */
+    for(; i <= j; ++i){
+      size_t len; const char *str;
+      lua_rawgeti(L, 2, i);
+      str = lua_tolstring(L, -1, &len);
+      memcpy(*s->buffer + *s->tail, str, len);
+      *s->tail += (unsigned char)len;
+      lua_pop(L, 1);
+    }
+    lua_pushliteral(L, "");
+    return 1;
+  }
+
+  p = res = l_result_init(L, &buffer, res_len);
+  if(tail){
+    memcpy(p, *s->buffer, tail);
+    p += tail;
+    *s->tail = 0;
+  }
+  for(; i <= j; ++i){
+    size_t len, n; const char *str;
+    lua_rawgeti(L, 2, i);
+    str = lua_tolstring(L, -1, &len);
+    n = (size_t)(res + res_len - p);
+    if(n > len) n = len;
+    memcpy(p, str, n);
+    p += n;
+    if(n < len){ /* only the last one may leave a tail */
+      memcpy(*s->buffer + *s->tail, str + n, len - n);
+      *s->tail += (unsigned char)(len - n);
+    }
+    lua_pop(L, 1);
+  }
+
+  if(l_stream_crypt(s, res, res_len) != EXIT_SUCCESS) return fail(L, "invalid block length");
+  l_result_push(&buffer, res_len);
+  return 1;
+}
+
+/* ctx:writev(t[, i[, j]]) */
+static int l_writev(lua_State *L, const l_stream *s){
+  lua_Integer i, j, k;
+  size_t total = 0;
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  i = luaL_optinteger(L, 3, 1);
+  j = luaL_optinteger(L, 4, (lua_Integer)lua_objlen(L, 2));
+
+  for(k = i; k <= j; ++k){
+    lua_rawgeti(L, 2, k);
+    if(lua_type(L, -1) != LUA_TSTRING)
+      return luaL_argerror(L, 2, lua_pushfstring(L, "string expected at index %d", (int)k));
+    total += lua_objlen(L, -1);
+    lua_pop(L, 1);
+  }
+
+  l_buffer_reserve(L, s->buffer, s->buffer_cap, s->buffer_size, (s->tail ? *s->tail : 0) + total);
+
+  if(s->writer_cb_ref == LUA_NOREF){
+    lua_settop(L, 2);
+    return l_writev_result(L, s, i, j, total);
+  }
+
+  lua_settop(L, 2);
+  lua_pushinteger(L, j);
+  lua_pushinteger(L, i);
+  lua_pushinteger(L, 0);
+  return l_writev_writer(L, s);
+}
+
+//}
+
+//{ Pump
+
+/* the next bytes of the source at 2 into p, at most len and 0 at its end.
+ * What a reader function returns and is not used yet stays at 4, with
+ * the offset in it at 5.
+ */
+static size_t l_pump_read(lua_State *L, unsigned char *p, size_t len){
+  void *src = l_file_handle(L, 2);
+  size_t n, size, off;
+  const char *str;
+
+  if(src){
+    FILE *file = l_file_stream(src);
+    if(!file) return luaL_error(L, "attempt to use a closed file");
+    n = fread(p, 1, len, file);
+    if(n < len && ferror(file)) return luaL_error(L, "read error: %s", strerror(errno));
+    return n;
+  }
+
+  off = (size_t)lua_tointeger(L, 5);
+  str = lua_tolstring(L, 4, &size);
+  if(!str || off == size){
+    lua_pushvalue(L, 2);
+    lua_pushinteger(L, (lua_Integer)len);
+    lua_call(L, 1, 1);
+    if(lua_isnil(L, -1)){
+      lua_pop(L, 1);
+      return 0;
+    }
+    str = lua_tolstring(L, -1, &size);
+    if(!str) return luaL_error(L, "reader must return a string or nil");
+    lua_replace(L, 4);
+    off = 0;
+  }
+
+  n = size - off;
+  if(n > len) n = len;
+  memcpy(p, str + off, n);
+  lua_pushinteger(L, (lua_Integer)(off + n));
+  lua_replace(L, 5);
+  return n;
+}
+
+/* the stage of writev, or the scratch buffer at 6 when chunk is more than
+ * the context buffer and no output is kept; never more room than chunk
+ */
+static unsigned char *l_pump_stage(lua_State *L, const l_stream *s, size_t chunk, size_t *room){
+  unsigned char *stage = l_writev_stage(s, room);
+  if(!L_FLUSH_ON(s->flush) && *room < chunk){
+    stage = (unsigned char*)lua_touserdata(L, 6);
+    *room = chunk;
+  }
+  if(*room > chunk) *room = chunk;
+  return stage;
+}
+
+/* ctx:pump(src[, dst][, chunk_size]) runs all of src through the context
+ * in one call. src is a Lua file or a function called with the most bytes
+ * it may return, which returns a string or nil or "" at the end. The input
+ * is read straight into the stage of writev and done in place there, then
+ * it goes to the Lua file dst or else to the writer of the context, which
+ * may not yield here. Returns the number of bytes read.
+ */
+static int l_pump(lua_State *L, const l_stream *s){
+  l_stream ds;
+  l_flush direct;
+  lua_Integer total = 0, chunk_size;
+  unsigned char rest[AES_BLOCK_SIZE], *stage;
+  size_t fill = 0, room, blocks, ready, rest_len, n;
+
+  luaL_argcheck(L, l_file_handle(L, 2) || lua_isfunction(L, 2), 2, "file or function expected");
+  if(lua_type(L, 3) == LUA_TNUMBER){ /* pump(src, chunk_size) */
+    lua_pushnil(L);
+    lua_insert(L, 3);
+  }
+  chunk_size = luaL_optinteger(L, 4, (lua_Integer)s->buffer_size);
+  luaL_argcheck(L, chunk_size >= (AES_BLOCK_SIZE * 2), 4, "chunk size is too small");
+
+  if(!lua_isnoneornil(L, 3)){ /* the output of this call only, nothing kept */
+    memset(&direct, 0, sizeof(direct));
+    direct.file = l_file_handle(L, 3);
+    luaL_argcheck(L, direct.file != NULL, 3, "file expected");
+    ds = *s;
+    ds.flush = &direct;
+    s = &ds;
+  }
+  else luaL_argcheck(L, s->writer_cb_ref != LUA_NOREF, 3, "no writer present");
+
+  l_buffer_reserve(L, s->buffer, s->buffer_cap, s->buffer_size, (size_t)chunk_size);
+  lua_settop(L, 3);
+  lua_pushnil(L);
+  lua_pushinteger(L, 0);
+  if(*s->buffer_cap < (size_t)chunk_size) lua_newuserdata(L, (size_t)chunk_size);
+  else lua_pushnil(L);
+
+  stage = l_pump_stage(L, s, (size_t)chunk_size, &room);
+  if(s->tail){ /* the pending tail goes first */
+    fill = *s->tail;
+    if(stage != *s->buffer) memcpy(stage, *s->buffer, fill);
+    *s->tail = 0;
+  }
+
+  do{
+    n = l_pump_read(L, stage + fill, room - fill);
+    fill  += n;
+    total += n;
+    if(n && fill < room) continue;
+
+    blocks = s->tail ? (fill & ~(size_t)(AES_BLOCK_SIZE - 1)) : fill;
+    if(l_stream_crypt(s, stage, blocks) != EXIT_SUCCESS) return fail(L, "invalid block length");
+    rest_len = fill - blocks;
+    memcpy(rest, stage + blocks, rest_len);
+
+    ready = blocks ? l_flush_done(s->flush, blocks) : 0;
+    if(ready && !l_flush_file(L, s->flush, stage, ready)){
+      int k = l_stream_push_writer(L, s);
+      lua_call(L, l_flush_push(L, s->flush, k, stage, ready), 0);
+    }
+
+    stage = l_pump_stage(L, s, (size_t)chunk_size, &room);
+    memcpy(stage, rest, rest_len);
+    fill = rest_len;
+  }while(n);
+
+  if(s->tail){
+    memcpy(*s->buffer, rest, fill);
+    *s->tail = (unsigned char)fill;
+  }
+
+  lua_pushinteger(L, total);
+  return 1;
+}
+
+//}
+
+//{ File
+
+static const char *const l_file_modes[] = {"ecb", "cbc", "cfb", "ofb", "ctr", NULL};
+
+/* indexed by AES_FILE_THREADS, _URING and _PREAD */
+static const char *const l_file_engines[] = {"threads", "uring", "pread", NULL};
+
+/* the string field name of the options at opt pushed, NULL if it is nil */
+static const char *l_file_opt_string(lua_State *L, int opt, const char *name, size_t *len){
+  const char *str;
+  lua_getfield(L, opt, name);
+  if(lua_isnil(L, -1)) return NULL;
+  str = lua_tolstring(L, -1, len);
+  if(!str) luaL_argerror(L, opt, lua_pushfstring(L, "string expected for %s", name));
+  return str;
+}
+
+static lua_Integer l_file_opt_integer(lua_State *L, int opt, const char *name, lua_Integer def){
+  lua_Integer n;
+  lua_getfield(L, opt, name);
+  if(lua_isnil(L, -1)) n = def;
+  else if(lua_isnumber(L, -1)) n = lua_tointeger(L, -1);
+  else return luaL_argerror(L, opt, lua_pushfstring(L, "number expected for %s", name));
+  lua_pop(L, 1);
+  return n;
+}
+
+/* the AES_CTR_* of the inc_mode option, named as for set_inc_mode */
+static int l_file_opt_inc_mode(lua_State *L, int opt){
+  size_t len; const char *str = l_file_opt_string(L, opt, "inc_mode", &len);
+  if(!str) return AES_CTR_INC_BE;
+  luaL_argcheck(L, (str[0] == 'b' || str[0] == 'f'), opt, "invalid increment mode");
+  if(str[1] == 'd' && str[2] == 'w') return (str[0] == 'b') ? AES_CTR_DEC_BE : AES_CTR_DEC_LE;
+  return (str[0] == 'b')
+    ? ((str[1] == 'd') ? AES_CTR_DEC_BE_LEGACY : AES_CTR_INC_BE)
+    : ((str[1] == 'd') ? AES_CTR_DEC_LE_LEGACY : AES_CTR_INC_LE);
+}
+
+static void l_file_push_size(lua_State *L, unsigned long long n){
+#if LUA_VERSION_NUM >= 503
+  lua_pushinteger(L, (lua_Integer)n);
+#else
+  lua_pushnumber(L, (lua_Number)n);
+#endif
+}
+
+/* nil and the error of a file operation */
+static int l_file_fail(lua_State *L, const char *error, int err_no){
+  lua_pushnil(L);
+  if(err_no) lua_pushfstring(L, "%s: %s", error, strerror(err_no));
+  else lua_pushstring(L, error);
+  return 2;
+}
+
+/* the key on the top, a string or a key object, set up in cx */
+static void l_file_key_setup(lua_State *L, int opt, int decrypt, aes_encrypt_ctx *cx){
+  l_sched sched;
+  int ret;
 
-#if LUA_VERSION_NUM < 503 /* Lua 5.2 */
+  luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING || l_test_key_at(L, -1), opt, "key expected");
+  l_sched_init(&sched, cx);
+  ret = l_key_setup(L, lua_gettop(L), decrypt, &sched, cx);
+  if(sched.cx != cx) memcpy(cx, sched.cx, sizeof(aes_encrypt_ctx));
+  l_sched_release(L, &sched, cx);
+  luaL_argcheck(L, ret == EXIT_SUCCESS, opt, "invalid key length");
+  cx->inf.b[2] = 0;
+}
 
-typedef int lua_KContext;
+/* aes.encrypt_file(in_path, out_path, options) and decrypt_file, see
+ * aes_file.h. The options are mode, key (a string or a key object), iv
+ * unless the mode is ECB, inc_mode for CTR as for set_inc_mode, and the
+ * size and number of the buffers. Returns the number of bytes read or nil
+ * and the error.
+ */
+static int l_aes_crypt_file(lua_State *L, int decrypt){
+  const char *in_path  = luaL_checkstring(L, 1);
+  const char *out_path = luaL_checkstring(L, 2);
+  aes_file_job job;
+  const char *str;
+  size_t len;
+  lua_Integer size, buffers;
+  int i, ret;
+
+  luaL_checktype(L, 3, LUA_TTABLE);
+  lua_settop(L, 3);
+  memset(&job, 0, sizeof(job));
+  job.backend  = l_backend(L);
+  job.decrypt  = decrypt;
+  job.ctr_mode = AES_CTR_INC_BE;
+
+  str = l_file_opt_string(L, 3, "mode", &len);
+  for(i = 0; str && l_file_modes[i]; ++i){
+    if(!strcmp(str, l_file_modes[i])) break;
+  }
+  luaL_argcheck(L, str && l_file_modes[i], 3, "invalid mode");
+  job.mode = i;
 
-typedef lua_CFunction lua_KFunction;
+  lua_getfield(L, 3, "key");
+  l_file_key_setup(L, 3, decrypt && job.mode <= AES_FILE_CBC, job.cx.ectx);
 
-#endif
+  if(job.mode != AES_FILE_ECB){
+    str = l_file_opt_string(L, 3, "iv", &len);
+    luaL_argcheck(L, str && len >= IV_SIZE, 3, "invalid iv length");
+    memcpy(job.iv, str, IV_SIZE);
+  }
 
-#if LUA_VERSION_NUM < 503
-#  define KFUNCTION(F) F(lua_State *L)
-#else
-#  define KFUNCTION(F) F(lua_State *L, int status, lua_KContext ctx)
-#endif
+  if(job.mode == AES_FILE_CTR) job.ctr_mode = l_file_opt_inc_mode(L, 3);
 
-#endif
+  size    = l_file_opt_integer(L, 3, "buffer_size", AES_FILE_BUFFER_SIZE);
+  buffers = l_file_opt_integer(L, 3, "buffers", AES_FILE_BUFFERS);
+  luaL_argcheck(L, size >= AES_BLOCK_SIZE && (size_t)size <= MAX_CHUNK_SIZE, 3, "invalid buffer_size");
+  luaL_argcheck(L, buffers >= 2 && buffers <= 64, 3, "invalid number of buffers");
+  job.buffer_size = (size_t)size & ~(size_t)(AES_BLOCK_SIZE - 1);
+  job.buffers     = (int)buffers;
 
-#define L_AES_ALIGN_INT(V, A) (((V) & (A - 1)) ? (((V) | (A - 1)) + 0x01) : (V))
+  str = l_file_opt_string(L, 3, "engine", &len);
+  for(i = 0; str && l_file_engines[i]; ++i){
+    if(!strcmp(str, l_file_engines[i])) break;
+  }
+  luaL_argcheck(L, !str || (l_file_engines[i] && i != AES_FILE_PREAD), 3, "invalid engine");
+  job.engine = str ? i : AES_FILE_THREADS;
 
-#if defined( USE_INTEL_AES_IF_PRESENT )
-#  define L_AES_ALIGN_CTX_VALUE 16
-#else
-#  define L_AES_ALIGN_CTX_VALUE 0
-#endif
+  ret = aes_file_crypt(in_path, out_path, &job);
+  l_secure_zero(&job.cx, sizeof(job.cx));
+  l_secure_zero(job.iv, sizeof(job.iv));
 
-#if L_AES_ALIGN_CTX_VALUE == 0
-#  define L_AES_ALIGNED_SIZE(size) size
-#  define L_AES_ALIGNED_CTX(T, ctx) (T*)ctx
-#else
-#  define L_AES_ALIGNED_SIZE(size) (L_AES_ALIGN_CTX_VALUE + size - 1)
-#  define L_AES_ALIGNED_CTX(T, ctx) (T*)L_AES_ALIGN_INT((uintptr_t)(ctx), L_AES_ALIGN_CTX_VALUE)
-#endif
+  if(ret != EXIT_SUCCESS) return l_file_fail(L, job.error, job.err_no);
 
-static void *laes_aligned_newudatap(lua_State *L, size_t size, const void *p) {
-  void* ptr = lutil_newudatap_impl(L, L_AES_ALIGNED_SIZE(size), p);
-  return L_AES_ALIGNED_CTX(void, ptr);
+  l_file_push_size(L, job.count);
+  lua_pushstring(L, l_file_engines[job.engine]);
+  return 2;
 }
 
-static void *laes_aligned_checkudatap(lua_State *L, int i, const void *p) {
-  void* ptr = lutil_checkudatap(L, i, p);
-  if (!ptr) return NULL;
-  return L_AES_ALIGNED_CTX(void, ptr);
+static int l_aes_encrypt_file(lua_State *L){
+  return l_aes_crypt_file(L, 0);
 }
 
-//! @fixme on mingw32 (gcc 4.8.1) this does not work
-#define L_AES_STATIC_ASSERT(A) {(void)(int(*)[(A)?1:0])0;}
+static int l_aes_decrypt_file(lua_State *L){
+  return l_aes_crypt_file(L, 1);
+}
 
-static int fail(lua_State *L, const char *msg){
-  lua_pushnil(L);
-  lua_pushstring(L, msg);
-  return 2;
+#define L_EFILE_NAME "AES encrypted file"
+static const char * L_EFILE_CTX = L_EFILE_NAME;
+
+/* read only CTR encrypted file, see aes_file_reader */
+typedef struct l_efile_tag{
+  aes_file_reader    r;
+  unsigned long long pos;
+} l_efile;
+
+static l_efile *l_get_efile_at(lua_State *L, int i){
+  l_efile *f = (l_efile *)laes_aligned_checkudatap(L, i, L_EFILE_CTX);
+  luaL_argcheck(L, f != NULL, i, L_EFILE_NAME " expected");
+  if(!f->r.cache) luaL_error(L, "attempt to use a closed file");
+  return f;
 }
 
-static int pass(lua_State *L){
-  lua_pushboolean(L, 1);
+/* aes.open_encrypted(path, key, iv [, mode [, options]]) opens a file
+ * written by CTR for reading at any offset. The mode may only be "r" or
+ * "rb"; the options are inc_mode as for set_inc_mode and the size and
+ * number of the cached pages. Returns the file or nil and the error.
+ */
+static int l_aes_open_encrypted(lua_State *L){
+  const char *path = luaL_checkstring(L, 1);
+  const char *mode = luaL_optstring(L, 4, "r");
+  size_t len; const char *iv = luaL_checklstring(L, 3, &len);
+  lua_Integer size, pages;
+  l_efile *f;
+
+  luaL_argcheck(L, len >= IV_SIZE, 3, "invalid iv length");
+  luaL_argcheck(L, !strcmp(mode, "r") || !strcmp(mode, "rb"), 4, "invalid mode");
+  if(!lua_isnoneornil(L, 5)) luaL_checktype(L, 5, LUA_TTABLE);
+  else{ lua_settop(L, 4); lua_newtable(L); }
+  lua_settop(L, 5);
+
+  f = (l_efile *)laes_aligned_newudatap(L, sizeof(l_efile), L_EFILE_CTX);
+  memset(f, 0, sizeof(l_efile));
+  f->r.backend  = l_backend(L);
+  f->r.ctr_mode = l_file_opt_inc_mode(L, 5);
+  memcpy(f->r.iv, iv, IV_SIZE);
+
+  size  = l_file_opt_integer(L, 5, "page_size", AES_FILE_PAGE_SIZE);
+  pages = l_file_opt_integer(L, 5, "pages", AES_FILE_PAGES);
+  luaL_argcheck(L, size >= AES_BLOCK_SIZE && (size_t)size <= MAX_CHUNK_SIZE, 5, "invalid page_size");
+  luaL_argcheck(L, pages >= 1 && pages <= 1024, 5, "invalid number of pages");
+  f->r.page_size = (size_t)size & ~(size_t)(AES_BLOCK_SIZE - 1);
+  f->r.pages     = (int)pages;
+
+  lua_pushvalue(L, 2);
+  l_file_key_setup(L, 2, 0, f->r.ectx);
+  lua_settop(L, 6);
+
+  if(aes_file_reader_open(&f->r, path) != EXIT_SUCCESS){
+    l_secure_zero(f->r.ectx, sizeof(f->r.ectx));
+    return l_file_fail(L, f->r.error, f->r.err_no);
+  }
   return 1;
 }
 
-/* return [ buffer[be], buffer[en] ] */
-static const char* correct_range(lua_State *L, int idx, size_t *size){
-  if(lua_islightuserdata(L, idx)){
-    /* (ud, [offset=0,] size) */
-    const char *input = (const char*)lua_touserdata(L, idx);
-    int of, sz;
+/* the plain text at the position, NULL at the end; raises read errors */
+static const unsigned char *l_efile_at(lua_State *L, l_efile *f, size_t *len){
+  const unsigned char *p = aes_file_reader_at(&f->r, f->pos, len);
+  if(!p && f->r.error){
+    l_file_fail(L, f->r.error, f->r.err_no);
+    f->r.error = NULL;
+    lua_error(L);
+  }
+  return p;
+}
 
-    if(lua_isnumber(L, idx + 1) && lua_isnumber(L, idx + 2)){
-      of = lua_tointeger(L, idx + 1);
-      sz = lua_tointeger(L, idx + 2);
-      lua_remove(L, idx + 1);
-      lua_remove(L, idx + 1);
+/* up to n bytes or the rest with n = -1, 0 if there is nothing left */
+static int l_efile_read_bytes(lua_State *L, l_efile *f, size_t n){
+  luaL_Buffer b; size_t len, got = 0;
+  const unsigned char *p;
+
+  luaL_buffinit(L, &b);
+  while(got < n && (p = l_efile_at(L, f, &len)) != NULL){
+    if(len > n - got) len = n - got;
+    luaL_addlstring(&b, (const char*)p, len);
+    f->pos += len; got += len;
+  }
+  luaL_pushresult(&b);
+  return got > 0;
+}
+
+/* the next line with the end of line or not, 0 at the end of the file */
+static int l_efile_read_line(lua_State *L, l_efile *f, int keep){
+  luaL_Buffer b; size_t len;
+  const unsigned char *p, *e;
+  int found = 0, got = 0;
+
+  luaL_buffinit(L, &b);
+  while(!found && (p = l_efile_at(L, f, &len)) != NULL){
+    if((e = (const unsigned char*)memchr(p, '\n', len)) != NULL){
+      found = 1;
+      len = e - p + 1;
+    }
+    luaL_addlstring(&b, (const char*)p, (found && !keep) ? len - 1 : len);
+    f->pos += len; got = 1;
+  }
+  luaL_pushresult(&b);
+  return got;
+}
+
+/* the formats from first on as for io.read, nil at the first one that fails */
+static int l_efile_read_impl(lua_State *L, l_efile *f, int first){
+  int i, n = lua_gettop(L), ok = 1;
+
+  if(first > n){
+    lua_pushliteral(L, "l");
+    ++n;
+  }
+  luaL_checkstack(L, n - first + LUA_MINSTACK, "too many arguments");
+
+  for(i = first; ok && i <= n; ++i){
+    if(lua_type(L, i) == LUA_TNUMBER){
+      lua_Integer k = lua_tointeger(L, i);
+      luaL_argcheck(L, k >= 0, i, "invalid size");
+      if(k == 0){
+        lua_pushliteral(L, "");
+        ok = f->pos < f->r.size;
+      }
+      else ok = l_efile_read_bytes(L, f, (size_t)k);
     }
     else{
-      of = 0;
-      sz = luaL_checkinteger(L, idx + 1);
-      lua_remove(L, idx + 1);
+      const char *fmt = luaL_checkstring(L, i);
+      if(*fmt == '*') ++fmt;
+      switch(*fmt){
+        case 'l': ok = l_efile_read_line(L, f, 0); break;
+        case 'L': ok = l_efile_read_line(L, f, 1); break;
+        case 'a': l_efile_read_bytes(L, f, (size_t)-1); ok = 1; break;
+        default: return luaL_argerror(L, i, "invalid format");
+      }
     }
+  }
 
-    luaL_argcheck(L, of >= 0, idx+1, "invalid offset");
-    luaL_argcheck(L, sz >= 0, idx+2, "invalid size"  );
+  if(!ok){
+    lua_pop(L, 1);
+    lua_pushnil(L);
+  }
+  return i - first;
+}
 
-    *size = sz;
-    return input + of;
+static int l_efile_read(lua_State *L){
+  l_efile *f = l_get_efile_at(L, 1);
+  return l_efile_read_impl(L, f, 2);
+}
+
+static int l_efile_lines_iter(lua_State *L){
+  l_efile *f = (l_efile *)laes_aligned_checkudatap(L, lua_upvalueindex(1), L_EFILE_CTX);
+  if(!f->r.cache) return luaL_error(L, "file is already closed");
+  lua_settop(L, 0);
+  lua_pushvalue(L, lua_upvalueindex(2));
+  return l_efile_read_impl(L, f, 1);
+}
+
+static int l_efile_lines(lua_State *L){
+  l_get_efile_at(L, 1);
+  if(lua_isnoneornil(L, 2)){
+    lua_settop(L, 1);
+    lua_pushliteral(L, "l");
   }
-  else{
-    /* (str, [be=1[, size=(#str-be+1)]]) */
-    size_t len; const char *input = luaL_checklstring(L, idx, &len);
-    int be, sz;
-    if(lua_isnumber(L, idx+1)){
-      be = lua_tointeger(L, idx+1);
-      lua_remove(L, idx+1);
-      luaL_argcheck(L, be > 0, idx+1, "invalid begin index");
-    }else be = 1;
+  lua_settop(L, 2);
+  lua_pushcclosure(L, l_efile_lines_iter, 2);
+  return 1;
+}
 
-    if(lua_isnumber(L, idx+1)){
-      sz = lua_tointeger(L, idx+1);
-      lua_remove(L, idx+1);
-      luaL_argcheck(L, sz >= 0, idx+2, "invalid size");
-    }else sz = len;
+static int l_efile_seek(lua_State *L){
+  static const char *const whences[] = {"set", "cur", "end", NULL};
+  l_efile *f = l_get_efile_at(L, 1);
+  int whence = luaL_checkoption(L, 2, "cur", whences);
+  lua_Integer offset = luaL_optinteger(L, 3, 0);
+  unsigned long long base = (whence == 0) ? 0 : (whence == 1) ? f->pos : f->r.size;
 
-    if((size_t)be > len){
-      *size = 0;
-      return input;
-    }
+  /* in unsigned, -offset overflows for the smallest integer */
+  if(offset < 0 && 0 - (unsigned long long)offset > base)
+    return l_file_fail(L, "invalid position", EINVAL);
+  f->pos = base + (unsigned long long)offset;
 
-    len = len - be + 1;
+  l_file_push_size(L, f->pos);
+  return 1;
+}
 
-    if((size_t)sz > len) sz = len;
+static int l_efile_size(lua_State *L){
+  l_efile *f = l_get_efile_at(L, 1);
+  l_file_push_size(L, f->r.size);
+  return 1;
+}
 
-    *size = sz;
-    return input + be - 1;
+static int l_efile_close(lua_State *L){
+  l_efile *f = (l_efile *)laes_aligned_checkudatap(L, 1, L_EFILE_CTX);
+  luaL_argcheck(L, f != NULL, 1, L_EFILE_NAME " expected");
+  if(f->r.cache){
+    aes_file_reader_close(&f->r);
+    l_secure_zero(f->r.ectx, sizeof(f->r.ectx));
   }
+  return pass(L);
+}
+
+static int l_efile_tostring(lua_State *L){
+  l_efile *f = (l_efile *)laes_aligned_checkudatap(L, 1, L_EFILE_CTX);
+  lua_pushfstring(L, L_EFILE_NAME " (%s): %p", f->r.cache ? "open" : "closed", f);
+  return 1;
 }
 
+static const struct luaL_Reg l_efile_meth[] = {
+  {"__gc",       l_efile_close     },
+  {"__tostring", l_efile_tostring  },
+  {"read",       l_efile_read      },
+  {"lines",      l_efile_lines     },
+  {"seek",       l_efile_seek      },
+  {"size",       l_efile_size      },
+  {"close",      l_efile_close     },
+
+  {NULL, NULL}
+};
+
+//}
+
 //{ AES
 
 #define L_AES_NAME "AES context"
@@ -158,6 +1693,8 @@ typedef struct l_aes_ctx_tag{
     aes_decrypt_ctx dctx[1];
   };
   FLAG_TYPE       flags;
+  l_engine        engine;
+  l_sched         sched;
   unsigned char   buffer[AES_BLOCK_SIZE];
 } l_aes_ctx;
 
@@ -172,6 +1709,8 @@ static int l_aes_new(lua_State *L, int decrypt){
   l_aes_ctx *ctx = (l_aes_ctx*)laes_aligned_newudatap(L, sizeof(l_aes_ctx), L_AES_CTX);
 
   memset(ctx, 0, sizeof(l_aes_ctx));
+  l_sched_init(&ctx->sched, ctx->ectx);
+  l_engine_init(L, &ctx->engine);
 
   if(decrypt) ctx->flags |= FLAG_DECRYPT;
 
@@ -205,6 +1744,7 @@ static int l_aes_destroy(lua_State *L){
     ctx->flags &= ~FLAG_OPEN;
   }
 
+  l_sched_release(L, &ctx->sched, ctx->ectx);
   ctx->flags |= FLAG_DESTROYED;
   return 0;
 }
@@ -218,21 +1758,18 @@ static int l_aes_destroyed(lua_State *L){
 
 static int l_aes_open(lua_State *L){
   l_aes_ctx *ctx = l_get_aes_at(L, 1);
-  size_t key_len; const unsigned char *key = (unsigned char *)luaL_checklstring(L, 2, &key_len);
   int result;
 
   luaL_argcheck(L, !CTX_FLAG(ctx, OPEN), 1, L_AES_NAME " already open" );
 
-  if(CTX_FLAG(ctx, DECRYPT))
-    result = aes_decrypt_key(key, key_len, ctx->dctx);
-  else
-    result = aes_encrypt_key(key, key_len, ctx->ectx);
+  result = l_key_setup(L, 2, CTX_FLAG(ctx, DECRYPT), &ctx->sched, ctx->ectx);
 
   if(result != EXIT_SUCCESS){
     luaL_argcheck(L, 0, 2, "invalid key length");
     return 0;
   }
 
+  l_engine_select(&ctx->engine, L_ECTX(ctx));
   ctx->flags |= FLAG_OPEN;
   lua_settop(L, 1);
   return 1;
@@ -254,14 +1791,36 @@ static int l_aes_closed(lua_State *L){
 static int l_aes_encrypt(lua_State *L){
   l_aes_ctx *ctx = l_get_aes_at(L, 1);
   size_t len; const unsigned char *data = (unsigned char *)correct_range(L, 2, &len);
+  luaL_Buffer buffer;
+  unsigned char *out;
+  const size_t res_len = len;
   int ret;
 
-  luaL_argcheck(L, len == AES_BLOCK_SIZE, 1, L_AES_NAME " invalid block length" );
+  luaL_argcheck(L, len && !(len & (AES_BLOCK_SIZE - 1)), 1, L_AES_NAME " invalid block length" );
+
+  if(len == AES_BLOCK_SIZE){
+    if(CTX_FLAG(ctx, DECRYPT)) ret = L_ENGINE(ctx)->decrypt(data, ctx->buffer, L_DCTX(ctx));
+    else                       ret = L_ENGINE(ctx)->encrypt(data, ctx->buffer, L_ECTX(ctx));
+
+    lua_pushlstring(L, (char *)ctx->buffer, AES_BLOCK_SIZE);
+    return 1;
+  }
+
+  // several blocks at once go through the multi block ECB code
+  lua_settop(L, 2);
+  out = l_result_init(L, &buffer, res_len);
+  while(len){
+    size_t left = (len > MAX_CHUNK_SIZE) ? MAX_CHUNK_SIZE : len;
 
-  if(CTX_FLAG(ctx, DECRYPT)) ret = aes_decrypt(data, ctx->buffer, ctx->dctx);
-  else                       ret = aes_encrypt(data, ctx->buffer, ctx->ectx);
+    if(CTX_FLAG(ctx, DECRYPT)) ret = L_ENGINE(ctx)->ecb_decrypt(data, out, left, L_DCTX(ctx));
+    else                       ret = L_ENGINE(ctx)->ecb_encrypt(data, out, left, L_ECTX(ctx));
+    if(ret != EXIT_SUCCESS) return fail(L, "invalid block length");
 
-  lua_pushlstring(L, (char *)ctx->buffer, AES_BLOCK_SIZE);
+    out  += left;
+    data += left;
+    len  -= left;
+  }
+  l_result_push(&buffer, res_len);
   return 1;
 }
 
@@ -292,11 +1851,16 @@ typedef struct l_ecb_ctx_tag{
     aes_decrypt_ctx dctx[1];
   };
   FLAG_TYPE       flags;
+  l_engine        engine;
+  l_sched         sched;
   int             writer_cb_ref;
   int             writer_ud_ref;
+  l_flush         flush;
   unsigned char   tail;
   size_t          buffer_size;
-  unsigned char   buffer[1];
+  size_t          buffer_cap;
+  unsigned char   *buffer;
+  unsigned char   buffer_data[1];
 } l_ecb_ctx;
 
 static l_ecb_ctx *l_get_ecb_at (lua_State *L, int i) {
@@ -315,8 +1879,12 @@ static int l_ecb_new(lua_State *L, int decrypt){
 
   ctx = (l_ecb_ctx *)laes_aligned_newudatap(L, ctx_len, L_ECB_CTX);
   memset(ctx, 0, ctx_len);
+  l_sched_init(&ctx->sched, ctx->ectx);
+  l_engine_init(L, &ctx->engine);
 
   ctx->buffer_size = buf_len;
+  ctx->buffer_cap = buf_len;
+  ctx->buffer     = ctx->buffer_data;
   ctx->writer_cb_ref  = LUA_NOREF;
   ctx->writer_ud_ref  = LUA_NOREF;
   if(decrypt) ctx->flags |= FLAG_DECRYPT;
@@ -327,13 +1895,15 @@ static int l_ecb_new(lua_State *L, int decrypt){
 static int l_ecb_clone(lua_State *L){
   l_ecb_ctx *ctx = l_get_ecb_at(L, 1);
   size_t buf_len = luaL_optinteger(L, 2, ctx->buffer_size);
-  const size_t ctx_len = sizeof(l_ecb_ctx) + buf_len - 1;
+  const size_t ctx_len = sizeof(l_ecb_ctx);
   l_ecb_ctx *ctx2;
 
   luaL_argcheck (L, buf_len >= (AES_BLOCK_SIZE * 2), 1, "buffer size is too small");
 
   ctx2 = (l_ecb_ctx *)laes_aligned_newudatap(L, ctx_len, L_ECB_CTX);
   memset(ctx2, 0, ctx_len);
+  l_sched_init(&ctx2->sched, ctx2->ectx);
+  l_engine_init(L, &ctx2->engine);
 
   ctx2->buffer_size    = buf_len;
   ctx2->flags          = ctx->flags;
@@ -341,8 +1911,13 @@ static int l_ecb_clone(lua_State *L){
   ctx2->writer_cb_ref  = LUA_NOREF;
   ctx2->writer_ud_ref  = LUA_NOREF;
 
-  memcpy(ctx2->ctx, ctx->ctx, sizeof(aes_encrypt_ctx));
-  memcpy(ctx2->buffer, ctx->buffer, ctx->tail);
+  l_sched_share(L, &ctx->sched, ctx->ectx, CTX_FLAG(ctx, DECRYPT));
+  l_sched_copy(L, &ctx2->sched, &ctx->sched);
+  ctx2->ectx->inf.l = ctx->ectx->inf.l;
+  if(ctx->tail){
+    L_BUFFER_RESERVE(L, ctx2, 2 * AES_BLOCK_SIZE);
+    memcpy(ctx2->buffer, ctx->buffer, ctx->tail);
+  }
   return 1;
 }
 
@@ -377,6 +1952,9 @@ static int l_ecb_destroy(lua_State *L){
     ctx->flags &= ~FLAG_OPEN;
   }
 
+  l_sched_release(L, &ctx->sched, ctx->ectx);
+  L_BUFFER_FREE(L, ctx);
+  l_flush_resize(L, &ctx->flush, 0);
   ctx->flags |= FLAG_DESTROYED;
   return 0;
 }
@@ -390,21 +1968,18 @@ static int l_ecb_destroyed(lua_State *L){
 
 static int l_ecb_open(lua_State *L){
   l_ecb_ctx *ctx = l_get_ecb_at(L, 1);
-  size_t key_len; const unsigned char *key = (unsigned char *)luaL_checklstring(L, 2, &key_len);
   int result;
 
   luaL_argcheck(L, !CTX_FLAG(ctx, OPEN), 1, L_ECB_NAME " already open" );
 
-  if(CTX_FLAG(ctx, DECRYPT))
-    result = aes_decrypt_key(key, key_len, ctx->dctx);
-  else
-    result = aes_encrypt_key(key, key_len, ctx->ectx);
+  result = l_key_setup(L, 2, CTX_FLAG(ctx, DECRYPT), &ctx->sched, ctx->ectx);
 
   if(result != EXIT_SUCCESS){
     luaL_argcheck(L, 0, 2, "invalid key length");
     return 0;
   }
 
+  l_engine_select(&ctx->engine, L_ECTX(ctx));
   ctx->flags |= FLAG_OPEN;
   lua_settop(L, 1);
   return 1;
@@ -423,8 +1998,27 @@ static int l_ecb_closed(lua_State *L){
   return 1;
 }
 
+static int l_ecb_push_writer(lua_State *L, l_ecb_ctx *ctx){
+  assert(ctx->writer_cb_ref != LUA_NOREF);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_cb_ref);
+  if(ctx->writer_ud_ref != LUA_NOREF){
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_ud_ref);
+    return 2;
+  }
+  return 1;
+}
+
 static int l_ecb_set_writer(lua_State *L){
   l_ecb_ctx *ctx = l_get_ecb_at(L, 1);
+  int raw; size_t flush_size = l_flush_opt(L, 4, ctx->flush.size, &raw);
+
+  if(ctx->flush.len){
+    int n = l_ecb_push_writer(L, ctx);
+    l_flush_write(L, &ctx->flush, n, 0);
+  }
+  l_flush_resize(L, &ctx->flush, flush_size);
+  ctx->flush.raw  = raw;
+  ctx->flush.file = NULL;
 
   if(ctx->writer_ud_ref != LUA_NOREF){
     luaL_unref(L, LUA_REGISTRYINDEX, ctx->writer_ud_ref);
@@ -439,7 +2033,11 @@ static int l_ecb_set_writer(lua_State *L){
   if(lua_gettop(L) >= 3){// reader + context
     lua_settop(L, 3);
     luaL_argcheck(L, !lua_isnil(L, 2), 2, "no writer present");
-    ctx->writer_ud_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    if(lua_isnil(L, 3)) lua_pop(L, 1); /* only the options given */
+    else{
+      ctx->flush.file = l_file_writer(L, 2, 3);
+      ctx->writer_ud_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
     ctx->writer_cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
     assert(1 == lua_gettop(L));
     return 1;
@@ -462,6 +2060,7 @@ static int l_ecb_set_writer(lua_State *L){
   if(lua_isuserdata(L, 2) || lua_istable(L, 2)){
     lua_getfield(L, 2, "write");
     luaL_argcheck(L, lua_isfunction(L, -1), 2, "write method not found in object");
+    ctx->flush.file = l_file_writer(L, 3, 2);
     ctx->writer_cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
     ctx->writer_ud_ref = luaL_ref(L, LUA_REGISTRYINDEX);
     assert(1 == lua_gettop(L));
@@ -472,34 +2071,54 @@ static int l_ecb_set_writer(lua_State *L){
   return lua_error(L);
 }
 
-static int l_ecb_get_writer(lua_State *L){
+static int l_ecb_set_flush(lua_State *L){
   l_ecb_ctx *ctx = l_get_ecb_at(L, 1);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_cb_ref);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_ud_ref);
-  return 2;
+  lua_Integer size = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, size >= 0, 2, "invalid size");
+  lua_settop(L, 1);
+
+  if(ctx->flush.len){
+    int n = l_ecb_push_writer(L, ctx);
+    l_flush_write(L, &ctx->flush, n, 0);
+  }
+  l_flush_resize(L, &ctx->flush, (size_t)size);
+  return 1;
 }
 
-static int l_ecb_push_writer(lua_State *L, l_ecb_ctx *ctx){
-  assert(ctx->writer_cb_ref != LUA_NOREF);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_cb_ref);
-  if(ctx->writer_ud_ref != LUA_NOREF){
-    lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_ud_ref);
-    return 2;
+static int l_ecb_flush(lua_State *L){
+  l_ecb_ctx *ctx = l_get_ecb_at(L, 1);
+  lua_settop(L, 1);
+
+  if(ctx->flush.len){
+    int n = l_ecb_push_writer(L, ctx);
+    l_flush_write(L, &ctx->flush, n, 1);
   }
   return 1;
 }
 
+static int l_ecb_get_writer(lua_State *L){
+  l_ecb_ctx *ctx = l_get_ecb_at(L, 1);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_cb_ref);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_ud_ref);
+  return 2;
+}
+
 static int l_ecb_write_impl(lua_State *L){
   l_ecb_ctx *ctx = l_get_ecb_at(L, 1);
   size_t len; const unsigned char *data = (unsigned char *)correct_range(L, 2, &len);
   size_t align_len;
   const int use_buffer = (ctx->writer_cb_ref == LUA_NOREF)?1:0;
+  const size_t res_len = use_buffer ? ((ctx->tail + len) >> AES_BLOCK_NB) << AES_BLOCK_NB : 0;
   luaL_Buffer buffer; int n = 0;
+  l_flush *f = use_buffer ? NULL : &ctx->flush;
+  unsigned char *out, *res = NULL;
+  size_t left, ready;
   const unsigned char *b, *e;
   int ret;
 
+  L_BUFFER_RESERVE(L, ctx, use_buffer ? 2 * AES_BLOCK_SIZE : ctx->tail + len);
   lua_settop(L, 2);
-  if(use_buffer) luaL_buffinit(L, &buffer);
+  if(use_buffer) res = l_result_init(L, &buffer, res_len);
   else n = l_ecb_push_writer(L, ctx);
 
   if(ctx->tail){
@@ -519,15 +2138,15 @@ static int l_ecb_write_impl(lua_State *L){
     }
     assert(ctx->tail == AES_BLOCK_SIZE);
 
-    if(CTX_FLAG(ctx, DECRYPT)) ret = aes_ecb_decrypt(ctx->buffer, ctx->buffer + AES_BLOCK_SIZE, AES_BLOCK_SIZE, ctx->dctx);
-    else                       ret = aes_ecb_encrypt(ctx->buffer, ctx->buffer + AES_BLOCK_SIZE, AES_BLOCK_SIZE, ctx->ectx);
+    out = use_buffer ? res : l_flush_out(f, ctx->buffer + AES_BLOCK_SIZE);
+    if(CTX_FLAG(ctx, DECRYPT)) ret = L_ENGINE(ctx)->ecb_decrypt(ctx->buffer, out, AES_BLOCK_SIZE, L_DCTX(ctx));
+    else                       ret = L_ENGINE(ctx)->ecb_encrypt(ctx->buffer, out, AES_BLOCK_SIZE, L_ECTX(ctx));
 
-    if(use_buffer) luaL_addlstring(&buffer, (char*)ctx->buffer + AES_BLOCK_SIZE, AES_BLOCK_SIZE);
-    else{
+    if(use_buffer) res += AES_BLOCK_SIZE;
+    else if((ready = l_flush_done(f, AES_BLOCK_SIZE)) != 0 && !l_flush_file(L, f, out, ready)){
       int i, top = lua_gettop(L);
       for(i = n; i > 0; --i) lua_pushvalue(L, top - i + 1);
-      lua_pushlstring(L, (char*)ctx->buffer + AES_BLOCK_SIZE, AES_BLOCK_SIZE);
-      lua_call(L, n, 0);
+      lua_call(L, l_flush_push(L, f, n, out, ready), 0);
     }
 
     ctx->tail = 0;
@@ -536,20 +2155,20 @@ static int l_ecb_write_impl(lua_State *L){
   }
   align_len = (len >> AES_BLOCK_NB) << AES_BLOCK_NB;
 
-  for(b = data, e = data + align_len; b < e; b += ctx->buffer_size){
-    size_t left = e - b;
-    if(left > ctx->buffer_size) left = ctx->buffer_size;
+  for(b = data, e = data + align_len; b < e; b += left){
+    out  = use_buffer ? res : l_flush_out(f, ctx->buffer);
+    left = use_buffer ? MAX_CHUNK_SIZE : l_flush_room(f, ctx->buffer_cap);
+    if(left > (size_t)(e - b)) left = e - b;
 
-    if(CTX_FLAG(ctx, DECRYPT)) ret = aes_ecb_decrypt(b, ctx->buffer, left, ctx->dctx);
-    else                       ret = aes_ecb_encrypt(b, ctx->buffer, left, ctx->ectx);
+    if(CTX_FLAG(ctx, DECRYPT)) ret = L_ENGINE(ctx)->ecb_decrypt(b, out, left, L_DCTX(ctx));
+    else                       ret = L_ENGINE(ctx)->ecb_encrypt(b, out, left, L_ECTX(ctx));
     if(ret != EXIT_SUCCESS) return fail(L, "invalid block length");
 
-    if(use_buffer) luaL_addlstring(&buffer, (char*)ctx->buffer, left);
-    else{
+    if(use_buffer) res += left;
+    else if((ready = l_flush_done(f, left)) != 0 && !l_flush_file(L, f, out, ready)){
       int i, top = lua_gettop(L);
       for(i = n; i > 0; --i) lua_pushvalue(L, top - i + 1);
-      lua_pushlstring(L, (char*)ctx->buffer, left);
-      lua_call(L, n, 0);
+      lua_call(L, l_flush_push(L, f, n, out, ready), 0);
     }
   }
 
@@ -557,7 +2176,7 @@ static int l_ecb_write_impl(lua_State *L){
   memcpy(ctx->buffer, data + align_len, ctx->tail);
 
   if(use_buffer){
-    luaL_pushresult(&buffer);
+    l_result_push(&buffer, res_len);
     return 1;
   }
 
@@ -577,6 +2196,8 @@ static int KFUNCTION(l_ecb_writek){
 
 static int l_ecb_writek_impl(lua_State *L, int status, lua_KContext lctx){
   l_ecb_ctx *ctx = l_get_ecb_at(L, 1);
+  unsigned char *out;
+  size_t left, ready;
   size_t len, align_len;
   const unsigned char *data, *b, *e;
   int ret;
@@ -588,6 +2209,7 @@ static int l_ecb_writek_impl(lua_State *L, int status, lua_KContext lctx){
   }
   else{
     data = (unsigned char *)correct_range(L, 2, &len);
+    L_BUFFER_RESERVE(L, ctx, ctx->tail + len);
   }
 
   lua_settop(L, 2);
@@ -603,56 +2225,184 @@ static int l_ecb_writek_impl(lua_State *L, int status, lua_KContext lctx){
     memcpy(ctx->buffer + ctx->tail, data, tail);
     ctx->tail += tail;
     if(ctx->tail < AES_BLOCK_SIZE){
-      return 0;
+      return 0;
+    }
+    assert(ctx->tail == AES_BLOCK_SIZE);
+
+    out = l_flush_out(&ctx->flush, ctx->buffer + AES_BLOCK_SIZE);
+    if(CTX_FLAG(ctx, DECRYPT)) ret = L_ENGINE(ctx)->ecb_decrypt(ctx->buffer, out, AES_BLOCK_SIZE, L_DCTX(ctx));
+    else                       ret = L_ENGINE(ctx)->ecb_encrypt(ctx->buffer, out, AES_BLOCK_SIZE, L_ECTX(ctx));
+
+    ctx->tail = 0;
+    data += tail;
+    len  -= tail;
+
+    if((ready = l_flush_done(&ctx->flush, AES_BLOCK_SIZE)) != 0 && !l_flush_file(L, &ctx->flush, out, ready)){
+      lua_pushlightuserdata(L, (void*)data);
+      lua_pushinteger(L, len);
+      {
+        int n = l_ecb_push_writer(L, ctx);
+        lua_callk(L, l_flush_push(L, &ctx->flush, n, out, ready), 0, 2, l_ecb_writek);
+      }
+    }
+  }
+  align_len = (len >> AES_BLOCK_NB) << AES_BLOCK_NB;
+
+  for(b = data, e = data + align_len; b < e; b += left){
+    const unsigned char *next;
+    out  = l_flush_out(&ctx->flush, ctx->buffer);
+    left = l_flush_room(&ctx->flush, ctx->buffer_cap);
+    if(left > (size_t)(e - b)) left = e - b;
+
+    if(CTX_FLAG(ctx, DECRYPT)) ret = L_ENGINE(ctx)->ecb_decrypt(b, out, left, L_DCTX(ctx));
+    else                       ret = L_ENGINE(ctx)->ecb_encrypt(b, out, left, L_ECTX(ctx));
+    if(ret != EXIT_SUCCESS) return fail(L, "invalid block length");
+    if((ready = l_flush_done(&ctx->flush, left)) == 0 || l_flush_file(L, &ctx->flush, out, ready)) continue;
+
+    next = b + left;
+    assert(len >= (next - data));
+
+    lua_pushlightuserdata(L, (void*)(next));
+    lua_pushinteger(L, len - (next - data));
+    {
+      int n = l_ecb_push_writer(L, ctx);
+      lua_callk(L, l_flush_push(L, &ctx->flush, n, out, ready), 0, 2, l_ecb_writek);
+    }
+    lua_settop(L, 2);
+  }
+
+  ctx->tail = len - align_len;
+  memcpy(ctx->buffer, data + align_len, ctx->tail);
+
+  return 0;
+}
+
+#endif
+
+static int l_ecb_crypt_buf(void *c, unsigned char *buf, int len){
+  l_ecb_ctx *ctx = (l_ecb_ctx *)c;
+  if(CTX_FLAG(ctx, DECRYPT)) return L_ENGINE(ctx)->ecb_decrypt(buf, buf, len, L_DCTX(ctx));
+  return L_ENGINE(ctx)->ecb_encrypt(buf, buf, len, L_ECTX(ctx));
+}
+
+#if LUA_VERSION_NUM >= 502
+static int KFUNCTION(l_ecb_writevk);
+#endif
+
+static const l_stream *l_ecb_stream(l_ecb_ctx *ctx, l_stream *s){
+  s->ctx           = ctx;
+  s->buffer        = &ctx->buffer;
+  s->buffer_cap    = &ctx->buffer_cap;
+  s->buffer_size   = ctx->buffer_size;
+  s->tail          = &ctx->tail;
+  s->flush         = &ctx->flush;
+  s->writer_cb_ref = ctx->writer_cb_ref;
+  s->writer_ud_ref = ctx->writer_ud_ref;
+  s->crypt         = l_ecb_crypt_buf;
+#if LUA_VERSION_NUM >= 502
+  s->k             = l_ecb_writevk;
+#endif
+  return s;
+}
+
+#if LUA_VERSION_NUM >= 502
+static int KFUNCTION(l_ecb_writevk){
+  l_stream s;
+#if LUA_VERSION_NUM < 503
+  lua_KContext ctx; lua_getctx(L, &ctx);
+#else
+  (void)status;
+#endif
+  return l_writev_k(L, l_ecb_stream(l_get_ecb_at(L, 1), &s), ctx);
+}
+#endif
+
+static int l_ecb_writev(lua_State *L){
+  l_ecb_ctx *ctx = l_get_ecb_at(L, 1);
+  l_stream s;
+  luaL_argcheck(L, CTX_FLAG(ctx, OPEN), 1, L_ECB_NAME " is close");
+  return l_writev(L, l_ecb_stream(ctx, &s));
+}
+
+static int l_ecb_pump(lua_State *L){
+  l_ecb_ctx *ctx = l_get_ecb_at(L, 1);
+  l_stream s;
+  luaL_argcheck(L, CTX_FLAG(ctx, OPEN), 1, L_ECB_NAME " is close");
+  return l_pump(L, l_ecb_stream(ctx, &s));
+}
+
+static int l_ecb_write_into(lua_State *L){
+  l_ecb_ctx *ctx = l_get_ecb_at(L, 1);
+  size_t dst_len; unsigned char *dst = dst_range(L, 2, &dst_len);
+  size_t len; const unsigned char *data = (unsigned char *)correct_range(L, 4, &len);
+  const size_t out_len = ((ctx->tail + len) >> AES_BLOCK_NB) << AES_BLOCK_NB;
+  size_t align_len;
+  const unsigned char *b, *e;
+  int ret;
+
+  luaL_argcheck(L, CTX_FLAG(ctx, OPEN), 1, L_ECB_NAME " is close");
+  luaL_argcheck(L, out_len <= dst_len, 2, "destination is too small");
+
+  L_BUFFER_RESERVE(L, ctx, 2 * AES_BLOCK_SIZE);
+
+  if(ctx->tail){
+    unsigned char tail = AES_BLOCK_SIZE - ctx->tail;
+    assert(ctx->tail < AES_BLOCK_SIZE);
+    if(tail > len) tail = len;
+    memcpy(ctx->buffer + ctx->tail, data, tail);
+    ctx->tail += tail;
+    data += tail;
+    len  -= tail;
+    if(ctx->tail < AES_BLOCK_SIZE){
+      lua_pushinteger(L, 0);
+      return 1;
     }
-    assert(ctx->tail == AES_BLOCK_SIZE);
-
-    if(CTX_FLAG(ctx, DECRYPT)) ret = aes_ecb_decrypt(ctx->buffer, ctx->buffer + AES_BLOCK_SIZE, AES_BLOCK_SIZE, ctx->dctx);
-    else                       ret = aes_ecb_encrypt(ctx->buffer, ctx->buffer + AES_BLOCK_SIZE, AES_BLOCK_SIZE, ctx->ectx);
 
+    if(CTX_FLAG(ctx, DECRYPT)) ret = L_ENGINE(ctx)->ecb_decrypt(ctx->buffer, dst, AES_BLOCK_SIZE, L_DCTX(ctx));
+    else                       ret = L_ENGINE(ctx)->ecb_encrypt(ctx->buffer, dst, AES_BLOCK_SIZE, L_ECTX(ctx));
     ctx->tail = 0;
-    data += tail;
-    len  -= tail;
-
-    lua_pushlightuserdata(L, (void*)data);
-    lua_pushinteger(L, len);
-    {
-      int n = l_ecb_push_writer(L, ctx);
-      lua_pushlstring(L, (char*)ctx->buffer + AES_BLOCK_SIZE, AES_BLOCK_SIZE);
-      lua_callk(L, n, 0, 2, l_ecb_writek);
-    }
+    dst += AES_BLOCK_SIZE;
   }
   align_len = (len >> AES_BLOCK_NB) << AES_BLOCK_NB;
 
-  for(b = data, e = data + align_len; b < e; b += ctx->buffer_size){
+  for(b = data, e = data + align_len; b < e; b += MAX_CHUNK_SIZE, dst += MAX_CHUNK_SIZE){
     size_t left = e - b;
-    const unsigned char *next;
-    if(left > ctx->buffer_size) left = ctx->buffer_size;
+    if(left > MAX_CHUNK_SIZE) left = MAX_CHUNK_SIZE;
 
-    if(CTX_FLAG(ctx, DECRYPT)) ret = aes_ecb_decrypt(b, ctx->buffer, left, ctx->dctx);
-    else                       ret = aes_ecb_encrypt(b, ctx->buffer, left, ctx->ectx);
+    if(CTX_FLAG(ctx, DECRYPT)) ret = L_ENGINE(ctx)->ecb_decrypt(b, dst, (int)left, L_DCTX(ctx));
+    else                       ret = L_ENGINE(ctx)->ecb_encrypt(b, dst, (int)left, L_ECTX(ctx));
     if(ret != EXIT_SUCCESS) return fail(L, "invalid block length");
-
-    next = b + left;
-    assert(len >= (next - data));
-
-    lua_pushlightuserdata(L, (void*)(next));
-    lua_pushinteger(L, len - (next - data));
-    {
-      int n = l_ecb_push_writer(L, ctx);
-      lua_pushlstring(L, (char*)ctx->buffer, left);
-      lua_callk(L, n, 0, 2, l_ecb_writek);
-    }
-    lua_settop(L, 2);
   }
 
   ctx->tail = len - align_len;
   memcpy(ctx->buffer, data + align_len, ctx->tail);
 
-  return 0;
+  lua_pushinteger(L, (lua_Integer)out_len);
+  return 1;
 }
 
-#endif
+static int l_ecb_transform(lua_State *L){
+  l_ecb_ctx *ctx = l_get_ecb_at(L, 1);
+  size_t len; unsigned char *data = ud_range(L, 2, &len);
+  unsigned char *b, *e;
+  int ret;
+
+  luaL_argcheck(L, CTX_FLAG(ctx, OPEN), 1, L_ECB_NAME " is close");
+  luaL_argcheck(L, ctx->tail == 0, 1, L_ECB_NAME " has a partial block");
+  luaL_argcheck(L, (len & (AES_BLOCK_SIZE - 1)) == 0, 4, "size is not a multiple of the block size");
+
+  for(b = data, e = data + len; b < e; b += MAX_CHUNK_SIZE){
+    size_t left = e - b;
+    if(left > MAX_CHUNK_SIZE) left = MAX_CHUNK_SIZE;
+
+    if(CTX_FLAG(ctx, DECRYPT)) ret = L_ENGINE(ctx)->ecb_decrypt(b, b, (int)left, L_DCTX(ctx));
+    else                       ret = L_ENGINE(ctx)->ecb_encrypt(b, b, (int)left, L_ECTX(ctx));
+    if(ret != EXIT_SUCCESS) return fail(L, "invalid block length");
+  }
+
+  lua_pushinteger(L, (lua_Integer)len);
+  return 1;
+}
 
 static int l_ecb_write(lua_State *L){
   l_ecb_ctx *ctx = l_get_ecb_at(L, 1);
@@ -673,19 +2423,16 @@ static int l_ecb_write(lua_State *L){
 static int l_ecb_reset(lua_State *L){
   l_ecb_ctx *ctx = l_get_ecb_at(L, 1);
   if(lua_gettop(L) > 1){ /*reset key*/
-    size_t key_len; const unsigned char *key = (unsigned char *)luaL_checklstring(L, 2, &key_len);
     int result;
 
-    if(CTX_FLAG(ctx, DECRYPT))
-      result = aes_decrypt_key(key, key_len, ctx->dctx);
-    else
-      result = aes_encrypt_key(key, key_len, ctx->ectx);
+    result = l_key_setup(L, 2, CTX_FLAG(ctx, DECRYPT), &ctx->sched, ctx->ectx);
 
     if(result != EXIT_SUCCESS){
       luaL_argcheck(L, 0, 2, "invalid key length");
       return 0;
     }
 
+    l_engine_select(&ctx->engine, L_ECTX(ctx));
     ctx->flags |= FLAG_OPEN;
   }
 
@@ -703,7 +2450,14 @@ static const struct luaL_Reg l_ecb_meth[] = {
   {"destroyed",  l_ecb_destroyed   },
   {"set_writer", l_ecb_set_writer  },
   {"get_writer", l_ecb_get_writer  },
+  {"set_flush",  l_ecb_set_flush   },
+  {"flush",      l_ecb_flush       },
   {"write",      l_ecb_write       },
+  {"writev",     l_ecb_writev      },
+
+  {"pump",       l_ecb_pump        },
+  {"write_into", l_ecb_write_into  },
+  {"transform",  l_ecb_transform   },
   {"reset",      l_ecb_reset       },
   {"close",      l_ecb_close       },
   {"clone",      l_ecb_clone       },
@@ -725,12 +2479,17 @@ typedef struct l_cbc_ctx_tag{
     aes_decrypt_ctx dctx[1];
   };
   FLAG_TYPE       flags;
+  l_engine        engine;
+  l_sched         sched;
   unsigned char   iv[IV_SIZE];
   int             writer_cb_ref;
   int             writer_ud_ref;
+  l_flush         flush;
   unsigned char   tail;
   size_t          buffer_size;
-  unsigned char   buffer[1];
+  size_t          buffer_cap;
+  unsigned char   *buffer;
+  unsigned char   buffer_data[1];
 } l_cbc_ctx;
 
 static l_cbc_ctx *l_get_cbc_at (lua_State *L, int i) {
@@ -749,8 +2508,12 @@ static int l_cbc_new(lua_State *L, int decrypt){
 
   ctx = (l_cbc_ctx *)laes_aligned_newudatap(L, ctx_len, L_CBC_CTX);
   memset(ctx, 0, ctx_len);
+  l_sched_init(&ctx->sched, ctx->ectx);
+  l_engine_init(L, &ctx->engine);
 
   ctx->buffer_size = buf_len;
+  ctx->buffer_cap = buf_len;
+  ctx->buffer     = ctx->buffer_data;
   ctx->writer_cb_ref  = LUA_NOREF;
   ctx->writer_ud_ref  = LUA_NOREF;
   if(decrypt) ctx->flags |= FLAG_DECRYPT;
@@ -761,13 +2524,15 @@ static int l_cbc_new(lua_State *L, int decrypt){
 static int l_cbc_clone(lua_State *L){
   l_cbc_ctx *ctx = l_get_cbc_at(L, 1);
   size_t buf_len = luaL_optinteger(L, 2, ctx->buffer_size);
-  const size_t ctx_len = sizeof(l_cbc_ctx) + buf_len - 1;
+  const size_t ctx_len = sizeof(l_cbc_ctx);
   l_cbc_ctx *ctx2;
 
   luaL_argcheck (L, buf_len >= (AES_BLOCK_SIZE * 2), 1, "buffer size is too small");
 
   ctx2 = (l_cbc_ctx *)laes_aligned_newudatap(L, ctx_len, L_CBC_CTX);
   memset(ctx2, 0, ctx_len);
+  l_sched_init(&ctx2->sched, ctx2->ectx);
+  l_engine_init(L, &ctx2->engine);
 
   ctx2->buffer_size    = buf_len;
   ctx2->flags          = ctx->flags;
@@ -775,9 +2540,14 @@ static int l_cbc_clone(lua_State *L){
   ctx2->writer_cb_ref  = LUA_NOREF;
   ctx2->writer_ud_ref  = LUA_NOREF;
 
-  memcpy(ctx2->ctx, ctx->ctx, sizeof(aes_encrypt_ctx));
+  l_sched_share(L, &ctx->sched, ctx->ectx, CTX_FLAG(ctx, DECRYPT));
+  l_sched_copy(L, &ctx2->sched, &ctx->sched);
+  ctx2->ectx->inf.l = ctx->ectx->inf.l;
   memcpy(ctx2->iv,  ctx->iv,  IV_SIZE);
-  memcpy(ctx2->buffer, ctx->buffer, ctx->tail);
+  if(ctx->tail){
+    L_BUFFER_RESERVE(L, ctx2, 2 * AES_BLOCK_SIZE);
+    memcpy(ctx2->buffer, ctx->buffer, ctx->tail);
+  }
   return 1;
 }
 
@@ -812,6 +2582,9 @@ static int l_cbc_destroy(lua_State *L){
     ctx->flags &= ~FLAG_OPEN;
   }
 
+  l_sched_release(L, &ctx->sched, ctx->ectx);
+  L_BUFFER_FREE(L, ctx);
+  l_flush_resize(L, &ctx->flush, 0);
   ctx->flags |= FLAG_DESTROYED;
   return 0;
 }
@@ -825,7 +2598,6 @@ static int l_cbc_destroyed(lua_State *L){
 
 static int l_cbc_open(lua_State *L){
   l_cbc_ctx *ctx = l_get_cbc_at(L, 1);
-  size_t key_len; const unsigned char *key = (unsigned char *)luaL_checklstring(L, 2, &key_len);
   size_t iv_len;  const unsigned char *iv  = (unsigned char *)luaL_checklstring(L, 3, &iv_len);
   int result;
 
@@ -834,16 +2606,14 @@ static int l_cbc_open(lua_State *L){
   luaL_argcheck(L, iv_len >= IV_SIZE, 1, L_CBC_NAME " invalid iv length" );
   memcpy(ctx->iv, iv, IV_SIZE);
 
-  if(CTX_FLAG(ctx, DECRYPT))
-    result = aes_decrypt_key(key, key_len, ctx->dctx);
-  else
-    result = aes_encrypt_key(key, key_len, ctx->ectx);
+  result = l_key_setup(L, 2, CTX_FLAG(ctx, DECRYPT), &ctx->sched, ctx->ectx);
 
   if(result != EXIT_SUCCESS){
     luaL_argcheck(L, 0, 2, "invalid key length");
     return 0;
   }
 
+  l_engine_select(&ctx->engine, L_ECTX(ctx));
   ctx->flags |= FLAG_OPEN;
   lua_settop(L, 1);
   return 1;
@@ -862,8 +2632,27 @@ static int l_cbc_closed(lua_State *L){
   return 1;
 }
 
+static int l_cbc_push_writer(lua_State *L, l_cbc_ctx *ctx){
+  assert(ctx->writer_cb_ref != LUA_NOREF);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_cb_ref);
+  if(ctx->writer_ud_ref != LUA_NOREF){
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_ud_ref);
+    return 2;
+  }
+  return 1;
+}
+
 static int l_cbc_set_writer(lua_State *L){
   l_cbc_ctx *ctx = l_get_cbc_at(L, 1);
+  int raw; size_t flush_size = l_flush_opt(L, 4, ctx->flush.size, &raw);
+
+  if(ctx->flush.len){
+    int n = l_cbc_push_writer(L, ctx);
+    l_flush_write(L, &ctx->flush, n, 0);
+  }
+  l_flush_resize(L, &ctx->flush, flush_size);
+  ctx->flush.raw  = raw;
+  ctx->flush.file = NULL;
 
   if(ctx->writer_ud_ref != LUA_NOREF){
     luaL_unref(L, LUA_REGISTRYINDEX, ctx->writer_ud_ref);
@@ -878,7 +2667,11 @@ static int l_cbc_set_writer(lua_State *L){
   if(lua_gettop(L) >= 3){// reader + context
     lua_settop(L, 3);
     luaL_argcheck(L, !lua_isnil(L, 2), 2, "no writer present");
-    ctx->writer_ud_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    if(lua_isnil(L, 3)) lua_pop(L, 1); /* only the options given */
+    else{
+      ctx->flush.file = l_file_writer(L, 2, 3);
+      ctx->writer_ud_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
     ctx->writer_cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
     assert(1 == lua_gettop(L));
     return 1;
@@ -901,6 +2694,7 @@ static int l_cbc_set_writer(lua_State *L){
   if(lua_isuserdata(L, 2) || lua_istable(L, 2)){
     lua_getfield(L, 2, "write");
     luaL_argcheck(L, lua_isfunction(L, -1), 2, "write method not found in object");
+    ctx->flush.file = l_file_writer(L, 3, 2);
     ctx->writer_cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
     ctx->writer_ud_ref = luaL_ref(L, LUA_REGISTRYINDEX);
     assert(1 == lua_gettop(L));
@@ -911,34 +2705,54 @@ static int l_cbc_set_writer(lua_State *L){
   return lua_error(L);
 }
 
-static int l_cbc_get_writer(lua_State *L){
+static int l_cbc_set_flush(lua_State *L){
   l_cbc_ctx *ctx = l_get_cbc_at(L, 1);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_cb_ref);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_ud_ref);
-  return 2;
+  lua_Integer size = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, size >= 0, 2, "invalid size");
+  lua_settop(L, 1);
+
+  if(ctx->flush.len){
+    int n = l_cbc_push_writer(L, ctx);
+    l_flush_write(L, &ctx->flush, n, 0);
+  }
+  l_flush_resize(L, &ctx->flush, (size_t)size);
+  return 1;
 }
 
-static int l_cbc_push_writer(lua_State *L, l_cbc_ctx *ctx){
-  assert(ctx->writer_cb_ref != LUA_NOREF);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_cb_ref);
-  if(ctx->writer_ud_ref != LUA_NOREF){
-    lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_ud_ref);
-    return 2;
+static int l_cbc_flush(lua_State *L){
+  l_cbc_ctx *ctx = l_get_cbc_at(L, 1);
+  lua_settop(L, 1);
+
+  if(ctx->flush.len){
+    int n = l_cbc_push_writer(L, ctx);
+    l_flush_write(L, &ctx->flush, n, 1);
   }
   return 1;
 }
 
+static int l_cbc_get_writer(lua_State *L){
+  l_cbc_ctx *ctx = l_get_cbc_at(L, 1);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_cb_ref);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_ud_ref);
+  return 2;
+}
+
 static int l_cbc_write_impl(lua_State *L){
   l_cbc_ctx *ctx = l_get_cbc_at(L, 1);
   size_t len; const unsigned char *data = (unsigned char *)correct_range(L, 2, &len);
   size_t align_len;
   const int use_buffer = (ctx->writer_cb_ref == LUA_NOREF)?1:0;
+  const size_t res_len = use_buffer ? ((ctx->tail + len) >> AES_BLOCK_NB) << AES_BLOCK_NB : 0;
   luaL_Buffer buffer; int n = 0;
+  l_flush *f = use_buffer ? NULL : &ctx->flush;
+  unsigned char *out, *res = NULL;
+  size_t left, ready;
   const unsigned char *b, *e;
   int ret;
 
+  L_BUFFER_RESERVE(L, ctx, use_buffer ? 2 * AES_BLOCK_SIZE : ctx->tail + len);
   lua_settop(L, 2);
-  if(use_buffer) luaL_buffinit(L, &buffer);
+  if(use_buffer) res = l_result_init(L, &buffer, res_len);
   else n = l_cbc_push_writer(L, ctx);
 
   if(ctx->tail){
@@ -958,15 +2772,15 @@ static int l_cbc_write_impl(lua_State *L){
     }
     assert(ctx->tail == AES_BLOCK_SIZE);
 
-    if(CTX_FLAG(ctx, DECRYPT)) ret = aes_cbc_decrypt(ctx->buffer, ctx->buffer + AES_BLOCK_SIZE, AES_BLOCK_SIZE, ctx->iv, ctx->dctx);
-    else                       ret = aes_cbc_encrypt(ctx->buffer, ctx->buffer + AES_BLOCK_SIZE, AES_BLOCK_SIZE, ctx->iv, ctx->ectx);
+    out = use_buffer ? res : l_flush_out(f, ctx->buffer + AES_BLOCK_SIZE);
+    if(CTX_FLAG(ctx, DECRYPT)) ret = L_ENGINE(ctx)->cbc_decrypt(ctx->buffer, out, AES_BLOCK_SIZE, ctx->iv, L_DCTX(ctx));
+    else                       ret = L_ENGINE(ctx)->cbc_encrypt(ctx->buffer, out, AES_BLOCK_SIZE, ctx->iv, L_ECTX(ctx));
 
-    if(use_buffer) luaL_addlstring(&buffer, (char*)ctx->buffer + AES_BLOCK_SIZE, AES_BLOCK_SIZE);
-    else{
+    if(use_buffer) res += AES_BLOCK_SIZE;
+    else if((ready = l_flush_done(f, AES_BLOCK_SIZE)) != 0 && !l_flush_file(L, f, out, ready)){
       int i, top = lua_gettop(L);
       for(i = n; i > 0; --i) lua_pushvalue(L, top - i + 1);
-      lua_pushlstring(L, (char*)ctx->buffer + AES_BLOCK_SIZE, AES_BLOCK_SIZE);
-      lua_call(L, n, 0);
+      lua_call(L, l_flush_push(L, f, n, out, ready), 0);
     }
 
     ctx->tail = 0;
@@ -976,20 +2790,20 @@ static int l_cbc_write_impl(lua_State *L){
   align_len = (len >> AES_BLOCK_NB) << AES_BLOCK_NB;
 
 
-  for(b = data, e = data + align_len; b < e; b += ctx->buffer_size){
-    size_t left = e - b;
-    if(left > ctx->buffer_size) left = ctx->buffer_size;
+  for(b = data, e = data + align_len; b < e; b += left){
+    out  = use_buffer ? res : l_flush_out(f, ctx->buffer);
+    left = use_buffer ? MAX_CHUNK_SIZE : l_flush_room(f, ctx->buffer_cap);
+    if(left > (size_t)(e - b)) left = e - b;
 
-    if(CTX_FLAG(ctx, DECRYPT)) ret = aes_cbc_decrypt(b, ctx->buffer, left, ctx->iv, ctx->dctx);
-    else                       ret = aes_cbc_encrypt(b, ctx->buffer, left, ctx->iv, ctx->ectx);
+    if(CTX_FLAG(ctx, DECRYPT)) ret = L_ENGINE(ctx)->cbc_decrypt(b, out, left, ctx->iv, L_DCTX(ctx));
+    else                       ret = L_ENGINE(ctx)->cbc_encrypt(b, out, left, ctx->iv, L_ECTX(ctx));
     if(ret != EXIT_SUCCESS) return fail(L, "invalid block length");
 
-    if(use_buffer) luaL_addlstring(&buffer, (char*)ctx->buffer, left);
-    else{
+    if(use_buffer) res += left;
+    else if((ready = l_flush_done(f, left)) != 0 && !l_flush_file(L, f, out, ready)){
       int i, top = lua_gettop(L);
       for(i = n; i > 0; --i) lua_pushvalue(L, top - i + 1);
-      lua_pushlstring(L, (char*)ctx->buffer, left);
-      lua_call(L, n, 0);
+      lua_call(L, l_flush_push(L, f, n, out, ready), 0);
     }
   }
 
@@ -997,7 +2811,7 @@ static int l_cbc_write_impl(lua_State *L){
   memcpy(ctx->buffer, data + align_len, ctx->tail);
 
   if(use_buffer){
-    luaL_pushresult(&buffer);
+    l_result_push(&buffer, res_len);
     return 1;
   }
 
@@ -1017,6 +2831,8 @@ static int KFUNCTION(l_cbc_writek){
 
 static int l_cbc_writek_impl(lua_State *L, int status, lua_KContext lctx){
   l_cbc_ctx *ctx = l_get_cbc_at(L, 1);
+  unsigned char *out;
+  size_t left, ready;
   size_t len, align_len;
   const unsigned char *data, *b, *e;
   int ret;
@@ -1028,6 +2844,7 @@ static int l_cbc_writek_impl(lua_State *L, int status, lua_KContext lctx){
   }
   else{
     data = (unsigned char *)correct_range(L, 2, &len);
+    L_BUFFER_RESERVE(L, ctx, ctx->tail + len);
   }
 
   lua_settop(L, 2);
@@ -1047,31 +2864,35 @@ static int l_cbc_writek_impl(lua_State *L, int status, lua_KContext lctx){
     }
     assert(ctx->tail == AES_BLOCK_SIZE);
 
-    if(CTX_FLAG(ctx, DECRYPT)) ret = aes_cbc_decrypt(ctx->buffer, ctx->buffer + AES_BLOCK_SIZE, AES_BLOCK_SIZE, ctx->iv, ctx->dctx);
-    else                       ret = aes_cbc_encrypt(ctx->buffer, ctx->buffer + AES_BLOCK_SIZE, AES_BLOCK_SIZE, ctx->iv, ctx->ectx);
+    out = l_flush_out(&ctx->flush, ctx->buffer + AES_BLOCK_SIZE);
+    if(CTX_FLAG(ctx, DECRYPT)) ret = L_ENGINE(ctx)->cbc_decrypt(ctx->buffer, out, AES_BLOCK_SIZE, ctx->iv, L_DCTX(ctx));
+    else                       ret = L_ENGINE(ctx)->cbc_encrypt(ctx->buffer, out, AES_BLOCK_SIZE, ctx->iv, L_ECTX(ctx));
 
     ctx->tail = 0;
     data += tail;
     len  -= tail;
 
-    lua_pushlightuserdata(L, (void*)data);
-    lua_pushinteger(L, len);
-    {
-      int n = l_cbc_push_writer(L, ctx);
-      lua_pushlstring(L, (char*)ctx->buffer + AES_BLOCK_SIZE, AES_BLOCK_SIZE);
-      lua_callk(L, n, 0, 2, l_cbc_writek);
+    if((ready = l_flush_done(&ctx->flush, AES_BLOCK_SIZE)) != 0 && !l_flush_file(L, &ctx->flush, out, ready)){
+      lua_pushlightuserdata(L, (void*)data);
+      lua_pushinteger(L, len);
+      {
+        int n = l_cbc_push_writer(L, ctx);
+        lua_callk(L, l_flush_push(L, &ctx->flush, n, out, ready), 0, 2, l_cbc_writek);
+      }
     }
   }
   align_len = (len >> AES_BLOCK_NB) << AES_BLOCK_NB;
 
-  for(b = data, e = data + align_len; b < e; b += ctx->buffer_size){
-    size_t left = e - b;
+  for(b = data, e = data + align_len; b < e; b += left){
     const unsigned char *next;
-    if(left > ctx->buffer_size) left = ctx->buffer_size;
+    out  = l_flush_out(&ctx->flush, ctx->buffer);
+    left = l_flush_room(&ctx->flush, ctx->buffer_cap);
+    if(left > (size_t)(e - b)) left = e - b;
 
-    if(CTX_FLAG(ctx, DECRYPT)) ret = aes_cbc_decrypt(b, ctx->buffer, left, ctx->iv, ctx->dctx);
-    else                       ret = aes_cbc_encrypt(b, ctx->buffer, left, ctx->iv, ctx->ectx);
+    if(CTX_FLAG(ctx, DECRYPT)) ret = L_ENGINE(ctx)->cbc_decrypt(b, out, left, ctx->iv, L_DCTX(ctx));
+    else                       ret = L_ENGINE(ctx)->cbc_encrypt(b, out, left, ctx->iv, L_ECTX(ctx));
     if(ret != EXIT_SUCCESS) return fail(L, "invalid block length");
+    if((ready = l_flush_done(&ctx->flush, left)) == 0 || l_flush_file(L, &ctx->flush, out, ready)) continue;
 
     next = b + left;
     assert(len >= (next - data));
@@ -1080,8 +2901,7 @@ static int l_cbc_writek_impl(lua_State *L, int status, lua_KContext lctx){
     lua_pushinteger(L, len - (next - data));
     {
       int n = l_cbc_push_writer(L, ctx);
-      lua_pushlstring(L, (char*)ctx->buffer, left);
-      lua_callk(L, n, 0, 2, l_cbc_writek);
+      lua_callk(L, l_flush_push(L, &ctx->flush, n, out, ready), 0, 2, l_cbc_writek);
     }
     lua_settop(L, 2);
   }
@@ -1094,6 +2914,131 @@ static int l_cbc_writek_impl(lua_State *L, int status, lua_KContext lctx){
 
 #endif
 
+static int l_cbc_crypt_buf(void *c, unsigned char *buf, int len){
+  l_cbc_ctx *ctx = (l_cbc_ctx *)c;
+  if(CTX_FLAG(ctx, DECRYPT)) return L_ENGINE(ctx)->cbc_decrypt(buf, buf, len, ctx->iv, L_DCTX(ctx));
+  return L_ENGINE(ctx)->cbc_encrypt(buf, buf, len, ctx->iv, L_ECTX(ctx));
+}
+
+#if LUA_VERSION_NUM >= 502
+static int KFUNCTION(l_cbc_writevk);
+#endif
+
+static const l_stream *l_cbc_stream(l_cbc_ctx *ctx, l_stream *s){
+  s->ctx           = ctx;
+  s->buffer        = &ctx->buffer;
+  s->buffer_cap    = &ctx->buffer_cap;
+  s->buffer_size   = ctx->buffer_size;
+  s->tail          = &ctx->tail;
+  s->flush         = &ctx->flush;
+  s->writer_cb_ref = ctx->writer_cb_ref;
+  s->writer_ud_ref = ctx->writer_ud_ref;
+  s->crypt         = l_cbc_crypt_buf;
+#if LUA_VERSION_NUM >= 502
+  s->k             = l_cbc_writevk;
+#endif
+  return s;
+}
+
+#if LUA_VERSION_NUM >= 502
+static int KFUNCTION(l_cbc_writevk){
+  l_stream s;
+#if LUA_VERSION_NUM < 503
+  lua_KContext ctx; lua_getctx(L, &ctx);
+#else
+  (void)status;
+#endif
+  return l_writev_k(L, l_cbc_stream(l_get_cbc_at(L, 1), &s), ctx);
+}
+#endif
+
+static int l_cbc_writev(lua_State *L){
+  l_cbc_ctx *ctx = l_get_cbc_at(L, 1);
+  l_stream s;
+  luaL_argcheck(L, CTX_FLAG(ctx, OPEN), 1, L_CBC_NAME " is close");
+  return l_writev(L, l_cbc_stream(ctx, &s));
+}
+
+static int l_cbc_pump(lua_State *L){
+  l_cbc_ctx *ctx = l_get_cbc_at(L, 1);
+  l_stream s;
+  luaL_argcheck(L, CTX_FLAG(ctx, OPEN), 1, L_CBC_NAME " is close");
+  return l_pump(L, l_cbc_stream(ctx, &s));
+}
+
+static int l_cbc_write_into(lua_State *L){
+  l_cbc_ctx *ctx = l_get_cbc_at(L, 1);
+  size_t dst_len; unsigned char *dst = dst_range(L, 2, &dst_len);
+  size_t len; const unsigned char *data = (unsigned char *)correct_range(L, 4, &len);
+  const size_t out_len = ((ctx->tail + len) >> AES_BLOCK_NB) << AES_BLOCK_NB;
+  size_t align_len;
+  const unsigned char *b, *e;
+  int ret;
+
+  luaL_argcheck(L, CTX_FLAG(ctx, OPEN), 1, L_CBC_NAME " is close");
+  luaL_argcheck(L, out_len <= dst_len, 2, "destination is too small");
+
+  L_BUFFER_RESERVE(L, ctx, 2 * AES_BLOCK_SIZE);
+
+  if(ctx->tail){
+    unsigned char tail = AES_BLOCK_SIZE - ctx->tail;
+    assert(ctx->tail < AES_BLOCK_SIZE);
+    if(tail > len) tail = len;
+    memcpy(ctx->buffer + ctx->tail, data, tail);
+    ctx->tail += tail;
+    data += tail;
+    len  -= tail;
+    if(ctx->tail < AES_BLOCK_SIZE){
+      lua_pushinteger(L, 0);
+      return 1;
+    }
+
+    if(CTX_FLAG(ctx, DECRYPT)) ret = L_ENGINE(ctx)->cbc_decrypt(ctx->buffer, dst, AES_BLOCK_SIZE, ctx->iv, L_DCTX(ctx));
+    else                       ret = L_ENGINE(ctx)->cbc_encrypt(ctx->buffer, dst, AES_BLOCK_SIZE, ctx->iv, L_ECTX(ctx));
+    ctx->tail = 0;
+    dst += AES_BLOCK_SIZE;
+  }
+  align_len = (len >> AES_BLOCK_NB) << AES_BLOCK_NB;
+
+  for(b = data, e = data + align_len; b < e; b += MAX_CHUNK_SIZE, dst += MAX_CHUNK_SIZE){
+    size_t left = e - b;
+    if(left > MAX_CHUNK_SIZE) left = MAX_CHUNK_SIZE;
+
+    if(CTX_FLAG(ctx, DECRYPT)) ret = L_ENGINE(ctx)->cbc_decrypt(b, dst, (int)left, ctx->iv, L_DCTX(ctx));
+    else                       ret = L_ENGINE(ctx)->cbc_encrypt(b, dst, (int)left, ctx->iv, L_ECTX(ctx));
+    if(ret != EXIT_SUCCESS) return fail(L, "invalid block length");
+  }
+
+  ctx->tail = len - align_len;
+  memcpy(ctx->buffer, data + align_len, ctx->tail);
+
+  lua_pushinteger(L, (lua_Integer)out_len);
+  return 1;
+}
+
+static int l_cbc_transform(lua_State *L){
+  l_cbc_ctx *ctx = l_get_cbc_at(L, 1);
+  size_t len; unsigned char *data = ud_range(L, 2, &len);
+  unsigned char *b, *e;
+  int ret;
+
+  luaL_argcheck(L, CTX_FLAG(ctx, OPEN), 1, L_CBC_NAME " is close");
+  luaL_argcheck(L, ctx->tail == 0, 1, L_CBC_NAME " has a partial block");
+  luaL_argcheck(L, (len & (AES_BLOCK_SIZE - 1)) == 0, 4, "size is not a multiple of the block size");
+
+  for(b = data, e = data + len; b < e; b += MAX_CHUNK_SIZE){
+    size_t left = e - b;
+    if(left > MAX_CHUNK_SIZE) left = MAX_CHUNK_SIZE;
+
+    if(CTX_FLAG(ctx, DECRYPT)) ret = L_ENGINE(ctx)->cbc_decrypt(b, b, (int)left, ctx->iv, L_DCTX(ctx));
+    else                       ret = L_ENGINE(ctx)->cbc_encrypt(b, b, (int)left, ctx->iv, L_ECTX(ctx));
+    if(ret != EXIT_SUCCESS) return fail(L, "invalid block length");
+  }
+
+  lua_pushinteger(L, (lua_Integer)len);
+  return 1;
+}
+
 static int l_cbc_write(lua_State *L){
   l_cbc_ctx *ctx = l_get_cbc_at(L, 1);
   luaL_argcheck(L, CTX_FLAG(ctx, OPEN), 1, L_CBC_NAME " is close");
@@ -1114,23 +3059,20 @@ static int l_cbc_reset(lua_State *L){
   l_cbc_ctx *ctx = l_get_cbc_at(L, 1);
 
   if(lua_gettop(L) > 2){ /*reset key*/
-    size_t key_len; const unsigned char *key = (unsigned char *)luaL_checklstring(L, 2, &key_len);
     size_t iv_len;  const unsigned char *iv  = (unsigned char *)luaL_checklstring(L, 3, &iv_len);
     int result;
 
     luaL_argcheck(L, iv_len >= IV_SIZE, 1, L_CBC_NAME " invalid iv length" );
     memcpy(ctx->iv, iv, IV_SIZE);
 
-    if(CTX_FLAG(ctx, DECRYPT))
-      result = aes_decrypt_key(key, key_len, ctx->dctx);
-    else
-      result = aes_encrypt_key(key, key_len, ctx->ectx);
+    result = l_key_setup(L, 2, CTX_FLAG(ctx, DECRYPT), &ctx->sched, ctx->ectx);
 
     if(result != EXIT_SUCCESS){
       luaL_argcheck(L, 0, 2, "invalid key length");
       return 0;
     }
 
+    l_engine_select(&ctx->engine, L_ECTX(ctx));
     ctx->flags |= FLAG_OPEN;
   }
   else{
@@ -1153,7 +3095,14 @@ static const struct luaL_Reg l_cbc_meth[] = {
   {"destroyed",  l_cbc_destroyed   },
   {"set_writer", l_cbc_set_writer  },
   {"get_writer", l_cbc_get_writer  },
+  {"set_flush",  l_cbc_set_flush   },
+  {"flush",      l_cbc_flush       },
   {"write",      l_cbc_write       },
+  {"writev",     l_cbc_writev      },
+
+  {"pump",       l_cbc_pump        },
+  {"write_into", l_cbc_write_into  },
+  {"transform",  l_cbc_transform   },
   {"reset",      l_cbc_reset       }, 
   {"close",      l_cbc_close       },
   {"clone",      l_cbc_clone       },
@@ -1175,11 +3124,16 @@ typedef struct l_cfb_ctx_tag{
     aes_decrypt_ctx dctx[1];
   };
   FLAG_TYPE       flags;
+  l_engine        engine;
+  l_sched         sched;
   unsigned char   iv[IV_SIZE];
   int             writer_cb_ref;
   int             writer_ud_ref;
+  l_flush         flush;
   size_t          buffer_size;
-  unsigned char   buffer[1];
+  size_t          buffer_cap;
+  unsigned char   *buffer;
+  unsigned char   buffer_data[1];
 } l_cfb_ctx;
 
 static l_cfb_ctx *l_get_cfb_at (lua_State *L, int i) {
@@ -1198,8 +3152,12 @@ static int l_cfb_new(lua_State *L, int decrypt){
 
   ctx = (l_cfb_ctx *)laes_aligned_newudatap(L, ctx_len, L_CFB_CTX);
   memset(ctx, 0, ctx_len);
+  l_sched_init(&ctx->sched, ctx->ectx);
+  l_engine_init(L, &ctx->engine);
 
   ctx->buffer_size = buf_len;
+  ctx->buffer_cap = buf_len;
+  ctx->buffer     = ctx->buffer_data;
   ctx->writer_cb_ref  = LUA_NOREF;
   ctx->writer_ud_ref  = LUA_NOREF;
   if(decrypt) ctx->flags |= FLAG_DECRYPT;
@@ -1210,20 +3168,24 @@ static int l_cfb_new(lua_State *L, int decrypt){
 static int l_cfb_clone(lua_State *L){
   l_cfb_ctx *ctx = l_get_cfb_at(L, 1);
   size_t buf_len = luaL_optinteger(L, 2, ctx->buffer_size);
-  const size_t ctx_len = sizeof(l_cfb_ctx) + buf_len - 1;
+  const size_t ctx_len = sizeof(l_cfb_ctx);
   l_cfb_ctx *ctx2;
 
   luaL_argcheck (L, buf_len >= (AES_BLOCK_SIZE * 2), 1, "buffer size is too small");
 
   ctx2 = (l_cfb_ctx *)laes_aligned_newudatap(L, ctx_len, L_CFB_CTX);
   memset(ctx2, 0, ctx_len);
+  l_sched_init(&ctx2->sched, ctx2->ectx);
+  l_engine_init(L, &ctx2->engine);
 
   ctx2->buffer_size    = buf_len;
   ctx2->flags          = ctx->flags;
   ctx2->writer_cb_ref  = LUA_NOREF;
   ctx2->writer_ud_ref  = LUA_NOREF;
 
-  memcpy(ctx2->ctx, ctx->ctx, sizeof(aes_encrypt_ctx));
+  l_sched_share(L, &ctx->sched, ctx->ectx, 0);
+  l_sched_copy(L, &ctx2->sched, &ctx->sched);
+  ctx2->ectx->inf.l = ctx->ectx->inf.l;
   memcpy(ctx2->iv,  ctx->iv,  IV_SIZE);
   return 1;
 }
@@ -1259,6 +3221,9 @@ static int l_cfb_destroy(lua_State *L){
     ctx->flags &= ~FLAG_OPEN;
   }
 
+  l_sched_release(L, &ctx->sched, ctx->ectx);
+  L_BUFFER_FREE(L, ctx);
+  l_flush_resize(L, &ctx->flush, 0);
   ctx->flags |= FLAG_DESTROYED;
   return 0;
 }
@@ -1272,7 +3237,6 @@ static int l_cfb_destroyed(lua_State *L){
 
 static int l_cfb_open(lua_State *L){
   l_cfb_ctx *ctx = l_get_cfb_at(L, 1);
-  size_t key_len; const unsigned char *key = (unsigned char *)luaL_checklstring(L, 2, &key_len);
   size_t iv_len;  const unsigned char *iv  = (unsigned char *)luaL_checklstring(L, 3, &iv_len);
   int result;
 
@@ -1281,16 +3245,14 @@ static int l_cfb_open(lua_State *L){
   luaL_argcheck(L, iv_len >= IV_SIZE, 1, L_CFB_NAME " invalid iv length" );
   memcpy(ctx->iv, iv, IV_SIZE);
 
-  if(CTX_FLAG(ctx, DECRYPT))
-    result = aes_encrypt_key(key, key_len, ctx->ectx);
-  else
-    result = aes_encrypt_key(key, key_len, ctx->ectx);
+  result = l_key_setup(L, 2, 0, &ctx->sched, ctx->ectx);
 
   if(result != EXIT_SUCCESS){
     luaL_argcheck(L, 0, 2, "invalid key length");
     return 0;
   }
 
+  l_engine_select(&ctx->engine, L_ECTX(ctx));
   ctx->flags |= FLAG_OPEN;
   lua_settop(L, 1);
   return 1;
@@ -1309,8 +3271,27 @@ static int l_cfb_closed(lua_State *L){
   return 1;
 }
 
+static int l_cfb_push_writer(lua_State *L, l_cfb_ctx *ctx){
+  assert(ctx->writer_cb_ref != LUA_NOREF);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_cb_ref);
+  if(ctx->writer_ud_ref != LUA_NOREF){
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_ud_ref);
+    return 2;
+  }
+  return 1;
+}
+
 static int l_cfb_set_writer(lua_State *L){
   l_cfb_ctx *ctx = l_get_cfb_at(L, 1);
+  int raw; size_t flush_size = l_flush_opt(L, 4, ctx->flush.size, &raw);
+
+  if(ctx->flush.len){
+    int n = l_cfb_push_writer(L, ctx);
+    l_flush_write(L, &ctx->flush, n, 0);
+  }
+  l_flush_resize(L, &ctx->flush, flush_size);
+  ctx->flush.raw  = raw;
+  ctx->flush.file = NULL;
 
   if(ctx->writer_ud_ref != LUA_NOREF){
     luaL_unref(L, LUA_REGISTRYINDEX, ctx->writer_ud_ref);
@@ -1325,7 +3306,11 @@ static int l_cfb_set_writer(lua_State *L){
   if(lua_gettop(L) >= 3){// reader + context
     lua_settop(L, 3);
     luaL_argcheck(L, !lua_isnil(L, 2), 2, "no writer present");
-    ctx->writer_ud_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    if(lua_isnil(L, 3)) lua_pop(L, 1); /* only the options given */
+    else{
+      ctx->flush.file = l_file_writer(L, 2, 3);
+      ctx->writer_ud_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
     ctx->writer_cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
     assert(1 == lua_gettop(L));
     return 1;
@@ -1348,6 +3333,7 @@ static int l_cfb_set_writer(lua_State *L){
   if(lua_isuserdata(L, 2) || lua_istable(L, 2)){
     lua_getfield(L, 2, "write");
     luaL_argcheck(L, lua_isfunction(L, -1), 2, "write method not found in object");
+    ctx->flush.file = l_file_writer(L, 3, 2);
     ctx->writer_cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
     ctx->writer_ud_ref = luaL_ref(L, LUA_REGISTRYINDEX);
     assert(1 == lua_gettop(L));
@@ -1358,54 +3344,76 @@ static int l_cfb_set_writer(lua_State *L){
   return lua_error(L);
 }
 
-static int l_cfb_get_writer(lua_State *L){
+static int l_cfb_set_flush(lua_State *L){
   l_cfb_ctx *ctx = l_get_cfb_at(L, 1);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_cb_ref);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_ud_ref);
-  return 2;
+  lua_Integer size = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, size >= 0, 2, "invalid size");
+  lua_settop(L, 1);
+
+  if(ctx->flush.len){
+    int n = l_cfb_push_writer(L, ctx);
+    l_flush_write(L, &ctx->flush, n, 0);
+  }
+  l_flush_resize(L, &ctx->flush, (size_t)size);
+  return 1;
 }
 
-static int l_cfb_push_writer(lua_State *L, l_cfb_ctx *ctx){
-  assert(ctx->writer_cb_ref != LUA_NOREF);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_cb_ref);
-  if(ctx->writer_ud_ref != LUA_NOREF){
-    lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_ud_ref);
-    return 2;
+static int l_cfb_flush(lua_State *L){
+  l_cfb_ctx *ctx = l_get_cfb_at(L, 1);
+  lua_settop(L, 1);
+
+  if(ctx->flush.len){
+    int n = l_cfb_push_writer(L, ctx);
+    l_flush_write(L, &ctx->flush, n, 1);
   }
   return 1;
 }
 
+static int l_cfb_get_writer(lua_State *L){
+  l_cfb_ctx *ctx = l_get_cfb_at(L, 1);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_cb_ref);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_ud_ref);
+  return 2;
+}
+
 static int l_cfb_write_impl(lua_State *L){
   l_cfb_ctx *ctx = l_get_cfb_at(L, 1);
   size_t len; const unsigned char *data = (unsigned char *)correct_range(L, 2, &len);
   const int use_buffer = (ctx->writer_cb_ref == LUA_NOREF)?1:0;
+  const size_t res_len = use_buffer ? len : 0;
   luaL_Buffer buffer; int n = 0;
+  l_flush *f = use_buffer ? NULL : &ctx->flush;
+  unsigned char *out, *res = NULL;
+  size_t left, ready;
   const unsigned char *b, *e;
   int ret;
 
+  if(!use_buffer) L_BUFFER_RESERVE(L, ctx, len);
   lua_settop(L, 2);
-  if(use_buffer) luaL_buffinit(L, &buffer);
+  if(use_buffer) res = l_result_init(L, &buffer, res_len);
   else n = l_cfb_push_writer(L, ctx);
 
-  for(b = data, e = data + len; b < e; b += ctx->buffer_size){
-    size_t left = e - b;
-    if(left > ctx->buffer_size) left = ctx->buffer_size;
+  for(b = data, e = data + len; b < e; b += left){
+    out  = use_buffer ? res : l_flush_out(f, ctx->buffer);
+    left = use_buffer ? MAX_CHUNK_SIZE : l_flush_room(f, ctx->buffer_cap);
+    if(left > (size_t)(e - b)) left = e - b;
 
-    if(CTX_FLAG(ctx, DECRYPT)) ret = aes_cfb_decrypt(b, ctx->buffer, left, ctx->iv, ctx->ectx);
-    else                       ret = aes_cfb_encrypt(b, ctx->buffer, left, ctx->iv, ctx->ectx);
+    l_sched_enter(&ctx->sched, ctx->ectx);
+    if(CTX_FLAG(ctx, DECRYPT)) ret = L_ENGINE(ctx)->cfb_decrypt(b, out, left, ctx->iv, L_ECTX(ctx));
+    else                       ret = L_ENGINE(ctx)->cfb_encrypt(b, out, left, ctx->iv, L_ECTX(ctx));
+    l_sched_leave(&ctx->sched, ctx->ectx);
     if(ret != EXIT_SUCCESS) return fail(L, "invalid block length");
 
-    if(use_buffer) luaL_addlstring(&buffer, (char*)ctx->buffer, left);
-    else{
+    if(use_buffer) res += left;
+    else if((ready = l_flush_done(f, left)) != 0 && !l_flush_file(L, f, out, ready)){
       int i, top = lua_gettop(L);
       for(i = n; i > 0; --i) lua_pushvalue(L, top - i + 1);
-      lua_pushlstring(L, (char*)ctx->buffer, left);
-      lua_call(L, n, 0);
+      lua_call(L, l_flush_push(L, f, n, out, ready), 0);
     }
   }
 
   if(use_buffer){
-    luaL_pushresult(&buffer);
+    l_result_push(&buffer, res_len);
     return 1;
   }
 
@@ -1425,6 +3433,8 @@ static int KFUNCTION(l_cfb_writek){
 
 static int l_cfb_writek_impl(lua_State *L, int status, lua_KContext lctx){
   l_cfb_ctx *ctx = l_get_cfb_at(L, 1);
+  unsigned char *out;
+  size_t left, ready;
   size_t len;
   const unsigned char *data, *b, *e;
   int ret;
@@ -1436,39 +3446,147 @@ static int l_cfb_writek_impl(lua_State *L, int status, lua_KContext lctx){
   }
   else{
     data = (unsigned char *)correct_range(L, 2, &len);
+    L_BUFFER_RESERVE(L, ctx, len);
   }
 
   lua_settop(L, 2);
 
   if(len == 0) return 0;
 
-  for(b = data, e = data + len; b < e; b += ctx->buffer_size){
-    size_t left = e - b;
+  for(b = data, e = data + len; b < e; b += left){
     const unsigned char *next;
-    if(left > ctx->buffer_size) left = ctx->buffer_size;
-
-    if(CTX_FLAG(ctx, DECRYPT)) ret = aes_cfb_decrypt(b, ctx->buffer, left, ctx->iv, ctx->ectx);
-    else                       ret = aes_cfb_encrypt(b, ctx->buffer, left, ctx->iv, ctx->ectx);
+    out  = l_flush_out(&ctx->flush, ctx->buffer);
+    left = l_flush_room(&ctx->flush, ctx->buffer_cap);
+    if(left > (size_t)(e - b)) left = e - b;
+
+    l_sched_enter(&ctx->sched, ctx->ectx);
+    if(CTX_FLAG(ctx, DECRYPT)) ret = L_ENGINE(ctx)->cfb_decrypt(b, out, left, ctx->iv, L_ECTX(ctx));
+    else                       ret = L_ENGINE(ctx)->cfb_encrypt(b, out, left, ctx->iv, L_ECTX(ctx));
+    l_sched_leave(&ctx->sched, ctx->ectx);
     if(ret != EXIT_SUCCESS) return fail(L, "invalid block length");
+    if((ready = l_flush_done(&ctx->flush, left)) == 0 || l_flush_file(L, &ctx->flush, out, ready)) continue;
 
     next = b + left;
     assert(len >= (next - data));
 
-    lua_pushlightuserdata(L, (void*)(next));
-    lua_pushinteger(L, len - (next - data));
-    {
-      int n = l_cfb_push_writer(L, ctx);
-      lua_pushlstring(L, (char*)ctx->buffer, left);
-      lua_callk(L, n, 0, 2, l_cfb_writek);
-    }
-    lua_settop(L, 2);
+    lua_pushlightuserdata(L, (void*)(next));
+    lua_pushinteger(L, len - (next - data));
+    {
+      int n = l_cfb_push_writer(L, ctx);
+      lua_callk(L, l_flush_push(L, &ctx->flush, n, out, ready), 0, 2, l_cfb_writek);
+    }
+    lua_settop(L, 2);
+  }
+
+  return 0;
+}
+
+#endif
+
+static int l_cfb_crypt_buf(void *c, unsigned char *buf, int len){
+  l_cfb_ctx *ctx = (l_cfb_ctx *)c;
+  int ret;
+  l_sched_enter(&ctx->sched, ctx->ectx);
+  if(CTX_FLAG(ctx, DECRYPT)) ret = L_ENGINE(ctx)->cfb_decrypt(buf, buf, len, ctx->iv, L_ECTX(ctx));
+  else                       ret = L_ENGINE(ctx)->cfb_encrypt(buf, buf, len, ctx->iv, L_ECTX(ctx));
+  l_sched_leave(&ctx->sched, ctx->ectx);
+  return ret;
+}
+
+#if LUA_VERSION_NUM >= 502
+static int KFUNCTION(l_cfb_writevk);
+#endif
+
+static const l_stream *l_cfb_stream(l_cfb_ctx *ctx, l_stream *s){
+  s->ctx           = ctx;
+  s->buffer        = &ctx->buffer;
+  s->buffer_cap    = &ctx->buffer_cap;
+  s->buffer_size   = ctx->buffer_size;
+  s->tail          = NULL;
+  s->flush         = &ctx->flush;
+  s->writer_cb_ref = ctx->writer_cb_ref;
+  s->writer_ud_ref = ctx->writer_ud_ref;
+  s->crypt         = l_cfb_crypt_buf;
+#if LUA_VERSION_NUM >= 502
+  s->k             = l_cfb_writevk;
+#endif
+  return s;
+}
+
+#if LUA_VERSION_NUM >= 502
+static int KFUNCTION(l_cfb_writevk){
+  l_stream s;
+#if LUA_VERSION_NUM < 503
+  lua_KContext ctx; lua_getctx(L, &ctx);
+#else
+  (void)status;
+#endif
+  return l_writev_k(L, l_cfb_stream(l_get_cfb_at(L, 1), &s), ctx);
+}
+#endif
+
+static int l_cfb_writev(lua_State *L){
+  l_cfb_ctx *ctx = l_get_cfb_at(L, 1);
+  l_stream s;
+  luaL_argcheck(L, CTX_FLAG(ctx, OPEN), 1, L_CFB_NAME " is close");
+  return l_writev(L, l_cfb_stream(ctx, &s));
+}
+
+static int l_cfb_pump(lua_State *L){
+  l_cfb_ctx *ctx = l_get_cfb_at(L, 1);
+  l_stream s;
+  luaL_argcheck(L, CTX_FLAG(ctx, OPEN), 1, L_CFB_NAME " is close");
+  return l_pump(L, l_cfb_stream(ctx, &s));
+}
+
+static int l_cfb_write_into(lua_State *L){
+  l_cfb_ctx *ctx = l_get_cfb_at(L, 1);
+  size_t dst_len; unsigned char *dst = dst_range(L, 2, &dst_len);
+  size_t len; const unsigned char *data = (unsigned char *)correct_range(L, 4, &len);
+  const unsigned char *b, *e;
+  int ret;
+
+  luaL_argcheck(L, CTX_FLAG(ctx, OPEN), 1, L_CFB_NAME " is close");
+  luaL_argcheck(L, len <= dst_len, 2, "destination is too small");
+
+  for(b = data, e = data + len; b < e; b += MAX_CHUNK_SIZE, dst += MAX_CHUNK_SIZE){
+    size_t left = e - b;
+    if(left > MAX_CHUNK_SIZE) left = MAX_CHUNK_SIZE;
+
+    l_sched_enter(&ctx->sched, ctx->ectx);
+    if(CTX_FLAG(ctx, DECRYPT)) ret = L_ENGINE(ctx)->cfb_decrypt(b, dst, (int)left, ctx->iv, L_ECTX(ctx));
+    else                       ret = L_ENGINE(ctx)->cfb_encrypt(b, dst, (int)left, ctx->iv, L_ECTX(ctx));
+    l_sched_leave(&ctx->sched, ctx->ectx);
+    if(ret != EXIT_SUCCESS) return fail(L, "invalid block length");
+  }
+
+  lua_pushinteger(L, (lua_Integer)len);
+  return 1;
+}
+
+static int l_cfb_transform(lua_State *L){
+  l_cfb_ctx *ctx = l_get_cfb_at(L, 1);
+  size_t len; unsigned char *data = ud_range(L, 2, &len);
+  unsigned char *b, *e;
+  int ret;
+
+  luaL_argcheck(L, CTX_FLAG(ctx, OPEN), 1, L_CFB_NAME " is close");
+
+  for(b = data, e = data + len; b < e; b += MAX_CHUNK_SIZE){
+    size_t left = e - b;
+    if(left > MAX_CHUNK_SIZE) left = MAX_CHUNK_SIZE;
+
+    l_sched_enter(&ctx->sched, ctx->ectx);
+    if(CTX_FLAG(ctx, DECRYPT)) ret = L_ENGINE(ctx)->cfb_decrypt(b, b, (int)left, ctx->iv, L_ECTX(ctx));
+    else                       ret = L_ENGINE(ctx)->cfb_encrypt(b, b, (int)left, ctx->iv, L_ECTX(ctx));
+    l_sched_leave(&ctx->sched, ctx->ectx);
+    if(ret != EXIT_SUCCESS) return fail(L, "invalid block length");
   }
 
-  return 0;
+  lua_pushinteger(L, (lua_Integer)len);
+  return 1;
 }
 
-#endif
-
 static int l_cfb_write(lua_State *L){
   l_cfb_ctx *ctx = l_get_cfb_at(L, 1);
   luaL_argcheck(L, CTX_FLAG(ctx, OPEN), 1, L_CFB_NAME " is close");
@@ -1489,23 +3607,20 @@ static int l_cfb_reset(lua_State *L){
   l_cfb_ctx *ctx = l_get_cfb_at(L, 1);
 
   if(lua_gettop(L) > 2){ /*reset key*/
-    size_t key_len; const unsigned char *key = (unsigned char *)luaL_checklstring(L, 2, &key_len);
     size_t iv_len;  const unsigned char *iv  = (unsigned char *)luaL_checklstring(L, 3, &iv_len);
     int result;
 
     luaL_argcheck(L, iv_len >= IV_SIZE, 1, L_CFB_NAME " invalid iv length" );
     memcpy(ctx->iv, iv, IV_SIZE);
 
-    if(CTX_FLAG(ctx, DECRYPT))
-      result = aes_decrypt_key(key, key_len, ctx->dctx);
-    else
-      result = aes_encrypt_key(key, key_len, ctx->ectx);
+    result = l_key_setup(L, 2, 0, &ctx->sched, ctx->ectx);
 
     if(result != EXIT_SUCCESS){
       luaL_argcheck(L, 0, 2, "invalid key length");
       return 0;
     }
 
+    l_engine_select(&ctx->engine, L_ECTX(ctx));
     ctx->flags |= FLAG_OPEN;
   }
   else{
@@ -1529,7 +3644,14 @@ static const struct luaL_Reg l_cfb_meth[] = {
   {"destroyed",  l_cfb_destroyed   },
   {"set_writer", l_cfb_set_writer  },
   {"get_writer", l_cfb_get_writer  },
+  {"set_flush",  l_cfb_set_flush   },
+  {"flush",      l_cfb_flush       },
   {"write",      l_cfb_write       },
+  {"writev",     l_cfb_writev      },
+
+  {"pump",       l_cfb_pump        },
+  {"write_into", l_cfb_write_into  },
+  {"transform",  l_cfb_transform   },
   {"reset",      l_cfb_reset       }, 
   {"close",      l_cfb_close       },
   {"clone",      l_cfb_clone       },
@@ -1551,11 +3673,16 @@ typedef struct l_ofb_ctx_tag{
     aes_decrypt_ctx dctx[1];
   };
   FLAG_TYPE       flags;
+  l_engine        engine;
+  l_sched         sched;
   unsigned char   iv[IV_SIZE];
   int             writer_cb_ref;
   int             writer_ud_ref;
+  l_flush         flush;
   size_t          buffer_size;
-  unsigned char   buffer[1];
+  size_t          buffer_cap;
+  unsigned char   *buffer;
+  unsigned char   buffer_data[1];
 } l_ofb_ctx;
 
 static l_ofb_ctx *l_get_ofb_at (lua_State *L, int i) {
@@ -1574,8 +3701,12 @@ static int l_ofb_new(lua_State *L, int decrypt){
 
   ctx = (l_ofb_ctx *)laes_aligned_newudatap(L, ctx_len, L_OFB_CTX);
   memset(ctx, 0, ctx_len);
+  l_sched_init(&ctx->sched, ctx->ectx);
+  l_engine_init(L, &ctx->engine);
 
   ctx->buffer_size = buf_len;
+  ctx->buffer_cap = buf_len;
+  ctx->buffer     = ctx->buffer_data;
   ctx->writer_cb_ref  = LUA_NOREF;
   ctx->writer_ud_ref  = LUA_NOREF;
   if(decrypt) ctx->flags |= FLAG_DECRYPT;
@@ -1586,20 +3717,24 @@ static int l_ofb_new(lua_State *L, int decrypt){
 static int l_ofb_clone(lua_State *L){
   l_ofb_ctx *ctx = l_get_ofb_at(L, 1);
   size_t buf_len = luaL_optinteger(L, 2, ctx->buffer_size);
-  const size_t ctx_len = sizeof(l_ofb_ctx) + buf_len - 1;
+  const size_t ctx_len = sizeof(l_ofb_ctx);
   l_ofb_ctx *ctx2;
 
   luaL_argcheck (L, buf_len >= (AES_BLOCK_SIZE * 2), 1, "buffer size is too small");
 
   ctx2 = (l_ofb_ctx *)laes_aligned_newudatap(L, ctx_len, L_OFB_CTX);
   memset(ctx2, 0, ctx_len);
+  l_sched_init(&ctx2->sched, ctx2->ectx);
+  l_engine_init(L, &ctx2->engine);
 
   ctx2->buffer_size    = buf_len;
   ctx2->flags          = ctx->flags;
   ctx2->writer_cb_ref  = LUA_NOREF;
   ctx2->writer_ud_ref  = LUA_NOREF;
 
-  memcpy(ctx2->ctx, ctx->ctx, sizeof(aes_encrypt_ctx));
+  l_sched_share(L, &ctx->sched, ctx->ectx, 0);
+  l_sched_copy(L, &ctx2->sched, &ctx->sched);
+  ctx2->ectx->inf.l = ctx->ectx->inf.l;
   memcpy(ctx2->iv,  ctx->iv,  IV_SIZE);
   return 1;
 }
@@ -1635,6 +3770,9 @@ static int l_ofb_destroy(lua_State *L){
     ctx->flags &= ~FLAG_OPEN;
   }
 
+  l_sched_release(L, &ctx->sched, ctx->ectx);
+  L_BUFFER_FREE(L, ctx);
+  l_flush_resize(L, &ctx->flush, 0);
   ctx->flags |= FLAG_DESTROYED;
   return 0;
 }
@@ -1648,7 +3786,6 @@ static int l_ofb_destroyed(lua_State *L){
 
 static int l_ofb_open(lua_State *L){
   l_ofb_ctx *ctx = l_get_ofb_at(L, 1);
-  size_t key_len; const unsigned char *key = (unsigned char *)luaL_checklstring(L, 2, &key_len);
   size_t iv_len;  const unsigned char *iv  = (unsigned char *)luaL_checklstring(L, 3, &iv_len);
   int result;
 
@@ -1657,16 +3794,14 @@ static int l_ofb_open(lua_State *L){
   luaL_argcheck(L, iv_len >= IV_SIZE, 1, L_OFB_NAME " invalid iv length" );
   memcpy(ctx->iv, iv, IV_SIZE);
 
-  if(CTX_FLAG(ctx, DECRYPT))
-    result = aes_encrypt_key(key, key_len, ctx->ectx);
-  else
-    result = aes_encrypt_key(key, key_len, ctx->ectx);
+  result = l_key_setup(L, 2, 0, &ctx->sched, ctx->ectx);
 
   if(result != EXIT_SUCCESS){
     luaL_argcheck(L, 0, 2, "invalid key length");
     return 0;
   }
 
+  l_engine_select(&ctx->engine, L_ECTX(ctx));
   ctx->flags |= FLAG_OPEN;
   lua_settop(L, 1);
   return 1;
@@ -1685,8 +3820,27 @@ static int l_ofb_closed(lua_State *L){
   return 1;
 }
 
+static int l_ofb_push_writer(lua_State *L, l_ofb_ctx *ctx){
+  assert(ctx->writer_cb_ref != LUA_NOREF);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_cb_ref);
+  if(ctx->writer_ud_ref != LUA_NOREF){
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_ud_ref);
+    return 2;
+  }
+  return 1;
+}
+
 static int l_ofb_set_writer(lua_State *L){
   l_ofb_ctx *ctx = l_get_ofb_at(L, 1);
+  int raw; size_t flush_size = l_flush_opt(L, 4, ctx->flush.size, &raw);
+
+  if(ctx->flush.len){
+    int n = l_ofb_push_writer(L, ctx);
+    l_flush_write(L, &ctx->flush, n, 0);
+  }
+  l_flush_resize(L, &ctx->flush, flush_size);
+  ctx->flush.raw  = raw;
+  ctx->flush.file = NULL;
 
   if(ctx->writer_ud_ref != LUA_NOREF){
     luaL_unref(L, LUA_REGISTRYINDEX, ctx->writer_ud_ref);
@@ -1701,7 +3855,11 @@ static int l_ofb_set_writer(lua_State *L){
   if(lua_gettop(L) >= 3){// reader + context
     lua_settop(L, 3);
     luaL_argcheck(L, !lua_isnil(L, 2), 2, "no writer present");
-    ctx->writer_ud_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    if(lua_isnil(L, 3)) lua_pop(L, 1); /* only the options given */
+    else{
+      ctx->flush.file = l_file_writer(L, 2, 3);
+      ctx->writer_ud_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
     ctx->writer_cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
     assert(1 == lua_gettop(L));
     return 1;
@@ -1724,6 +3882,7 @@ static int l_ofb_set_writer(lua_State *L){
   if(lua_isuserdata(L, 2) || lua_istable(L, 2)){
     lua_getfield(L, 2, "write");
     luaL_argcheck(L, lua_isfunction(L, -1), 2, "write method not found in object");
+    ctx->flush.file = l_file_writer(L, 3, 2);
     ctx->writer_cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
     ctx->writer_ud_ref = luaL_ref(L, LUA_REGISTRYINDEX);
     assert(1 == lua_gettop(L));
@@ -1734,54 +3893,76 @@ static int l_ofb_set_writer(lua_State *L){
   return lua_error(L);
 }
 
-static int l_ofb_get_writer(lua_State *L){
+static int l_ofb_set_flush(lua_State *L){
   l_ofb_ctx *ctx = l_get_ofb_at(L, 1);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_cb_ref);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_ud_ref);
-  return 2;
+  lua_Integer size = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, size >= 0, 2, "invalid size");
+  lua_settop(L, 1);
+
+  if(ctx->flush.len){
+    int n = l_ofb_push_writer(L, ctx);
+    l_flush_write(L, &ctx->flush, n, 0);
+  }
+  l_flush_resize(L, &ctx->flush, (size_t)size);
+  return 1;
 }
 
-static int l_ofb_push_writer(lua_State *L, l_ofb_ctx *ctx){
-  assert(ctx->writer_cb_ref != LUA_NOREF);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_cb_ref);
-  if(ctx->writer_ud_ref != LUA_NOREF){
-    lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_ud_ref);
-    return 2;
+static int l_ofb_flush(lua_State *L){
+  l_ofb_ctx *ctx = l_get_ofb_at(L, 1);
+  lua_settop(L, 1);
+
+  if(ctx->flush.len){
+    int n = l_ofb_push_writer(L, ctx);
+    l_flush_write(L, &ctx->flush, n, 1);
   }
   return 1;
 }
 
+static int l_ofb_get_writer(lua_State *L){
+  l_ofb_ctx *ctx = l_get_ofb_at(L, 1);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_cb_ref);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_ud_ref);
+  return 2;
+}
+
 static int l_ofb_write_impl(lua_State *L){
   l_ofb_ctx *ctx = l_get_ofb_at(L, 1);
   size_t len; const unsigned char *data = (unsigned char *)correct_range(L, 2, &len);
   const int use_buffer = (ctx->writer_cb_ref == LUA_NOREF)?1:0;
+  const size_t res_len = use_buffer ? len : 0;
   luaL_Buffer buffer; int n = 0;
+  l_flush *f = use_buffer ? NULL : &ctx->flush;
+  unsigned char *out, *res = NULL;
+  size_t left, ready;
   const unsigned char *b, *e;
   int ret;
 
+  if(!use_buffer) L_BUFFER_RESERVE(L, ctx, len);
   lua_settop(L, 2);
-  if(use_buffer) luaL_buffinit(L, &buffer);
+  if(use_buffer) res = l_result_init(L, &buffer, res_len);
   else n = l_ofb_push_writer(L, ctx);
 
-  for(b = data, e = data + len; b < e; b += ctx->buffer_size){
-    size_t left = e - b;
-    if(left > ctx->buffer_size) left = ctx->buffer_size;
+  for(b = data, e = data + len; b < e; b += left){
+    out  = use_buffer ? res : l_flush_out(f, ctx->buffer);
+    left = use_buffer ? MAX_CHUNK_SIZE : l_flush_room(f, ctx->buffer_cap);
+    if(left > (size_t)(e - b)) left = e - b;
 
-    if(CTX_FLAG(ctx, DECRYPT)) ret = aes_ofb_decrypt(b, ctx->buffer, left, ctx->iv, ctx->ectx);
-    else                       ret = aes_ofb_encrypt(b, ctx->buffer, left, ctx->iv, ctx->ectx);
+    l_sched_enter(&ctx->sched, ctx->ectx);
+    if(CTX_FLAG(ctx, DECRYPT)) ret = L_ENGINE(ctx)->ofb_crypt(b, out, left, ctx->iv, L_ECTX(ctx));
+    else                       ret = L_ENGINE(ctx)->ofb_crypt(b, out, left, ctx->iv, L_ECTX(ctx));
+    l_sched_leave(&ctx->sched, ctx->ectx);
     if(ret != EXIT_SUCCESS) return fail(L, "invalid block length");
 
-    if(use_buffer) luaL_addlstring(&buffer, (char*)ctx->buffer, left);
-    else{
+    if(use_buffer) res += left;
+    else if((ready = l_flush_done(f, left)) != 0 && !l_flush_file(L, f, out, ready)){
       int i, top = lua_gettop(L);
       for(i = n; i > 0; --i) lua_pushvalue(L, top - i + 1);
-      lua_pushlstring(L, (char*)ctx->buffer, left);
-      lua_call(L, n, 0);
+      lua_call(L, l_flush_push(L, f, n, out, ready), 0);
     }
   }
 
   if(use_buffer){
-    luaL_pushresult(&buffer);
+    l_result_push(&buffer, res_len);
     return 1;
   }
 
@@ -1801,6 +3982,8 @@ static int KFUNCTION(l_ofb_writek){
 
 static int l_ofb_writek_impl(lua_State *L, int status, lua_KContext lctx){
   l_ofb_ctx *ctx = l_get_ofb_at(L, 1);
+  unsigned char *out;
+  size_t left, ready;
   size_t len;
   const unsigned char *data, *b, *e;
   int ret;
@@ -1812,18 +3995,23 @@ static int l_ofb_writek_impl(lua_State *L, int status, lua_KContext lctx){
   }
   else{
     data = (unsigned char *)correct_range(L, 2, &len);
+    L_BUFFER_RESERVE(L, ctx, len);
   }
 
   lua_settop(L, 2);
 
-  for(b = data, e = data + len; b < e; b += ctx->buffer_size){
-    size_t left = e - b;
+  for(b = data, e = data + len; b < e; b += left){
     const unsigned char *next;
-    if(left > ctx->buffer_size) left = ctx->buffer_size;
-
-    if(CTX_FLAG(ctx, DECRYPT)) ret = aes_ofb_decrypt(b, ctx->buffer, left, ctx->iv, ctx->ectx);
-    else                       ret = aes_ofb_encrypt(b, ctx->buffer, left, ctx->iv, ctx->ectx);
+    out  = l_flush_out(&ctx->flush, ctx->buffer);
+    left = l_flush_room(&ctx->flush, ctx->buffer_cap);
+    if(left > (size_t)(e - b)) left = e - b;
+
+    l_sched_enter(&ctx->sched, ctx->ectx);
+    if(CTX_FLAG(ctx, DECRYPT)) ret = L_ENGINE(ctx)->ofb_crypt(b, out, left, ctx->iv, L_ECTX(ctx));
+    else                       ret = L_ENGINE(ctx)->ofb_crypt(b, out, left, ctx->iv, L_ECTX(ctx));
+    l_sched_leave(&ctx->sched, ctx->ectx);
     if(ret != EXIT_SUCCESS) return fail(L, "invalid block length");
+    if((ready = l_flush_done(&ctx->flush, left)) == 0 || l_flush_file(L, &ctx->flush, out, ready)) continue;
 
     next = b + left;
     assert(len >= (next - data));
@@ -1832,8 +4020,7 @@ static int l_ofb_writek_impl(lua_State *L, int status, lua_KContext lctx){
     lua_pushinteger(L, len - (next - data));
     {
       int n = l_ofb_push_writer(L, ctx);
-      lua_pushlstring(L, (char*)ctx->buffer, left);
-      lua_callk(L, n, 0, 2, l_ofb_writek);
+      lua_callk(L, l_flush_push(L, &ctx->flush, n, out, ready), 0, 2, l_ofb_writek);
     }
     lua_settop(L, 2);
   }
@@ -1843,6 +4030,107 @@ static int l_ofb_writek_impl(lua_State *L, int status, lua_KContext lctx){
 
 #endif
 
+static int l_ofb_crypt_buf(void *c, unsigned char *buf, int len){
+  l_ofb_ctx *ctx = (l_ofb_ctx *)c;
+  int ret;
+  l_sched_enter(&ctx->sched, ctx->ectx);
+  ret = L_ENGINE(ctx)->ofb_crypt(buf, buf, len, ctx->iv, L_ECTX(ctx));
+  l_sched_leave(&ctx->sched, ctx->ectx);
+  return ret;
+}
+
+#if LUA_VERSION_NUM >= 502
+static int KFUNCTION(l_ofb_writevk);
+#endif
+
+static const l_stream *l_ofb_stream(l_ofb_ctx *ctx, l_stream *s){
+  s->ctx           = ctx;
+  s->buffer        = &ctx->buffer;
+  s->buffer_cap    = &ctx->buffer_cap;
+  s->buffer_size   = ctx->buffer_size;
+  s->tail          = NULL;
+  s->flush         = &ctx->flush;
+  s->writer_cb_ref = ctx->writer_cb_ref;
+  s->writer_ud_ref = ctx->writer_ud_ref;
+  s->crypt         = l_ofb_crypt_buf;
+#if LUA_VERSION_NUM >= 502
+  s->k             = l_ofb_writevk;
+#endif
+  return s;
+}
+
+#if LUA_VERSION_NUM >= 502
+static int KFUNCTION(l_ofb_writevk){
+  l_stream s;
+#if LUA_VERSION_NUM < 503
+  lua_KContext ctx; lua_getctx(L, &ctx);
+#else
+  (void)status;
+#endif
+  return l_writev_k(L, l_ofb_stream(l_get_ofb_at(L, 1), &s), ctx);
+}
+#endif
+
+static int l_ofb_writev(lua_State *L){
+  l_ofb_ctx *ctx = l_get_ofb_at(L, 1);
+  l_stream s;
+  luaL_argcheck(L, CTX_FLAG(ctx, OPEN), 1, L_OFB_NAME " is close");
+  return l_writev(L, l_ofb_stream(ctx, &s));
+}
+
+static int l_ofb_pump(lua_State *L){
+  l_ofb_ctx *ctx = l_get_ofb_at(L, 1);
+  l_stream s;
+  luaL_argcheck(L, CTX_FLAG(ctx, OPEN), 1, L_OFB_NAME " is close");
+  return l_pump(L, l_ofb_stream(ctx, &s));
+}
+
+static int l_ofb_write_into(lua_State *L){
+  l_ofb_ctx *ctx = l_get_ofb_at(L, 1);
+  size_t dst_len; unsigned char *dst = dst_range(L, 2, &dst_len);
+  size_t len; const unsigned char *data = (unsigned char *)correct_range(L, 4, &len);
+  const unsigned char *b, *e;
+  int ret;
+
+  luaL_argcheck(L, CTX_FLAG(ctx, OPEN), 1, L_OFB_NAME " is close");
+  luaL_argcheck(L, len <= dst_len, 2, "destination is too small");
+
+  for(b = data, e = data + len; b < e; b += MAX_CHUNK_SIZE, dst += MAX_CHUNK_SIZE){
+    size_t left = e - b;
+    if(left > MAX_CHUNK_SIZE) left = MAX_CHUNK_SIZE;
+
+    l_sched_enter(&ctx->sched, ctx->ectx);
+    ret = L_ENGINE(ctx)->ofb_crypt(b, dst, (int)left, ctx->iv, L_ECTX(ctx));
+    l_sched_leave(&ctx->sched, ctx->ectx);
+    if(ret != EXIT_SUCCESS) return fail(L, "invalid block length");
+  }
+
+  lua_pushinteger(L, (lua_Integer)len);
+  return 1;
+}
+
+static int l_ofb_transform(lua_State *L){
+  l_ofb_ctx *ctx = l_get_ofb_at(L, 1);
+  size_t len; unsigned char *data = ud_range(L, 2, &len);
+  unsigned char *b, *e;
+  int ret;
+
+  luaL_argcheck(L, CTX_FLAG(ctx, OPEN), 1, L_OFB_NAME " is close");
+
+  for(b = data, e = data + len; b < e; b += MAX_CHUNK_SIZE){
+    size_t left = e - b;
+    if(left > MAX_CHUNK_SIZE) left = MAX_CHUNK_SIZE;
+
+    l_sched_enter(&ctx->sched, ctx->ectx);
+    ret = L_ENGINE(ctx)->ofb_crypt(b, b, (int)left, ctx->iv, L_ECTX(ctx));
+    l_sched_leave(&ctx->sched, ctx->ectx);
+    if(ret != EXIT_SUCCESS) return fail(L, "invalid block length");
+  }
+
+  lua_pushinteger(L, (lua_Integer)len);
+  return 1;
+}
+
 static int l_ofb_write(lua_State *L){
   l_ofb_ctx *ctx = l_get_ofb_at(L, 1);
   luaL_argcheck(L, CTX_FLAG(ctx, OPEN), 1, L_OFB_NAME " is close");
@@ -1863,23 +4151,20 @@ static int l_ofb_reset(lua_State *L){
   l_ofb_ctx *ctx = l_get_ofb_at(L, 1);
 
   if(lua_gettop(L) > 2){ /*reset key*/
-    size_t key_len; const unsigned char *key = (unsigned char *)luaL_checklstring(L, 2, &key_len);
     size_t iv_len;  const unsigned char *iv  = (unsigned char *)luaL_checklstring(L, 3, &iv_len);
     int result;
 
     luaL_argcheck(L, iv_len >= IV_SIZE, 1, L_OFB_NAME " invalid iv length" );
     memcpy(ctx->iv, iv, IV_SIZE);
 
-    if(CTX_FLAG(ctx, DECRYPT))
-      result = aes_decrypt_key(key, key_len, ctx->dctx);
-    else
-      result = aes_encrypt_key(key, key_len, ctx->ectx);
+    result = l_key_setup(L, 2, 0, &ctx->sched, ctx->ectx);
 
     if(result != EXIT_SUCCESS){
       luaL_argcheck(L, 0, 2, "invalid key length");
       return 0;
     }
 
+    l_engine_select(&ctx->engine, L_ECTX(ctx));
     ctx->flags |= FLAG_OPEN;
   }
   else{
@@ -1903,7 +4188,14 @@ static const struct luaL_Reg l_ofb_meth[] = {
   {"destroyed",  l_ofb_destroyed   },
   {"set_writer", l_ofb_set_writer  },
   {"get_writer", l_ofb_get_writer  },
+  {"set_flush",  l_ofb_set_flush   },
+  {"flush",      l_ofb_flush       },
   {"write",      l_ofb_write       },
+  {"writev",     l_ofb_writev      },
+
+  {"pump",       l_ofb_pump        },
+  {"write_into", l_ofb_write_into  },
+  {"transform",  l_ofb_transform   },
   {"reset",      l_ofb_reset       }, 
   {"close",      l_ofb_close       },
   {"clone",      l_ofb_clone       },
@@ -1929,6 +4221,7 @@ static void backward_iv_inc(unsigned char *iv){
   }
 }
 
+/* "fd" and "bd", a byte borrows when it becomes 0, see AES_CTR_DEC_BE_LEGACY */
 static void forward_iv_dec(unsigned char *iv){
   int i;
   for(i = 0; i < IV_SIZE; ++i){
@@ -1943,6 +4236,32 @@ static void backward_iv_dec(unsigned char *iv){
   }
 }
 
+/* "fdw" and "bdw", a byte borrows when it wraps */
+static void forward_iv_dec_wrap(unsigned char *iv){
+  int i;
+  for(i = 0; i < IV_SIZE; ++i){
+    if(iv[i]--) return;
+  }
+}
+
+static void backward_iv_dec_wrap(unsigned char *iv){
+  int i;
+  for(i = IV_SIZE-1; i >= 0; --i){
+    if(iv[i]--) return;
+  }
+}
+
+/* built-in counter mode for aes_ctr_crypt_ex or -1 for custom inc_fn */
+static int l_ctr_inc_mode(cbuf_inc *inc_fn){
+  if(inc_fn == backward_iv_inc)      return AES_CTR_INC_BE;
+  if(inc_fn == backward_iv_dec_wrap) return AES_CTR_DEC_BE;
+  if(inc_fn == forward_iv_inc)       return AES_CTR_INC_LE;
+  if(inc_fn == forward_iv_dec_wrap)  return AES_CTR_DEC_LE;
+  if(inc_fn == backward_iv_dec)      return AES_CTR_DEC_BE_LEGACY;
+  if(inc_fn == forward_iv_dec)       return AES_CTR_DEC_LE_LEGACY;
+  return -1;
+}
+
 #define L_CTR_NAME "CTR context"
 static const char * L_CTR_CTX = L_CTR_NAME;
 
@@ -1953,12 +4272,19 @@ typedef struct l_ctr_ctx_tag{
     aes_decrypt_ctx dctx[1];
   };
   FLAG_TYPE       flags;
+  l_engine        engine;
+  l_sched         sched;
   unsigned char   iv[IV_SIZE];
+  unsigned char   base_iv[IV_SIZE]; /* the iv given to open or reset, for seek */
   cbuf_inc        *inc_fn;
+  int             inc_mode;
   int             writer_cb_ref;
   int             writer_ud_ref;
+  l_flush         flush;
   size_t          buffer_size;
-  unsigned char   buffer[1];
+  size_t          buffer_cap;
+  unsigned char   *buffer;
+  unsigned char   buffer_data[1];
 } l_ctr_ctx;
 
 static l_ctr_ctx *l_get_ctr_at (lua_State *L, int i) {
@@ -1968,6 +4294,22 @@ static l_ctr_ctx *l_get_ctr_at (lua_State *L, int i) {
   return ctx;
 }
 
+static void l_ctr_set_inc_fn(l_ctr_ctx *ctx, cbuf_inc *inc_fn){
+  ctx->inc_fn   = inc_fn;
+  ctx->inc_mode = l_ctr_inc_mode(inc_fn);
+}
+
+static int l_ctr_crypt(l_ctr_ctx *ctx, const unsigned char *ibuf, unsigned char *obuf, int len){
+  int ret;
+  l_sched_enter(&ctx->sched, ctx->ectx);
+  if(ctx->inc_mode >= 0)
+    ret = L_ENGINE(ctx)->ctr_crypt_ex(ibuf, obuf, len, ctx->iv, ctx->inc_mode, L_ECTX(ctx));
+  else
+    ret = L_ENGINE(ctx)->ctr_crypt(ibuf, obuf, len, ctx->iv, ctx->inc_fn, L_ECTX(ctx));
+  l_sched_leave(&ctx->sched, ctx->ectx);
+  return ret;
+}
+
 static int l_ctr_new(lua_State *L, int decrypt){
   size_t buf_len = luaL_optinteger(L, 1, DEFAULT_BUFFER_SIZE);
   const size_t ctx_len = sizeof(l_ctr_ctx) + buf_len - 1;
@@ -1977,9 +4319,13 @@ static int l_ctr_new(lua_State *L, int decrypt){
 
   ctx = (l_ctr_ctx *)laes_aligned_newudatap(L, ctx_len, L_CTR_CTX);
   memset(ctx, 0, ctx_len);
+  l_sched_init(&ctx->sched, ctx->ectx);
+  l_engine_init(L, &ctx->engine);
 
-  ctx->inc_fn         = backward_iv_inc;
+  l_ctr_set_inc_fn(ctx, backward_iv_inc);
   ctx->buffer_size    = buf_len;
+  ctx->buffer_cap    = buf_len;
+  ctx->buffer        = ctx->buffer_data;
   ctx->writer_cb_ref  = LUA_NOREF;
   ctx->writer_ud_ref  = LUA_NOREF;
   if(decrypt) ctx->flags |= FLAG_DECRYPT;
@@ -1990,22 +4336,28 @@ static int l_ctr_new(lua_State *L, int decrypt){
 static int l_ctr_clone(lua_State *L){
   l_ctr_ctx *ctx = l_get_ctr_at(L, 1);
   size_t buf_len = luaL_optinteger(L, 2, ctx->buffer_size);
-  const size_t ctx_len = sizeof(l_ctr_ctx) + buf_len - 1;
+  const size_t ctx_len = sizeof(l_ctr_ctx);
   l_ctr_ctx *ctx2;
 
   luaL_argcheck (L, buf_len >= (AES_BLOCK_SIZE * 2), 1, "buffer size is too small");
 
   ctx2 = (l_ctr_ctx *)laes_aligned_newudatap(L, ctx_len, L_CTR_CTX);
   memset(ctx2, 0, ctx_len);
+  l_sched_init(&ctx2->sched, ctx2->ectx);
+  l_engine_init(L, &ctx2->engine);
 
   ctx2->buffer_size    = buf_len;
   ctx2->flags          = ctx->flags;
   ctx2->inc_fn         = ctx->inc_fn;
+  ctx2->inc_mode       = ctx->inc_mode;
   ctx2->writer_cb_ref  = LUA_NOREF;
   ctx2->writer_ud_ref  = LUA_NOREF;
 
-  memcpy(ctx2->ctx, ctx->ctx, sizeof(aes_encrypt_ctx));
+  l_sched_share(L, &ctx->sched, ctx->ectx, 0);
+  l_sched_copy(L, &ctx2->sched, &ctx->sched);
+  ctx2->ectx->inf.l = ctx->ectx->inf.l;
   memcpy(ctx2->iv,  ctx->iv,  IV_SIZE);
+  memcpy(ctx2->base_iv, ctx->base_iv, IV_SIZE);
   return 1;
 }
 
@@ -2040,6 +4392,9 @@ static int l_ctr_destroy(lua_State *L){
     ctx->flags &= ~FLAG_OPEN;
   }
 
+  l_sched_release(L, &ctx->sched, ctx->ectx);
+  L_BUFFER_FREE(L, ctx);
+  l_flush_resize(L, &ctx->flush, 0);
   ctx->flags |= FLAG_DESTROYED;
   return 0;
 }
@@ -2053,7 +4408,6 @@ static int l_ctr_destroyed(lua_State *L){
 
 static int l_ctr_open(lua_State *L){
   l_ctr_ctx *ctx = l_get_ctr_at(L, 1);
-  size_t key_len; const unsigned char *key = (unsigned char *)luaL_checklstring(L, 2, &key_len);
   size_t iv_len;  const unsigned char *iv  = (unsigned char *)luaL_checklstring(L, 3, &iv_len);
   int result;
 
@@ -2061,17 +4415,16 @@ static int l_ctr_open(lua_State *L){
 
   luaL_argcheck(L, iv_len >= IV_SIZE, 1, L_CTR_NAME " invalid iv length" );
   memcpy(ctx->iv, iv, IV_SIZE);
+  memcpy(ctx->base_iv, iv, IV_SIZE);
 
-  if(CTX_FLAG(ctx, DECRYPT))
-    result = aes_encrypt_key(key, key_len, ctx->ectx);
-  else
-    result = aes_encrypt_key(key, key_len, ctx->ectx);
+  result = l_key_setup(L, 2, 0, &ctx->sched, ctx->ectx);
 
   if(result != EXIT_SUCCESS){
     luaL_argcheck(L, 0, 2, "invalid key length");
     return 0;
   }
 
+  l_engine_select(&ctx->engine, L_ECTX(ctx));
   ctx->flags |= FLAG_OPEN;
   lua_settop(L, 1);
   return 1;
@@ -2090,8 +4443,27 @@ static int l_ctr_closed(lua_State *L){
   return 1;
 }
 
+static int l_ctr_push_writer(lua_State *L, l_ctr_ctx *ctx){
+  assert(ctx->writer_cb_ref != LUA_NOREF);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_cb_ref);
+  if(ctx->writer_ud_ref != LUA_NOREF){
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_ud_ref);
+    return 2;
+  }
+  return 1;
+}
+
 static int l_ctr_set_writer(lua_State *L){
   l_ctr_ctx *ctx = l_get_ctr_at(L, 1);
+  int raw; size_t flush_size = l_flush_opt(L, 4, ctx->flush.size, &raw);
+
+  if(ctx->flush.len){
+    int n = l_ctr_push_writer(L, ctx);
+    l_flush_write(L, &ctx->flush, n, 0);
+  }
+  l_flush_resize(L, &ctx->flush, flush_size);
+  ctx->flush.raw  = raw;
+  ctx->flush.file = NULL;
 
   if(ctx->writer_ud_ref != LUA_NOREF){
     luaL_unref(L, LUA_REGISTRYINDEX, ctx->writer_ud_ref);
@@ -2106,7 +4478,11 @@ static int l_ctr_set_writer(lua_State *L){
   if(lua_gettop(L) >= 3){// reader + context
     lua_settop(L, 3);
     luaL_argcheck(L, !lua_isnil(L, 2), 2, "no writer present");
-    ctx->writer_ud_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    if(lua_isnil(L, 3)) lua_pop(L, 1); /* only the options given */
+    else{
+      ctx->flush.file = l_file_writer(L, 2, 3);
+      ctx->writer_ud_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
     ctx->writer_cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
     assert(1 == lua_gettop(L));
     return 1;
@@ -2129,6 +4505,7 @@ static int l_ctr_set_writer(lua_State *L){
   if(lua_isuserdata(L, 2) || lua_istable(L, 2)){
     lua_getfield(L, 2, "write");
     luaL_argcheck(L, lua_isfunction(L, -1), 2, "write method not found in object");
+    ctx->flush.file = l_file_writer(L, 3, 2);
     ctx->writer_cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
     ctx->writer_ud_ref = luaL_ref(L, LUA_REGISTRYINDEX);
     assert(1 == lua_gettop(L));
@@ -2139,54 +4516,73 @@ static int l_ctr_set_writer(lua_State *L){
   return lua_error(L);
 }
 
-static int l_ctr_get_writer(lua_State *L){
+static int l_ctr_set_flush(lua_State *L){
   l_ctr_ctx *ctx = l_get_ctr_at(L, 1);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_cb_ref);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_ud_ref);
-  return 2;
+  lua_Integer size = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, size >= 0, 2, "invalid size");
+  lua_settop(L, 1);
+
+  if(ctx->flush.len){
+    int n = l_ctr_push_writer(L, ctx);
+    l_flush_write(L, &ctx->flush, n, 0);
+  }
+  l_flush_resize(L, &ctx->flush, (size_t)size);
+  return 1;
 }
 
-static int l_ctr_push_writer(lua_State *L, l_ctr_ctx *ctx){
-  assert(ctx->writer_cb_ref != LUA_NOREF);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_cb_ref);
-  if(ctx->writer_ud_ref != LUA_NOREF){
-    lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_ud_ref);
-    return 2;
+static int l_ctr_flush(lua_State *L){
+  l_ctr_ctx *ctx = l_get_ctr_at(L, 1);
+  lua_settop(L, 1);
+
+  if(ctx->flush.len){
+    int n = l_ctr_push_writer(L, ctx);
+    l_flush_write(L, &ctx->flush, n, 1);
   }
   return 1;
 }
 
+static int l_ctr_get_writer(lua_State *L){
+  l_ctr_ctx *ctx = l_get_ctr_at(L, 1);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_cb_ref);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->writer_ud_ref);
+  return 2;
+}
+
 static int l_ctr_write_impl(lua_State *L){
   l_ctr_ctx *ctx = l_get_ctr_at(L, 1);
   size_t len; const unsigned char *data = (unsigned char *)correct_range(L, 2, &len);
   const int use_buffer = (ctx->writer_cb_ref == LUA_NOREF)?1:0;
+  const size_t res_len = use_buffer ? len : 0;
   luaL_Buffer buffer; int n = 0;
+  l_flush *f = use_buffer ? NULL : &ctx->flush;
+  unsigned char *out, *res = NULL;
+  size_t left, ready;
   const unsigned char *b, *e;
   int ret;
 
+  if(!use_buffer) L_BUFFER_RESERVE(L, ctx, len);
   lua_settop(L, 2);
-  if(use_buffer) luaL_buffinit(L, &buffer);
+  if(use_buffer) res = l_result_init(L, &buffer, res_len);
   else n = l_ctr_push_writer(L, ctx);
 
-  for(b = data, e = data + len; b < e; b += ctx->buffer_size){
-    size_t left = e - b;
-    if(left > ctx->buffer_size) left = ctx->buffer_size;
+  for(b = data, e = data + len; b < e; b += left){
+    out  = use_buffer ? res : l_flush_out(f, ctx->buffer);
+    left = use_buffer ? MAX_CHUNK_SIZE : l_flush_room(f, ctx->buffer_cap);
+    if(left > (size_t)(e - b)) left = e - b;
 
-    if(CTX_FLAG(ctx, DECRYPT)) ret = aes_ctr_decrypt(b, ctx->buffer, left, ctx->iv, ctx->inc_fn, ctx->ectx);
-    else                       ret = aes_ctr_encrypt(b, ctx->buffer, left, ctx->iv, ctx->inc_fn, ctx->ectx);
+    ret = l_ctr_crypt(ctx, b, out, left);
     if(ret != EXIT_SUCCESS) return fail(L, "invalid block length");
 
-    if(use_buffer) luaL_addlstring(&buffer, (char*)ctx->buffer, left);
-    else{
+    if(use_buffer) res += left;
+    else if((ready = l_flush_done(f, left)) != 0 && !l_flush_file(L, f, out, ready)){
       int i, top = lua_gettop(L);
       for(i = n; i > 0; --i) lua_pushvalue(L, top - i + 1);
-      lua_pushlstring(L, (char*)ctx->buffer, left);
-      lua_call(L, n, 0);
+      lua_call(L, l_flush_push(L, f, n, out, ready), 0);
     }
   }
 
   if(use_buffer){
-    luaL_pushresult(&buffer);
+    l_result_push(&buffer, res_len);
     return 1;
   }
 
@@ -2206,6 +4602,8 @@ static int KFUNCTION(l_ctr_writek){
 
 static int l_ctr_writek_impl(lua_State *L, int status, lua_KContext lctx){
   l_ctr_ctx *ctx = l_get_ctr_at(L, 1);
+  unsigned char *out;
+  size_t left, ready;
   size_t len;
   const unsigned char *data, *b, *e;
   int ret;
@@ -2217,20 +4615,22 @@ static int l_ctr_writek_impl(lua_State *L, int status, lua_KContext lctx){
   }
   else{
     data = (unsigned char *)correct_range(L, 2, &len);
+    L_BUFFER_RESERVE(L, ctx, len);
   }
 
   lua_settop(L, 2);
 
   if(len == 0) return 0;
 
-  for(b = data, e = data + len; b < e; b += ctx->buffer_size){
-    size_t left = e - b;
+  for(b = data, e = data + len; b < e; b += left){
     const unsigned char *next;
-    if(left > ctx->buffer_size) left = ctx->buffer_size;
+    out  = l_flush_out(&ctx->flush, ctx->buffer);
+    left = l_flush_room(&ctx->flush, ctx->buffer_cap);
+    if(left > (size_t)(e - b)) left = e - b;
 
-    if(CTX_FLAG(ctx, DECRYPT)) ret = aes_ctr_decrypt(b, ctx->buffer, left, ctx->iv, ctx->inc_fn, ctx->ectx);
-    else                       ret = aes_ctr_encrypt(b, ctx->buffer, left, ctx->iv, ctx->inc_fn, ctx->ectx);
+    ret = l_ctr_crypt(ctx, b, out, left);
     if(ret != EXIT_SUCCESS) return fail(L, "invalid block length");
+    if((ready = l_flush_done(&ctx->flush, left)) == 0 || l_flush_file(L, &ctx->flush, out, ready)) continue;
 
     next = b + left;
     assert(len >= (next - data));
@@ -2239,8 +4639,7 @@ static int l_ctr_writek_impl(lua_State *L, int status, lua_KContext lctx){
     lua_pushinteger(L, len - (next - data));
     {
       int n = l_ctr_push_writer(L, ctx);
-      lua_pushlstring(L, (char*)ctx->buffer, left);
-      lua_callk(L, n, 0, 3, l_ctr_writek);
+      lua_callk(L, l_flush_push(L, &ctx->flush, n, out, ready), 0, 3, l_ctr_writek);
     }
     lua_settop(L, 2);
   }
@@ -2250,6 +4649,99 @@ static int l_ctr_writek_impl(lua_State *L, int status, lua_KContext lctx){
 
 #endif
 
+static int l_ctr_crypt_buf(void *c, unsigned char *buf, int len){
+  l_ctr_ctx *ctx = (l_ctr_ctx *)c;
+  return l_ctr_crypt(ctx, buf, buf, len);
+}
+
+#if LUA_VERSION_NUM >= 502
+static int KFUNCTION(l_ctr_writevk);
+#endif
+
+static const l_stream *l_ctr_stream(l_ctr_ctx *ctx, l_stream *s){
+  s->ctx           = ctx;
+  s->buffer        = &ctx->buffer;
+  s->buffer_cap    = &ctx->buffer_cap;
+  s->buffer_size   = ctx->buffer_size;
+  s->tail          = NULL;
+  s->flush         = &ctx->flush;
+  s->writer_cb_ref = ctx->writer_cb_ref;
+  s->writer_ud_ref = ctx->writer_ud_ref;
+  s->crypt         = l_ctr_crypt_buf;
+#if LUA_VERSION_NUM >= 502
+  s->k             = l_ctr_writevk;
+#endif
+  return s;
+}
+
+#if LUA_VERSION_NUM >= 502
+static int KFUNCTION(l_ctr_writevk){
+  l_stream s;
+#if LUA_VERSION_NUM < 503
+  lua_KContext ctx; lua_getctx(L, &ctx);
+#else
+  (void)status;
+#endif
+  return l_writev_k(L, l_ctr_stream(l_get_ctr_at(L, 1), &s), ctx);
+}
+#endif
+
+static int l_ctr_writev(lua_State *L){
+  l_ctr_ctx *ctx = l_get_ctr_at(L, 1);
+  l_stream s;
+  luaL_argcheck(L, CTX_FLAG(ctx, OPEN), 1, L_CTR_NAME " is close");
+  return l_writev(L, l_ctr_stream(ctx, &s));
+}
+
+static int l_ctr_pump(lua_State *L){
+  l_ctr_ctx *ctx = l_get_ctr_at(L, 1);
+  l_stream s;
+  luaL_argcheck(L, CTX_FLAG(ctx, OPEN), 1, L_CTR_NAME " is close");
+  return l_pump(L, l_ctr_stream(ctx, &s));
+}
+
+static int l_ctr_write_into(lua_State *L){
+  l_ctr_ctx *ctx = l_get_ctr_at(L, 1);
+  size_t dst_len; unsigned char *dst = dst_range(L, 2, &dst_len);
+  size_t len; const unsigned char *data = (unsigned char *)correct_range(L, 4, &len);
+  const unsigned char *b, *e;
+  int ret;
+
+  luaL_argcheck(L, CTX_FLAG(ctx, OPEN), 1, L_CTR_NAME " is close");
+  luaL_argcheck(L, len <= dst_len, 2, "destination is too small");
+
+  for(b = data, e = data + len; b < e; b += MAX_CHUNK_SIZE, dst += MAX_CHUNK_SIZE){
+    size_t left = e - b;
+    if(left > MAX_CHUNK_SIZE) left = MAX_CHUNK_SIZE;
+
+    ret = l_ctr_crypt(ctx, b, dst, (int)left);
+    if(ret != EXIT_SUCCESS) return fail(L, "invalid block length");
+  }
+
+  lua_pushinteger(L, (lua_Integer)len);
+  return 1;
+}
+
+static int l_ctr_transform(lua_State *L){
+  l_ctr_ctx *ctx = l_get_ctr_at(L, 1);
+  size_t len; unsigned char *data = ud_range(L, 2, &len);
+  unsigned char *b, *e;
+  int ret;
+
+  luaL_argcheck(L, CTX_FLAG(ctx, OPEN), 1, L_CTR_NAME " is close");
+
+  for(b = data, e = data + len; b < e; b += MAX_CHUNK_SIZE){
+    size_t left = e - b;
+    if(left > MAX_CHUNK_SIZE) left = MAX_CHUNK_SIZE;
+
+    ret = l_ctr_crypt(ctx, b, b, (int)left);
+    if(ret != EXIT_SUCCESS) return fail(L, "invalid block length");
+  }
+
+  lua_pushinteger(L, (lua_Integer)len);
+  return 1;
+}
+
 static int l_ctr_write(lua_State *L){
   l_ctr_ctx *ctx = l_get_ctr_at(L, 1);
   luaL_argcheck(L, CTX_FLAG(ctx, OPEN), 1, L_CTR_NAME " is close");
@@ -2266,33 +4758,94 @@ static int l_ctr_write(lua_State *L){
   return l_ctr_write_impl(L);
 }
 
+/* write of a string with its blocks shared out between threads threads,
+ * one per processor by default; the context ends as after write(data).
+ * With a writer the kept output goes first, then all of the result in one
+ * call, and the context is returned.
+ */
+static int l_ctr_write_parallel(lua_State *L){
+  l_ctr_ctx *ctx = l_get_ctr_at(L, 1);
+  size_t len; const unsigned char *data = (const unsigned char *)luaL_checklstring(L, 2, &len);
+  lua_Integer threads = luaL_optinteger(L, 3, aes_cpu_count());
+  const int use_buffer = (ctx->writer_cb_ref == LUA_NOREF)?1:0;
+  luaL_Buffer buffer; l_flush direct;
+  unsigned char *out, iv[IV_SIZE], pos;
+  int n, ret;
+
+  luaL_argcheck(L, CTX_FLAG(ctx, OPEN), 1, L_CTR_NAME " is close");
+  luaL_argcheck(L, threads >= 1, 3, "invalid number of threads");
+  luaL_argcheck(L, ctx->inc_mode >= 0, 1, L_CTR_NAME " invalid increment mode");
+  lua_settop(L, 2);
+
+  if(use_buffer) out = l_result_init(L, &buffer, len);
+  else out = (unsigned char *)lua_newuserdata(L, len ? len : 1);
+
+  /* the counter as it was if the encryption fails */
+  memcpy(iv, ctx->iv, IV_SIZE);
+  pos = ctx->ectx->inf.b[2];
+
+  l_sched_enter(&ctx->sched, ctx->ectx);
+  ret = aes_ctr_crypt_mt(L_ENGINE(ctx), data, out, len, ctx->iv, ctx->inc_mode, L_ECTX(ctx), (int)threads);
+  l_sched_leave(&ctx->sched, ctx->ectx);
+  if(ret != EXIT_SUCCESS){
+    memcpy(ctx->iv, iv, IV_SIZE);
+    ctx->ectx->inf.b[2] = pos;
+    return fail(L, "CTR encryption failed");
+  }
+
+  if(use_buffer){
+    l_result_push(&buffer, len);
+    return 1;
+  }
+
+  if(ctx->flush.len){
+    n = l_ctr_push_writer(L, ctx);
+    l_flush_write(L, &ctx->flush, n, 0);
+  }
+
+  /* the result as it is, past the threshold of set_flush */
+  direct = ctx->flush;
+  direct.size = direct.len = 0;
+  if(len && !l_flush_file(L, &direct, out, len)){
+    n = l_ctr_push_writer(L, ctx);
+    n = l_flush_push(L, &direct, n, out, len);
+#if LUA_VERSION_NUM >= 502
+    lua_callk(L, n, 0, 0, l_flush_k);
+#else
+    lua_call(L, n, 0);
+#endif
+  }
+
+  lua_settop(L, 1);
+  return 1;
+}
+
 static int l_ctr_reset(lua_State *L){
   l_ctr_ctx *ctx = l_get_ctr_at(L, 1);
 
   if(lua_gettop(L) > 2){ /*reset key*/
-    size_t key_len; const unsigned char *key = (unsigned char *)luaL_checklstring(L, 2, &key_len);
     size_t iv_len;  const unsigned char *iv  = (unsigned char *)luaL_checklstring(L, 3, &iv_len);
     int result;
 
     luaL_argcheck(L, iv_len >= IV_SIZE, 1, L_CTR_NAME " invalid iv length" );
     memcpy(ctx->iv, iv, IV_SIZE);
+    memcpy(ctx->base_iv, iv, IV_SIZE);
 
-    if(CTX_FLAG(ctx, DECRYPT))
-      result = aes_decrypt_key(key, key_len, ctx->dctx);
-    else
-      result = aes_encrypt_key(key, key_len, ctx->ectx);
+    result = l_key_setup(L, 2, 0, &ctx->sched, ctx->ectx);
 
     if(result != EXIT_SUCCESS){
       luaL_argcheck(L, 0, 2, "invalid key length");
       return 0;
     }
 
+    l_engine_select(&ctx->engine, L_ECTX(ctx));
     ctx->flags |= FLAG_OPEN;
   }
   else{
     size_t iv_len;  const unsigned char *iv  = (unsigned char *)luaL_checklstring(L, 2, &iv_len);
     luaL_argcheck(L, iv_len >= IV_SIZE, 1, L_CTR_NAME " invalid iv length" );
     memcpy(ctx->iv, iv, IV_SIZE);
+    memcpy(ctx->base_iv, iv, IV_SIZE);
   }
 
   aes_mode_reset(ctx->ctx);
@@ -2301,19 +4854,37 @@ static int l_ctr_reset(lua_State *L){
   return 1;
 }
 
+/* the counter of the block at offset from the iv of open or reset, */
+/* with the offset in that block kept for the next write            */
+static int l_ctr_seek(lua_State *L){
+  l_ctr_ctx *ctx = l_get_ctr_at(L, 1);
+  lua_Integer offset = luaL_checkinteger(L, 2);
+
+  luaL_argcheck(L, CTX_FLAG(ctx, OPEN), 1, L_CTR_NAME " is close");
+  luaL_argcheck(L, offset >= 0, 2, "invalid offset");
+  luaL_argcheck(L, ctx->inc_mode >= 0, 1, L_CTR_NAME " invalid increment mode");
+
+  memcpy(ctx->iv, ctx->base_iv, IV_SIZE);
+  aes_ctr_add(ctx->iv, (uint64_t)offset / AES_BLOCK_SIZE, ctx->inc_mode);
+  ctx->ectx->inf.b[2] = (uint8_t)((uint64_t)offset % AES_BLOCK_SIZE);
+
+  lua_settop(L, 1);
+  return 1;
+}
+
 static int l_ctr_set_inc_mode(lua_State *L){
   l_ctr_ctx *ctx = l_get_ctr_at(L, 1);
   const char *mode = luaL_optstring(L, 2, "bi");
   if(mode[0] == 'b'){
-         if(mode[1] == 'i') ctx->inc_fn = backward_iv_inc;
-    else if(mode[1] == 'd') ctx->inc_fn = backward_iv_dec;
-    else                    ctx->inc_fn = backward_iv_inc;
+         if(mode[1] == 'i') l_ctr_set_inc_fn(ctx, backward_iv_inc);
+    else if(mode[1] == 'd') l_ctr_set_inc_fn(ctx, (mode[2] == 'w') ? backward_iv_dec_wrap : backward_iv_dec);
+    else                    l_ctr_set_inc_fn(ctx, backward_iv_inc);
     return pass(L);
   }
   if(mode[0] == 'f'){
-         if(mode[1] == 'i') ctx->inc_fn = forward_iv_inc;
-    else if(mode[1] == 'd') ctx->inc_fn = forward_iv_dec;
-    else                    ctx->inc_fn = forward_iv_inc;
+         if(mode[1] == 'i') l_ctr_set_inc_fn(ctx, forward_iv_inc);
+    else if(mode[1] == 'd') l_ctr_set_inc_fn(ctx, (mode[2] == 'w') ? forward_iv_dec_wrap : forward_iv_dec);
+    else                    l_ctr_set_inc_fn(ctx, forward_iv_inc);
     return pass(L);
   }
 
@@ -2329,8 +4900,17 @@ static const struct luaL_Reg l_ctr_meth[] = {
   {"destroyed",    l_ctr_destroyed    },
   {"set_writer",   l_ctr_set_writer   },
   {"get_writer",   l_ctr_get_writer   },
+  {"set_flush",    l_ctr_set_flush    },
+  {"flush",        l_ctr_flush        },
   {"write",        l_ctr_write        },
+  {"writev",       l_ctr_writev       },
+  {"write_parallel", l_ctr_write_parallel },
+
+  {"pump",         l_ctr_pump         },
+  {"write_into",   l_ctr_write_into   },
+  {"transform",    l_ctr_transform    },
   {"reset",        l_ctr_reset        },
+  {"seek",         l_ctr_seek         },
   {"set_inc_mode", l_ctr_set_inc_mode },
   {"close",        l_ctr_close        },
   {"clone",        l_ctr_clone        },
@@ -2353,6 +4933,16 @@ static const struct luaL_Reg l_bgcrypto_lib[] = {
   {"ofb_decrypter", l_ofb_new_decrypt},
   {"ctr_encrypter", l_ctr_new_encrypt},
   {"ctr_decrypter", l_ctr_new_decrypt},
+  {"backend",       l_aes_backend},
+  {"backends",      l_aes_backends},
+  {"set_backend",   l_aes_set_backend},
+  {"key",           l_aes_key},
+  {"expand_keys",   l_aes_expand_keys},
+  {"set_key_cache", l_aes_set_key_cache},
+  {"key_cache",     l_aes_key_cache},
+  {"encrypt_file",  l_aes_encrypt_file},
+  {"decrypt_file",  l_aes_decrypt_file},
+  {"open_encrypted", l_aes_open_encrypted},
   {NULL, NULL}
 };
 
@@ -2403,12 +4993,23 @@ LUTL_EXPORT int luaopen_bgcrypto_aes(lua_State*L){
 
   aes_init();
 
+  lua_rawgetp(L, LUA_REGISTRYINDEX, L_BACKEND_REF);
+  if(!lua_touserdata(L, -1)){
+    const aes_backend **slot = (const aes_backend **)lua_newuserdata(L, sizeof(const aes_backend *));
+    *slot = aes_backend_list()[0];
+    lua_rawsetp(L, LUA_REGISTRYINDEX, L_BACKEND_REF);
+  }
+  lua_pop(L, 1);
+
+  lutil_createmetap(L, L_KCACHE_CTX, l_kcache_meth, 0);
+  lutil_createmetap(L, L_KEY_CTX, l_key_meth, 0);
   lutil_createmetap(L, L_AES_CTX, l_aes_meth, 0);
   lutil_createmetap(L, L_ECB_CTX, l_ecb_meth, 0);
   lutil_createmetap(L, L_CBC_CTX, l_cbc_meth, 0);
   lutil_createmetap(L, L_CFB_CTX, l_cfb_meth, 0);
   lutil_createmetap(L, L_OFB_CTX, l_ofb_meth, 0);
   lutil_createmetap(L, L_CTR_CTX, l_ctr_meth, 0);
+  lutil_createmetap(L, L_EFILE_CTX, l_efile_meth, 0);
 
   lua_settop(L, top);
 
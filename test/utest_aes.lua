@@ -18,6 +18,8 @@ local zmsg = zmq and zmq.msg_init()
 
 local IS_LUA52 = _VERSION >= 'Lua 5.2'
 
+local unpack = unpack or table.unpack
+
 local TEST_CASE = assert(lunit.TEST_CASE)
 
 ------------------------------------------------------------
@@ -230,6 +232,163 @@ function test_partial_cb()
   assert_equal(STR(EDATA32), STR(str4))
 end
 
+function test_flush()
+  local t = {}
+  ectx:open(KEY)
+  ectx:set_writer(table.insert, t, {flush_bytes = 20})
+
+  ectx:write(DATA32:sub(1, 5))
+  ectx:write(DATA32:sub(6, 24))
+  assert_equal(0, #t)
+  ectx:write(DATA32:sub(25))
+  assert_equal(1, #t)
+  assert_equal(STR(EDATA32), STR(t[1]))
+
+  ectx:write(DATA32 .. DATA32)
+  ectx:flush()
+  assert_equal(3, #t)
+
+  if IS_LUA52 then
+    ectx:set_writer(coroutine.yield, nil, {flush_bytes = 64})
+    ectx:reset(KEY)
+    local str = co_encrypt(function()
+      ectx:write(DATA32:sub(1, 16))
+      ectx:write(DATA32:sub(17))
+      ectx:flush()
+    end)
+    assert_equal(STR(EDATA32), STR(str))
+  end
+end
+
+function test_writev()
+  local parts = {"1", DATA32:sub(2, 7), "", DATA32:sub(8, 29), DATA32:sub(30)}
+  ectx:open(KEY)
+
+  assert_equal(STR(EDATA32), STR(ectx:writev(parts)))
+  assert_equal(STR(EDATA32), STR(ectx:reset(KEY):writev(parts, 1, 2) .. ectx:writev(parts, 3)))
+  assert_equal("", ectx:writev(parts, 3, 2))
+
+  -- pending input from write and writev carried over both ways
+  ectx:reset(KEY)
+  local str = ectx:write(DATA32:sub(1, 3)) .. ectx:writev{DATA32:sub(4, 7), DATA32:sub(8, 20)}
+  str = str .. ectx:write(DATA32:sub(21, 25)) .. ectx:writev({DATA32:sub(26)}, 1, 1)
+  assert_equal(STR(EDATA32), STR(str))
+
+  local t = {}
+  ectx:reset(KEY)
+  ectx:set_writer(table.insert, t)
+  ectx:writev(parts)
+  assert_equal(STR(EDATA32), STR(table.concat(t)))
+
+  t = {}
+  ectx:reset(KEY)
+  ectx:set_writer(table.insert, t, {flush_bytes = 16})
+  ectx:writev{DATA32, DATA32:sub(1, 5)}
+  ectx:writev{DATA32:sub(6)}
+  ectx:flush()
+  assert_equal(4, #t)
+  assert_equal(16, #t[1])
+
+  assert_error(function() ectx:writev{"1", 2, "3"} end)
+
+  if IS_LUA52 then
+    ectx:set_writer(coroutine.yield, nil, {flush_bytes = 0})
+    ectx:reset(KEY)
+    str = co_encrypt(function() ectx:writev(parts) end)
+    assert_equal(STR(EDATA32), STR(str))
+  end
+end
+
+function test_raw_writer()
+  local t = {}
+  ectx:open(KEY)
+  dctx:open(KEY)
+
+  ectx:set_writer(function(p, n)
+    assert_userdata(p)
+    t[#t + 1] = dctx:write(p, 0, n)
+  end, nil, "raw")
+  ectx:write(DATA32:sub(1, 5))
+  ectx:writev{DATA32:sub(6, 20), DATA32:sub(21)}
+  assert_equal(DATA32, table.concat(t))
+
+  t = {}
+  ectx:set_writer(function(self, p, n)
+    assert_equal(t, self)
+    t[#t + 1] = dctx:write(p, 0, n)
+  end, t, {raw = true, flush_bytes = 64})
+  ectx:write(DATA32)
+  ectx:write(DATA32)
+  ectx:write(DATA32)
+  ectx:flush()
+  assert_equal(2, #t)
+  assert_equal(DATA32:rep(3), table.concat(t))
+
+  -- a new writer gets strings unless it asks for raw output
+  t = {}
+  ectx:set_writer(table.insert, t)
+  ectx:write(DATA32)
+  ectx:flush()
+  assert_string(t[1])
+
+  assert_error(function() ectx:set_writer(table.insert, t, "pointer") end)
+end
+
+function test_file_writer()
+  local f = assert(io.tmpfile())
+  ectx:open(KEY)
+
+  ectx:set_writer(f)
+  ectx:write(DATA32:sub(1, 5))
+  ectx:writev{DATA32:sub(6, 20), DATA32:sub(21)}
+  ectx:set_writer(f.write, f, {flush_bytes = 64})
+  ectx:write(DATA32)
+  ectx:flush()
+  local a, b = ectx:get_writer()
+  assert_equal(f.write, a)
+  assert_equal(f, b)
+
+  ectx:reset(KEY)
+  local edata = ectx:set_writer():write(DATA32 .. DATA32)
+  f:seek("set")
+  assert_equal(STR(edata), STR(f:read("*a")))
+
+  ectx:set_writer(f.write, f, {flush_bytes = 0})
+  f:close()
+  assert_error(function() ectx:write(DATA32) end)
+  ectx:set_writer()
+end
+
+function test_pump()
+  local data = DATA32:rep(300) .. DATA32:sub(1, 5)
+  ectx:open(KEY)
+  local edata = ectx:write(data) .. ectx:write(DATA32:sub(6))
+
+  local src, dst = assert(io.tmpfile()), assert(io.tmpfile())
+  src:write(data)
+  src:seek("set")
+  ectx:reset(KEY)
+  assert_equal(#data, ectx:pump(src, dst, 64))
+  dst:seek("set")
+  assert_equal(STR(edata), STR(dst:read("*a") .. ectx:write(DATA32:sub(6))))
+
+  local t, i = {}, 0
+  ectx:reset(KEY)
+  ectx:set_writer(table.insert, t)
+  assert_equal(#data, ectx:pump(function(n)
+    local str = data:sub(i + 1, i + 7)
+    i = i + #str
+    return str
+  end, 48))
+  ectx:set_writer()
+  assert_equal(STR(edata), STR(table.concat(t) .. ectx:write(DATA32:sub(6))))
+
+  assert_error(function() ectx:pump(src) end)
+  src:close()
+  assert_error(function() ectx:pump(src, dst) end)
+  dst:close()
+end
+
 function test_clone()
   local ctx1, ctx2, str1, str2
 
@@ -295,6 +454,38 @@ function test_slice_ud()
   assert_equal(STR(EDATA32), STR(str4))
 end
 
+function test_write_into()
+  ectx:open(KEY)
+  dctx:open(KEY)
+
+  zmsg:set_size(0) zmsg:set_data(("*"):rep(#DATA32 + 2))
+  local n1 = ectx:write_into(zmsg:pointer(), 1, DATA32, 1, 5)
+  local n2 = ectx:write_into(zmsg:pointer(), 1 + n1, DATA32, 6)
+  assert_equal(#DATA32, n1 + n2)
+  assert_equal(STR("*" .. EDATA32 .. "*"), STR(zmsg:data()))
+
+  zmsg:set_size(0) zmsg:set_data(("*"):rep(#DATA32))
+  assert_equal(#DATA32, dctx:write_into(zmsg:pointer(), 0, EDATA32))
+  assert_equal(DATA32, zmsg:data())
+end
+
+function test_transform()
+  ectx:open(KEY)
+  dctx:open(KEY)
+
+  zmsg:set_size(0) zmsg:set_data("*" .. DATA32 .. "*")
+  assert_equal(16, ectx:transform(zmsg:pointer(), 1, 16))
+  assert_equal(#DATA32 - 16, ectx:transform(zmsg:pointer(), 17, #DATA32 - 16))
+  assert_equal(STR("*" .. EDATA32 .. "*"), STR(zmsg:data()))
+
+  assert_equal(#DATA32, dctx:transform(zmsg:pointer(), 1, #DATA32))
+  assert_equal("*" .. DATA32 .. "*", zmsg:data())
+
+  assert_error(function() ectx:transform(zmsg:pointer(), 1, 15) end)
+  ectx:write("1")
+  assert_error(function() ectx:transform(zmsg:pointer(), 1, 16) end)
+end
+
 end
 
 function test_reset()
@@ -327,6 +518,24 @@ function test_reset_open()
   assert_false(ectx:closed())
 end
 
+function test_bulk()
+  local data = DATA32:rep(517)
+
+  local encrypt = ectx:open(KEY):write(data)
+  assert_equal(STR(EDATA32), STR(encrypt:sub(1, 32)))
+  assert_equal(data, dctx:open(KEY):write(encrypt))
+
+  local e = aes.encrypter():open(KEY)
+  local d = aes.decrypter():open(KEY)
+  assert_equal(STR(EDATA32), STR(e:encrypt(DATA32)))
+  assert_equal(STR(encrypt), STR(e:encrypt(data)))
+  assert_equal(data, d:encrypt(encrypt))
+  assert_error(function() e:encrypt(DATA32 .. "1") end)
+  assert_error(function() e:encrypt("") end)
+  e:destroy()
+  d:destroy()
+end
+
 end
 
 local _ENV = TEST_CASE"CBC" do
@@ -508,6 +717,186 @@ function test_partial_cb()
   assert_equal(STR(EDATA32), STR(str4))
 end
 
+function test_flush()
+  local t = {}
+  ectx:open(KEY, IV)
+  ectx:set_writer(table.insert, t, {flush_bytes = 20})
+
+  ectx:write(DATA32:sub(1, 5))
+  ectx:write(DATA32:sub(6, 24))
+  assert_equal(0, #t)
+  ectx:write(DATA32:sub(25))
+  assert_equal(1, #t)
+  assert_equal(STR(EDATA32), STR(t[1]))
+
+  ectx:write(DATA32 .. DATA32)
+  ectx:flush()
+  assert_equal(3, #t)
+
+  if IS_LUA52 then
+    ectx:set_writer(coroutine.yield, nil, {flush_bytes = 64})
+    ectx:reset(KEY, IV)
+    local str = co_encrypt(function()
+      ectx:write(DATA32:sub(1, 16))
+      ectx:write(DATA32:sub(17))
+      ectx:flush()
+    end)
+    assert_equal(STR(EDATA32), STR(str))
+  end
+end
+
+function test_writev()
+  local parts = {"1", DATA32:sub(2, 7), "", DATA32:sub(8, 29), DATA32:sub(30)}
+  ectx:open(KEY, IV)
+
+  assert_equal(STR(EDATA32), STR(ectx:writev(parts)))
+  assert_equal(STR(EDATA32), STR(ectx:reset(KEY, IV):writev(parts, 1, 2) .. ectx:writev(parts, 3)))
+  assert_equal("", ectx:writev(parts, 3, 2))
+
+  -- pending input from write and writev carried over both ways
+  ectx:reset(KEY, IV)
+  local str = ectx:write(DATA32:sub(1, 3)) .. ectx:writev{DATA32:sub(4, 7), DATA32:sub(8, 20)}
+  str = str .. ectx:write(DATA32:sub(21, 25)) .. ectx:writev({DATA32:sub(26)}, 1, 1)
+  assert_equal(STR(EDATA32), STR(str))
+
+  local t = {}
+  ectx:reset(KEY, IV)
+  ectx:set_writer(table.insert, t)
+  ectx:writev(parts)
+  assert_equal(STR(EDATA32), STR(table.concat(t)))
+
+  t = {}
+  ectx:reset(KEY, IV)
+  ectx:set_writer(table.insert, t, {flush_bytes = 16})
+  ectx:writev{DATA32, DATA32:sub(1, 5)}
+  ectx:writev{DATA32:sub(6)}
+  ectx:flush()
+  assert_equal(4, #t)
+  assert_equal(16, #t[1])
+
+  assert_error(function() ectx:writev{"1", 2, "3"} end)
+
+  if IS_LUA52 then
+    ectx:set_writer(coroutine.yield, nil, {flush_bytes = 0})
+    ectx:reset(KEY, IV)
+    str = co_encrypt(function() ectx:writev(parts) end)
+    assert_equal(STR(EDATA32), STR(str))
+  end
+end
+
+function test_raw_writer()
+  local t = {}
+  ectx:open(KEY, IV)
+  dctx:open(KEY, IV)
+
+  ectx:set_writer(function(p, n)
+    assert_userdata(p)
+    t[#t + 1] = dctx:write(p, 0, n)
+  end, nil, "raw")
+  ectx:write(DATA32:sub(1, 5))
+  ectx:writev{DATA32:sub(6, 20), DATA32:sub(21)}
+  assert_equal(DATA32, table.concat(t))
+
+  t = {}
+  ectx:set_writer(function(self, p, n)
+    assert_equal(t, self)
+    t[#t + 1] = dctx:write(p, 0, n)
+  end, t, {raw = true, flush_bytes = 64})
+  ectx:write(DATA32)
+  ectx:write(DATA32)
+  ectx:write(DATA32)
+  ectx:flush()
+  assert_equal(2, #t)
+  assert_equal(DATA32:rep(3), table.concat(t))
+
+  -- a new writer gets strings unless it asks for raw output
+  t = {}
+  ectx:set_writer(table.insert, t)
+  ectx:write(DATA32)
+  ectx:flush()
+  assert_string(t[1])
+
+  assert_error(function() ectx:set_writer(table.insert, t, "pointer") end)
+end
+
+function test_file_writer()
+  local f = assert(io.tmpfile())
+  ectx:open(KEY, IV)
+
+  ectx:set_writer(f)
+  ectx:write(DATA32:sub(1, 5))
+  ectx:writev{DATA32:sub(6, 20), DATA32:sub(21)}
+  ectx:set_writer(f.write, f, {flush_bytes = 64})
+  ectx:write(DATA32)
+  ectx:flush()
+  local a, b = ectx:get_writer()
+  assert_equal(f.write, a)
+  assert_equal(f, b)
+
+  ectx:reset(KEY, IV)
+  local edata = ectx:set_writer():write(DATA32 .. DATA32)
+  f:seek("set")
+  assert_equal(STR(edata), STR(f:read("*a")))
+
+  ectx:set_writer(f.write, f, {flush_bytes = 0})
+  f:close()
+  assert_error(function() ectx:write(DATA32) end)
+  ectx:set_writer()
+end
+
+function test_pump()
+  local data = DATA32:rep(300) .. DATA32:sub(1, 5)
+  ectx:open(KEY, IV)
+  local edata = ectx:write(data) .. ectx:write(DATA32:sub(6))
+
+  local src, dst = assert(io.tmpfile()), assert(io.tmpfile())
+  src:write(data)
+  src:seek("set")
+  ectx:reset(KEY, IV)
+  assert_equal(#data, ectx:pump(src, dst, 64))
+  dst:seek("set")
+  assert_equal(STR(edata), STR(dst:read("*a") .. ectx:write(DATA32:sub(6))))
+
+  local t, i = {}, 0
+  ectx:reset(KEY, IV)
+  ectx:set_writer(table.insert, t)
+  assert_equal(#data, ectx:pump(function(n)
+    local str = data:sub(i + 1, i + 7)
+    i = i + #str
+    return str
+  end, 48))
+  ectx:set_writer()
+  assert_equal(STR(edata), STR(table.concat(t) .. ectx:write(DATA32:sub(6))))
+
+  assert_error(function() ectx:pump(src) end)
+  src:close()
+  assert_error(function() ectx:pump(src, dst) end)
+  dst:close()
+end
+
+function test_pump_chunk_size()
+  local data = DATA32:rep(300)
+  local edata = aes.cbc_encrypter():open(KEY, IV):write(data)
+  local ctx = aes.cbc_encrypter(64):open(KEY, IV)
+
+  local t, sizes, i = {}, {}, 0
+  ctx:set_writer(table.insert, t)
+  assert_equal(#data, ctx:pump(function(n)
+    sizes[#sizes + 1] = n
+    local str = data:sub(i + 1, i + n)
+    i = i + #str
+    return str
+  end, 4096))
+  assert_equal(4096, sizes[1])
+  assert_equal(STR(edata), STR(table.concat(t)))
+  assert_true(#t <= 3)
+
+  ctx:set_writer()
+  ctx:reset(KEY, IV)
+  assert_equal(STR(edata), STR(ctx:write(data)))
+  ctx:destroy()
+end
+
 function test_clone()
   local key = ("1"):rep(32)
   local iv  = ("0"):rep(16)
@@ -575,6 +964,38 @@ function test_slice_ud()
   assert_equal(STR(EDATA32), STR(str4))
 end
 
+function test_write_into()
+  ectx:open(KEY,IV)
+  dctx:open(KEY,IV)
+
+  zmsg:set_size(0) zmsg:set_data(("*"):rep(#DATA32 + 2))
+  local n1 = ectx:write_into(zmsg:pointer(), 1, DATA32, 1, 5)
+  local n2 = ectx:write_into(zmsg:pointer(), 1 + n1, DATA32, 6)
+  assert_equal(#DATA32, n1 + n2)
+  assert_equal(STR("*" .. EDATA32 .. "*"), STR(zmsg:data()))
+
+  zmsg:set_size(0) zmsg:set_data(("*"):rep(#DATA32))
+  assert_equal(#DATA32, dctx:write_into(zmsg:pointer(), 0, EDATA32))
+  assert_equal(DATA32, zmsg:data())
+end
+
+function test_transform()
+  ectx:open(KEY,IV)
+  dctx:open(KEY,IV)
+
+  zmsg:set_size(0) zmsg:set_data("*" .. DATA32 .. "*")
+  assert_equal(16, ectx:transform(zmsg:pointer(), 1, 16))
+  assert_equal(#DATA32 - 16, ectx:transform(zmsg:pointer(), 17, #DATA32 - 16))
+  assert_equal(STR("*" .. EDATA32 .. "*"), STR(zmsg:data()))
+
+  assert_equal(#DATA32, dctx:transform(zmsg:pointer(), 1, #DATA32))
+  assert_equal("*" .. DATA32 .. "*", zmsg:data())
+
+  assert_error(function() ectx:transform(zmsg:pointer(), 1, 15) end)
+  ectx:write("1")
+  assert_error(function() ectx:transform(zmsg:pointer(), 1, 16) end)
+end
+
 end
 
 function test_reset()
@@ -607,6 +1028,29 @@ function test_reset_open()
   assert_false(ectx:closed())
 end
 
+function test_bulk_decrypt()
+  local data = ""
+  for i = 1, 1031 do data = data .. string.char(i % 251) end
+  data = data .. ("\0"):rep(16 - #data % 16)
+
+  local encrypt = ectx:open(KEY, IV):write(data)
+  assert_equal(#data, #encrypt)
+
+  assert_equal(data, dctx:open(KEY, IV):write(encrypt))
+  dctx:close()
+
+  for _, n in ipairs{1, 15, 17, 127, 128, 129, 333} do
+    dctx:open(KEY, IV)
+    local decrypt, i = {}, 1
+    while i <= #encrypt do
+      decrypt[#decrypt + 1] = dctx:write(encrypt:sub(i, i + n - 1))
+      i = i + n
+    end
+    assert_equal(data, table.concat(decrypt))
+    dctx:close()
+  end
+end
+
 end
 
 local _ENV = TEST_CASE"CFB" do
@@ -790,6 +1234,176 @@ function test_partial_cb()
   assert_equal(STR(EDATA32), STR(str4))
 end
 
+function test_flush()
+  local t = {}
+  ectx:open(KEY, IV)
+  ectx:set_writer(table.insert, t, {flush_bytes = 20})
+
+  ectx:write(DATA32:sub(1, 5))
+  ectx:write(DATA32:sub(6, 24))
+  assert_equal(0, #t)
+  ectx:write(DATA32:sub(25))
+  assert_equal(1, #t)
+  assert_equal(STR(EDATA32), STR(t[1]))
+
+  ectx:write(DATA32 .. DATA32)
+  ectx:flush()
+  assert_equal(3, #t)
+
+  ectx:write("12")
+  assert_equal(3, #t)
+  ectx:flush()
+  assert_equal(4, #t)
+  assert_equal(2, #t[4])
+
+  -- output kept goes to the writer before the threshold changes
+  ectx:write("3")
+  ectx:set_flush(0)
+  assert_equal(5, #t)
+  ectx:write("4")
+  assert_equal(6, #t)
+
+  if IS_LUA52 then
+    ectx:set_writer(coroutine.yield, nil, {flush_bytes = 64})
+    ectx:reset(KEY, IV)
+    local str = co_encrypt(function()
+      ectx:write(DATA32:sub(1, 16))
+      ectx:write(DATA32:sub(17))
+      ectx:flush()
+    end)
+    assert_equal(STR(EDATA32), STR(str))
+  end
+end
+
+function test_writev()
+  local parts = {"1", DATA32:sub(2, 7), "", DATA32:sub(8, 29), DATA32:sub(30)}
+  ectx:open(KEY, IV)
+
+  assert_equal(STR(EDATA32), STR(ectx:writev(parts)))
+  assert_equal(STR(EDATA32), STR(ectx:reset(KEY, IV):writev(parts, 1, 2) .. ectx:writev(parts, 3)))
+  assert_equal("", ectx:writev(parts, 3, 2))
+
+  -- pending input from write and writev carried over both ways
+  ectx:reset(KEY, IV)
+  local str = ectx:write(DATA32:sub(1, 3)) .. ectx:writev{DATA32:sub(4, 7), DATA32:sub(8, 20)}
+  str = str .. ectx:write(DATA32:sub(21, 25)) .. ectx:writev({DATA32:sub(26)}, 1, 1)
+  assert_equal(STR(EDATA32), STR(str))
+
+  local t = {}
+  ectx:reset(KEY, IV)
+  ectx:set_writer(table.insert, t)
+  ectx:writev(parts)
+  assert_equal(STR(EDATA32), STR(table.concat(t)))
+
+  t = {}
+  ectx:reset(KEY, IV)
+  ectx:set_writer(table.insert, t, {flush_bytes = 16})
+  ectx:writev{DATA32, DATA32:sub(1, 5)}
+  ectx:writev{DATA32:sub(6)}
+  ectx:flush()
+  assert_equal(4, #t)
+  assert_equal(16, #t[1])
+
+  assert_error(function() ectx:writev{"1", 2, "3"} end)
+
+  if IS_LUA52 then
+    ectx:set_writer(coroutine.yield, nil, {flush_bytes = 0})
+    ectx:reset(KEY, IV)
+    str = co_encrypt(function() ectx:writev(parts) end)
+    assert_equal(STR(EDATA32), STR(str))
+  end
+end
+
+function test_raw_writer()
+  local t = {}
+  ectx:open(KEY, IV)
+  dctx:open(KEY, IV)
+
+  ectx:set_writer(function(p, n)
+    assert_userdata(p)
+    t[#t + 1] = dctx:write(p, 0, n)
+  end, nil, "raw")
+  ectx:write(DATA32:sub(1, 5))
+  ectx:writev{DATA32:sub(6, 20), DATA32:sub(21)}
+  assert_equal(DATA32, table.concat(t))
+
+  t = {}
+  ectx:set_writer(function(self, p, n)
+    assert_equal(t, self)
+    t[#t + 1] = dctx:write(p, 0, n)
+  end, t, {raw = true, flush_bytes = 64})
+  ectx:write(DATA32)
+  ectx:write(DATA32)
+  ectx:write(DATA32)
+  ectx:flush()
+  assert_equal(2, #t)
+  assert_equal(DATA32:rep(3), table.concat(t))
+
+  -- a new writer gets strings unless it asks for raw output
+  t = {}
+  ectx:set_writer(table.insert, t)
+  ectx:write(DATA32)
+  ectx:flush()
+  assert_string(t[1])
+
+  assert_error(function() ectx:set_writer(table.insert, t, "pointer") end)
+end
+
+function test_file_writer()
+  local f = assert(io.tmpfile())
+  ectx:open(KEY, IV)
+
+  ectx:set_writer(f)
+  ectx:write(DATA32:sub(1, 5))
+  ectx:writev{DATA32:sub(6, 20), DATA32:sub(21)}
+  ectx:set_writer(f.write, f, {flush_bytes = 64})
+  ectx:write(DATA32)
+  ectx:flush()
+  local a, b = ectx:get_writer()
+  assert_equal(f.write, a)
+  assert_equal(f, b)
+
+  ectx:reset(KEY, IV)
+  local edata = ectx:set_writer():write(DATA32 .. DATA32)
+  f:seek("set")
+  assert_equal(STR(edata), STR(f:read("*a")))
+
+  ectx:set_writer(f.write, f, {flush_bytes = 0})
+  f:close()
+  assert_error(function() ectx:write(DATA32) end)
+  ectx:set_writer()
+end
+
+function test_pump()
+  local data = DATA32:rep(300) .. DATA32:sub(1, 5)
+  ectx:open(KEY, IV)
+  local edata = ectx:write(data) .. ectx:write(DATA32:sub(6))
+
+  local src, dst = assert(io.tmpfile()), assert(io.tmpfile())
+  src:write(data)
+  src:seek("set")
+  ectx:reset(KEY, IV)
+  assert_equal(#data, ectx:pump(src, dst, 64))
+  dst:seek("set")
+  assert_equal(STR(edata), STR(dst:read("*a") .. ectx:write(DATA32:sub(6))))
+
+  local t, i = {}, 0
+  ectx:reset(KEY, IV)
+  ectx:set_writer(table.insert, t)
+  assert_equal(#data, ectx:pump(function(n)
+    local str = data:sub(i + 1, i + 7)
+    i = i + #str
+    return str
+  end, 48))
+  ectx:set_writer()
+  assert_equal(STR(edata), STR(table.concat(t) .. ectx:write(DATA32:sub(6))))
+
+  assert_error(function() ectx:pump(src) end)
+  src:close()
+  assert_error(function() ectx:pump(src, dst) end)
+  dst:close()
+end
+
 function test_clone()
   local key = ("1"):rep(32)
   local iv  = ("0"):rep(16)
@@ -857,6 +1471,40 @@ function test_slice_ud()
   assert_equal(STR(EDATA32), STR(str4))
 end
 
+function test_write_into()
+  ectx:open(KEY,IV)
+  dctx:open(KEY,IV)
+
+  zmsg:set_size(0) zmsg:set_data(("*"):rep(#DATA32 + 2))
+  local n1 = ectx:write_into(zmsg:pointer(), 1, DATA32, 1, 5)
+  local n2 = ectx:write_into(zmsg:pointer(), 1 + n1, DATA32, 6)
+  assert_equal(#DATA32, n1 + n2)
+  assert_equal(STR("*" .. EDATA32 .. "*"), STR(zmsg:data()))
+
+  zmsg:set_size(0) zmsg:set_data(("*"):rep(#DATA32))
+  assert_equal(#DATA32, dctx:write_into(zmsg:pointer(), 0, EDATA32))
+  assert_equal(DATA32, zmsg:data())
+end
+
+function test_transform()
+  ectx:open(KEY,IV)
+  dctx:open(KEY,IV)
+
+  zmsg:set_size(0) zmsg:set_data("*" .. DATA32 .. "*")
+  assert_equal(16, ectx:transform(zmsg:pointer(), 1, 16))
+  assert_equal(#DATA32 - 16, ectx:transform(zmsg:pointer(), 17, #DATA32 - 16))
+  assert_equal(STR("*" .. EDATA32 .. "*"), STR(zmsg:data()))
+
+  assert_equal(#DATA32, dctx:transform(zmsg:pointer(), 1, #DATA32))
+  assert_equal("*" .. DATA32 .. "*", zmsg:data())
+
+  zmsg:set_size(0) zmsg:set_data(DATA32)
+  ectx:reset(KEY, IV)
+  assert_equal(5, ectx:transform(zmsg:pointer(), 0, 5))
+  assert_equal(#DATA32 - 5, ectx:transform(zmsg:pointer(), 5, #DATA32 - 5))
+  assert_equal(STR(EDATA32), STR(zmsg:data()))
+end
+
 end
 
 function test_reset_pos()
@@ -1087,6 +1735,176 @@ function test_partial_cb()
   assert_equal(STR(EDATA32), STR(str4))
 end
 
+function test_flush()
+  local t = {}
+  ectx:open(KEY, IV)
+  ectx:set_writer(table.insert, t, {flush_bytes = 20})
+
+  ectx:write(DATA32:sub(1, 5))
+  ectx:write(DATA32:sub(6, 24))
+  assert_equal(0, #t)
+  ectx:write(DATA32:sub(25))
+  assert_equal(1, #t)
+  assert_equal(STR(EDATA32), STR(t[1]))
+
+  ectx:write(DATA32 .. DATA32)
+  ectx:flush()
+  assert_equal(3, #t)
+
+  ectx:write("12")
+  assert_equal(3, #t)
+  ectx:flush()
+  assert_equal(4, #t)
+  assert_equal(2, #t[4])
+
+  -- output kept goes to the writer before the threshold changes
+  ectx:write("3")
+  ectx:set_flush(0)
+  assert_equal(5, #t)
+  ectx:write("4")
+  assert_equal(6, #t)
+
+  if IS_LUA52 then
+    ectx:set_writer(coroutine.yield, nil, {flush_bytes = 64})
+    ectx:reset(KEY, IV)
+    local str = co_encrypt(function()
+      ectx:write(DATA32:sub(1, 16))
+      ectx:write(DATA32:sub(17))
+      ectx:flush()
+    end)
+    assert_equal(STR(EDATA32), STR(str))
+  end
+end
+
+function test_writev()
+  local parts = {"1", DATA32:sub(2, 7), "", DATA32:sub(8, 29), DATA32:sub(30)}
+  ectx:open(KEY, IV)
+
+  assert_equal(STR(EDATA32), STR(ectx:writev(parts)))
+  assert_equal(STR(EDATA32), STR(ectx:reset(KEY, IV):writev(parts, 1, 2) .. ectx:writev(parts, 3)))
+  assert_equal("", ectx:writev(parts, 3, 2))
+
+  -- pending input from write and writev carried over both ways
+  ectx:reset(KEY, IV)
+  local str = ectx:write(DATA32:sub(1, 3)) .. ectx:writev{DATA32:sub(4, 7), DATA32:sub(8, 20)}
+  str = str .. ectx:write(DATA32:sub(21, 25)) .. ectx:writev({DATA32:sub(26)}, 1, 1)
+  assert_equal(STR(EDATA32), STR(str))
+
+  local t = {}
+  ectx:reset(KEY, IV)
+  ectx:set_writer(table.insert, t)
+  ectx:writev(parts)
+  assert_equal(STR(EDATA32), STR(table.concat(t)))
+
+  t = {}
+  ectx:reset(KEY, IV)
+  ectx:set_writer(table.insert, t, {flush_bytes = 16})
+  ectx:writev{DATA32, DATA32:sub(1, 5)}
+  ectx:writev{DATA32:sub(6)}
+  ectx:flush()
+  assert_equal(4, #t)
+  assert_equal(16, #t[1])
+
+  assert_error(function() ectx:writev{"1", 2, "3"} end)
+
+  if IS_LUA52 then
+    ectx:set_writer(coroutine.yield, nil, {flush_bytes = 0})
+    ectx:reset(KEY, IV)
+    str = co_encrypt(function() ectx:writev(parts) end)
+    assert_equal(STR(EDATA32), STR(str))
+  end
+end
+
+function test_raw_writer()
+  local t = {}
+  ectx:open(KEY, IV)
+  dctx:open(KEY, IV)
+
+  ectx:set_writer(function(p, n)
+    assert_userdata(p)
+    t[#t + 1] = dctx:write(p, 0, n)
+  end, nil, "raw")
+  ectx:write(DATA32:sub(1, 5))
+  ectx:writev{DATA32:sub(6, 20), DATA32:sub(21)}
+  assert_equal(DATA32, table.concat(t))
+
+  t = {}
+  ectx:set_writer(function(self, p, n)
+    assert_equal(t, self)
+    t[#t + 1] = dctx:write(p, 0, n)
+  end, t, {raw = true, flush_bytes = 64})
+  ectx:write(DATA32)
+  ectx:write(DATA32)
+  ectx:write(DATA32)
+  ectx:flush()
+  assert_equal(2, #t)
+  assert_equal(DATA32:rep(3), table.concat(t))
+
+  -- a new writer gets strings unless it asks for raw output
+  t = {}
+  ectx:set_writer(table.insert, t)
+  ectx:write(DATA32)
+  ectx:flush()
+  assert_string(t[1])
+
+  assert_error(function() ectx:set_writer(table.insert, t, "pointer") end)
+end
+
+function test_file_writer()
+  local f = assert(io.tmpfile())
+  ectx:open(KEY, IV)
+
+  ectx:set_writer(f)
+  ectx:write(DATA32:sub(1, 5))
+  ectx:writev{DATA32:sub(6, 20), DATA32:sub(21)}
+  ectx:set_writer(f.write, f, {flush_bytes = 64})
+  ectx:write(DATA32)
+  ectx:flush()
+  local a, b = ectx:get_writer()
+  assert_equal(f.write, a)
+  assert_equal(f, b)
+
+  ectx:reset(KEY, IV)
+  local edata = ectx:set_writer():write(DATA32 .. DATA32)
+  f:seek("set")
+  assert_equal(STR(edata), STR(f:read("*a")))
+
+  ectx:set_writer(f.write, f, {flush_bytes = 0})
+  f:close()
+  assert_error(function() ectx:write(DATA32) end)
+  ectx:set_writer()
+end
+
+function test_pump()
+  local data = DATA32:rep(300) .. DATA32:sub(1, 5)
+  ectx:open(KEY, IV)
+  local edata = ectx:write(data) .. ectx:write(DATA32:sub(6))
+
+  local src, dst = assert(io.tmpfile()), assert(io.tmpfile())
+  src:write(data)
+  src:seek("set")
+  ectx:reset(KEY, IV)
+  assert_equal(#data, ectx:pump(src, dst, 64))
+  dst:seek("set")
+  assert_equal(STR(edata), STR(dst:read("*a") .. ectx:write(DATA32:sub(6))))
+
+  local t, i = {}, 0
+  ectx:reset(KEY, IV)
+  ectx:set_writer(table.insert, t)
+  assert_equal(#data, ectx:pump(function(n)
+    local str = data:sub(i + 1, i + 7)
+    i = i + #str
+    return str
+  end, 48))
+  ectx:set_writer()
+  assert_equal(STR(edata), STR(table.concat(t) .. ectx:write(DATA32:sub(6))))
+
+  assert_error(function() ectx:pump(src) end)
+  src:close()
+  assert_error(function() ectx:pump(src, dst) end)
+  dst:close()
+end
+
 function test_clone()
   local key = ("1"):rep(32)
   local iv  = ("0"):rep(16)
@@ -1154,6 +1972,40 @@ function test_slice_ud()
   assert_equal(STR(EDATA32), STR(str4))
 end
 
+function test_write_into()
+  ectx:open(KEY,IV)
+  dctx:open(KEY,IV)
+
+  zmsg:set_size(0) zmsg:set_data(("*"):rep(#DATA32 + 2))
+  local n1 = ectx:write_into(zmsg:pointer(), 1, DATA32, 1, 5)
+  local n2 = ectx:write_into(zmsg:pointer(), 1 + n1, DATA32, 6)
+  assert_equal(#DATA32, n1 + n2)
+  assert_equal(STR("*" .. EDATA32 .. "*"), STR(zmsg:data()))
+
+  zmsg:set_size(0) zmsg:set_data(("*"):rep(#DATA32))
+  assert_equal(#DATA32, dctx:write_into(zmsg:pointer(), 0, EDATA32))
+  assert_equal(DATA32, zmsg:data())
+end
+
+function test_transform()
+  ectx:open(KEY,IV)
+  dctx:open(KEY,IV)
+
+  zmsg:set_size(0) zmsg:set_data("*" .. DATA32 .. "*")
+  assert_equal(16, ectx:transform(zmsg:pointer(), 1, 16))
+  assert_equal(#DATA32 - 16, ectx:transform(zmsg:pointer(), 17, #DATA32 - 16))
+  assert_equal(STR("*" .. EDATA32 .. "*"), STR(zmsg:data()))
+
+  assert_equal(#DATA32, dctx:transform(zmsg:pointer(), 1, #DATA32))
+  assert_equal("*" .. DATA32 .. "*", zmsg:data())
+
+  zmsg:set_size(0) zmsg:set_data(DATA32)
+  ectx:reset(KEY, IV)
+  assert_equal(5, ectx:transform(zmsg:pointer(), 0, 5))
+  assert_equal(#DATA32 - 5, ectx:transform(zmsg:pointer(), 5, #DATA32 - 5))
+  assert_equal(STR(EDATA32), STR(zmsg:data()))
+end
+
 end
 
 function test_reset_pos()
@@ -1437,6 +2289,199 @@ function test_partial_cb()
   assert_equal(STR(EDATA32), STR(str4))
 end
 
+function test_flush()
+  local t = {}
+  ectx:open(KEY, IV)
+  ectx:set_writer(table.insert, t, {flush_bytes = 20})
+
+  ectx:write(DATA32:sub(1, 5))
+  ectx:write(DATA32:sub(6, 24))
+  assert_equal(0, #t)
+  ectx:write(DATA32:sub(25))
+  assert_equal(1, #t)
+  assert_equal(STR(EDATA32), STR(t[1]))
+
+  ectx:write(DATA32 .. DATA32)
+  ectx:flush()
+  assert_equal(3, #t)
+
+  ectx:write("12")
+  assert_equal(3, #t)
+  ectx:flush()
+  assert_equal(4, #t)
+  assert_equal(2, #t[4])
+
+  -- output kept goes to the writer before the threshold changes
+  ectx:write("3")
+  ectx:set_flush(0)
+  assert_equal(5, #t)
+  ectx:write("4")
+  assert_equal(6, #t)
+
+  if IS_LUA52 then
+    ectx:set_writer(coroutine.yield, nil, {flush_bytes = 64})
+    ectx:reset(KEY, IV)
+    local str = co_encrypt(function()
+      ectx:write(DATA32:sub(1, 16))
+      ectx:write(DATA32:sub(17))
+      ectx:flush()
+    end)
+    assert_equal(STR(EDATA32), STR(str))
+  end
+end
+
+function test_writev()
+  local parts = {"1", DATA32:sub(2, 7), "", DATA32:sub(8, 29), DATA32:sub(30)}
+  ectx:open(KEY, IV)
+
+  assert_equal(STR(EDATA32), STR(ectx:writev(parts)))
+  assert_equal(STR(EDATA32), STR(ectx:reset(KEY, IV):writev(parts, 1, 2) .. ectx:writev(parts, 3)))
+  assert_equal("", ectx:writev(parts, 3, 2))
+
+  -- pending input from write and writev carried over both ways
+  ectx:reset(KEY, IV)
+  local str = ectx:write(DATA32:sub(1, 3)) .. ectx:writev{DATA32:sub(4, 7), DATA32:sub(8, 20)}
+  str = str .. ectx:write(DATA32:sub(21, 25)) .. ectx:writev({DATA32:sub(26)}, 1, 1)
+  assert_equal(STR(EDATA32), STR(str))
+
+  local t = {}
+  ectx:reset(KEY, IV)
+  ectx:set_writer(table.insert, t)
+  ectx:writev(parts)
+  assert_equal(STR(EDATA32), STR(table.concat(t)))
+
+  t = {}
+  ectx:reset(KEY, IV)
+  ectx:set_writer(table.insert, t, {flush_bytes = 16})
+  ectx:writev{DATA32, DATA32:sub(1, 5)}
+  ectx:writev{DATA32:sub(6)}
+  ectx:flush()
+  assert_equal(4, #t)
+  assert_equal(16, #t[1])
+
+  assert_error(function() ectx:writev{"1", 2, "3"} end)
+
+  if IS_LUA52 then
+    ectx:set_writer(coroutine.yield, nil, {flush_bytes = 0})
+    ectx:reset(KEY, IV)
+    str = co_encrypt(function() ectx:writev(parts) end)
+    assert_equal(STR(EDATA32), STR(str))
+  end
+end
+
+function test_raw_writer()
+  local t = {}
+  ectx:open(KEY, IV)
+  dctx:open(KEY, IV)
+
+  ectx:set_writer(function(p, n)
+    assert_userdata(p)
+    t[#t + 1] = dctx:write(p, 0, n)
+  end, nil, "raw")
+  ectx:write(DATA32:sub(1, 5))
+  ectx:writev{DATA32:sub(6, 20), DATA32:sub(21)}
+  assert_equal(DATA32, table.concat(t))
+
+  t = {}
+  ectx:set_writer(function(self, p, n)
+    assert_equal(t, self)
+    t[#t + 1] = dctx:write(p, 0, n)
+  end, t, {raw = true, flush_bytes = 64})
+  ectx:write(DATA32)
+  ectx:write(DATA32)
+  ectx:write(DATA32)
+  ectx:flush()
+  assert_equal(2, #t)
+  assert_equal(DATA32:rep(3), table.concat(t))
+
+  -- a new writer gets strings unless it asks for raw output
+  t = {}
+  ectx:set_writer(table.insert, t)
+  ectx:write(DATA32)
+  ectx:flush()
+  assert_string(t[1])
+
+  assert_error(function() ectx:set_writer(table.insert, t, "pointer") end)
+end
+
+function test_file_writer()
+  local f = assert(io.tmpfile())
+  ectx:open(KEY, IV)
+
+  ectx:set_writer(f)
+  ectx:write(DATA32:sub(1, 5))
+  ectx:writev{DATA32:sub(6, 20), DATA32:sub(21)}
+  ectx:set_writer(f.write, f, {flush_bytes = 64})
+  ectx:write(DATA32)
+  ectx:flush()
+  local a, b = ectx:get_writer()
+  assert_equal(f.write, a)
+  assert_equal(f, b)
+
+  ectx:reset(KEY, IV)
+  local edata = ectx:set_writer():write(DATA32 .. DATA32)
+  f:seek("set")
+  assert_equal(STR(edata), STR(f:read("*a")))
+
+  ectx:set_writer(f.write, f, {flush_bytes = 0})
+  f:close()
+  assert_error(function() ectx:write(DATA32) end)
+  ectx:set_writer()
+end
+
+function test_pump()
+  local data = DATA32:rep(300) .. DATA32:sub(1, 5)
+  ectx:open(KEY, IV)
+  local edata = ectx:write(data) .. ectx:write(DATA32:sub(6))
+
+  local src, dst = assert(io.tmpfile()), assert(io.tmpfile())
+  src:write(data)
+  src:seek("set")
+  ectx:reset(KEY, IV)
+  assert_equal(#data, ectx:pump(src, dst, 64))
+  dst:seek("set")
+  assert_equal(STR(edata), STR(dst:read("*a") .. ectx:write(DATA32:sub(6))))
+
+  local t, i = {}, 0
+  ectx:reset(KEY, IV)
+  ectx:set_writer(table.insert, t)
+  assert_equal(#data, ectx:pump(function(n)
+    local str = data:sub(i + 1, i + 7)
+    i = i + #str
+    return str
+  end, 48))
+  ectx:set_writer()
+  assert_equal(STR(edata), STR(table.concat(t) .. ectx:write(DATA32:sub(6))))
+
+  assert_error(function() ectx:pump(src) end)
+  src:close()
+  assert_error(function() ectx:pump(src, dst) end)
+  dst:close()
+end
+
+function test_pump_chunk_size()
+  local data = DATA32:rep(300)
+  local edata = aes.ctr_encrypter():open(KEY, IV):write(data)
+  local ctx = aes.ctr_encrypter(64):open(KEY, IV)
+
+  local t, sizes, i = {}, {}, 0
+  ctx:set_writer(table.insert, t)
+  assert_equal(#data, ctx:pump(function(n)
+    sizes[#sizes + 1] = n
+    local str = data:sub(i + 1, i + n)
+    i = i + #str
+    return str
+  end, 4096))
+  assert_equal(4096, sizes[1])
+  assert_equal(STR(edata), STR(table.concat(t)))
+  assert_true(#t <= 3)
+
+  ctx:set_writer()
+  ctx:reset(KEY, IV)
+  assert_equal(STR(edata), STR(ctx:write(data)))
+  ctx:destroy()
+end
+
 function test_clone()
   local key = ("1"):rep(32)
   local iv  = ("0"):rep(16)
@@ -1504,6 +2549,40 @@ function test_slice_ud()
   assert_equal(STR(EDATA32), STR(str4))
 end
 
+function test_write_into()
+  ectx:open(KEY,IV)
+  dctx:open(KEY,IV)
+
+  zmsg:set_size(0) zmsg:set_data(("*"):rep(#DATA32 + 2))
+  local n1 = ectx:write_into(zmsg:pointer(), 1, DATA32, 1, 5)
+  local n2 = ectx:write_into(zmsg:pointer(), 1 + n1, DATA32, 6)
+  assert_equal(#DATA32, n1 + n2)
+  assert_equal(STR("*" .. EDATA32 .. "*"), STR(zmsg:data()))
+
+  zmsg:set_size(0) zmsg:set_data(("*"):rep(#DATA32))
+  assert_equal(#DATA32, dctx:write_into(zmsg:pointer(), 0, EDATA32))
+  assert_equal(DATA32, zmsg:data())
+end
+
+function test_transform()
+  ectx:open(KEY,IV)
+  dctx:open(KEY,IV)
+
+  zmsg:set_size(0) zmsg:set_data("*" .. DATA32 .. "*")
+  assert_equal(16, ectx:transform(zmsg:pointer(), 1, 16))
+  assert_equal(#DATA32 - 16, ectx:transform(zmsg:pointer(), 17, #DATA32 - 16))
+  assert_equal(STR("*" .. EDATA32 .. "*"), STR(zmsg:data()))
+
+  assert_equal(#DATA32, dctx:transform(zmsg:pointer(), 1, #DATA32))
+  assert_equal("*" .. DATA32 .. "*", zmsg:data())
+
+  zmsg:set_size(0) zmsg:set_data(DATA32)
+  ectx:reset(KEY, IV)
+  assert_equal(5, ectx:transform(zmsg:pointer(), 0, 5))
+  assert_equal(#DATA32 - 5, ectx:transform(zmsg:pointer(), 5, #DATA32 - 5))
+  assert_equal(STR(EDATA32), STR(zmsg:data()))
+end
+
 end
 
 function test_increment_mode()
@@ -1518,6 +2597,163 @@ function test_increment_mode()
   assert_equal(STR(edata), STR(encrypt))
 end
 
+function test_legacy_dec_mode()
+  -- output of "bd"/"fd" as produced by earlier releases
+  local ZERO = ("\0"):rep(16 * 5)
+  local KAT = {
+    bd = {
+      HEX"ff000000000000010000000000000003",
+      HEX"77357b6b2f070db8df99eb798af01ae30aa0e9103f0116a03a33ea9e7039e6ae9b28c519615cf89ce1a97dcda32ee42ce328e2ef7ee264094fd899fc56ec2221279d8e52df46a5e5586fbf395d616889"
+    };
+    fd = {
+      HEX"030000000000000000010000000000ff",
+      HEX"3c30c786ce581f02bdeeab52ba402809afc2469127a2b72ff25b6a48849c3cbe77e969ccc38763a4e8e1b71948fe790c234d8824e3a1795e1ee1c1ec6bcb9eb883604f4f9c3e42c402f099345df0e535"
+    };
+  }
+
+  for mode, t in pairs(KAT) do
+    assert_true(ectx:set_inc_mode(mode))
+    ectx:open(KEY, t[1])
+    assert_equal(STR(t[2]), STR(ectx:write(ZERO)), mode)
+    ectx:close()
+  end
+end
+
+-- expected CTR key stream build as ECB over explicit counter blocks
+-- "bd"/"fd" carry to the next byte when a byte becomes 0 (legacy),
+-- "bdw"/"fdw" when it wraps from 0 to 255
+local function ctr_key_stream(key, iv, mode, n)
+  local b, e, step = 16, 1, 1
+  if mode:sub(1,1) == 'f' then b, e = 1, 16 end
+  if mode:sub(2,2) == 'd' then step = -1 end
+  local legacy = (mode == "bd") or (mode == "fd")
+
+  local ctr = {iv:byte(1, -1)}
+  local blocks = {}
+  for _ = 1, n do
+    blocks[#blocks + 1] = string.char(unpack(ctr))
+    for i = b, e, (b < e) and 1 or -1 do
+      local v = ctr[i] + step
+      ctr[i] = v % 256
+      if legacy then
+        if ctr[i] ~= 0 then break end
+      elseif v >= 0 and v <= 255 then break end
+    end
+  end
+
+  local ecb = aes.ecb_encrypter():open(key)
+  local stream = ecb:write(table.concat(blocks))
+  ecb:destroy()
+  return stream
+end
+
+function test_increment_mode_bulk()
+  local ZERO = ("\0"):rep(16 * 41)
+  local IVS = {
+    bi = HEX"00000000000000fffffffffffffffffa";
+    bd = HEX"ff000000000000010000000000000005";
+    fi = HEX"f9ffffffffffffffffff000000000000";
+    fd = HEX"060000000000000000000100000000ff";
+    bdw = HEX"ff000000000000010000000000000005";
+    fdw = HEX"060000000000000000000100000000ff";
+  }
+
+  for mode, iv in pairs(IVS) do
+    local expected = ctr_key_stream(KEY, iv, mode, 82)
+
+    assert_true(ectx:set_inc_mode(mode))
+    ectx:open(KEY, iv)
+    assert_equal(STR(expected:sub(1, #ZERO)), STR(ectx:write(ZERO)))
+
+    ectx:reset(iv)
+    local encrypt = enc_2_parts(ectx, ZERO, 7)
+      .. enc_2_parts(ectx, ZERO, 16 * 20 + 3)
+    assert_equal(STR(expected), STR(encrypt))
+
+    ectx:close()
+  end
+end
+
+function test_seek()
+  local ZERO = ("\0"):rep(16 * 41)
+  local IVS = {
+    bi = HEX"00000000000000fffffffffffffffffa";
+    bd = HEX"ff000000000000010000000000000005";
+    fi = HEX"f9ffffffffffffffffff000000000000";
+    fd = HEX"060000000000000000000100000000ff";
+    bdw = HEX"ff000000000000010000000000000005";
+    fdw = HEX"060000000000000000000100000000ff";
+  }
+
+  for mode, iv in pairs(IVS) do
+    local expected = ctr_key_stream(KEY, iv, mode, 82)
+
+    assert_true(ectx:set_inc_mode(mode))
+    ectx:open(KEY, iv)
+    ectx:write(ZERO)
+    for _, pos in ipairs{0, 5, 16, 96, 101, 16 * 40 + 15} do
+      assert_equal(ectx, ectx:seek(pos))
+      assert_equal(STR(expected:sub(pos + 1, pos + #ZERO)), STR(ectx:write(ZERO)), mode .. " " .. pos)
+    end
+
+    -- seek is from the iv of reset
+    ectx:reset(IV)
+    ectx:seek(16 * 3 + 1)
+    assert_equal(STR(ctr_key_stream(KEY, IV, mode, 5):sub(50, 60)), STR(ectx:write(ZERO:sub(1, 11))))
+    ectx:close()
+  end
+
+  ectx:set_inc_mode("bi")
+  ectx:open(KEY, ("\0"):rep(16))
+  ectx:seek(2^40 + 5)
+  local iv = HEX"00000000000000000000001000000000"
+  assert_equal(STR(ctr_key_stream(KEY, iv, "bi", 2):sub(6, 20)), STR(ectx:write(ZERO:sub(1, 15))))
+
+  assert_error(function() ectx:seek(-1) end)
+  ectx:close()
+  assert_error(function() ectx:seek(0) end)
+end
+
+function test_write_parallel()
+  local DATA = ("0123456789abcdef"):rep(65536 * 3) .. "12345"
+  local IVS = {
+    bi = HEX"00000000000000fffffffffffffffffa";
+    fd = HEX"060000000000000000000100000000ff";
+    bdw = HEX"ff000000000000010000000000000005";
+    fdw = HEX"060000000000000000000100000000ff";
+  }
+
+  for mode, iv in pairs(IVS) do
+    local ref = aes.ctr_encrypter():open(KEY, iv)
+    ref:set_inc_mode(mode)
+    local expected = ref:write("1234567") .. ref:write(DATA) .. ref:write(DATA:sub(1, 9))
+    ref:destroy()
+
+    ectx:set_inc_mode(mode)
+    ectx:open(KEY, iv)
+    for _, threads in ipairs{1, 3, 8} do
+      ectx:reset(iv)
+      local encrypt = ectx:write("1234567") .. ectx:write_parallel(DATA, threads) .. ectx:write(DATA:sub(1, 9))
+      assert_equal(STR(expected), STR(encrypt), mode .. " " .. threads)
+    end
+
+    local t = {}
+    ectx:reset(iv)
+    ectx:set_writer(function(s) t[#t + 1] = s end, nil, {flush_bytes = 64})
+    ectx:write("1234567")
+    assert_equal(ectx, ectx:write_parallel(DATA, 4))
+    ectx:write(DATA:sub(1, 9))
+    ectx:flush()
+    ectx:set_writer()
+    assert_equal(STR(expected), STR(table.concat(t)), mode)
+    ectx:close()
+  end
+
+  ectx:open(KEY, IV)
+  assert_equal("", ectx:write_parallel(""))
+  assert_error(function() ectx:write_parallel("1", 0) end)
+end
+
 function test_reset_pos()
   assert_equal(ectx, ectx:open(KEY, IV))
 
@@ -1675,6 +2911,546 @@ function test_nist()
   end
 end
 
+function test_digest_update()
+  for _, test in ipairs(CMAC) do
+    local M = test[3].M
+    local d = cmac.new(test.ALGO, test.KEY)
+    for i = 1, #M do
+      assert_equal(STR(cmac.digest(test.ALGO, test.KEY, M:sub(1, i - 1))), STR(d:digest()))
+      d:update(M:sub(i, i))
+    end
+    assert_equal(STR(test[3].T), STR(d:digest()))
+    d:destroy()
+  end
+end
+
+end
+
+local _ENV = TEST_CASE"Backend" do
+
+local KEY  = ("1"):rep(32)
+local IV   = ("0"):rep(16)
+
+local backend
+
+function setup()
+  backend = aes.backend()
+end
+
+function teardown()
+  assert_true(aes.set_backend(backend))
+end
+
+local function encrypt_all(data)
+  local res = {}
+  for _, mode in ipairs{"ecb", "cbc", "cfb", "ofb", "ctr"} do
+    local e = aes[mode .. "_encrypter"]()
+    local d = aes[mode .. "_decrypter"]()
+    local edata = e:open(KEY, IV):write(data)
+    assert_equal(data, d:open(KEY, IV):write(edata), mode)
+    e:destroy() d:destroy()
+    res[mode] = edata
+  end
+  return res
+end
+
+function test_list()
+  local list = aes.backends()
+  assert_table(list)
+  assert_equal(backend, list[1])
+  local names = {}
+  for _, name in ipairs(list) do names[name] = true end
+  assert_true(names.table)
+  assert_true(names.bitslice)
+end
+
+function test_set_backend()
+  assert_nil(aes.set_backend("unknown"))
+  assert_equal(backend, aes.backend())
+end
+
+function test_same_result()
+  local data = ""
+  for i = 1, 777 do data = data .. string.char(i % 256) end
+  data = data:rep(3) .. ("\0"):rep(16 - #data * 3 % 16)
+
+  assert_true(aes.set_backend("table"))
+  local expected = encrypt_all(data)
+
+  for _, name in ipairs(aes.backends()) do
+    assert_true(aes.set_backend(name))
+    assert_equal(name, aes.backend())
+    local res = encrypt_all(data)
+    for mode, edata in pairs(expected) do
+      assert_equal(STR(edata), STR(res[mode]), name .. "/" .. mode)
+    end
+  end
+end
+
+function test_switch_open_context()
+  local list = aes.backends()
+  local e = aes.ctr_encrypter():open(KEY, IV)
+  local d = aes.ctr_decrypter():open(KEY, IV)
+  local data = ("1234567"):rep(100)
+  for i = 1, 20 do
+    assert_true(aes.set_backend(list[i % #list + 1]))
+    assert_equal(data, d:write(e:write(data)))
+  end
+  e:destroy() d:destroy()
+end
+
+function test_reset_key_size()
+  local data = ("1234567"):rep(100)
+  for _, name in ipairs(aes.backends()) do
+    assert_true(aes.set_backend(name))
+    for _, mode in ipairs{"ecb", "cbc", "cfb", "ofb", "ctr"} do
+      local e = aes[mode .. "_encrypter"]()
+      e:open(("2"):rep(16), IV):write(data)
+      for _, klen in ipairs{24, 32, 16} do
+        local key = ("3"):rep(klen)
+        e:reset(key, IV)
+        local expected = aes[mode .. "_encrypter"]():open(key, IV):write(data)
+        assert_equal(STR(expected), STR(e:write(data)), name .. "/" .. mode .. "/" .. klen)
+      end
+      e:destroy()
+    end
+  end
+end
+
+end
+
+local _ENV = TEST_CASE"Key" do
+
+local IV    = ("0"):rep(16)
+local MODES = {"ecb", "cbc", "cfb", "ofb", "ctr"}
+
+local backend
+
+local function make_keys(n)
+  local t = {}
+  for i = 1, n do
+    local len = 16 + 8 * (i % 3)
+    t[i] = ("0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ"):sub(i % 4 + 1, i % 4 + len)
+  end
+  return t
+end
+
+function setup()
+  backend = aes.backend()
+end
+
+function teardown()
+  assert_true(aes.set_backend(backend))
+  assert_true(aes.set_key_cache(0))
+end
+
+function test_expand()
+  local keys = make_keys(21)
+  local objs = aes.expand_keys(keys)
+  assert_table(objs)
+  assert_equal(#keys, #objs)
+  for i, key in ipairs(objs) do
+    assert_userdata(key)
+    assert_match("^AES key %(" .. (#keys[i] * 8) .. " bit%)", tostring(key))
+  end
+  assert_equal(0, #aes.expand_keys{})
+end
+
+function test_invalid()
+  assert_error(function() aes.expand_keys() end)
+  assert_error(function() aes.expand_keys{("1"):rep(16), ("1"):rep(15)} end)
+  assert_error(function() aes.expand_keys{("1"):rep(16), 1234567890123456} end)
+end
+
+function test_same_as_string()
+  local data = ("1234567"):rep(96)
+  local keys = make_keys(11)
+  for _, name in ipairs(aes.backends()) do
+    assert_true(aes.set_backend(name))
+    local objs = aes.expand_keys(keys)
+    for i, key in ipairs(keys) do
+      for _, mode in ipairs(MODES) do
+        local msg = name .. "/" .. mode .. "/" .. i
+        local edata = aes[mode .. "_encrypter"]():open(key, IV):write(data)
+        assert_equal(STR(edata), STR(aes[mode .. "_encrypter"]():open(objs[i], IV):write(data)), msg)
+        assert_equal(data, aes[mode .. "_decrypter"]():open(objs[i], IV):write(edata), msg)
+      end
+    end
+  end
+end
+
+-- the decryption schedule of a key object and of an open decrypter is
+-- the same for every backend, also where the table code keeps it last
+-- first (AES_REV_DKS, builds without AES-NI)
+function test_decrypt_across_backends()
+  local data = ("1234567"):rep(96)
+  local keys = make_keys(3)
+  for _, made in ipairs(aes.backends()) do
+    assert_true(aes.set_backend(made))
+    local objs = aes.expand_keys(keys)
+    local key  = aes.key(keys[2])
+    for _, name in ipairs(aes.backends()) do
+      assert_true(aes.set_backend(name))
+      for _, mode in ipairs{"ecb", "cbc"} do
+        local msg  = made .. "/" .. name .. "/" .. mode
+        local edata = aes[mode .. "_encrypter"]():open(keys[2], IV):write(data)
+        for i, obj in ipairs(objs) do
+          local e = aes[mode .. "_encrypter"]():open(keys[i], IV):write(data)
+          assert_equal(data, aes[mode .. "_decrypter"]():open(obj, IV):write(e), msg .. "/" .. i)
+        end
+        assert_equal(data, aes[mode .. "_decrypter"]():open(key, IV):write(edata), msg)
+
+        assert_true(aes.set_backend(made))
+        local d = aes[mode .. "_decrypter"]():open(keys[2], IV)
+        local head = d:write(edata:sub(1, 112))
+        assert_true(aes.set_backend(name))
+        assert_equal(data, head .. d:write(edata:sub(113)), msg)
+      end
+    end
+  end
+end
+
+function test_reset_decrypter()
+  local data = ("1234567"):rep(96)
+  local key  = ("2"):rep(24)
+  local obj  = aes.expand_keys{key}[1]
+  for _, mode in ipairs(MODES) do
+    local edata = aes[mode .. "_encrypter"]():open(key, IV):write(data)
+    local d = aes[mode .. "_decrypter"]():open(("3"):rep(16), IV)
+    assert_equal(data, d:reset(key, IV):write(edata), mode)
+    assert_equal(data, d:reset(obj, IV):write(edata), mode)
+    d:destroy()
+  end
+end
+
+function test_key()
+  local key = aes.key(("1"):rep(32))
+  assert_userdata(key)
+  assert_match("^AES key %(256 bit%)", tostring(key))
+  assert_error(function() aes.key(("1"):rep(15)) end)
+  assert_error(function() aes.key() end)
+end
+
+function test_shared_key()
+  local data = ("1234567"):rep(96)
+  local key  = ("4"):rep(16)
+  local obj  = aes.key(key)
+  for _, name in ipairs(aes.backends()) do
+    assert_true(aes.set_backend(name))
+    for _, mode in ipairs{"cfb", "ofb", "ctr"} do
+      local expected = aes[mode .. "_encrypter"]():open(key, IV):write(data)
+      -- streams on one key object keep their own position in a block
+      local ctx, res, pos = {}, {}, {}
+      for i = 1, 3 do
+        ctx[i], res[i], pos[i] = aes[mode .. "_encrypter"]():open(obj, IV), {}, 1
+      end
+      repeat
+        local done = true
+        for i = 1, 3 do
+          local n = 3 + i * 2
+          if pos[i] <= #data then
+            res[i][#res[i] + 1] = ctx[i]:write(data:sub(pos[i], pos[i] + n - 1))
+            pos[i], done = pos[i] + n, false
+          end
+        end
+      until done
+      for i = 1, 3 do
+        assert_equal(STR(expected), STR(table.concat(res[i])), name .. "/" .. mode .. "/" .. i)
+      end
+    end
+  end
+end
+
+function test_key_lifetime()
+  local data = ("1234567"):rep(96)
+  local key  = ("5"):rep(24)
+  local expected = aes.ctr_encrypter():open(key, IV):write(data)
+  local e = aes.ctr_encrypter():open(aes.key(key), IV)
+  local d = aes.cbc_decrypter():open(aes.key(key), IV)
+  collectgarbage() collectgarbage()
+  assert_equal(STR(expected), STR(e:write(data)))
+  local c = aes.cbc_encrypter():open(key, IV):write(data)
+  assert_equal(data, d:write(c))
+end
+
+function test_clone_shared_key()
+  local data = ("1234567"):rep(96)
+  local key  = ("6"):rep(32)
+  local expected = aes.ctr_encrypter():open(key, IV):write(data)
+  local e = aes.ctr_encrypter():open(aes.key(key), IV)
+  local head = e:write(data:sub(1, 21))
+  local c = e:clone()
+  e:destroy()
+  collectgarbage() collectgarbage()
+  assert_equal(STR(expected), STR(head .. c:write(data:sub(22))))
+end
+
+function test_clone_fork()
+  local data = ("1234567"):rep(96)
+  local key  = ("6"):rep(24)
+  for _, mode in ipairs(MODES) do
+    for _, dir in ipairs{"encrypter", "decrypter"} do
+      local new = aes[mode .. "_" .. dir]
+      local expected = new():open(key, IV):write(data)
+      local e = new():open(key, IV)
+      local head = e:write(data:sub(1, 21))
+
+      -- a clone of a clone with a small buffer, grown by the writes
+      local c1 = e:clone()
+      local c2 = c1:clone(64)
+      assert_equal(STR(expected), STR(head .. c1:write(data:sub(22))), mode .. dir)
+      assert_equal(STR(expected), STR(head .. c2:write(data:sub(22, 40)) .. c2:write(data:sub(41))), mode .. dir)
+
+      -- a new key for the source does not change its clones
+      local c3 = e:clone()
+      e:reset(("7"):rep(16), IV)
+      e:destroy()
+      collectgarbage() collectgarbage()
+      assert_equal(STR(expected), STR(head .. c3:write(data:sub(22))), mode .. dir)
+    end
+  end
+end
+
+function test_cache()
+  local data = ("1234567"):rep(96)
+  local k1, k2, k3 = ("1"):rep(16), ("2"):rep(24), ("3"):rep(32)
+  local e1 = aes.cbc_encrypter():open(k1, IV):write(data)
+  local e2 = aes.cbc_encrypter():open(k2, IV):write(data)
+  local e3 = aes.cbc_encrypter():open(k3, IV):write(data)
+
+  assert_equal(0, (aes.key_cache()))
+  assert_true(aes.set_key_cache(2))
+  assert_equal(2, (aes.key_cache()))
+
+  local function check(key, edata, hits, misses)
+    assert_equal(STR(edata), STR(aes.cbc_encrypter():open(key, IV):write(data)))
+    assert_equal(data, aes.cbc_decrypter():open(key, IV):write(edata))
+    local n, h, m = aes.key_cache()
+    assert_equal(hits, h)
+    assert_equal(misses, m)
+  end
+
+  check(k1, e1, 0, 2)
+  check(k1, e1, 2, 2)
+  check(k2, e2, 2, 4)
+  check(k1, e1, 4, 4)
+  check(k3, e3, 4, 6) -- evicts k2
+  check(k2, e2, 4, 8) -- evicts k1
+  check(k3, e3, 6, 8)
+
+  -- the same schedule through reset and other backends
+  for _, name in ipairs(aes.backends()) do
+    assert_true(aes.set_backend(name))
+    local d = aes.ctr_decrypter():open(k3, IV)
+    assert_equal(data, d:reset(k2, IV):write(aes.ctr_encrypter():open(k2, IV):write(data)), name)
+  end
+
+  assert_true(aes.set_key_cache(0))
+  local n, h, m = aes.key_cache()
+  assert_equal(0, n) assert_equal(0, h) assert_equal(0, m)
+
+  assert_error(function() aes.set_key_cache(-1) end)
+end
+
+end
+
+local _ENV = TEST_CASE"File" do
+
+local KEY = ("1"):rep(32)
+local IV  = ("0"):rep(16)
+local DATA = ("1234567890123456"):rep(4096)
+
+local src, dst, out
+
+local function read_file(name)
+  local f = assert(io.open(name, "rb"))
+  local str = f:read("*a")
+  f:close()
+  return str
+end
+
+local function write_file(name, str)
+  local f = assert(io.open(name, "wb"))
+  f:write(str)
+  f:close()
+end
+
+function setup()
+  src, dst, out = os.tmpname(), os.tmpname(), os.tmpname()
+end
+
+function teardown()
+  os.remove(src) os.remove(dst) os.remove(out)
+end
+
+function test_modes()
+  for _, mode in ipairs{"ecb", "cbc", "cfb", "ofb", "ctr"} do
+    local data = (mode == "ecb" or mode == "cbc") and DATA or DATA .. "123"
+    local opt = {mode = mode, key = KEY, iv = IV, buffer_size = 4096, buffers = 3}
+    local ectx = aes[mode .. "_encrypter"]():open(KEY, IV)
+    write_file(src, data)
+
+    assert_equal(#data, aes.encrypt_file(src, dst, opt), mode)
+    assert_equal(ectx:write(data), read_file(dst), mode)
+
+    opt.key = aes.key(KEY)
+    assert_equal(#data, aes.decrypt_file(dst, out, opt), mode)
+    assert_equal(data, read_file(out), mode)
+    ectx:destroy()
+  end
+end
+
+function test_ctr_inc_mode()
+  write_file(src, DATA)
+  for _, mode in ipairs{"fd", "bdw", "fdw"} do
+    local ectx = aes.ctr_encrypter():open(KEY, IV)
+    ectx:set_inc_mode(mode)
+    assert_equal(#DATA, aes.encrypt_file(src, dst, {mode = "ctr", key = KEY, iv = IV, inc_mode = mode}))
+    assert_equal(ectx:write(DATA), read_file(dst), mode)
+    ectx:destroy()
+  end
+end
+
+function test_empty()
+  write_file(src, "")
+  assert_equal(0, aes.encrypt_file(src, dst, {mode = "cbc", key = KEY, iv = IV}))
+  assert_equal("", read_file(dst))
+end
+
+function test_error()
+  write_file(src, DATA .. "1")
+  os.remove(dst)
+  local ok, err = aes.encrypt_file(src, dst, {mode = "cbc", key = KEY, iv = IV})
+  assert_nil(ok)
+  assert_string(err)
+  assert_nil(io.open(dst, "rb"))
+
+  assert_nil(aes.encrypt_file(src .. ".none", dst, {mode = "ctr", key = KEY, iv = IV}))
+
+  assert_error(function() aes.encrypt_file(src, dst, {mode = "xts", key = KEY, iv = IV}) end)
+  assert_error(function() aes.encrypt_file(src, dst, {mode = "ctr", key = "1", iv = IV}) end)
+  assert_error(function() aes.encrypt_file(src, dst, {mode = "ctr", key = KEY}) end)
+  assert_error(function() aes.encrypt_file(src, dst, {mode = "ctr", key = KEY, iv = IV, buffers = 1}) end)
+  assert_error(function() aes.encrypt_file(src, dst, {mode = "ctr", key = KEY, iv = IV, engine = "pread"}) end)
+end
+
+function test_same_file()
+  write_file(src, DATA)
+  for _, engine in ipairs{"threads", "uring"} do
+    local ok, err = aes.encrypt_file(src, src, {mode = "ctr", key = KEY, iv = IV, engine = engine})
+    assert_nil(ok, engine)
+    assert_string(err, engine)
+    assert_equal(DATA, read_file(src), engine)
+  end
+end
+
+function test_engine()
+  local engines = {threads = true, uring = true, pread = true}
+  for _, mode in ipairs{"ecb", "cbc", "ctr"} do
+    local data = (mode == "ctr") and DATA .. "123" or DATA
+    local opt = {mode = mode, key = KEY, iv = IV, buffer_size = 4096, buffers = 3, engine = "uring"}
+    local ectx = aes[mode .. "_encrypter"]():open(KEY, IV)
+    write_file(src, data)
+
+    local n, engine = aes.encrypt_file(src, dst, opt)
+    assert_equal(#data, n, mode)
+    assert_true(engines[engine], mode)
+    if mode == "cbc" then assert_equal("threads", engine) end
+    assert_equal(ectx:write(data), read_file(dst), mode)
+
+    assert_equal(#data, aes.decrypt_file(dst, out, opt), mode)
+    assert_equal(data, read_file(out), mode)
+    ectx:destroy()
+  end
+
+  write_file(src, DATA .. "1")
+  os.remove(dst)
+  assert_nil(aes.encrypt_file(src, dst, {mode = "ecb", key = KEY, engine = "uring"}))
+  assert_nil(io.open(dst, "rb"))
+end
+
+local function encrypted(data, inc_mode)
+  local ectx = aes.ctr_encrypter():open(KEY, IV)
+  if inc_mode then ectx:set_inc_mode(inc_mode) end
+  write_file(src, ectx:write(data))
+  ectx:destroy()
+end
+
+function test_open_encrypted_read()
+  local data = DATA .. "123"
+  encrypted(data, "fd")
+
+  local f = assert(aes.open_encrypted(src, aes.key(KEY), IV, "r", {inc_mode = "fd", page_size = 1000, pages = 2}))
+  assert_equal(#data, f:size())
+  assert_equal(data:sub(1, 7), f:read(7))
+  assert_equal(data:sub(8, 3000), f:read(2993))
+  assert_equal(data:sub(3001), f:read("a"))
+  assert_equal("", f:read("a"))
+  assert_nil(f:read(1))
+  assert_nil(f:read(0))
+  assert_true(f:close())
+  assert_error(function() f:read(1) end)
+end
+
+function test_open_encrypted_seek()
+  local data = DATA .. "123"
+  encrypted(data)
+
+  local f = assert(aes.open_encrypted(src, KEY, IV, "rb", {page_size = 256, pages = 3}))
+  for _, pos in ipairs{5000, 17, 4096 * 16, 255, 256, 60000, 0} do
+    assert_equal(pos, f:seek("set", pos))
+    assert_equal(data:sub(pos + 1, pos + 300), f:read(300), pos)
+  end
+  assert_equal(300, f:seek())
+  assert_equal(310, f:seek("cur", 10))
+  assert_equal(#data - 3, f:seek("end", -3))
+  assert_equal("123", f:read(10))
+  assert_equal(#data + 5, f:seek("end", 5))
+  assert_nil(f:read(1))
+  assert_nil(f:seek("set", -1))
+  if math.mininteger then
+    assert_nil(f:seek("end", math.mininteger))
+    assert_equal(#data + 5, f:seek())
+  end
+  f:close()
+end
+
+function test_open_encrypted_lines()
+  local lines = {}
+  for i = 1, 2000 do lines[i] = ("line %d "):format(i) .. ("x"):rep(i % 37) end
+  local data = table.concat(lines, "\n") .. "\nlast"
+  encrypted(data)
+
+  local f = assert(aes.open_encrypted(src, KEY, IV, "r", {page_size = 64}))
+  local i = 0
+  for line in f:lines() do
+    i = i + 1
+    assert_equal(lines[i] or "last", line, i)
+  end
+  assert_equal(#lines + 1, i)
+
+  f:seek("set", 0)
+  assert_equal(lines[1] .. "\n", f:read("L"))
+  assert_equal(lines[2], f:read("*l"))
+  local a, b = f:read(3, "l")
+  assert_equal(lines[3]:sub(1, 3), a)
+  assert_equal(lines[3]:sub(4), b)
+  f:close()
+  assert_error(function() for _ in f:lines() do end end)
+end
+
+function test_open_encrypted_error()
+  encrypted(DATA)
+  local f, err = aes.open_encrypted(src .. ".none", KEY, IV)
+  assert_nil(f)
+  assert_string(err)
+
+  assert_error(function() aes.open_encrypted(src, KEY, IV, "w") end)
+  assert_error(function() aes.open_encrypted(src, KEY, "1") end)
+  assert_error(function() aes.open_encrypted(src, "1", IV) end)
+  assert_error(function() aes.open_encrypted(src, KEY, IV, "r", {pages = 0}) end)
+end
+
 end
 
 if not HAS_RUNNER then lunit.run() end